@@ -0,0 +1,84 @@
+#ifndef _ADAPTIVE_H_
+#define _ADAPTIVE_H_
+#include "cancel.h"
+#include "context.h"
+#include "metrics.h"
+#include "sink.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Adaptive format, all integers little-endian:
+ *
+ *   header  "HUFS", version, 3 reserved bytes, rebuild interval (u32),
+ *           4 reserved bytes
+ *   frames  raw length (u32), payload length (u32), then the codes packed
+ *           MSB first, the last byte padded with zero bits
+ *   end     a frame header with both lengths 0
+ *   footer  raw length (u64), CRC-32C of the original (u32), "SFUH"
+ *
+ * No code is stored. The coder and the decoder start from the same flat
+ * code and rebuild it from the bytes counted so far, first after
+ * ADAPTIVE_FIRST_REBUILD bytes, then after twice as many each time up to the
+ * rebuild interval; the counts are halved at every rebuild so the code
+ * follows the data. Both sides switch codes at the same byte, even in the
+ * middle of a frame. A frame holds what was written at once, up to
+ * ADAPTIVE_MAX_FRAME bytes, so output leaves as soon as input arrives
+ * instead of once a block is full.
+ */
+#define ADAPTIVE_MAGIC "HUFS"
+#define ADAPTIVE_FOOTER_MAGIC "SFUH"
+#define ADAPTIVE_VERSION 1
+#define ADAPTIVE_HEADER_LEN 16
+#define ADAPTIVE_FOOTER_LEN 16
+#define ADAPTIVE_MAX_FRAME (64 * 1024)
+#define ADAPTIVE_FIRST_REBUILD 1024
+#define DEFAULT_REBUILD_INTERVAL (32 * 1024)
+#define MAX_REBUILD_INTERVAL (16 * 1024 * 1024)
+
+/**
+ * is_adaptive_file - check whether data starts like an adaptive file.
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @return true if it carries the adaptive format magic.
+ */
+extern bool is_adaptive_file(const char *data, size_t data_len);
+
+/**
+ * new_adaptive_sink - create a sink that compresses everything written to it
+ * in one pass, each write going out as a frame of its own.
+ * @param inner The sink the compressed data goes to, closed along with this
+ * one.
+ * @param interval Most original bytes between two rebuilds of the code,
+ * between ADAPTIVE_FIRST_REBUILD and MAX_REBUILD_INTERVAL.
+ * @return A new sink.
+ */
+extern Sink *new_adaptive_sink(Sink *inner, size_t interval);
+
+/**
+ * new_adaptive_decode_sink - create a sink that decompresses an adaptive
+ * file written to it, a frame at a time as the frames arrive.
+ * @param inner The sink the original data goes to, closed along with this
+ * one.
+ * @return A new sink, whose close() fails if the file was malformed, cut
+ * short or doesn't match its checksum.
+ */
+extern Sink *new_adaptive_decode_sink(Sink *inner);
+
+/**
+ * adaptive_decompress - decompress a whole adaptive file.
+ * @param context Whose buffer holds a decoded frame.
+ * @param out Where the original data goes.
+ * @param data The compressed file.
+ * @param data_len The length of the file.
+ * @param cancel Checked between frames to abort the run.
+ * @param stats Where the stage timings, output length and the CRC-32C of the
+ * original go.
+ * @return 0 on success, -1 if malformed, the checksum doesn't match,
+ * cancelled or the sink failed.
+ */
+extern int adaptive_decompress(CodecContext *context, Sink *out,
+                               const char *data, size_t data_len,
+                               CancelToken *cancel, CodecStats *stats);
+#endif
@@ -0,0 +1,65 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct Admission Admission;
+/**
+ * Admission - limits on the work the server takes on at once
+ * Requests reserve memory from a global budget before their body is read,
+ * and codec runs take one of a fixed number of slots. What doesn't fit is
+ * turned away with 503 instead of pushing the host into swap.
+ */
+struct Admission {
+    size_t budget; // bytes requests may hold at once
+    size_t used;
+    int max_jobs; // codec runs at once
+    int running;
+    unsigned long rejected;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+
+    /**
+     * Reserve memory from the budget
+     * @param self The admission control
+     * @param bytes The amount to reserve
+     * @return true if it fits, false otherwise
+     */
+    bool (*reserve)(Admission *self, size_t bytes);
+
+    /**
+     * Give back memory reserved with reserve()
+     * @param self The admission control
+     * @param bytes The amount to give back
+     */
+    void (*release)(Admission *self, size_t bytes);
+
+    /**
+     * Take a codec slot if one is free
+     * @param self The admission control
+     * @return true if a slot was taken, false if all are busy
+     */
+    bool (*try_begin_job)(Admission *self);
+
+    /**
+     * Take a codec slot, waiting for one to free up
+     * @param self The admission control
+     */
+    void (*begin_job)(Admission *self);
+
+    /**
+     * Give back a codec slot
+     * @param self The admission control
+     */
+    void (*end_job)(Admission *self);
+};
+
+/**
+ * init_admission - create the admission control.
+ * @param self Where to store the admission control.
+ * @param budget Bytes requests may hold at once.
+ * @param max_jobs Codec runs allowed at once.
+ */
+extern void init_admission(Admission **self, size_t budget, int max_jobs);
+#endif
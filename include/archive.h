@@ -0,0 +1,152 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+#include "cancel.h"
+#include "sink.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Archive format, all integers little-endian:
+ *
+ *   header     "HUFA", version, 11 reserved bytes
+ *   members    one block-format file per member
+ *   directory  per member, sorted by name: offset (u64), compressed length
+ *              (u64), original length (u64), CRC-32C of the original (u32),
+ *              name length (u16), then the name
+ *   footer     directory offset (u64), member count (u32), "AFUH"
+ *
+ * A member is found from the directory at the end and decoded on its own,
+ * so extracting one costs a seek and the decoding of that member only.
+ * Names are relative paths with / as the separator and no .. component, so
+ * extracting an archive can't write outside the directory it goes to.
+ */
+#define ARCHIVE_MAGIC "HUFA"
+#define ARCHIVE_FOOTER_MAGIC "AFUH"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_LEN 16
+#define ARCHIVE_ENTRY_LEN 30 // a directory entry without its name
+#define ARCHIVE_FOOTER_LEN 16
+#define MAX_MEMBER_NAME 4096
+
+/**
+ * ArchiveMember - an entry of the directory of an archive
+ */
+typedef struct ArchiveMember {
+    const char *name; // not NUL-terminated, inside the directory
+    size_t name_len;
+    size_t offset;  // of the member's block-format file
+    size_t length;  // of the member's block-format file
+    size_t raw_len; // of the original
+    uint32_t checksum;
+} ArchiveMember;
+
+/**
+ * Archive - the directory of an archive in memory
+ */
+typedef struct Archive {
+    const char *data;
+    size_t data_len;
+    size_t count;
+    ArchiveMember *members; // sorted by name
+} Archive;
+
+typedef struct ArchiveWriter ArchiveWriter;
+/**
+ * ArchiveWriter - an archive being written, a member at a time
+ */
+struct ArchiveWriter {
+    Sink *out;
+    uint64_t offset; // bytes written so far
+    size_t count;
+    size_t room;
+    ArchiveMember *members; // names are malloc'd copies
+    int status;
+
+    /**
+     * Compress a file into the archive
+     * @param self The writer
+     * @param name Name of the member
+     * @param data The content of the file
+     * @param data_len The length of the content
+     * @param cancel Checked between blocks to abort the run
+     * @return 0 on success, -1 once the writer has failed
+     */
+    int (*add)(ArchiveWriter *self, const char *name, const char *data,
+               size_t data_len, CancelToken *cancel);
+
+    /**
+     * Write the directory and the footer, then free the writer and close
+     * the sink of the archive
+     * @param self The writer
+     * @return 0 on success, -1 if anything failed to be written
+     */
+    int (*finish)(ArchiveWriter *self);
+};
+
+/**
+ * is_archive - check whether data starts like an archive.
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @return true if it carries the archive magic.
+ */
+extern bool is_archive(const char *data, size_t data_len);
+
+/**
+ * new_archive_writer - start an archive.
+ * @param out Where the archive goes, closed by finish().
+ * @return A new writer.
+ */
+extern ArchiveWriter *new_archive_writer(Sink *out);
+
+/**
+ * archive_open - read and check the directory of an archive.
+ * @param archive Where the directory goes, pointing into data.
+ * @param data The archive.
+ * @param data_len The length of the archive.
+ * @return 0 on success, -1 if the archive is malformed.
+ */
+extern int archive_open(Archive *archive, const char *data, size_t data_len);
+
+/**
+ * archive_find - look up a member by name.
+ * @param archive The archive.
+ * @param name The name of the member.
+ * @return The member, NULL if there is none of that name.
+ */
+extern const ArchiveMember *archive_find(const Archive *archive,
+                                         const char *name);
+
+/**
+ * archive_extract - decompress a member and check it against its checksum.
+ * @param archive The archive.
+ * @param member The member.
+ * @param out Where the original goes.
+ * @param cancel Checked between blocks to abort the run.
+ * @return 0 on success, -1 if the member is corrupt, cancelled or the sink
+ * failed.
+ */
+extern int archive_extract(const Archive *archive,
+                           const ArchiveMember *member, Sink *out,
+                           CancelToken *cancel);
+
+/**
+ * archive_verify - decode every member of an archive without keeping it and
+ * check it against its length and checksum.
+ * The blocks of all the members are decoded on several threads at once.
+ * @param archive The archive.
+ * @param threads Number of blocks decoded at once.
+ * @param cancel Checked between blocks to abort the run.
+ * @param corrupt Where each member that failed is flagged, in directory
+ * order.
+ * @return 0 if every member checked out, -1 otherwise.
+ */
+extern int archive_verify(const Archive *archive, int threads,
+                          CancelToken *cancel, bool *corrupt);
+
+/**
+ * archive_close - free the directory of an archive.
+ * @param archive The archive, whose data is left alone.
+ */
+extern void archive_close(Archive *archive);
+#endif
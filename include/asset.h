@@ -0,0 +1,92 @@
+#ifndef _ASSET_H_
+#define _ASSET_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct Asset Asset;
+#define WATCH_INTERVAL 1 // seconds between two looks at the files
+
+/**
+ * Asset - a static file with its responses rendered ahead of time
+ * Everything a GET needs is precomputed at load time, so serving an asset is
+ * a single write of header + body. The cache holds a reference while the
+ * asset is current and every request sending it holds one, so a reloaded
+ * asset is freed once the last response using it is out.
+ */
+struct Asset {
+    char *path;
+    char *body;
+    size_t body_len;
+    char *header;
+    size_t header_len;
+    char *not_modified;
+    size_t not_modified_len;
+    char etag[24];
+    char last_modified[32];
+    time_t mtime;
+    int status;
+    int refs;
+};
+
+typedef struct AssetCache AssetCache;
+struct AssetCache {
+    Asset **assets;
+    size_t len;
+    bool watch;
+    time_t last_check;
+    pthread_mutex_t lock;      // serializes refreshes
+    pthread_mutex_t swap_lock; // guards swapping assets and taking references
+
+    /**
+     * Read a file and render its responses
+     * @param self The asset cache
+     * @param path The file to load
+     * @param status HTTP status the file is served with
+     * @return The loaded asset, NULL if the file can't be read
+     */
+    const Asset *(*load)(AssetCache *self, const char *path, int status);
+
+    /**
+     * Find a loaded asset and take a reference to it
+     * @param self The asset cache
+     * @param path The file the asset was loaded from
+     * @return The asset, to be released after use, NULL if it was never
+     * loaded
+     */
+    const Asset *(*find)(AssetCache *self, const char *path);
+
+    /**
+     * Give back an asset returned by find(), freeing it if it was replaced
+     * and this was the last reference
+     * @param self The asset cache
+     * @param asset The asset
+     */
+    void (*release)(AssetCache *self, const Asset *asset);
+
+    /**
+     * Reload the assets whose file changed on disk (only when watching,
+     * and at most once every WATCH_INTERVAL seconds)
+     * @param self The asset cache
+     */
+    void (*refresh)(AssetCache *self);
+
+    /**
+     * Check whether the client already holds the current version
+     * @param asset The asset requested
+     * @param if_none_match If-None-Match request header, or NULL
+     * @param if_modified_since If-Modified-Since request header, or NULL
+     * @return true if a 304 Not Modified response is enough
+     */
+    bool (*is_fresh)(const Asset *asset, const char *if_none_match,
+                     const char *if_modified_since);
+};
+
+/**
+ * init_asset_cache - create an empty asset cache.
+ * @param self Where to store the asset cache.
+ * @param watch Reload files when they change on disk.
+ */
+extern void init_asset_cache(AssetCache **self, bool watch);
+#endif
@@ -0,0 +1,95 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+#include "cancel.h"
+#include "config.h"
+#include "metrics.h"
+#include "sink.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#define COMPRESSED_SUFFIX ".huf"
+// appended to the name of a decompressed file that lacked COMPRESSED_SUFFIX
+#define DECOMPRESSED_SUFFIX ".out"
+
+/**
+ * BatchFile - an input of a batch run and where its output goes
+ */
+typedef struct BatchFile {
+    char *input;
+    char *name;   // relative to the output directory, without the suffix
+    char *output; // NULL if the batch only collects files
+    size_t size;  // of the input, the largest are handed out first
+} BatchFile;
+
+typedef struct Batch Batch;
+/**
+ * Batch - many files coded by a pool of threads in one process
+ * Inputs are files, glob patterns or directories, walked recursively; the
+ * outputs land in one directory, mirroring the layout of the walked
+ * directories. Each thread keeps its input buffer and cancel token from one
+ * file to the next, so a file costs its reads, writes and codec run only.
+ */
+struct Batch {
+    enum MODE mode;
+    const char *output_dir; // NULL if the batch only collects files
+    int threads;
+    BatchFile *files;
+    size_t count;
+    size_t room;
+    size_t next;   // next file to hand out
+    size_t failed; // files that couldn't be coded
+    uint64_t bytes_in, bytes_out;
+
+    /**
+     * Run the codec on a file
+     * @param mode Whether to compress or decompress
+     * @param input The content of the file
+     * @param input_len The length of the content
+     * @param out Where the output goes, closed by the caller
+     * @param cancel The cancel token of the thread
+     * @param stats Where the stage timings and output length go
+     * @return 0 on success, -1 on failure
+     */
+    int (*run)(enum MODE mode, char *input, size_t input_len, Sink *out,
+               CancelToken *cancel, CodecStats *stats);
+
+    /**
+     * Add a file, the files matching a glob pattern or a directory
+     * @param self The batch
+     * @param path The file, pattern or directory
+     * @return 0 on success, -1 if nothing can be read there
+     */
+    int (*add)(Batch *self, const char *path);
+
+    /**
+     * Code every file added, reporting failures as they happen
+     * @param self The batch
+     * @return 0 if every file was coded, -1 otherwise
+     */
+    int (*start)(Batch *self);
+
+    /**
+     * Free the batch
+     * @param self The batch
+     */
+    void (*destroy)(Batch *self);
+};
+
+/**
+ * is_batch_input - check whether an input names more than one file.
+ * @param path The input given on the command line.
+ * @return true for a directory or a glob pattern.
+ */
+extern bool is_batch_input(const char *path);
+
+/**
+ * init_batch - create an empty batch.
+ * @param self Where to store the batch.
+ * @param mode Whether to compress or decompress.
+ * @param output_dir Directory the outputs go to, created if missing, or
+ * NULL to only collect the files, e.g. to put them in an archive.
+ * @param threads Number of files coded at once.
+ */
+extern void init_batch(Batch **self, enum MODE mode, const char *output_dir,
+                       int threads);
+#endif
@@ -0,0 +1,178 @@
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+#include "cancel.h"
+#include "code.h"
+#include "context.h"
+#include "metrics.h"
+#include "sink.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Block format, all integers little-endian:
+ *
+ *   header   "HUF2", version, flags, 2 reserved bytes, block size (u32),
+ *            4 reserved bytes
+ *   blocks   raw length (u32), payload length (u32), with
+ *            BLOCK_FLAG_BLOCK_CHECKSUMS the CRC-32C of its original bytes
+ *            (u32), 256 code lengths packed two per byte, then the codes
+ *            packed MSB first
+ *   end      a block header with both lengths 0
+ *   index    per block: offset in the file (u64), then with
+ *            BLOCK_FLAG_CHECKSUMS the CRC-32C of its original bytes (u32)
+ *   footer   raw length (u64), index offset (u64), block count (u32), then
+ *            with BLOCK_FLAG_CHECKSUMS the CRC-32C of the original (u32),
+ *            "2FUH"
+ *
+ * Every block has its own canonical Huffman code and holds block size bytes
+ * of the original data, except the last one, so any byte range can be
+ * decoded from the index without touching the blocks around it, and checked
+ * against the CRCs of its blocks. The CRC in front of every block lets a
+ * stream, which only meets the index at the end, check each block before it
+ * passes it on. Files without the flags, written before checksums were
+ * added, are still read.
+ */
+#define BLOCK_MAGIC "HUF2"
+#define BLOCK_FOOTER_MAGIC "2FUH"
+#define BLOCK_VERSION 1
+#define BLOCK_HEADER_LEN 16
+#define BLOCK_FLAG_CHECKSUMS 0x01
+#define BLOCK_FLAG_BLOCK_CHECKSUMS 0x02
+#define BLOCK_FOOTER_LEN 24 // without the checksum
+#define DEFAULT_BLOCK_SIZE (64 * 1024)
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+/**
+ * BlockIndex - where the blocks of a block-format file are
+ */
+typedef struct BlockIndex {
+    size_t raw_len;    // length of the original data
+    size_t block_size; // original bytes per block, the last may hold less
+    size_t count;      // number of blocks
+    size_t end;        // offset of the end marker, where the blocks stop
+    const unsigned char *offsets; // the index inside the file
+    size_t entry_len;             // bytes per block in the index
+    bool checksums;               // the index and footer carry CRC-32Cs
+    unsigned char flags;          // of the file header
+    uint32_t checksum;            // CRC-32C of the original, if carried
+} BlockIndex;
+
+/**
+ * BlockCheck - a block-format file checked by block_verify
+ */
+typedef struct BlockCheck {
+    const char *data;
+    size_t data_len;
+    size_t raw_len;    // set by block_verify: length of the original
+    uint32_t checksum; // set by block_verify: CRC-32C of the original
+    int status;        // set by block_verify: 0 if every block checked out
+} BlockCheck;
+
+/**
+ * is_block_file - check whether data starts like a block-format file.
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @return true if it carries the block format magic.
+ */
+extern bool is_block_file(const char *data, size_t data_len);
+
+/**
+ * block_compress - compress data into the block format.
+ * @param context Whose workspaces hold the code, a block and the index.
+ * @param out Where the compressed data goes.
+ * @param data The data to compress.
+ * @param data_len The length of the data.
+ * @param block_size Original bytes per block.
+ * @param cancel Checked between blocks to abort the run.
+ * @param stats Where the stage timings, output length and the CRC-32C of the
+ * data go.
+ * @return 0 on success, -1 if cancelled or the sink failed.
+ */
+extern int block_compress(CodecContext *context, Sink *out, const char *data,
+                          size_t data_len, size_t block_size,
+                          CancelToken *cancel, CodecStats *stats);
+
+/**
+ * new_block_sink - create a sink that compresses everything written to it
+ * into the block format, a block at a time.
+ * @param inner The sink the compressed data goes to, closed along with this
+ * one.
+ * @param block_size Original bytes per block, at most MAX_BLOCK_SIZE.
+ * @return A new sink.
+ */
+extern Sink *new_block_sink(Sink *inner, size_t block_size);
+
+/**
+ * new_block_decode_sink - create a sink that decompresses a block-format
+ * file written to it, a block at a time.
+ * The blocks are decoded in the order they come, without the index, so the
+ * file can arrive through a pipe; only one block is held in memory. A block
+ * is checked against the CRC in its header before it is passed on, so what
+ * reaches the inner sink checked out, though a file cut short or with a bad
+ * footer is only found at close, after the blocks before it.
+ * @param inner The sink the original data goes to, closed along with this
+ * one.
+ * @return A new sink, whose close() fails if the file was malformed, cut
+ * short or doesn't match its checksum.
+ */
+extern Sink *new_block_decode_sink(Sink *inner);
+
+/**
+ * block_read_index - find and check the index of a block-format file.
+ * @param data The compressed file.
+ * @param data_len The length of the file.
+ * @param index Where the index goes, pointing into data.
+ * @return 0 on success, -1 if the file is malformed.
+ */
+extern int block_read_index(const char *data, size_t data_len,
+                            BlockIndex *index);
+
+/**
+ * block_decompress - decompress a whole block-format file.
+ * @param context Whose buffer holds a decoded block.
+ * @param out Where the original data goes.
+ * @param data The compressed file.
+ * @param data_len The length of the file.
+ * @param cancel Checked between blocks to abort the run.
+ * @param stats Where the stage timings, output length and the CRC-32C of the
+ * original go.
+ * @return 0 on success, -1 if malformed, a checksum doesn't match, cancelled
+ * or the sink failed.
+ */
+extern int block_decompress(CodecContext *context, Sink *out,
+                            const char *data, size_t data_len,
+                            CancelToken *cancel, CodecStats *stats);
+
+/**
+ * block_decompress_range - decompress part of a block-format file.
+ * Only the blocks overlapping the range are decoded.
+ * @param context Whose buffer holds a decoded block.
+ * @param out Where the original bytes go.
+ * @param data The compressed file.
+ * @param index The index read from it.
+ * @param first Offset of the first original byte wanted.
+ * @param len Number of original bytes wanted.
+ * @return 0 on success, -1 if malformed, a block doesn't match its checksum,
+ * out of range or the sink failed.
+ */
+extern int block_decompress_range(CodecContext *context, Sink *out,
+                                  const char *data, const BlockIndex *index,
+                                  size_t first, size_t len);
+
+/**
+ * block_verify - decode every block of block-format files into scratch
+ * buffers, on several threads, without keeping the original, and check the
+ * blocks and files that carry checksums against them.
+ * The blocks of all the files are shared out one at a time, so one large
+ * file and many small ones keep every thread busy alike.
+ * @param files The files, whose status, length and checksum are set.
+ * @param count The number of files.
+ * @param threads Number of blocks decoded at once.
+ * @param cancel Checked between blocks to abort the run.
+ * @return 0 if every file checked out, -1 if any is malformed, doesn't
+ * match a checksum or the run was cancelled.
+ */
+extern int block_verify(BlockCheck *files, size_t count, int threads,
+                        CancelToken *cancel);
+#endif
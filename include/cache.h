@@ -0,0 +1,100 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include "config.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct CacheEntry CacheEntry;
+/**
+ * CacheEntry - the result of one codec run, keyed by what produced it
+ * The input is kept too, so a hit is only served for the very same bytes
+ * and not for another input that happens to share its hash.
+ */
+struct CacheEntry {
+    uint64_t hash;    // keyed hash of the input
+    char *input;      // copy of the input
+    size_t input_len; // length of the input
+    enum MODE mode;   // operation that produced the result
+    char *data;
+    size_t len;
+    int refs; // readers, plus one while the entry is cached
+    CacheEntry *prev, *next; // LRU order, most recently used first
+    CacheEntry *chain;       // next entry in the same bucket
+};
+
+typedef struct ResultCache ResultCache;
+/**
+ * ResultCache - memory-bounded LRU of codec results
+ * Repeated uploads of the same payload are answered from memory instead of
+ * rebuilding the tree and recoding the data.
+ */
+struct ResultCache {
+    size_t capacity; // bytes of results and inputs kept at most, 0 disables
+    size_t size;
+    size_t count;
+    size_t bucket_count;
+    CacheEntry **buckets;
+    CacheEntry *head, *tail;
+    uint64_t seed;
+    unsigned long hits, misses, evictions;
+    pthread_mutex_t lock;
+
+    /**
+     * Hash an input with the cache's secret seed
+     * @param self The result cache
+     * @param data The input
+     * @param data_len The length of the input
+     * @return The hash of the input
+     */
+    uint64_t (*hash)(ResultCache *self, const char *data, size_t data_len);
+
+    /**
+     * Look up a result, counting a hit or a miss
+     * @param self The result cache
+     * @param hash Hash of the input
+     * @param input The input
+     * @param input_len Length of the input
+     * @param mode Operation run on the input
+     * @return The entry, to be released after use, NULL on a miss
+     */
+    const CacheEntry *(*get)(ResultCache *self, uint64_t hash,
+                             const char *input, size_t input_len,
+                             enum MODE mode);
+
+    /**
+     * Give back an entry returned by get()
+     * @param self The result cache
+     * @param entry The entry
+     */
+    void (*release)(ResultCache *self, const CacheEntry *entry);
+
+    /**
+     * Store a result, evicting the least recently used ones to make room
+     * @param self The result cache
+     * @param hash Hash of the input
+     * @param input The input, copied into the entry
+     * @param input_len Length of the input
+     * @param mode Operation run on the input
+     * @param data The result, owned by the cache from now on
+     * @param len The length of the result
+     */
+    void (*put)(ResultCache *self, uint64_t hash, const char *input,
+                size_t input_len, enum MODE mode, char *data, size_t len);
+
+    /**
+     * Render the counters as JSON
+     * @param self The result cache
+     * @param buffer Where to render
+     * @param buffer_len Size of the buffer
+     */
+    void (*stats)(ResultCache *self, char *buffer, size_t buffer_len);
+};
+
+/**
+ * init_result_cache - create an empty result cache.
+ * @param self Where to store the result cache.
+ * @param capacity Bytes of results to keep at most, 0 to disable.
+ */
+extern void init_result_cache(ResultCache **self, size_t capacity);
+#endif
@@ -0,0 +1,36 @@
+#ifndef _CANCEL_H_
+#define _CANCEL_H_
+#include <stdbool.h>
+
+typedef struct CancelToken CancelToken;
+/**
+ * CancelToken - tells a long codec run that nobody wants its result anymore
+ * The codec checks the token between blocks. A token watching a client
+ * socket trips by itself once the connection is gone; a client that only
+ * half-closed it still gets its result.
+ */
+struct CancelToken {
+    int fd; // socket watched for a hangup, -1 for none
+    int cancelled;
+
+    /**
+     * Check whether the run should stop
+     * @param self The cancel token
+     * @return true once cancelled
+     */
+    bool (*is_cancelled)(CancelToken *self);
+
+    /**
+     * Ask the run to stop
+     * @param self The cancel token
+     */
+    void (*cancel)(CancelToken *self);
+};
+
+/**
+ * init_cancel_token - create a cancel token.
+ * @param self Where to store the cancel token.
+ * @param fd Client socket whose hangup cancels the run, -1 for none.
+ */
+extern void init_cancel_token(CancelToken **self, int fd);
+#endif
@@ -0,0 +1,70 @@
+#ifndef _CODE_H_
+#define _CODE_H_
+#include <stdint.h>
+#include <stdlib.h>
+#define SYMBOLS 256
+#define MAX_CODE_LEN 15
+#define LOOKUP_BITS 10
+
+/**
+ * HuffmanCode - a canonical Huffman code over bytes
+ */
+typedef struct HuffmanCode {
+    unsigned char lengths[SYMBOLS];
+    uint16_t codes[SYMBOLS];
+    // for decoding: how many codes each length has, the first of them and
+    // where their bytes start in sorted; short codes also go in lookup
+    uint16_t count[MAX_CODE_LEN + 1];
+    uint16_t first[MAX_CODE_LEN + 1];
+    uint16_t start[MAX_CODE_LEN + 1];
+    unsigned char sorted[SYMBOLS];
+    uint16_t lookup[1 << LOOKUP_BITS]; // symbol << 4 | length, 0 if longer
+} HuffmanCode;
+
+/**
+ * build_code_lengths - compute Huffman code lengths of at most MAX_CODE_LEN
+ * bits.
+ * Leaves are merged from two sorted queues, so no heap is needed. Codes that
+ * come out too long are clamped, and the Kraft sum is brought back under one
+ * by lengthening the rarest codes that still have room.
+ * @param freq Occurrences of every byte.
+ * @param lengths Where the code lengths go, 0 for unused bytes.
+ */
+extern void build_code_lengths(const uint64_t freq[SYMBOLS],
+                               unsigned char lengths[SYMBOLS]);
+
+/**
+ * assign_codes - derive the canonical code from the code lengths.
+ * Shorter codes come first, and codes of one length follow byte order, so
+ * the lengths alone describe the code.
+ * @param code The code, with lengths set.
+ * @return 0 on success, -1 if the lengths don't form a prefix code.
+ */
+extern int assign_codes(HuffmanCode *code);
+
+/**
+ * decode_symbol - find the byte whose code starts the input.
+ * @param code The code.
+ * @param bits The next bits of the input, left-aligned.
+ * @param code_len Where the length of the code goes.
+ * @return The byte, -1 if no code matches.
+ */
+static inline int decode_symbol(const HuffmanCode *code, uint64_t bits,
+                                int *code_len)
+{
+    uint16_t entry = code->lookup[bits >> (64 - LOOKUP_BITS)];
+    if (entry != 0) {
+        *code_len = entry & 0x0f;
+        return entry >> 4;
+    }
+    for (int len = LOOKUP_BITS + 1; len <= MAX_CODE_LEN; len++) {
+        uint32_t value = (uint32_t)(bits >> (64 - len));
+        if (value >= code->first[len] &&
+            value - code->first[len] < code->count[len]) {
+            *code_len = len;
+            return code->sorted[code->start[len] + value - code->first[len]];
+        }
+    }
+    return -1;
+}
+#endif
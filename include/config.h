@@ -1,5 +1,6 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
+#include "logger.h"
 #include <stdbool.h>
 #include <stdlib.h>
 #define autofree_config __attribute__((cleanup(free_config)))
@@ -8,16 +9,47 @@ enum MODE { COMPRESS, DECOMPRESS };
 
 typedef struct Config Config;
 struct Config {
-    const char *input_file;
+    const char *input_file; // the first of input_files
+    const char **input_files;
+    int input_count;
     const char *output_file;
     enum MODE mode;
+    bool archive;            // pack the inputs into one archive
+    const char *member;      // extract this member of an archive only
+    bool list;               // list the members of an archive
+    bool test;               // check compressed files without writing them out
+    bool adaptive;           // compress in one pass, for streams
+    size_t rebuild_interval; // most bytes between two codes of --adaptive
     bool using_server;
+    bool watch_templates;
+    int port;
+    int backlog;
+    int workers;
+    int job_workers;
+    bool reuseport;
+    bool io_uring;
+    bool store_compressed;
+    const char *unix_path;
+    const char *shm_name;
+    int shm_slots;
+    size_t shm_slot_size;
+    size_t cache_size;
+    int max_jobs;
+    size_t memory_budget;
+    int header_timeout;
+    int body_timeout;
+    int idle_timeout;
+    int write_timeout;
+    int min_rate;
+    const char *kernels; // variant of the codec loops, NULL for the best
+    enum LOG_LEVEL log_level;
 };
 
 extern Config *new_config(const int argc, const char **argv);
 
 __attribute__((always_inline)) inline void free_config(Config **config)
 {
+    free((*config)->input_files);
     free((*config));
 }
 #endif
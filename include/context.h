@@ -0,0 +1,55 @@
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+#include "code.h"
+#include "tree.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * CodecContext - the workspaces of one thread's codec runs
+ * Every run resets what it uses instead of freeing it, and the buffers only
+ * grow, to the largest run so far, so a thread coding small inputs over and
+ * over allocates nothing once it has warmed up. A context is used by one run
+ * at a time; the codecs take their thread's from codec_context().
+ */
+typedef struct CodecContext {
+    uint64_t freq[SYMBOLS]; // histogram of the block being compressed
+    HuffmanCode code;       // code of that block
+    unsigned char *block;   // one compressed block
+    size_t block_room;
+    unsigned char *index; // index of the file being written, then its tail
+    size_t index_room;
+    unsigned char *buffer; // original bytes of a block, frame or slice
+    size_t buffer_room;
+    HuffmanTree *tree; // rebuilt from the header of every legacy file
+} CodecContext;
+
+/**
+ * new_codec_context - create a context with empty workspaces.
+ * @return A new context, freed with free_codec_context().
+ */
+extern CodecContext *new_codec_context(void);
+
+/**
+ * free_codec_context - free a context and its workspaces.
+ * @param context The context.
+ */
+extern void free_codec_context(CodecContext *context);
+
+/**
+ * codec_context - the calling thread's context, created on first use and
+ * freed when the thread exits.
+ * @return The context.
+ */
+extern CodecContext *codec_context(void);
+
+/**
+ * reserve - make a workspace hold at least len bytes, keeping what it holds.
+ * @param buffer The workspace, moved if it has to grow.
+ * @param room Its size, updated if it grows.
+ * @param len The bytes needed.
+ * @return The workspace.
+ */
+extern unsigned char *reserve(unsigned char **buffer, size_t *room,
+                              size_t len);
+#endif
@@ -0,0 +1,121 @@
+#ifndef _JOBS_H_
+#define _JOBS_H_
+#include "admission.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#define MAX_JOB_NAME 100
+#define JOB_BUCKETS 1024
+
+enum JOB_STATE { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+
+typedef struct Job Job;
+/**
+ * Job - a codec run handed to the background pool
+ */
+struct Job {
+    uint64_t id;
+    enum JOB_STATE state;
+    enum MODE mode;
+    char name[MAX_JOB_NAME]; // file name offered with the result
+    char *input;
+    size_t input_len;
+    char *result; // valid once the job is done
+    size_t result_len;
+    void *ctx;       // handed to the runner untouched
+    size_t reserved; // memory held in the admission budget
+    long long queued_at;
+    long long finished_at;
+    int refs;
+    Job *next;  // queue, or list of finished jobs
+    Job *chain; // next job in the same id bucket
+    void (*run)(Job *job); // runs a request job, see submit_request()
+};
+
+typedef struct JobPool JobPool;
+/**
+ * JobPool - background threads running submitted jobs
+ * Small inputs have their own queue and at least one thread never picks up a
+ * large job, so small requests don't wait behind big ones. A large job that
+ * has waited too long is picked first so it can't starve either. Finished
+ * jobs are kept for a while so clients can fetch the result. Each run takes
+ * a codec slot first, so queued jobs wait while the server is saturated.
+ * Requests whose response is being produced get threads of their own, so
+ * the event loops never run the codec and never wait for background jobs.
+ */
+struct JobPool {
+    int workers;
+    pthread_t *threads;
+    int request_workers; // threads that only run request jobs
+    pthread_t *request_threads;
+    size_t small_limit; // inputs up to this size are small jobs
+    int running_large;
+    int max_large;
+    int queued_small, queued_large, running; // for /metrics
+    Job *small_head, *small_tail;
+    Job *large_head, *large_tail;
+    Job *done_head, *done_tail;
+    Job *request_head, *request_tail;
+    Job *table[JOB_BUCKETS];
+    Admission *admission; // codec slots and memory budget
+    uint64_t seed;
+    uint64_t next_seq;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t request_ready;
+
+    /**
+     * Do the work of a job
+     * @param job The job, whose result to fill in
+     * @return 0 on success, -1 on failure
+     */
+    int (*run)(Job *job);
+
+    /**
+     * Queue a job, owned by the pool from now on
+     * @param self The job pool
+     * @param job The job
+     * @return The id of the job
+     */
+    uint64_t (*submit)(JobPool *self, Job *job);
+
+    /**
+     * Queue the rest of a request that is being answered
+     * The job already holds its codec slots and gives them back itself, so
+     * it never waits for one. It gets no id and isn't kept: its run() is
+     * called on a request thread, then the job is freed.
+     * @param self The job pool
+     * @param job The job, owned by the pool from now on
+     */
+    void (*submit_request)(JobPool *self, Job *job);
+
+    /**
+     * Look up a job
+     * @param self The job pool
+     * @param id The id of the job
+     * @param state Where to store the current state of the job
+     * @return The job, to be released after use, NULL if unknown or expired
+     */
+    Job *(*find)(JobPool *self, uint64_t id, enum JOB_STATE *state);
+
+    /**
+     * Give back a job returned by find()
+     * @param self The job pool
+     * @param job The job
+     */
+    void (*release)(JobPool *self, Job *job);
+};
+
+/**
+ * init_job_pool - create a job pool and start its threads.
+ * @param self Where to store the job pool.
+ * @param workers Number of threads running background jobs.
+ * @param request_workers Number of threads running request jobs, as many as
+ * there are codec slots so that every request job finds one.
+ * @param run The function doing the work of a background job.
+ * @param admission Codec slots to take and memory budget to give back to.
+ */
+extern void init_job_pool(JobPool **self, int workers, int request_workers,
+                          int (*run)(Job *job), Admission *admission);
+#endif
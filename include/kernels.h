@@ -0,0 +1,80 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+#include "code.h"
+#include <stdint.h>
+#include <stdlib.h>
+#define KERNEL_NAMES "auto, scalar, sse4.2 or bmi2"
+
+/**
+ * Kernels - the inner loops of the block codec, built for one level of the
+ * instruction set
+ * Every build produces the same bytes. scalar is portable C; sse4.2 folds
+ * checksums with the crc32 instruction; bmi2 also has the variable shifts of
+ * packing and unpacking compiled to shlx and shrx, which take the count from
+ * any register and leave the flags alone.
+ */
+typedef struct Kernels {
+    const char *name;
+
+    /**
+     * Count the bytes of a block and checksum them from the same loads
+     * @param data The bytes
+     * @param len The number of bytes
+     * @param freq Where the occurrences of every byte are added
+     * @return The CRC-32C of the bytes
+     */
+    uint32_t (*count)(const unsigned char *data, size_t len,
+                      uint64_t freq[SYMBOLS]);
+
+    /**
+     * Write the codes of the bytes, packed MSB first, the last byte padded
+     * with zero bits
+     * @param code The code
+     * @param data The bytes
+     * @param len The number of bytes
+     * @param out Room for len * MAX_CODE_LEN / 8 + 8 bytes
+     * @return The number of bytes written
+     */
+    size_t (*pack)(const HuffmanCode *code, const unsigned char *data,
+                   size_t len, unsigned char *out);
+
+    /**
+     * Decode bytes and checksum them while they are still in L1
+     * @param code The code
+     * @param in The packed codes
+     * @param in_len The length of the packed codes
+     * @param out Room for len bytes
+     * @param len The number of bytes to decode
+     * @param checksum Where the CRC-32C of the bytes goes
+     * @return 0 on success, -1 if a code is invalid or the input runs out
+     */
+    int (*unpack)(const HuffmanCode *code, const unsigned char *in,
+                  size_t in_len, unsigned char *out, size_t len,
+                  uint32_t *checksum);
+
+    /**
+     * CRC-32C of data, continuing an earlier one
+     * @param crc The CRC of the data before this one, 0 to start
+     * @param data The data
+     * @param data_len The length of the data
+     * @return The CRC of everything so far
+     */
+    uint32_t (*crc32c)(uint32_t crc, const void *data, size_t data_len);
+} Kernels;
+
+/**
+ * kernels - the kernels in use, the best this CPU runs unless
+ * select_kernels() chose others.
+ * @return The kernels.
+ */
+extern const Kernels *kernels(void);
+
+/**
+ * select_kernels - choose the kernels by name, e.g. to compare them.
+ * Meant to be called at startup, before any codec runs.
+ * @param name One of KERNEL_NAMES, auto being the best this CPU runs.
+ * @return 0 on success, -1 if the name is unknown or the CPU lacks the
+ * instructions.
+ */
+extern int select_kernels(const char *name);
+#endif
@@ -1,10 +1,58 @@
 #ifndef _LOGGER_H_
 #define _LOGGER_H_
+#include <stdint.h>
+
+enum LOG_LEVEL {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+};
+
+// sites below this level are compiled out, e.g. make
+// LOG_MIN_LEVEL=LOG_LEVEL_WARN
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// the level is checked before any argument is evaluated, so a disabled site
+// costs one comparison, and nothing at all below LOG_MIN_LEVEL
+#define LOG_AT(logger, lvl, msg, ...)                                          \
+    do {                                                                       \
+        if ((lvl) >= LOG_MIN_LEVEL && (lvl) >= (logger)->level)                \
+            log_write((logger), (lvl), __FILE__, __LINE__, (msg),             \
+                      __VA_ARGS__);                                            \
+    } while (0)
+
+// LOG_X logs a message, LOG_XF adds printf-style key=value fields to it
+#define LOG_DEBUG(logger, msg) LOG_AT(logger, LOG_LEVEL_DEBUG, msg, NULL)
+#define LOG_INFO(logger, msg) LOG_AT(logger, LOG_LEVEL_INFO, msg, NULL)
+#define LOG_WARN(logger, msg) LOG_AT(logger, LOG_LEVEL_WARN, msg, NULL)
+#define LOG_ERROR(logger, msg) LOG_AT(logger, LOG_LEVEL_ERROR, msg, NULL)
+#define LOG_DEBUGF(logger, msg, ...)                                           \
+    LOG_AT(logger, LOG_LEVEL_DEBUG, msg, __VA_ARGS__)
+#define LOG_INFOF(logger, msg, ...)                                            \
+    LOG_AT(logger, LOG_LEVEL_INFO, msg, __VA_ARGS__)
+#define LOG_WARNF(logger, msg, ...)                                            \
+    LOG_AT(logger, LOG_LEVEL_WARN, msg, __VA_ARGS__)
+#define LOG_ERRORF(logger, msg, ...)                                           \
+    LOG_AT(logger, LOG_LEVEL_ERROR, msg, __VA_ARGS__)
+
+typedef struct LogRing LogRing;
+
 typedef struct Logger Logger;
 struct Logger {
-    void (*info_log)(const char *msg, const char *file, const int line);
-    void (*warn_log)(const char *msg, const char *file, const int line);
-    void (*error_log)(const char *msg, const char *file, const int line);
+    enum LOG_LEVEL level;
+    LogRing *rings;
+    uint64_t dropped;
+    int stderr_only; // set while stdout carries data, e.g. a CLI stream
+    void (*flush)(Logger *self);
 };
+
+extern void log_write(Logger *self, enum LOG_LEVEL level, const char *file,
+                      int line, const char *msg, const char *fields, ...)
+    __attribute__((format(printf, 6, 7)));
+extern int parse_log_level(const char *name, enum LOG_LEVEL *level);
 extern void init_logger(Logger **self);
 #endif
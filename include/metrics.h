@@ -0,0 +1,136 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+#include "config.h"
+#include "route.h"
+#include "sink.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#define HISTOGRAM_SLOTS 16
+#define STATUS_SLOTS 13
+
+enum COUNTER {
+    COUNTER_CONNECTIONS_OPENED,
+    COUNTER_CONNECTIONS_CLOSED,
+    COUNTER_BYTES_RECEIVED,
+    COUNTER_BYTES_SENT,
+    COUNTER_TIMEOUTS,
+    COUNTER_REJECTED,
+    COUNTER_COUNT
+};
+
+enum STAGE {
+    STAGE_FREQUENCY,
+    STAGE_TREE,
+    STAGE_CODE_TABLE,
+    STAGE_ENCODE,
+    STAGE_HEADER,
+    STAGE_DECODE,
+    STAGE_COUNT
+};
+
+/**
+ * CodecStats - what one codec run produced, and how long each stage took
+ */
+typedef struct CodecStats {
+    double stage[STAGE_COUNT]; // seconds
+    size_t output_len;
+    uint32_t checksum; // CRC-32C of the original, if the codec computed it
+} CodecStats;
+
+/**
+ * Histogram - observations counted per bucket, not cumulated
+ */
+typedef struct Histogram {
+    uint64_t buckets[HISTOGRAM_SLOTS];
+    uint64_t count;
+    double sum;
+} Histogram;
+
+typedef struct MetricsShard MetricsShard;
+/**
+ * MetricsShard - the metrics recorded by one thread
+ * Only the owning thread writes a shard, so updates need no lock and no
+ * read-modify-write instruction; scrapes read every shard and add them up.
+ */
+struct MetricsShard {
+    MetricsShard *next;
+    uint64_t counters[COUNTER_COUNT];
+    Histogram requests[MAX_ROUTES + 1][STATUS_SLOTS]; // last route: unmatched
+    Histogram codec_seconds[2];                       // by MODE
+    Histogram codec_ratio[2];
+    Histogram codec_throughput[2];
+    Histogram stages[STAGE_COUNT];
+};
+
+typedef struct Metrics Metrics;
+/**
+ * Metrics - counters and histograms exposed at /metrics
+ * There is one Metrics object per process: the shard of a thread is found
+ * through a thread-local pointer.
+ */
+struct Metrics {
+    MetricsShard *shards;
+    pthread_mutex_t lock; // guards the list of shards
+
+    /**
+     * Add to a counter
+     * @param self The metrics
+     * @param counter The counter
+     * @param value The amount to add
+     */
+    void (*count)(Metrics *self, enum COUNTER counter, uint64_t value);
+
+    /**
+     * Record a handled request
+     * @param self The metrics
+     * @param route The route that handled it, NULL if none matched
+     * @param status The status code sent, 0 if none
+     * @param seconds Time spent handling it
+     */
+    void (*observe_request)(Metrics *self, const Route *route, int status,
+                            double seconds);
+
+    /**
+     * Record a codec run
+     * @param self The metrics
+     * @param mode Whether it compressed or decompressed
+     * @param in_len Length of the input
+     * @param seconds Time spent in total
+     * @param stats Output length and time spent in each stage
+     */
+    void (*observe_codec)(Metrics *self, enum MODE mode, size_t in_len,
+                          double seconds, const CodecStats *stats);
+
+    /**
+     * Write every metric in the Prometheus text format
+     * @param self The metrics
+     * @param router Router whose routes label the request metrics
+     * @param out Where to write
+     */
+    void (*render)(Metrics *self, const Router *router, Sink *out);
+};
+
+/**
+ * init_metrics - create the metrics of the process.
+ * @param self Where to store the metrics.
+ */
+extern void init_metrics(Metrics **self);
+
+/**
+ * write_metric - write a single-valued metric in the Prometheus text format.
+ * @param out Where to write.
+ * @param name Name of the metric.
+ * @param type "counter" or "gauge".
+ * @param help Description of the metric.
+ * @param value Current value.
+ */
+extern void write_metric(Sink *out, const char *name, const char *type,
+                         const char *help, double value);
+
+/**
+ * monotonic_seconds - read the monotonic clock.
+ * @return Seconds since an arbitrary point.
+ */
+extern double monotonic_seconds(void);
+#endif
@@ -0,0 +1,134 @@
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// bytes of copies a producer off the event loop may get ahead of the client
+#define OUTBOX_LIMIT (1 << 20)
+
+enum OUTBOX_STATE {
+    OUTBOX_BLOCKED, // bytes are pending and the socket is full
+    OUTBOX_WAITING, // everything went out, or failed, but more may come
+    OUTBOX_DONE     // everything went out, or failed, and nothing more comes
+};
+
+typedef struct Segment Segment;
+typedef struct Outbox Outbox;
+/**
+ * Outbox - the response of a connection on its way out
+ * Handlers append to it instead of writing to the socket. Whatever the
+ * socket takes right away goes out at once and the rest is queued, to be
+ * written by the event loop whenever the socket becomes writable again, so
+ * no thread ever blocks on a slow reader. A producer finishing a response on
+ * the job pool waits once it is OUTBOX_LIMIT bytes ahead of the client.
+ */
+struct Outbox {
+    int fd;
+    Segment *head, *tail;
+    size_t buffered;      // bytes of copies queued, bounded by OUTBOX_LIMIT
+    size_t sent;          // bytes written to the socket
+    int status;           // status code of the response, 0 before it's known
+    long long started_ms; // when the first byte went out, 0 before
+    size_t taken;          // bytes the client had taken when last checked
+    long long progress_ms; // when taken last grew, 0 before the first check
+    bool off_loop;        // the producer runs on the job pool, see defer()
+    bool blocked;         // the event loop waits for the socket to drain
+    bool finished;        // the producer is done
+    bool failed;          // the client is gone or too slow
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+
+    /**
+     * Ask the event loop to look at the outbox, from a producer off the
+     * loop, once the socket is full or the response is finished
+     * @param self The outbox
+     */
+    void (*wake)(Outbox *self);
+    void *owner; // the connection, for wake()
+
+    /**
+     * Send data, or queue a copy of what the socket doesn't take
+     * @param self The outbox
+     * @param data The data
+     * @param data_len The length of the data
+     * @return 0 on success, -1 once the outbox has failed
+     */
+    int (*append)(Outbox *self, const char *data, size_t data_len);
+
+    /**
+     * Send a buffer that stays valid until release() is called, queuing it
+     * without a copy
+     * @param self The outbox
+     * @param data The data
+     * @param data_len The length of the data
+     * @param release Called once the data went out or the outbox failed
+     * @param ctx Handed to release
+     * @return 0 on success, -1 once the outbox has failed
+     */
+    int (*append_held)(Outbox *self, const char *data, size_t data_len,
+                       void (*release)(void *ctx), void *ctx);
+
+    /**
+     * Send a file region straight from the page cache
+     * @param self The outbox
+     * @param fd The file, duplicated if the region has to be queued
+     * @param offset Offset of the first byte to send
+     * @param len Number of bytes to send
+     * @return 0 on success, -1 once the outbox has failed
+     */
+    int (*append_file)(Outbox *self, int fd, off_t offset, size_t len);
+
+    /**
+     * Write what is queued, as far as the socket takes it
+     * @param self The outbox
+     * @return Whether the event loop must wait for the socket, for the
+     * producer or for nothing
+     */
+    enum OUTBOX_STATE (*flush)(Outbox *self);
+
+    /**
+     * Mark the response as complete, waking the event loop if the producer
+     * runs off it
+     * @param self The outbox
+     */
+    void (*finish)(Outbox *self);
+
+    /**
+     * Give up on the response: drop what is queued, shut the connection
+     * down and wake a producer waiting for room
+     * @param self The outbox
+     */
+    void (*fail)(Outbox *self);
+
+    /**
+     * Work out when the client of a blocked outbox is too slow
+     * The client gets timeout_ms from the last time it was seen taking more
+     * of the response, and no more than timeout_ms plus a second for every
+     * min_rate bytes it took since the first byte went out. Bytes still
+     * queued in the socket don't count.
+     * @param self The outbox
+     * @param now_ms The current time
+     * @param timeout_ms How long a write may stall
+     * @param min_rate Bytes per second the response must be read at, 0 for
+     * no limit
+     * @return The deadline in milliseconds
+     */
+    long long (*deadline)(Outbox *self, long long now_ms, long long timeout_ms,
+                          int min_rate);
+};
+
+/**
+ * init_outbox - create an outbox.
+ * @param self Where to store the outbox.
+ * @param fd Client socket, non-blocking.
+ */
+extern void init_outbox(Outbox **self, int fd);
+
+/**
+ * free_outbox - release what is still queued and free an outbox.
+ * @param self The outbox, whose producer is done.
+ */
+extern void free_outbox(Outbox *self);
+#endif
@@ -1,19 +1,90 @@
 #ifndef _ROUTE_H_
 #define _ROUTE_H_
+#include <stdbool.h>
+#include <stdlib.h>
+typedef struct Server Server;
+typedef struct Request Request;
 typedef struct Router Router;
 typedef struct Route Route;
+typedef struct RouteNode RouteNode;
+
+#define MAX_ROUTES 32
+
+enum METHOD { HTTP_GET, HTTP_POST, HTTP_METHOD_COUNT };
+
+typedef void (*RouteHandler)(Server *server, Request *req);
+
 struct Route {
-    char *key;
-    char *value;
-    Route *left, *right;
+    enum METHOD method;
+    const char *path;
+    RouteHandler handler;
+    const char *value; // handler argument, e.g. the template to render
+    bool is_prefix;    // also matches every path below this one
+    int id;            // index in the router's route list
+};
+
+/**
+ * RouteNode - node of the radix trie the router dispatches on
+ * Each node owns a run of path bytes; routes hang off the node where their
+ * path ends, one slot per method.
+ */
+struct RouteNode {
+    char *label;
+    size_t label_len;
+    RouteNode *children;
+    RouteNode *next;
+    Route *exact[HTTP_METHOD_COUNT];
+    Route *prefix[HTTP_METHOD_COUNT];
 };
 
 struct Router {
-    Route *root;
-    void (*list_routes)(Route *self);
-    void (*add_route)(Route **self, char *key, char *value);
-    Route *(*search_route)(Route *self, const char *key);
+    RouteNode *root;
+    Route *routes[MAX_ROUTES]; // every route, by id
+    int route_count;
+
+    /**
+     * Print every route
+     * @param self The router
+     */
+    void (*list_routes)(Router *self);
+
+    /**
+     * Register a handler for a method and path
+     * @param self The router
+     * @param method HTTP method
+     * @param path Path to match (without query string)
+     * @param handler Function handling the request
+     * @param value Handler argument, e.g. the template to render
+     * @param is_prefix Also match every path starting with this one
+     */
+    void (*add_route)(Router *self, enum METHOD method, const char *path,
+                      RouteHandler handler, const char *value, bool is_prefix);
+
+    /**
+     * Find the route for a request in O(path length)
+     * @param self The router
+     * @param method HTTP method of the request
+     * @param target Request target, the query string is ignored
+     * @param path_known Set when the path exists for another method
+     * @return The route, NULL if none matches
+     */
+    const Route *(*match_route)(Router *self, enum METHOD method,
+                                const char *target, bool *path_known);
 };
 
+/**
+ * parse_method - map an HTTP method name to its enum value.
+ * @param name The method name, e.g. "GET".
+ * @return The method, HTTP_METHOD_COUNT if it isn't supported.
+ */
+extern enum METHOD parse_method(const char *name);
+
+/**
+ * method_name - map a method to its HTTP name.
+ * @param method The method.
+ * @return The method name, e.g. "GET".
+ */
+extern const char *method_name(enum METHOD method);
+
 void init_router(Router **self);
 #endif
@@ -1,25 +1,105 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 #include "route.h"
-typedef struct Server Server;
+#include "../include/admission.h"
+#include "../include/asset.h"
+#include "../include/cache.h"
+#include "../include/jobs.h"
 #include "../include/logger.h"
+#include "../include/metrics.h"
+#include "../include/outbox.h"
+#include "../include/sink.h"
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#define MAX_PARAM_LEN 100
+#define MAX_TARGET_LEN 2048
+
+/**
+ * Request - a parsed HTTP request handed to route handlers
+ * The worker fills in the socket, the raw request and the outbox; the rest
+ * is parsed by handle_request().
+ */
+struct Request {
+    int client_socket;
+    enum METHOD method;
+    const char *target; // path and query string
+    const char *raw;    // the whole request, headers and body
+    size_t raw_len;
+    const Route *route;
+    double started; // when the request was complete, for its latency
+    Outbox *outbox; // where the response goes, written out by the worker
+};
+
+/**
+ * RequestTask - the rest of a request, run on the job pool by defer()
+ * @param server Server object
+ * @param req The request, whose connection stays open until the task returns
+ * and its outbox drained
+ * @param arg What the handler handed over, freed by the task
+ */
+typedef void (*RequestTask)(Server *server, Request *req, void *arg);
+
+/**
+ * Timeouts - how long a client may take, in seconds
+ */
+typedef struct Timeouts {
+    int header;   // to send the request headers
+    int body;     // to send the body, on top of what min_rate grants
+    int idle;     // between two reads
+    int write;    // to accept more of a response that is being sent
+    int min_rate; // bytes per second a body must average, 0 for no limit
+} Timeouts;
+
 struct Server {
     int port;
+    int backlog;
+    bool reuseport;
+    bool io_uring; // queue accepts and reads on io_uring instead of epoll
+    bool store_compressed; // keep decompressed results compressed on disk
     int socket;
+    const char *unix_path; // Unix domain socket listened on too, or NULL
+    int unix_socket;       // -1 without unix_path
     Logger *logger;
     Router *router;
+    AssetCache *assets;
+    ResultCache *results;
+    JobPool *jobs;
+    Admission *admission;
+    Timeouts timeouts;
+    Metrics *metrics;
     void (*config_router)(Server *self);
-    const char *(*render_static_route)(Server *self, const char *endpoint);
     void (*send_ok_response)(int client_socket, const char *body);
     void (*send_not_found_response)(int client_socket);
-    void (*get_client_request)(int client_socket, char **client_req,
-                               size_t *req_len);
-    char *(*handle_get_requests)(Server *self, const char *route);
+    void (*send_method_not_allowed)(int client_socket);
+    int (*send_all)(int client_socket, const char *data, size_t data_len);
+    int (*send_held)(int client_socket, const char *data, size_t data_len,
+                     void (*release)(void *ctx), void *ctx);
+    int (*send_response)(int client_socket, const char *status,
+                         const char *headers, const char *body,
+                         size_t body_len);
+    int (*send_file)(int client_socket, int fd, off_t offset, size_t len);
+    void (*serve)(Server *self, int workers);
+    void (*handle_request)(Server *self, Request *req);
+    void (*observe_response)(Server *self, const Request *req,
+                             const Outbox *out);
+    void (*defer)(Server *self, Request *req, RequestTask task, void *arg);
+    void (*dispatch)(Server *self, Request *req);
+    void (*handle_get_requests)(Server *self, Request *req);
     const char *(*get_file_content)(Server *self, const char *const chunk,
                                     const size_t chunk_len, long *content_len);
     void (*parse_url_params)(Server *self, const char *url, char *out_file,
                              char *service_type);
+    bool (*get_url_param)(const char *url, const char *key, char *value,
+                          size_t value_len);
+    bool (*get_request_header)(const char *request, const char *name,
+                               char *value, size_t value_len);
+    int (*get_range)(const char *request, size_t total, size_t *first,
+                     size_t *last);
+    Sink *(*open_chunked_response)(int client_socket, const char *filename);
+    Sink *(*open_response)(int client_socket, const char *status,
+                           const char *headers, size_t body_len);
 };
-void init_server(Server **self, int port);
+void init_server(Server **self, int port, int backlog, bool reuseport,
+                 const char *unix_path);
 #endif
@@ -0,0 +1,134 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+#include "config.h"
+#include "sink.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Shared memory transport, for callers on the same host:
+ *
+ *   header   "HUFSHM1", slot geometry, service pid, doorbell, wait counters
+ *   slots    state, mode, length, then slot size bytes of data
+ *
+ * A client claims a free slot, writes its input into the slot data, marks
+ * the slot submitted and rings the doorbell. A service thread runs the codec
+ * and writes the output over the input, in the same slot, then marks it
+ * done. Both sides sleep on futexes inside the segment, so a request costs
+ * two wakeups and no socket copies.
+ */
+#define SHM_MAGIC "HUFSHM1"
+#define DEFAULT_SHM_SLOTS 16
+#define DEFAULT_SHM_SLOT_SIZE (4 * 1024 * 1024)
+
+enum SHM_STATE {
+    SHM_FREE,      // nobody uses the slot
+    SHM_CLAIMED,   // a client is writing its input
+    SHM_SUBMITTED, // the input is waiting for a service thread
+    SHM_RUNNING,   // a service thread is running the codec
+    SHM_DONE,      // the output replaced the input
+    SHM_FAILED,    // the codec failed, length is 0
+    SHM_TOO_LARGE  // the output didn't fit, length is what it needed
+};
+
+typedef struct ShmHeader ShmHeader;
+typedef struct ShmSlot ShmSlot;
+
+typedef struct ShmService ShmService;
+/**
+ * ShmService - threads answering requests placed in a shared segment
+ * The service creates the segment, replacing any left by an earlier run, and
+ * serves it for as long as the process lives.
+ */
+struct ShmService {
+    char name[64]; // name of the segment, as given to shm_open
+    ShmHeader *header;
+    size_t size; // bytes mapped
+    int threads;
+    pthread_t *pool;
+    void *ctx; // handed to run untouched
+
+    /**
+     * Run the codec on the input of a slot
+     * @param ctx The ctx of the service
+     * @param mode Whether to compress or decompress
+     * @param input The input, inside the slot
+     * @param input_len The length of the input
+     * @param out Where the output goes, to be closed by run
+     * @return 0 on success, -1 on failure
+     */
+    int (*run)(void *ctx, enum MODE mode, char *input, size_t input_len,
+               Sink *out);
+
+    /**
+     * Start the service threads
+     * @param self The service
+     */
+    void (*start)(ShmService *self);
+};
+
+/**
+ * init_shm_service - create a shared segment to serve requests from.
+ * @param self Where to store the service.
+ * @param name Name of the segment, e.g. "/huffman".
+ * @param slots Number of requests in flight at once.
+ * @param slot_size Largest input and output of a request, in bytes.
+ * @param threads Number of service threads.
+ * @return 0 on success, -1 if the segment can't be created.
+ */
+extern int init_shm_service(ShmService **self, const char *name, size_t slots,
+                            size_t slot_size, int threads);
+
+typedef struct ShmClient ShmClient;
+/**
+ * ShmClient - a process sending requests through a service's segment
+ */
+struct ShmClient {
+    ShmHeader *header;
+    size_t size; // bytes mapped
+
+    /**
+     * Claim a free slot, waiting for one if they are all in use
+     * @param self The client
+     * @param capacity Where to store how many bytes the slot holds
+     * @return The data of the slot, to write the input to
+     */
+    char *(*acquire)(ShmClient *self, size_t *capacity);
+
+    /**
+     * Submit the input written to a claimed slot and wait for the output
+     * @param self The client
+     * @param data The data of the slot, as returned by acquire
+     * @param mode Whether to compress or decompress
+     * @param input_len The length of the input
+     * @param output_len Where to store the length of the output, or the
+     * length it needed if it didn't fit
+     * @return The state the request ended in, SHM_DONE on success,
+     * SHM_FAILED as well if the service died
+     */
+    enum SHM_STATE (*call)(ShmClient *self, char *data, enum MODE mode,
+                           size_t input_len, size_t *output_len);
+
+    /**
+     * Give back a slot once its output has been read
+     * @param self The client
+     * @param data The data of the slot
+     */
+    void (*release)(ShmClient *self, char *data);
+
+    /**
+     * Unmap the segment and free the client
+     * @param self The client
+     */
+    void (*close)(ShmClient *self);
+};
+
+/**
+ * open_shm_client - attach to the segment of a running service.
+ * @param name Name of the segment.
+ * @return A new client, or NULL if there is no such segment.
+ */
+extern ShmClient *open_shm_client(const char *name);
+#endif
@@ -0,0 +1,77 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+#include <stdlib.h>
+
+typedef struct Sink Sink;
+/**
+ * Sink - destination for codec output (a file, a socket, ...)
+ * Producers push bytes as soon as they have them, so a sink never needs the
+ * whole result in memory.
+ */
+struct Sink {
+    /**
+     * Append data to the sink
+     * @param self The sink
+     * @param data The data to append
+     * @param data_len The length of the data
+     * @return 0 on success, -1 once the sink has failed
+     */
+    int (*write)(Sink *self, const char *data, const size_t data_len);
+
+    /**
+     * Flush pending data and free the sink
+     * @param self The sink
+     * @return 0 on success, -1 if any write failed
+     */
+    int (*close)(Sink *self);
+
+    /**
+     * Give up on the output after a failed run and free the sink, telling
+     * the reader it is incomplete where the sink can. NULL for sinks that
+     * have nothing to tell, which are closed instead; see sink_abort().
+     * @param self The sink
+     */
+    void (*abort)(Sink *self);
+};
+
+/**
+ * sink_abort - abort a sink, or close it if it has no abort.
+ * @param sink The sink, freed on return.
+ */
+extern void sink_abort(Sink *sink);
+
+/**
+ * new_file_sink - create a sink that writes to a file.
+ * @param filename The file to create or truncate.
+ * @return A new sink, or NULL if the file can't be opened.
+ */
+extern Sink *new_file_sink(const char *filename);
+
+/**
+ * new_fd_sink - create a sink that writes straight to a descriptor, e.g.
+ * stdout, without buffering.
+ * @param fd The descriptor, left open by close().
+ * @return A new sink.
+ */
+extern Sink *new_fd_sink(int fd);
+
+/**
+ * new_buffer_sink - create a sink that collects everything in memory.
+ * @param data Where close() stores the malloc'd buffer.
+ * @param data_len Where close() stores the length of the buffer.
+ * @return A new sink.
+ */
+extern Sink *new_buffer_sink(char **data, size_t *data_len);
+
+/**
+ * new_capture_sink - create a sink that forwards to another one and keeps a
+ * copy of everything written.
+ * @param inner The sink to forward to, closed along with this one.
+ * @param limit Stop copying once more than this many bytes were written.
+ * @param copy Where close() stores the copy, NULL if over limit or failed.
+ * @param copy_len Where close() stores the length of the copy.
+ * @return A new sink.
+ */
+extern Sink *new_capture_sink(Sink *inner, size_t limit, char **copy,
+                              size_t *copy_len);
+#endif
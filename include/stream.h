@@ -0,0 +1,39 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+#include "sink.h"
+#include <stdlib.h>
+
+/*
+ * Streams between descriptors and sinks, each side on its own thread. Data
+ * moves in chunks through a bounded queue, so a pipeline such as
+ *
+ *   read stdin -> compress -> write stdout
+ *
+ * reads, codes and writes at the same time while holding at most a few
+ * chunks in memory, however long the stream is.
+ */
+#define STREAM_CHUNK_SIZE (256 * 1024)
+#define STREAM_DEPTH 4
+
+/**
+ * new_async_sink - create a sink that hands data to a writer thread.
+ * Writes return as soon as the data is queued; they block only while
+ * STREAM_DEPTH chunks are waiting to be written. Data is queued a full chunk
+ * at a time, or as soon as it is written while the writer thread is idle.
+ * @param inner The sink the writer thread writes to, closed along with this
+ * one.
+ * @return A new sink.
+ */
+extern Sink *new_async_sink(Sink *inner);
+
+/**
+ * pump_fd - copy a descriptor into a sink until the end of file.
+ * A reader thread reads ahead by up to STREAM_DEPTH chunks while the calling
+ * thread writes to the sink.
+ * @param fd The descriptor, left open.
+ * @param out The sink, left open.
+ * @param total Where to store the number of bytes read.
+ * @return 0 on success, -1 if reading or the sink failed.
+ */
+extern int pump_fd(int fd, Sink *out, size_t *total);
+#endif
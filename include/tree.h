@@ -42,6 +42,30 @@ struct HuffmanTree {
      */
     char *(*decode)(HuffmanTree *self, char *encoded_str, size_t *decoded_len,
                     size_t raw_len);
+    /**
+     * Build the tree from the header of an encoded file, freeing the one
+     * built for an earlier file
+     * @param self The Huffman tree
+     * @param encoded_str The encoded file
+     * @param encoded_len The length of the file
+     * @return the encoded data following the header, NULL if the file lacks
+     * the length lines or any code
+     */
+    const char *(*read_header)(HuffmanTree *self, const char *encoded_str,
+                               size_t encoded_len);
+    /**
+     * Decode whole codes until the encoded data or the output room runs out
+     * @param self The Huffman tree, built by read_header
+     * @param encoded_data The encoded data
+     * @param encoded_len The length of the encoded data
+     * @param out Where to store the decoded bytes
+     * @param out_len Room in out
+     * @param consumed Set to the length of encoded data used
+     * @return the number of decoded bytes
+     */
+    size_t (*decode_slice)(HuffmanTree *self, const char *encoded_data,
+                           size_t encoded_len, char *out, size_t out_len,
+                           size_t *consumed);
 
     /**
      * Free the Huffman tree
@@ -0,0 +1,108 @@
+#ifndef _URING_H_
+#define _URING_H_
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct Ring Ring;
+/**
+ * Ring - an io_uring instance, driven with raw system calls
+ * Operations are queued on the submission ring and handed to the kernel in
+ * one batch by submit(), which also waits for completions, so a turn of an
+ * event loop costs a single system call however many operations it queued.
+ */
+struct Ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_queued; // local tail, published by submit()
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings; // submission and completion rings, mapped together
+    size_t rings_len;
+    bool multishot_accept; // cleared if the kernel is too old for it
+    struct __kernel_timespec timeout; // read by the kernel on submit
+
+    /**
+     * Queue an accept on a listening socket
+     * Multishot accepts keep producing a completion per connection.
+     * @param self The ring
+     * @param listener The listening socket
+     * @param user_data Tag of the completions
+     */
+    void (*accept)(Ring *self, int listener, uint64_t user_data);
+
+    /**
+     * Queue a receive
+     * @param self The ring
+     * @param fd The socket
+     * @param buf Where the data goes
+     * @param len Room in buf
+     * @param user_data Tag of the completion
+     */
+    void (*recv)(Ring *self, int fd, void *buf, size_t len,
+                 uint64_t user_data);
+
+    /**
+     * Queue a read, e.g. of an eventfd
+     * @param self The ring
+     * @param fd The descriptor
+     * @param buf Where the data goes
+     * @param len Room in buf
+     * @param user_data Tag of the completion
+     */
+    void (*read)(Ring *self, int fd, void *buf, size_t len,
+                 uint64_t user_data);
+
+    /**
+     * Queue a one-shot poll, e.g. for a socket to become writable
+     * @param self The ring
+     * @param fd The descriptor
+     * @param events Poll events to wait for
+     * @param user_data Tag of the completion
+     */
+    void (*poll)(Ring *self, int fd, unsigned events, uint64_t user_data);
+
+    /**
+     * Queue the cancellation of an operation still in flight
+     * @param self The ring
+     * @param target Tag of the operation to cancel
+     * @param user_data Tag of the completion
+     */
+    void (*cancel)(Ring *self, uint64_t target, uint64_t user_data);
+
+    /**
+     * Queue a timer, only one may be pending at a time
+     * @param self The ring
+     * @param ms Milliseconds until it fires
+     * @param user_data Tag of the completion
+     */
+    void (*timer)(Ring *self, long long ms, uint64_t user_data);
+
+    /**
+     * Hand the queued operations to the kernel
+     * @param self The ring
+     * @param wait_nr Completions to wait for, 0 to return at once
+     * @return 0 on success, -1 on failure
+     */
+    int (*submit)(Ring *self, unsigned wait_nr);
+
+    /**
+     * Take the next completion off the ring
+     * @param self The ring
+     * @param cqe Where the completion is copied
+     * @return true if there was one
+     */
+    bool (*next)(Ring *self, struct io_uring_cqe *cqe);
+};
+
+/**
+ * init_ring - set up an io_uring instance.
+ * @param self Where to store the ring.
+ * @param entries Size of the submission ring, a power of two.
+ * @return 0 on success, -1 if io_uring is unavailable.
+ */
+extern int init_ring(Ring **self, unsigned entries);
+#endif
@@ -1,6 +1,8 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * checked_malloc - Allocate memory and check for errors.
@@ -10,6 +12,96 @@
  */
 extern void *must_calloc(size_t count, size_t size);
 
+/**
+ * hash_bytes - Fast non-cryptographic 64-bit hash.
+ * @param data The data to hash.
+ * @param data_len The length of the data.
+ * @param seed The seed.
+ * @return The hash of the data.
+ */
+extern uint64_t hash_bytes(const void *data, size_t data_len, uint64_t seed);
+
+/**
+ * crc32c - CRC-32C (Castagnoli) of data, continuing an earlier one, with
+ * the crc32 instruction where the kernels in use have it.
+ * @param crc The CRC of the data before this one, 0 to start.
+ * @param data The data.
+ * @param data_len The length of the data.
+ * @return The CRC of everything so far.
+ */
+extern uint32_t crc32c(uint32_t crc, const void *data, size_t data_len);
+
+/**
+ * crc32c_tables - the slicing-by-8 tables of CRC-32C, built on first use.
+ * @return Eight tables of 256 entries, for crc32c_word and crc32c_byte.
+ */
+extern const uint32_t (*crc32c_tables(void))[256];
+
+/**
+ * load_le64 - read eight bytes as a little-endian integer.
+ * @param p The bytes, not necessarily aligned.
+ * @return The integer.
+ */
+static inline uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * crc32c_word - fold eight bytes into a CRC-32C register, so loops that
+ * have the bytes at hand anyway checksum them without another pass.
+ * The eight lookups don't depend on each other, unlike those of eight
+ * crc32c_byte calls.
+ * @param tables The tables from crc32c_tables().
+ * @param crc The register: ~0 to start, the CRC is its complement.
+ * @param word The eight bytes, as read by load_le64.
+ * @return The register after the bytes.
+ */
+static inline uint32_t crc32c_word(const uint32_t (*tables)[256], uint32_t crc,
+                                   uint64_t word)
+{
+    word ^= crc;
+    return tables[7][word & 0xff] ^ tables[6][word >> 8 & 0xff] ^
+           tables[5][word >> 16 & 0xff] ^ tables[4][word >> 24 & 0xff] ^
+           tables[3][word >> 32 & 0xff] ^ tables[2][word >> 40 & 0xff] ^
+           tables[1][word >> 48 & 0xff] ^ tables[0][word >> 56];
+}
+
+/**
+ * crc32c_byte - fold one byte into a CRC-32C register.
+ * @param tables The tables from crc32c_tables().
+ * @param crc The register: ~0 to start, the CRC is its complement.
+ * @param byte The byte.
+ * @return The register after the byte.
+ */
+static inline uint32_t crc32c_byte(const uint32_t (*tables)[256], uint32_t crc,
+                                   unsigned char byte)
+{
+    return crc >> 8 ^ tables[0][(crc ^ byte) & 0xff];
+}
+
+/**
+ * crc32c_combine - CRC-32C of two pieces of data put end to end, from the
+ * CRC of each, so pieces checked on different threads add up to the whole.
+ * @param crc1 The CRC of the first piece.
+ * @param crc2 The CRC of the second piece.
+ * @param len2 The length of the second piece.
+ * @return The CRC of both pieces.
+ */
+extern uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/**
+ * make_parent_dirs - Create the directories leading to a file.
+ * @param path The file.
+ * @return 0 on success, -1 if one can't be created.
+ */
+extern int make_parent_dirs(const char *path);
+
 /**
  * read_file - Read a file and return its contents.
  * @param filename The name of the file to read.
@@ -28,6 +120,19 @@ extern char *read_file(const char *filename, size_t *filelen);
 extern void write_data(const char *filename, const char *mode, const char *data,
                        const size_t data_len);
 
+/**
+ * format_header - Render the header of a compressed file into memory.
+ * @param header The header to render.
+ * @param encoded_len The length of the encoded data.
+ * @param raw_len The length of the raw data.
+ * @param header_num The number of headers
+ * @param header_len Where to store the length of the rendered header.
+ * @return The rendered header, to be freed by the caller.
+ */
+extern char *format_header(const char **header, const size_t encoded_len,
+                           const size_t raw_len, const size_t header_num,
+                           size_t *header_len);
+
 /**
  * write_header - Write a headers to a file.
  * @param filename The name of the file to write to.
@@ -0,0 +1,56 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+#include "server.h"
+#include <pthread.h>
+
+typedef struct Worker Worker;
+/**
+ * Worker - a server thread running its own event loop
+ * Every worker accepts on its listener, and on the server's Unix socket if
+ * there is one, reads requests without blocking and runs the handler once a
+ * request is complete. Responses go to an outbox whose backlog the worker
+ * writes out whenever the socket has room, so a slow reader never holds a
+ * thread. Readiness comes from epoll, or accepts, reads and polls are queued
+ * on io_uring instead. A timer wheel closes connections whose client is too
+ * slow, reading or writing. Handlers that run the codec finish on the job
+ * pool, which wakes the loop through an eventfd when their outbox needs it.
+ */
+struct Worker {
+    Server *server;
+    int id;
+    int cpu;           // core the worker is pinned to, -1 to let it float
+    int listener;      // listening socket, owned when using SO_REUSEPORT
+    int epoll_fd;      // -1 when using io_uring
+    struct Ring *ring; // io_uring backend, NULL when using epoll
+    pthread_t thread;
+    struct Conn **wheel;   // connections by the tick of their deadline
+    long long tick;        // last tick the wheel was advanced to
+    int conns;             // connections open
+    int wake_fd;           // eventfd the job pool wakes the loop with
+    struct Conn *woken;    // connections the job pool listed, see wake_conn()
+    pthread_mutex_t lock;  // guards woken
+
+    /**
+     * Start the event loop on a new thread
+     * @param self The worker
+     */
+    void (*start)(Worker *self);
+
+    /**
+     * Wait for the event loop to exit
+     * @param self The worker
+     */
+    void (*join)(Worker *self);
+};
+
+/**
+ * init_worker - create a worker.
+ * @param self Where to store the worker.
+ * @param server The server the worker handles requests for.
+ * @param id Index of the worker.
+ * @param listener Listening socket to accept on.
+ * @param cpu Core to pin the worker to, -1 for none.
+ */
+extern void init_worker(Worker **self, Server *server, int id, int listener,
+                        int cpu);
+#endif
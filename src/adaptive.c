@@ -0,0 +1,487 @@
+#include "../include/adaptive.h"
+#include "../include/code.h"
+#include "../include/utils.h"
+#include <stdio.h>
+#include <string.h>
+#define FRAME_HEADER_LEN 8
+// largest frame, header included; no code is longer than MAX_CODE_LEN bits
+#define FRAME_ROOM                                                            \
+    (FRAME_HEADER_LEN + ADAPTIVE_MAX_FRAME / 8 * MAX_CODE_LEN + 8)
+
+/**
+ * AdaptiveModel - the code both sides of an adaptive stream agree on, and
+ * the counts the next one is built from
+ */
+typedef struct AdaptiveModel {
+    HuffmanCode code;
+    uint64_t freq[SYMBOLS];
+    size_t interval;      // longest stretch between two rebuilds
+    size_t stretch;       // bytes coded since the last rebuild, once done
+    size_t until_rebuild; // bytes left to code before the next rebuild
+} AdaptiveModel;
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+/**
+ * rebuild_model - Derive the code from the counts so far, then halve them so
+ * recent bytes weigh more
+ * @param model The model
+ */
+static void rebuild_model(AdaptiveModel *model)
+{
+    build_code_lengths(model->freq, model->code.lengths);
+    assign_codes(&model->code);
+    // every count stays at least 1, so every byte keeps a code
+    for (int i = 0; i < SYMBOLS; i++)
+        model->freq[i] -= model->freq[i] / 2;
+    model->stretch = model->stretch * 2 < model->interval
+                         ? model->stretch * 2
+                         : model->interval;
+    model->until_rebuild = model->stretch;
+}
+
+/**
+ * init_model - Start from the flat code every stream starts with
+ * @param model The model
+ * @param interval Longest stretch between two rebuilds
+ */
+static void init_model(AdaptiveModel *model, size_t interval)
+{
+    for (int i = 0; i < SYMBOLS; i++)
+        model->freq[i] = 1;
+    model->interval = interval;
+    // doubled by the rebuild below
+    model->stretch = ADAPTIVE_FIRST_REBUILD / 2;
+    rebuild_model(model);
+}
+
+/**
+ * encode_frame - Compress what was written at once into a frame
+ * @param model The model, updated with the bytes
+ * @param data The original bytes
+ * @param len The number of bytes, from 1 to ADAPTIVE_MAX_FRAME
+ * @param out Room for FRAME_ROOM bytes
+ * @return The length of the frame
+ */
+static size_t encode_frame(AdaptiveModel *model, const unsigned char *data,
+                           size_t len, unsigned char *out)
+{
+    // the accumulator never holds more than 7 + MAX_CODE_LEN pending bits
+    unsigned char *p = out + FRAME_HEADER_LEN;
+    uint64_t pending = 0;
+    int pending_bits = 0;
+    for (size_t i = 0; i < len;) {
+        // the code changes only once a byte needs the next one, so both
+        // sides rebuild at the same byte
+        if (model->until_rebuild == 0)
+            rebuild_model(model);
+        size_t left = len - i;
+        size_t run = left < model->until_rebuild ? left : model->until_rebuild;
+        const HuffmanCode *code = &model->code;
+        for (size_t end = i + run; i < end; i++) {
+            unsigned char byte = data[i];
+            model->freq[byte]++;
+            pending = pending << code->lengths[byte] | code->codes[byte];
+            pending_bits += code->lengths[byte];
+            while (pending_bits >= 8) {
+                pending_bits -= 8;
+                *p++ = (unsigned char)(pending >> pending_bits);
+            }
+        }
+        model->until_rebuild -= run;
+    }
+    if (pending_bits > 0)
+        *p++ = (unsigned char)(pending << (8 - pending_bits));
+
+    size_t payload_len = (size_t)(p - out) - FRAME_HEADER_LEN;
+    put_u32(out, (uint32_t)len);
+    put_u32(out + 4, (uint32_t)payload_len);
+    return FRAME_HEADER_LEN + payload_len;
+}
+
+/**
+ * decode_frame - Decompress a frame whose lengths have been checked
+ * @param model The model, updated with the bytes
+ * @param in The codes of the frame
+ * @param payload_len The length of the codes
+ * @param out Room for the original bytes
+ * @param len The number of original bytes
+ * @return 0 on success, -1 unless the codes decode to exactly len bytes
+ * followed by zero padding
+ */
+static int decode_frame(AdaptiveModel *model, const unsigned char *in,
+                        size_t payload_len, unsigned char *out, size_t len)
+{
+    // bits are kept left-aligned in bits, available counts the valid ones
+    const unsigned char *in_end = in + payload_len;
+    uint64_t bits = 0;
+    int available = 0;
+    for (size_t i = 0; i < len;) {
+        if (model->until_rebuild == 0)
+            rebuild_model(model);
+        size_t left = len - i;
+        size_t run = left < model->until_rebuild ? left : model->until_rebuild;
+        const HuffmanCode *code = &model->code;
+        for (size_t end = i + run; i < end; i++) {
+            while (available <= 56 && in < in_end) {
+                bits |= (uint64_t)*in++ << (56 - available);
+                available += 8;
+            }
+            int code_len = 0;
+            int symbol = decode_symbol(code, bits, &code_len);
+            if (symbol < 0 || code_len > available)
+                return -1;
+            out[i] = (unsigned char)symbol;
+            model->freq[symbol]++;
+            bits <<= code_len;
+            available -= code_len;
+        }
+        model->until_rebuild -= run;
+    }
+    // the bits past the valid ones are always zero
+    return in == in_end && available < 8 && bits == 0 ? 0 : -1;
+}
+
+/**
+ * read_header - Check the header of an adaptive file and set up the model
+ * @param model The model
+ * @param p The header, ADAPTIVE_HEADER_LEN bytes
+ * @return 0 on success, -1 if the header is malformed
+ */
+static int read_header(AdaptiveModel *model, const unsigned char *p)
+{
+    size_t interval = get_u32(p + 8);
+    if (memcmp(p, ADAPTIVE_MAGIC, 4) != 0 || p[4] != ADAPTIVE_VERSION ||
+        interval < ADAPTIVE_FIRST_REBUILD || interval > MAX_REBUILD_INTERVAL)
+        return -1;
+    init_model(model, interval);
+    return 0;
+}
+
+/**
+ * check_frame_header - Read the lengths of a frame
+ * @param p The frame header
+ * @param len Where the number of original bytes goes
+ * @param payload_len Where the length of the codes goes
+ * @return 1 for a frame, 0 for the end of the frames, -1 if malformed
+ */
+static int check_frame_header(const unsigned char *p, size_t *len,
+                              size_t *payload_len)
+{
+    *len = get_u32(p);
+    *payload_len = get_u32(p + 4);
+    if (*len == 0 && *payload_len == 0)
+        return 0;
+    if (*len == 0 || *len > ADAPTIVE_MAX_FRAME ||
+        *payload_len > FRAME_ROOM - FRAME_HEADER_LEN)
+        return -1;
+    return 1;
+}
+
+/**
+ * check_footer - Compare the footer with what was decoded
+ * @param p The footer, ADAPTIVE_FOOTER_LEN bytes
+ * @param raw_len Original bytes decoded
+ * @param checksum CRC-32C of the original bytes decoded
+ * @return 0 if they match, -1 otherwise
+ */
+static int check_footer(const unsigned char *p, uint64_t raw_len,
+                        uint32_t checksum)
+{
+    return get_u64(p) == raw_len && get_u32(p + 8) == checksum &&
+                   memcmp(p + 12, ADAPTIVE_FOOTER_MAGIC, 4) == 0
+               ? 0
+               : -1;
+}
+
+bool is_adaptive_file(const char *data, size_t data_len)
+{
+    return data_len >= ADAPTIVE_HEADER_LEN &&
+           memcmp(data, ADAPTIVE_MAGIC, 4) == 0;
+}
+
+typedef struct AdaptiveSink AdaptiveSink;
+struct AdaptiveSink {
+    Sink base;
+    Sink *inner;
+    AdaptiveModel model;
+    unsigned char *frame;
+    uint64_t raw_len;  // original bytes written so far
+    uint32_t checksum; // CRC-32C of the original bytes so far
+    int status;
+};
+
+/**
+ * adaptive_sink_write - Compress data and pass it on at once, as one frame
+ * per ADAPTIVE_MAX_FRAME bytes
+ * @param self Adaptive sink
+ * @param data Data to compress
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the inner sink has failed
+ */
+static int adaptive_sink_write(Sink *self, const char *data,
+                               const size_t data_len)
+{
+    AdaptiveSink *sink = (AdaptiveSink *)self;
+    sink->checksum = crc32c(sink->checksum, data, data_len);
+    sink->raw_len += data_len;
+    for (size_t done = 0; done < data_len && sink->status == 0;) {
+        size_t left = data_len - done;
+        size_t len = left < ADAPTIVE_MAX_FRAME ? left : ADAPTIVE_MAX_FRAME;
+        size_t frame_len =
+            encode_frame(&sink->model, (const unsigned char *)data + done,
+                         len, sink->frame);
+        sink->status = sink->inner->write(sink->inner,
+                                          (const char *)sink->frame, frame_len);
+        done += len;
+    }
+    return sink->status;
+}
+
+/**
+ * adaptive_sink_close - Write the end of the frames and the footer, then
+ * free the sink, closing the inner one
+ * @param self Adaptive sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int adaptive_sink_close(Sink *self)
+{
+    AdaptiveSink *sink = (AdaptiveSink *)self;
+    unsigned char tail[FRAME_HEADER_LEN + ADAPTIVE_FOOTER_LEN] = {0};
+    unsigned char *footer = tail + FRAME_HEADER_LEN;
+    put_u64(footer, sink->raw_len);
+    put_u32(footer + 8, sink->checksum);
+    memcpy(footer + 12, ADAPTIVE_FOOTER_MAGIC, 4);
+    int status = sink->status;
+    if (status == 0)
+        status = sink->inner->write(sink->inner, (const char *)tail,
+                                    sizeof(tail));
+    if (sink->inner->close(sink->inner) != 0)
+        status = -1;
+    free(sink->frame);
+    free(sink);
+    return status;
+}
+
+Sink *new_adaptive_sink(Sink *inner, size_t interval)
+{
+    AdaptiveSink *sink = must_calloc(1, sizeof(AdaptiveSink));
+    sink->base.write = &adaptive_sink_write;
+    sink->base.close = &adaptive_sink_close;
+    sink->inner = inner;
+    sink->frame = must_calloc(FRAME_ROOM, 1);
+    init_model(&sink->model, interval);
+
+    // the header goes out at once, ahead of any data
+    unsigned char header[ADAPTIVE_HEADER_LEN] = {0};
+    memcpy(header, ADAPTIVE_MAGIC, 4);
+    header[4] = ADAPTIVE_VERSION;
+    put_u32(header + 8, (uint32_t)interval);
+    sink->status = inner->write(inner, (const char *)header, sizeof(header));
+    return &sink->base;
+}
+
+enum ADAPTIVE_PART {
+    PART_HEADER,
+    PART_FRAME_HEADER,
+    PART_FRAME,
+    PART_FOOTER,
+    PART_DONE
+};
+
+typedef struct AdaptiveDecodeSink AdaptiveDecodeSink;
+struct AdaptiveDecodeSink {
+    Sink base;
+    Sink *inner;
+    AdaptiveModel model;
+    enum ADAPTIVE_PART part; // what the bytes being collected are
+    size_t want;             // bytes that part needs
+    size_t have;             // bytes of it collected
+    size_t len;              // original bytes of the frame being collected
+    unsigned char *pending;
+    unsigned char *buffer; // original bytes of a frame
+    uint64_t raw_len;      // original bytes decoded so far
+    uint32_t checksum;     // CRC-32C of the original bytes so far
+    int status;
+};
+
+/**
+ * decode_part - Act on a part of the file once it is collected
+ * @param sink Adaptive decode sink
+ * @return 0 on success, -1 if the file is malformed or the inner sink failed
+ */
+static int decode_part(AdaptiveDecodeSink *sink)
+{
+    const unsigned char *p = sink->pending;
+    switch (sink->part) {
+    case PART_HEADER:
+        if (read_header(&sink->model, p) != 0)
+            return -1;
+        sink->part = PART_FRAME_HEADER;
+        sink->want = FRAME_HEADER_LEN;
+        return 0;
+    case PART_FRAME_HEADER: {
+        size_t payload_len = 0;
+        int frame = check_frame_header(p, &sink->len, &payload_len);
+        if (frame < 0)
+            return -1;
+        sink->part = frame ? PART_FRAME : PART_FOOTER;
+        sink->want = frame ? payload_len : ADAPTIVE_FOOTER_LEN;
+        // a frame may have no codes only if it was malformed
+        return sink->want == 0 ? -1 : 0;
+    }
+    case PART_FRAME:
+        if (decode_frame(&sink->model, p, sink->want, sink->buffer,
+                         sink->len) != 0)
+            return -1;
+        sink->checksum = crc32c(sink->checksum, sink->buffer, sink->len);
+        sink->raw_len += sink->len;
+        sink->part = PART_FRAME_HEADER;
+        sink->want = FRAME_HEADER_LEN;
+        return sink->inner->write(sink->inner, (const char *)sink->buffer,
+                                  sink->len);
+    case PART_FOOTER:
+        sink->part = PART_DONE;
+        return check_footer(p, sink->raw_len, sink->checksum);
+    default:
+        return -1;
+    }
+}
+
+/**
+ * adaptive_decode_sink_write - Collect the parts of the file and decode
+ * every frame once it is whole
+ * @param self Adaptive decode sink
+ * @param data Compressed data
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the file was found malformed or the inner
+ * sink has failed
+ */
+static int adaptive_decode_sink_write(Sink *self, const char *data,
+                                      const size_t data_len)
+{
+    AdaptiveDecodeSink *sink = (AdaptiveDecodeSink *)self;
+    size_t left = data_len;
+    while (left > 0 && sink->status == 0) {
+        if (sink->part == PART_DONE) {
+            sink->status = -1; // nothing may follow the footer
+            break;
+        }
+        size_t len = sink->want - sink->have < left ? sink->want - sink->have
+                                                    : left;
+        memcpy(sink->pending + sink->have, data, len);
+        sink->have += len;
+        data += len;
+        left -= len;
+        if (sink->have == sink->want) {
+            sink->have = 0;
+            if (decode_part(sink) != 0)
+                sink->status = -1;
+        }
+    }
+    return sink->status;
+}
+
+/**
+ * adaptive_decode_sink_close - Check that the file was whole and free the
+ * sink, closing the inner one
+ * @param self Adaptive decode sink
+ * @return 0 on success, -1 if the file was malformed, cut short or any write
+ * failed
+ */
+static int adaptive_decode_sink_close(Sink *self)
+{
+    AdaptiveDecodeSink *sink = (AdaptiveDecodeSink *)self;
+    int status = sink->part == PART_DONE ? sink->status : -1;
+    if (sink->inner->close(sink->inner) != 0)
+        status = -1;
+    free(sink->pending);
+    free(sink->buffer);
+    free(sink);
+    return status;
+}
+
+Sink *new_adaptive_decode_sink(Sink *inner)
+{
+    AdaptiveDecodeSink *sink = must_calloc(1, sizeof(AdaptiveDecodeSink));
+    sink->base.write = &adaptive_decode_sink_write;
+    sink->base.close = &adaptive_decode_sink_close;
+    sink->inner = inner;
+    sink->part = PART_HEADER;
+    sink->want = ADAPTIVE_HEADER_LEN;
+    sink->pending = must_calloc(FRAME_ROOM, 1);
+    sink->buffer = must_calloc(ADAPTIVE_MAX_FRAME, 1);
+    return &sink->base;
+}
+
+int adaptive_decompress(CodecContext *context, Sink *out, const char *data,
+                        size_t data_len, CancelToken *cancel,
+                        CodecStats *stats)
+{
+    double started = monotonic_seconds();
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + data_len;
+    AdaptiveModel model;
+    if (!is_adaptive_file(data, data_len) || read_header(&model, p) != 0)
+        return -1;
+    p += ADAPTIVE_HEADER_LEN;
+    double lap = monotonic_seconds();
+    stats->stage[STAGE_HEADER] = lap - started;
+
+    int status = 0;
+    unsigned char *buffer =
+        reserve(&context->buffer, &context->buffer_room, ADAPTIVE_MAX_FRAME);
+    while (status == 0) {
+        size_t len = 0, payload_len = 0;
+        if ((size_t)(end - p) < FRAME_HEADER_LEN) {
+            status = -1;
+            break;
+        }
+        int frame = check_frame_header(p, &len, &payload_len);
+        p += FRAME_HEADER_LEN;
+        if (frame == 0)
+            break;
+        if (frame < 0 || cancel->is_cancelled(cancel) || payload_len == 0 ||
+            payload_len > (size_t)(end - p) ||
+            decode_frame(&model, p, payload_len, buffer, len) != 0) {
+            status = -1;
+            break;
+        }
+        p += payload_len;
+        stats->output_len += len;
+        stats->checksum = crc32c(stats->checksum, buffer, len);
+        status = out->write(out, (const char *)buffer, len);
+    }
+    if (status == 0 &&
+        ((size_t)(end - p) != ADAPTIVE_FOOTER_LEN ||
+         check_footer(p, stats->output_len, stats->checksum) != 0))
+        status = -1;
+    stats->stage[STAGE_DECODE] = monotonic_seconds() - lap;
+    return status;
+}
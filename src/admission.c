@@ -0,0 +1,88 @@
+#include "../include/admission.h"
+#include "../include/utils.h"
+
+/**
+ * reserve - Reserve memory from the budget
+ * @param self The admission control
+ * @param bytes The amount to reserve
+ * @return true if it fits, false otherwise
+ */
+static bool reserve(Admission *self, size_t bytes)
+{
+    pthread_mutex_lock(&self->lock);
+    bool fits = bytes <= self->budget - self->used;
+    if (fits)
+        self->used += bytes;
+    else
+        self->rejected++;
+    pthread_mutex_unlock(&self->lock);
+    return fits;
+}
+
+/**
+ * release - Give back memory reserved with reserve()
+ * @param self The admission control
+ * @param bytes The amount to give back
+ */
+static void release(Admission *self, size_t bytes)
+{
+    pthread_mutex_lock(&self->lock);
+    self->used -= bytes;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * try_begin_job - Take a codec slot if one is free
+ * @param self The admission control
+ * @return true if a slot was taken, false if all are busy
+ */
+static bool try_begin_job(Admission *self)
+{
+    pthread_mutex_lock(&self->lock);
+    bool free_slot = self->running < self->max_jobs;
+    if (free_slot)
+        self->running++;
+    else
+        self->rejected++;
+    pthread_mutex_unlock(&self->lock);
+    return free_slot;
+}
+
+/**
+ * begin_job - Take a codec slot, waiting for one to free up
+ * @param self The admission control
+ */
+static void begin_job(Admission *self)
+{
+    pthread_mutex_lock(&self->lock);
+    while (self->running >= self->max_jobs)
+        pthread_cond_wait(&self->slot_free, &self->lock);
+    self->running++;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * end_job - Give back a codec slot
+ * @param self The admission control
+ */
+static void end_job(Admission *self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->running--;
+    pthread_cond_signal(&self->slot_free);
+    pthread_mutex_unlock(&self->lock);
+}
+
+void init_admission(Admission **self, size_t budget, int max_jobs)
+{
+    *self = (Admission *)must_calloc(1, sizeof(Admission));
+    (*self)->budget = budget;
+    (*self)->max_jobs = max_jobs;
+    pthread_mutex_init(&(*self)->lock, NULL);
+    pthread_cond_init(&(*self)->slot_free, NULL);
+    (*self)->reserve = &reserve;
+    (*self)->release = &release;
+    (*self)->try_begin_job = &try_begin_job;
+    (*self)->begin_job = &begin_job;
+    (*self)->end_job = &end_job;
+}
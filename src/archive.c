@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include "../include/archive.h"
+#include "../include/block.h"
+#include "../include/utils.h"
+#include <stdio.h>
+#include <string.h>
+
+static void put_u16(unsigned char *p, uint16_t value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+/**
+ * compare_names - Order two names like the directory does
+ * @param a A name
+ * @param a_len Its length
+ * @param b Another name
+ * @param b_len Its length
+ * @return Like strcmp
+ */
+static int compare_names(const char *a, size_t a_len, const char *b,
+                         size_t b_len)
+{
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order != 0)
+        return order;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * by_name - Order members by name
+ * @param a A member
+ * @param b Another member
+ * @return Like strcmp
+ */
+static int by_name(const void *a, const void *b)
+{
+    const ArchiveMember *left = a, *right = b;
+    return compare_names(left->name, left->name_len, right->name,
+                         right->name_len);
+}
+
+/**
+ * is_relative_name - Check that a name stays inside the directory it is
+ * extracted to
+ * @param name The name
+ * @param name_len Its length
+ * @return true unless it is absolute, has a .. component or a NUL byte
+ */
+static bool is_relative_name(const char *name, size_t name_len)
+{
+    if (name_len == 0 || name[0] == '/' || memchr(name, '\0', name_len))
+        return false;
+    for (size_t start = 0; start < name_len;) {
+        const char *slash = memchr(name + start, '/', name_len - start);
+        size_t end = slash ? (size_t)(slash - name) : name_len;
+        if (end - start == 2 && memcmp(name + start, "..", 2) == 0)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+bool is_archive(const char *data, size_t data_len)
+{
+    return data_len >= ARCHIVE_HEADER_LEN &&
+           memcmp(data, ARCHIVE_MAGIC, 4) == 0;
+}
+
+/**
+ * add - Compress a file into the archive
+ * @param self The writer
+ * @param name Name of the member
+ * @param data The content of the file
+ * @param data_len The length of the content
+ * @param cancel Checked between blocks to abort the run
+ * @return 0 on success, -1 once the writer has failed
+ */
+static int add(ArchiveWriter *self, const char *name, const char *data,
+               size_t data_len, CancelToken *cancel)
+{
+    size_t name_len = strlen(name);
+    if (self->status != 0 || name_len > MAX_MEMBER_NAME ||
+        !is_relative_name(name, name_len))
+        return self->status = -1;
+    if (self->count == self->room) {
+        self->room = self->room ? self->room * 2 : 64;
+        self->members =
+            realloc(self->members, self->room * sizeof(ArchiveMember));
+        if (self->members == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    CodecStats stats = {0};
+    self->status = block_compress(codec_context(), self->out, data, data_len,
+                                  DEFAULT_BLOCK_SIZE, cancel, &stats);
+    ArchiveMember *member = &self->members[self->count++];
+    member->name = strdup(name);
+    member->name_len = name_len;
+    member->offset = (size_t)self->offset;
+    member->length = stats.output_len;
+    member->raw_len = data_len;
+    member->checksum = stats.checksum; // computed while encoding
+    self->offset += stats.output_len;
+    return self->status;
+}
+
+/**
+ * finish - Write the directory and the footer, then free the writer and
+ * close the sink of the archive
+ * @param self The writer
+ * @return 0 on success, -1 if anything failed to be written
+ */
+static int finish(ArchiveWriter *self)
+{
+    qsort(self->members, self->count, sizeof(ArchiveMember), &by_name);
+    for (size_t i = 1; i < self->count && self->status == 0; i++) {
+        if (by_name(&self->members[i - 1], &self->members[i]) == 0)
+            self->status = -1; // two members of the same name
+    }
+
+    size_t dir_len = ARCHIVE_FOOTER_LEN;
+    for (size_t i = 0; i < self->count; i++)
+        dir_len += ARCHIVE_ENTRY_LEN + self->members[i].name_len;
+    if (self->status == 0) {
+        unsigned char *dir = must_calloc(dir_len, 1);
+        unsigned char *p = dir;
+        for (size_t i = 0; i < self->count; i++) {
+            const ArchiveMember *member = &self->members[i];
+            put_u64(p, member->offset);
+            put_u64(p + 8, member->length);
+            put_u64(p + 16, member->raw_len);
+            put_u32(p + 24, member->checksum);
+            put_u16(p + 28, (uint16_t)member->name_len);
+            memcpy(p + ARCHIVE_ENTRY_LEN, member->name, member->name_len);
+            p += ARCHIVE_ENTRY_LEN + member->name_len;
+        }
+        put_u64(p, self->offset);
+        put_u32(p + 8, (uint32_t)self->count);
+        memcpy(p + 12, ARCHIVE_FOOTER_MAGIC, 4);
+        self->status = self->out->write(self->out, (const char *)dir, dir_len);
+        free(dir);
+    }
+
+    int status = self->status;
+    if (self->out->close(self->out) != 0)
+        status = -1;
+    for (size_t i = 0; i < self->count; i++)
+        free((char *)self->members[i].name);
+    free(self->members);
+    free(self);
+    return status;
+}
+
+ArchiveWriter *new_archive_writer(Sink *out)
+{
+    ArchiveWriter *writer = must_calloc(1, sizeof(ArchiveWriter));
+    writer->out = out;
+    writer->add = &add;
+    writer->finish = &finish;
+
+    unsigned char header[ARCHIVE_HEADER_LEN] = {0};
+    memcpy(header, ARCHIVE_MAGIC, 4);
+    header[4] = ARCHIVE_VERSION;
+    writer->status = out->write(out, (const char *)header, sizeof(header));
+    writer->offset = ARCHIVE_HEADER_LEN;
+    return writer;
+}
+
+/**
+ * read_entry - Read and check an entry of the directory
+ * @param entry Where the entry starts, moved past it
+ * @param dir_end Where the directory ends
+ * @param dir_offset Offset of the directory, where the members end
+ * @param member Where the entry goes
+ * @return 0 on success, -1 if the entry is malformed
+ */
+static int read_entry(const unsigned char **entry,
+                      const unsigned char *dir_end, uint64_t dir_offset,
+                      ArchiveMember *member)
+{
+    const unsigned char *p = *entry;
+    if ((size_t)(dir_end - p) < ARCHIVE_ENTRY_LEN)
+        return -1;
+    uint64_t offset = get_u64(p);
+    uint64_t length = get_u64(p + 8);
+    member->raw_len = (size_t)get_u64(p + 16);
+    member->checksum = get_u32(p + 24);
+    member->name_len = get_u16(p + 28);
+    member->name = (const char *)p + ARCHIVE_ENTRY_LEN;
+    // a member lies between the header and the directory
+    if (member->name_len > (size_t)(dir_end - p) - ARCHIVE_ENTRY_LEN ||
+        !is_relative_name(member->name, member->name_len) ||
+        offset < ARCHIVE_HEADER_LEN || offset > dir_offset ||
+        length > dir_offset - offset)
+        return -1;
+    member->offset = (size_t)offset;
+    member->length = (size_t)length;
+    *entry = p + ARCHIVE_ENTRY_LEN + member->name_len;
+    return 0;
+}
+
+int archive_open(Archive *archive, const char *data, size_t data_len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    if (!is_archive(data, data_len) ||
+        data_len < ARCHIVE_HEADER_LEN + ARCHIVE_FOOTER_LEN ||
+        p[4] != ARCHIVE_VERSION)
+        return -1;
+    const unsigned char *footer = p + data_len - ARCHIVE_FOOTER_LEN;
+    uint64_t dir_offset = get_u64(footer);
+    size_t count = get_u32(footer + 8);
+    size_t dir_len = data_len - ARCHIVE_FOOTER_LEN - (size_t)dir_offset;
+    if (memcmp(footer + 12, ARCHIVE_FOOTER_MAGIC, 4) != 0 ||
+        dir_offset < ARCHIVE_HEADER_LEN ||
+        dir_offset > data_len - ARCHIVE_FOOTER_LEN ||
+        count > dir_len / ARCHIVE_ENTRY_LEN)
+        return -1;
+
+    // names must come in order, which also rules out duplicates
+    ArchiveMember *members =
+        must_calloc(count ? count : 1, sizeof(ArchiveMember));
+    const unsigned char *entry = p + dir_offset;
+    int status = 0;
+    for (size_t i = 0; i < count && status == 0; i++) {
+        status = read_entry(&entry, footer, dir_offset, &members[i]);
+        if (status == 0 && i > 0 && by_name(&members[i - 1], &members[i]) >= 0)
+            status = -1;
+    }
+    if (status != 0 || entry != footer) {
+        free(members);
+        return -1;
+    }
+
+    archive->data = data;
+    archive->data_len = data_len;
+    archive->count = count;
+    archive->members = members;
+    return 0;
+}
+
+const ArchiveMember *archive_find(const Archive *archive, const char *name)
+{
+    size_t name_len = strlen(name);
+    size_t low = 0, high = archive->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const ArchiveMember *member = &archive->members[mid];
+        int order =
+            compare_names(member->name, member->name_len, name, name_len);
+        if (order == 0)
+            return member;
+        if (order < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+int archive_extract(const Archive *archive, const ArchiveMember *member,
+                    Sink *out, CancelToken *cancel)
+{
+    // the decoder checksums the original as it produces it
+    CodecStats stats = {0};
+    int status =
+        block_decompress(codec_context(), out, archive->data + member->offset,
+                         member->length, cancel, &stats);
+    if (stats.output_len != member->raw_len ||
+        stats.checksum != member->checksum)
+        status = -1;
+    return status;
+}
+
+int archive_verify(const Archive *archive, int threads, CancelToken *cancel,
+                   bool *corrupt)
+{
+    BlockCheck *checks =
+        must_calloc(archive->count ? archive->count : 1, sizeof(BlockCheck));
+    for (size_t i = 0; i < archive->count; i++) {
+        checks[i].data = archive->data + archive->members[i].offset;
+        checks[i].data_len = archive->members[i].length;
+    }
+    int status = block_verify(checks, archive->count, threads, cancel);
+    for (size_t i = 0; i < archive->count; i++) {
+        const ArchiveMember *member = &archive->members[i];
+        corrupt[i] = checks[i].status != 0 ||
+                     checks[i].raw_len != member->raw_len ||
+                     checks[i].checksum != member->checksum;
+        if (corrupt[i])
+            status = -1;
+    }
+    free(checks);
+    return status;
+}
+
+void archive_close(Archive *archive)
+{
+    free(archive->members);
+    archive->members = NULL;
+    archive->count = 0;
+}
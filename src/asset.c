@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "../include/asset.h"
+#include "../include/utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * content_type - Guess the MIME type of a file from its extension
+ * @param path The file name
+ * @return The MIME type
+ */
+static const char *content_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL)
+        return "application/octet-stream";
+    if (strcmp(ext, ".html") == 0)
+        return "text/html; charset=utf-8";
+    if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    if (strcmp(ext, ".js") == 0)
+        return "text/javascript";
+    if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    if (strcmp(ext, ".ico") == 0)
+        return "image/x-icon";
+    return "application/octet-stream";
+}
+
+/**
+ * status_line - Get the HTTP status line for a status code
+ * @param status The status code
+ * @return The status line, without the line break
+ */
+static const char *status_line(int status)
+{
+    return status == 404 ? "HTTP/1.1 404 Not Found" : "HTTP/1.1 200 OK";
+}
+
+/**
+ * read_asset - Read a file and render its responses
+ * @param path The file to read
+ * @param status HTTP status the file is served with
+ * @return The new asset, NULL if the file can't be read
+ */
+static Asset *read_asset(const char *path, int status)
+{
+    struct stat file_stat;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    if (fstat(fileno(file), &file_stat) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    Asset *asset = must_calloc(1, sizeof(Asset));
+    asset->path = must_calloc(strlen(path) + 1, sizeof(char));
+    strcpy(asset->path, path);
+    asset->status = status;
+    asset->refs = 1; // the cache's
+    asset->mtime = file_stat.st_mtime;
+    asset->body_len = (size_t)file_stat.st_size;
+    asset->body = must_calloc(asset->body_len + 1, sizeof(char));
+    asset->body_len = fread(asset->body, 1, asset->body_len, file);
+    fclose(file);
+
+    struct tm mtime;
+    gmtime_r(&asset->mtime, &mtime);
+    strftime(asset->last_modified, sizeof(asset->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", &mtime);
+    snprintf(asset->etag, sizeof(asset->etag), "\"%016llx\"",
+             (unsigned long long)hash_bytes(asset->body, asset->body_len, 0));
+
+    const char *header_fmt = "%s\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %zu\r\n"
+                             "ETag: %s\r\n"
+                             "Last-Modified: %s\r\n"
+                             "Cache-Control: no-cache\r\n"
+                             "Connection: close\r\n"
+                             "\r\n";
+    const char *not_modified_fmt = "HTTP/1.1 304 Not Modified\r\n"
+                                   "ETag: %s\r\n"
+                                   "Last-Modified: %s\r\n"
+                                   "Cache-Control: no-cache\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n";
+    int header_len = snprintf(NULL, 0, header_fmt, status_line(status),
+                              content_type(path), asset->body_len, asset->etag,
+                              asset->last_modified);
+    asset->header = must_calloc((size_t)header_len + 1, sizeof(char));
+    asset->header_len = (size_t)snprintf(
+        asset->header, (size_t)header_len + 1, header_fmt, status_line(status),
+        content_type(path), asset->body_len, asset->etag, asset->last_modified);
+
+    int not_modified_len = snprintf(NULL, 0, not_modified_fmt, asset->etag,
+                                    asset->last_modified);
+    asset->not_modified = must_calloc((size_t)not_modified_len + 1, 1);
+    asset->not_modified_len = (size_t)snprintf(
+        asset->not_modified, (size_t)not_modified_len + 1, not_modified_fmt,
+        asset->etag, asset->last_modified);
+    return asset;
+}
+
+/**
+ * drop_asset - Drop a reference to an asset, freeing it with the last one
+ * @param asset The asset
+ */
+static void drop_asset(Asset *asset)
+{
+    if (__atomic_sub_fetch(&asset->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    free(asset->path);
+    free(asset->body);
+    free(asset->header);
+    free(asset->not_modified);
+    free(asset);
+}
+
+/**
+ * load - Read a file and render its responses
+ * @param self The asset cache
+ * @param path The file to load
+ * @param status HTTP status the file is served with
+ * @return The loaded asset, NULL if the file can't be read
+ */
+static const Asset *load(AssetCache *self, const char *path, int status)
+{
+    Asset *asset = read_asset(path, status);
+    if (asset == NULL) {
+        perror("Error loading asset");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->swap_lock);
+    self->assets = realloc(self->assets, sizeof(Asset *) * (self->len + 1));
+    self->assets[self->len++] = asset;
+    pthread_mutex_unlock(&self->swap_lock);
+    return asset;
+}
+
+/**
+ * find - Find a loaded asset and take a reference to it
+ * The reference is taken under the swap lock, so a refresh can't drop the
+ * asset in between.
+ * @param self The asset cache
+ * @param path The file the asset was loaded from
+ * @return The asset, NULL if it was never loaded
+ */
+static const Asset *find(AssetCache *self, const char *path)
+{
+    Asset *found = NULL;
+    pthread_mutex_lock(&self->swap_lock);
+    for (size_t i = 0; i < self->len && found == NULL; i++) {
+        if (strcmp(self->assets[i]->path, path) == 0) {
+            found = self->assets[i];
+            __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&self->swap_lock);
+    return found;
+}
+
+/**
+ * release - Give back an asset returned by find()
+ * @param self The asset cache
+ * @param asset The asset
+ */
+static void release(AssetCache *self, const Asset *asset)
+{
+    (void)self;
+    if (asset != NULL)
+        drop_asset((Asset *)asset);
+}
+
+/**
+ * refresh - Reload the assets whose file changed on disk
+ * A replaced asset loses the cache's reference and is freed once the
+ * requests still sending it are done. Only one thread refreshes at a time,
+ * the others keep serving what is there.
+ * @param self The asset cache
+ */
+static void refresh(AssetCache *self)
+{
+    if (!self->watch)
+        return;
+    time_t now = time(NULL);
+    if (now - __atomic_load_n(&self->last_check, __ATOMIC_RELAXED) <
+            WATCH_INTERVAL ||
+        pthread_mutex_trylock(&self->lock) != 0)
+        return;
+    __atomic_store_n(&self->last_check, now, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < self->len; i++) {
+        Asset *asset = self->assets[i];
+        struct stat file_stat;
+        if (stat(asset->path, &file_stat) != 0 ||
+            (file_stat.st_mtime == asset->mtime &&
+             (size_t)file_stat.st_size == asset->body_len))
+            continue;
+
+        Asset *fresh = read_asset(asset->path, asset->status);
+        if (fresh == NULL)
+            continue;
+        pthread_mutex_lock(&self->swap_lock);
+        self->assets[i] = fresh;
+        pthread_mutex_unlock(&self->swap_lock);
+        drop_asset(asset);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * is_fresh - Check whether the client already holds the current version
+ * @param asset The asset requested
+ * @param if_none_match If-None-Match request header, or NULL
+ * @param if_modified_since If-Modified-Since request header, or NULL
+ * @return true if a 304 Not Modified response is enough
+ */
+static bool is_fresh(const Asset *asset, const char *if_none_match,
+                     const char *if_modified_since)
+{
+    if (asset->status != 200)
+        return false;
+    if (if_none_match != NULL)
+        return strstr(if_none_match, asset->etag) != NULL ||
+               strcmp(if_none_match, "*") == 0;
+    return if_modified_since != NULL &&
+           strcmp(if_modified_since, asset->last_modified) == 0;
+}
+
+void init_asset_cache(AssetCache **self, bool watch)
+{
+    *self = (AssetCache *)must_calloc(1, sizeof(AssetCache));
+    (*self)->assets = NULL;
+    (*self)->len = 0;
+    (*self)->watch = watch;
+    pthread_mutex_init(&(*self)->lock, NULL);
+    pthread_mutex_init(&(*self)->swap_lock, NULL);
+    (*self)->load = &load;
+    (*self)->find = &find;
+    (*self)->release = &release;
+    (*self)->refresh = &refresh;
+    (*self)->is_fresh = &is_fresh;
+}
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "../include/batch.h"
+#include "../include/logger.h"
+#include "../include/utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * BatchWorker - what a batch thread keeps from one file to the next
+ */
+typedef struct BatchWorker {
+    pthread_t thread;
+    Batch *batch;
+    char *buffer; // input of the current file
+    size_t room;
+    CancelToken *cancel;
+} BatchWorker;
+
+bool is_batch_input(const char *path)
+{
+    struct stat path_stat;
+    if (strpbrk(path, "*?[") != NULL)
+        return true;
+    return stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode);
+}
+
+/**
+ * join_path - Join two path components with a slash
+ * @param dir The first component
+ * @param name The second component
+ * @param suffix Appended to the result, may be empty
+ * @return The path, malloc'd
+ */
+static char *join_path(const char *dir, const char *name, const char *suffix)
+{
+    size_t len = strlen(dir) + 1 + strlen(name) + strlen(suffix) + 1;
+    char *path = must_calloc(len, 1);
+    snprintf(path, len, "%s/%s%s", dir, name, suffix);
+    return path;
+}
+
+/**
+ * push_file - Queue a file of the batch
+ * @param self The batch
+ * @param input Path of the file, taken over by the batch
+ * @param name Path of the output relative to the output directory, without
+ * the suffix of the mode
+ * @param size Size of the file
+ */
+static void push_file(Batch *self, char *input, const char *name, size_t size)
+{
+    if (self->count == self->room) {
+        self->room = self->room ? self->room * 2 : 64;
+        self->files = realloc(self->files, self->room * sizeof(BatchFile));
+        if (self->files == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    const char *suffix = COMPRESSED_SUFFIX;
+    char *output = NULL;
+    if (self->output_dir != NULL && self->mode == COMPRESS) {
+        output = join_path(self->output_dir, name, suffix);
+    } else if (self->output_dir != NULL) {
+        size_t len = strlen(name);
+        size_t suffix_len = strlen(suffix);
+        if (len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0) {
+            output = join_path(self->output_dir, name, "");
+            output[strlen(output) - suffix_len] = '\0';
+        } else {
+            output = join_path(self->output_dir, name, DECOMPRESSED_SUFFIX);
+        }
+    }
+    self->files[self->count].input = input;
+    self->files[self->count].name = strdup(name);
+    self->files[self->count].output = output;
+    self->files[self->count].size = size;
+    self->count++;
+}
+
+/**
+ * walk - Queue every regular file under a directory
+ * Symbolic links to files are followed, links to directories are not, so a
+ * link can't send the walk round in circles.
+ * @param self The batch
+ * @param dir The directory
+ * @param name Path of the directory relative to the output directory
+ * @return 0 on success, -1 if the directory can't be read
+ */
+static int walk(Batch *self, const char *dir, const char *name)
+{
+    DIR *stream = opendir(dir);
+    if (stream == NULL)
+        return -1;
+    int status = 0;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0)
+            continue;
+        char *path = join_path(dir, entry->d_name, "");
+        char *child = name[0] ? join_path(name, entry->d_name, "")
+                              : strdup(entry->d_name);
+        struct stat path_stat;
+        bool is_link = lstat(path, &path_stat) == 0 &&
+                       S_ISLNK(path_stat.st_mode);
+        if (is_link && stat(path, &path_stat) != 0) {
+            free(path); // dangling link
+        } else if (S_ISDIR(path_stat.st_mode) && !is_link) {
+            if (walk(self, path, child) != 0)
+                status = -1;
+            free(path);
+        } else if (S_ISREG(path_stat.st_mode)) {
+            push_file(self, path, child, (size_t)path_stat.st_size);
+        } else {
+            free(path);
+        }
+        free(child);
+    }
+    closedir(stream);
+    return status;
+}
+
+/**
+ * add_path - Queue a file, or the files under a directory
+ * The files under a directory keep its name as the top of their layout in
+ * the output directory, so two directories with files of the same name
+ * don't collide.
+ * @param self The batch
+ * @param path The file or directory
+ * @return 0 on success, -1 if it can't be read
+ */
+static int add_path(Batch *self, const char *path)
+{
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0)
+        return -1;
+    char *copy = strdup(path);
+    const char *name = basename(copy);
+    int status = 0;
+    if (S_ISDIR(path_stat.st_mode)) {
+        bool unnamed = strcmp(name, "/") == 0 || strcmp(name, ".") == 0 ||
+                       strcmp(name, "..") == 0;
+        status = walk(self, path, unnamed ? "" : name);
+    } else if (S_ISREG(path_stat.st_mode)) {
+        push_file(self, strdup(path), name, (size_t)path_stat.st_size);
+    } else {
+        errno = EINVAL;
+        status = -1;
+    }
+    free(copy);
+    return status;
+}
+
+/**
+ * add - Add a file, the files matching a glob pattern or a directory
+ * @param self The batch
+ * @param path The file, pattern or directory
+ * @return 0 on success, -1 if nothing can be read there
+ */
+static int add(Batch *self, const char *path)
+{
+    Logger *logger;
+    init_logger(&logger);
+    if (strpbrk(path, "*?[") == NULL) {
+        if (add_path(self, path) == 0)
+            return 0;
+        LOG_ERRORF(logger, "Can't read input", "path=%s error=\"%s\"", path,
+                   strerror(errno));
+        return -1;
+    }
+
+    glob_t matches;
+    int found = glob(path, 0, NULL, &matches);
+    if (found != 0) {
+        LOG_ERRORF(logger, "No file matches", "pattern=%s", path);
+        if (found != GLOB_NOMATCH)
+            globfree(&matches);
+        return -1;
+    }
+    int status = 0;
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        if (add_path(self, matches.gl_pathv[i]) != 0) {
+            LOG_ERRORF(logger, "Can't read input", "path=%s error=\"%s\"",
+                       matches.gl_pathv[i], strerror(errno));
+            status = -1;
+        }
+    }
+    globfree(&matches);
+    return status;
+}
+
+/**
+ * read_input - Read a file into the buffer of a worker
+ * @param worker The worker, whose buffer grows as needed
+ * @param path The file
+ * @param len Where to store the length of the file
+ * @return 0 on success, -1 if it can't be read
+ */
+static int read_input(BatchWorker *worker, const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    *len = (size_t)file_stat.st_size;
+    if (*len >= worker->room) {
+        free(worker->buffer);
+        worker->room = *len + 1;
+        worker->buffer = must_calloc(worker->room, 1);
+    }
+    for (size_t done = 0; done < *len;) {
+        ssize_t got = read(fd, worker->buffer + done, *len - done);
+        if (got <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * code_file - Code one file of the batch
+ * @param worker The worker
+ * @param file The file
+ * @param stats Where the stage timings and output length go
+ * @return 0 on success, -1 on failure, with errno set for I/O errors
+ */
+static int code_file(BatchWorker *worker, const BatchFile *file,
+                     CodecStats *stats)
+{
+    Batch *batch = worker->batch;
+    size_t len = 0;
+    if (read_input(worker, file->input, &len) != 0 ||
+        make_parent_dirs(file->output) != 0)
+        return -1;
+    Sink *out = new_file_sink(file->output);
+    if (out == NULL)
+        return -1;
+    errno = 0;
+    int status = batch->run(batch->mode, worker->buffer, len, out,
+                            worker->cancel, stats);
+    if (out->close(out) != 0)
+        status = -1;
+    if (status != 0) {
+        unlink(file->output);
+        return -1;
+    }
+    __atomic_fetch_add(&batch->bytes_in, len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&batch->bytes_out, stats->output_len,
+                       __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * work - Code files of the batch until none is left
+ * @param arg The worker
+ * @return NULL
+ */
+static void *work(void *arg)
+{
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    Logger *logger;
+    init_logger(&logger);
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count)
+            break;
+        const BatchFile *file = &batch->files[i];
+        CodecStats stats = {0};
+        if (code_file(worker, file, &stats) != 0) {
+            LOG_ERRORF(logger, "Failed to code file",
+                       "input=%s output=%s error=\"%s\"", file->input,
+                       file->output, errno ? strerror(errno) : "bad input");
+            __atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * by_output - Order files by the name of their output
+ * @param a A file
+ * @param b Another file
+ * @return Like strcmp
+ */
+static int by_output(const void *a, const void *b)
+{
+    return strcmp(((const BatchFile *)a)->output,
+                  ((const BatchFile *)b)->output);
+}
+
+/**
+ * by_size - Order files from the largest to the smallest
+ * @param a A file
+ * @param b Another file
+ * @return Like strcmp
+ */
+static int by_size(const void *a, const void *b)
+{
+    size_t size_a = ((const BatchFile *)a)->size;
+    size_t size_b = ((const BatchFile *)b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/**
+ * start - Code every file added, reporting failures as they happen
+ * The largest files go first, so the threads don't end up waiting for one
+ * big file picked up last.
+ * @param self The batch
+ * @return 0 if every file was coded, -1 otherwise
+ */
+static int start(Batch *self)
+{
+    Logger *logger;
+    init_logger(&logger);
+    qsort(self->files, self->count, sizeof(BatchFile), &by_output);
+    for (size_t i = 1; i < self->count; i++) {
+        if (strcmp(self->files[i - 1].output, self->files[i].output) == 0) {
+            LOG_ERRORF(logger, "Two inputs would share an output",
+                       "inputs=%s,%s output=%s", self->files[i - 1].input,
+                       self->files[i].input, self->files[i].output);
+            return -1;
+        }
+    }
+    qsort(self->files, self->count, sizeof(BatchFile), &by_size);
+    if (mkdir(self->output_dir, 0755) != 0 && errno != EEXIST) {
+        LOG_ERRORF(logger, "Can't create output directory",
+                   "path=%s error=\"%s\"", self->output_dir, strerror(errno));
+        return -1;
+    }
+
+    double started = monotonic_seconds();
+    int threads = self->count < (size_t)self->threads ? (int)self->count
+                                                       : self->threads;
+    LOG_INFOF(logger, "Starting batch", "files=%zu threads=%d", self->count,
+              threads);
+    BatchWorker *workers = must_calloc((size_t)threads, sizeof(BatchWorker));
+    for (int i = 0; i < threads; i++) {
+        workers[i].batch = self;
+        init_cancel_token(&workers[i].cancel, -1);
+        if (pthread_create(&workers[i].thread, NULL, &work, &workers[i])) {
+            perror("Error creating batch thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].buffer);
+        free(workers[i].cancel);
+    }
+    free(workers);
+
+    double seconds = monotonic_seconds() - started;
+    LOG_INFOF(logger, "Done batch",
+              "files=%zu failed=%zu bytes_in=%llu bytes_out=%llu seconds=%.3f "
+              "mib_per_second=%.1f",
+              self->count, self->failed, (unsigned long long)self->bytes_in,
+              (unsigned long long)self->bytes_out, seconds,
+              seconds > 0 ? (double)self->bytes_in / seconds / 1048576 : 0.0);
+    return self->failed == 0 ? 0 : -1;
+}
+
+/**
+ * destroy - Free the batch
+ * @param self The batch
+ */
+static void destroy(Batch *self)
+{
+    for (size_t i = 0; i < self->count; i++) {
+        free(self->files[i].input);
+        free(self->files[i].name);
+        free(self->files[i].output);
+    }
+    free(self->files);
+    free(self);
+}
+
+void init_batch(Batch **self, enum MODE mode, const char *output_dir,
+                int threads)
+{
+    *self = (Batch *)must_calloc(1, sizeof(Batch));
+    (*self)->mode = mode;
+    (*self)->output_dir = output_dir;
+    (*self)->threads = threads;
+    (*self)->add = &add;
+    (*self)->start = &start;
+    (*self)->destroy = &destroy;
+}
@@ -0,0 +1,773 @@
+#include "../include/block.h"
+#include "../include/context.h"
+#include "../include/kernels.h"
+#include "../include/utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#define LENGTHS_LEN (SYMBOLS / 2)
+#define BLOCK_PREFIX_LEN (12 + LENGTHS_LEN) // as written, CRC included
+#define BLOCK_FLAGS (BLOCK_FLAG_CHECKSUMS | BLOCK_FLAG_BLOCK_CHECKSUMS)
+
+/**
+ * BlockWriter - a block-format file being written, one block at a time
+ * The index is collected in the context's index workspace after room for the
+ * end marker, so the tail goes out in one write.
+ */
+typedef struct BlockWriter {
+    Sink *out;
+    CodecContext *context;
+    size_t block_size;
+    size_t raw_len;    // original bytes written so far
+    uint64_t offset;   // compressed bytes written so far
+    size_t count;      // blocks written so far
+    uint32_t checksum; // CRC-32C of the original bytes so far
+    int status;
+} BlockWriter;
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void put_u64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+/**
+ * entry_len - Bytes per block in the index
+ * @param flags The flags of the file header
+ * @return The length of an index entry
+ */
+static size_t entry_len(unsigned char flags)
+{
+    return flags & BLOCK_FLAG_CHECKSUMS ? 12 : 8;
+}
+
+/**
+ * footer_len - Bytes in the footer
+ * @param flags The flags of the file header
+ * @return The length of the footer
+ */
+static size_t footer_len(unsigned char flags)
+{
+    return flags & BLOCK_FLAG_CHECKSUMS ? BLOCK_FOOTER_LEN + 4
+                                        : BLOCK_FOOTER_LEN;
+}
+
+/**
+ * prefix_len - Bytes in front of the codes of a block
+ * @param flags The flags of the file header
+ * @return The length of the lengths, CRC and code lengths of a block
+ */
+static size_t prefix_len(unsigned char flags)
+{
+    return flags & BLOCK_FLAG_BLOCK_CHECKSUMS ? BLOCK_PREFIX_LEN
+                                              : 8 + LENGTHS_LEN;
+}
+
+/**
+ * encode_block - Compress one block
+ * @param data The original bytes
+ * @param len The number of bytes, at least 1
+ * @param out Room for BLOCK_PREFIX_LEN + len * MAX_CODE_LEN / 8 + 8 bytes
+ * @param context Whose histogram and code are reset for the block
+ * @param checksum Where the CRC-32C of the original bytes goes
+ * @param stats Where the stage timings are added
+ * @return The length of the block
+ */
+static size_t encode_block(const unsigned char *data, size_t len,
+                           unsigned char *out, CodecContext *context,
+                           uint32_t *checksum, CodecStats *stats)
+{
+    double started = monotonic_seconds();
+    const Kernels *kernel = kernels();
+    uint64_t *freq = context->freq;
+    HuffmanCode *code = &context->code;
+    memset(freq, 0, sizeof(context->freq));
+    *checksum = kernel->count(data, len, freq);
+    double lap = monotonic_seconds();
+    stats->stage[STAGE_FREQUENCY] += lap - started;
+
+    build_code_lengths(freq, code->lengths);
+    started = lap;
+    lap = monotonic_seconds();
+    stats->stage[STAGE_TREE] += lap - started;
+
+    assign_codes(code);
+    for (int i = 0; i < LENGTHS_LEN; i++)
+        out[12 + i] = (unsigned char)(code->lengths[2 * i] |
+                                      code->lengths[2 * i + 1] << 4);
+    started = lap;
+    lap = monotonic_seconds();
+    stats->stage[STAGE_CODE_TABLE] += lap - started;
+
+    size_t payload_len = kernel->pack(code, data, len, out + BLOCK_PREFIX_LEN);
+    put_u32(out, (uint32_t)len);
+    put_u32(out + 4, (uint32_t)payload_len);
+    put_u32(out + 8, *checksum);
+    stats->stage[STAGE_ENCODE] += monotonic_seconds() - lap;
+    return BLOCK_PREFIX_LEN + payload_len;
+}
+
+/**
+ * decode_payload - Decompress a block whose lengths have been checked
+ * @param p The block, starting with its lengths
+ * @param flags The flags of the file header
+ * @param out Room for the original bytes of the block
+ * @param checksum Where the CRC-32C of the original bytes goes
+ * @return 0 on success, -1 if the block is malformed or doesn't match the
+ * CRC in its header
+ */
+static int decode_payload(const unsigned char *p, unsigned char flags,
+                          unsigned char *out, uint32_t *checksum)
+{
+    size_t len = get_u32(p);
+    size_t payload_len = get_u32(p + 4);
+    size_t prefix = prefix_len(flags);
+    const unsigned char *lengths = p + prefix - LENGTHS_LEN;
+    HuffmanCode code;
+    for (int i = 0; i < LENGTHS_LEN; i++) {
+        code.lengths[2 * i] = lengths[i] & 0x0f;
+        code.lengths[2 * i + 1] = lengths[i] >> 4;
+    }
+    if (assign_codes(&code) != 0 ||
+        kernels()->unpack(&code, p + prefix, payload_len, out, len,
+                          checksum) != 0)
+        return -1;
+    return flags & BLOCK_FLAG_BLOCK_CHECKSUMS && *checksum != get_u32(p + 8)
+               ? -1
+               : 0;
+}
+
+/**
+ * decode_block - Decompress one block found through the index
+ * @param data The compressed file
+ * @param index The index read from it
+ * @param block Number of the block
+ * @param out Room for index->block_size bytes
+ * @param out_len Where the number of original bytes goes
+ * @param checksum Where the CRC-32C of the original bytes goes
+ * @return 0 on success, -1 if the block is malformed or doesn't match the
+ * checksum in the index
+ */
+static int decode_block(const char *data, const BlockIndex *index,
+                        size_t block, unsigned char *out, size_t *out_len,
+                        uint32_t *checksum)
+{
+    const unsigned char *entry = index->offsets + index->entry_len * block;
+    uint64_t offset = get_u64(entry);
+    size_t prefix = prefix_len(index->flags);
+    if (offset < BLOCK_HEADER_LEN || offset > index->end ||
+        index->end - offset < prefix)
+        return -1;
+
+    const unsigned char *p = (const unsigned char *)data + offset;
+    size_t len = get_u32(p);
+    size_t payload_len = get_u32(p + 4);
+    size_t expected = block + 1 < index->count
+                          ? index->block_size
+                          : index->raw_len - block * index->block_size;
+    if (len != expected || payload_len > index->end - offset - prefix)
+        return -1;
+    *out_len = len;
+    if (decode_payload(p, index->flags, out, checksum) != 0)
+        return -1;
+    return index->checksums && *checksum != get_u32(entry + 8) ? -1 : 0;
+}
+
+bool is_block_file(const char *data, size_t data_len)
+{
+    return data_len >= BLOCK_HEADER_LEN && memcmp(data, BLOCK_MAGIC, 4) == 0;
+}
+
+/**
+ * block_room - Largest compressed size of a block
+ * @param block_size Original bytes per block
+ * @return Bytes a compressed block may take, lengths included
+ */
+static size_t block_room(size_t block_size)
+{
+    return BLOCK_PREFIX_LEN + block_size / 8 * MAX_CODE_LEN + MAX_CODE_LEN +
+           8;
+}
+
+/**
+ * start_writer - Set up a block writer and write the file header
+ * @param writer The writer
+ * @param context Whose workspaces hold the blocks and the index
+ * @param out Where the compressed data goes
+ * @param block_size Original bytes per block, at most MAX_BLOCK_SIZE
+ */
+static void start_writer(BlockWriter *writer, CodecContext *context,
+                         Sink *out, size_t block_size)
+{
+    writer->out = out;
+    writer->context = context;
+    writer->block_size = block_size;
+    writer->raw_len = 0;
+    writer->count = 0;
+    writer->checksum = 0;
+    reserve(&context->block, &context->block_room, block_room(block_size));
+
+    unsigned char header[BLOCK_HEADER_LEN] = {0};
+    memcpy(header, BLOCK_MAGIC, 4);
+    header[4] = BLOCK_VERSION;
+    header[5] = BLOCK_FLAGS;
+    put_u32(header + 8, (uint32_t)block_size);
+    writer->status = out->write(out, (const char *)header, sizeof(header));
+    writer->offset = BLOCK_HEADER_LEN;
+}
+
+/**
+ * write_block - Compress one block and write it out
+ * @param writer The writer
+ * @param data The original bytes
+ * @param len The number of bytes, between 1 and the block size
+ * @param stats Where the stage timings are added
+ * @return 0 on success, -1 once the writer has failed
+ */
+static int write_block(BlockWriter *writer, const unsigned char *data,
+                       size_t len, CodecStats *stats)
+{
+    if (writer->status != 0 || writer->count == UINT32_MAX)
+        return writer->status = -1;
+    CodecContext *context = writer->context;
+    size_t index_len = entry_len(BLOCK_FLAG_CHECKSUMS) * (writer->count + 1);
+    reserve(&context->index, &context->index_room, 8 + index_len);
+
+    uint32_t checksum = 0;
+    size_t block_len =
+        encode_block(data, len, context->block, context, &checksum, stats);
+    unsigned char *entry = context->index + 8 +
+                           entry_len(BLOCK_FLAG_CHECKSUMS) * writer->count++;
+    put_u64(entry, writer->offset);
+    put_u32(entry + 8, checksum);
+    writer->checksum = crc32c_combine(writer->checksum, checksum, len);
+    Sink *out = writer->out;
+    writer->status = out->write(out, (const char *)context->block, block_len);
+    writer->offset += block_len;
+    writer->raw_len += len;
+    return writer->status;
+}
+
+/**
+ * finish_writer - Write the end marker, the index and the footer
+ * @param writer The writer
+ * @return 0 on success, -1 if anything failed to be written
+ */
+static int finish_writer(BlockWriter *writer)
+{
+    // the end marker, the index and the footer go out together
+    size_t index_len = entry_len(BLOCK_FLAG_CHECKSUMS) * writer->count;
+    size_t tail_len = 8 + index_len + footer_len(BLOCK_FLAG_CHECKSUMS);
+    if (writer->status == 0) {
+        CodecContext *context = writer->context;
+        unsigned char *tail =
+            reserve(&context->index, &context->index_room, tail_len);
+        memset(tail, 0, 8);
+        unsigned char *footer = tail + 8 + index_len;
+        put_u64(footer, writer->raw_len);
+        put_u64(footer + 8, writer->offset + 8);
+        put_u32(footer + 16, (uint32_t)writer->count);
+        put_u32(footer + 20, writer->checksum);
+        memcpy(footer + 24, BLOCK_FOOTER_MAGIC, 4);
+        writer->status =
+            writer->out->write(writer->out, (const char *)tail, tail_len);
+        writer->offset += tail_len;
+    }
+    return writer->status;
+}
+
+int block_compress(CodecContext *context, Sink *out, const char *data,
+                   size_t data_len, size_t block_size, CancelToken *cancel,
+                   CodecStats *stats)
+{
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE)
+        return -1;
+
+    BlockWriter writer;
+    start_writer(&writer, context, out, block_size);
+    for (size_t start = 0; start < data_len && writer.status == 0;
+         start += block_size) {
+        if (cancel->is_cancelled(cancel)) {
+            writer.status = -1;
+            break;
+        }
+        size_t len =
+            data_len - start < block_size ? data_len - start : block_size;
+        write_block(&writer, (const unsigned char *)data + start, len, stats);
+    }
+    int status = finish_writer(&writer);
+    stats->output_len = (size_t)writer.offset;
+    stats->checksum = writer.checksum;
+    return status;
+}
+
+typedef struct BlockSink BlockSink;
+struct BlockSink {
+    Sink base;
+    Sink *inner;
+    BlockWriter writer; // writes through a context of the sink's own
+    CodecStats stats;
+    size_t len;
+    unsigned char *pending; // the block being filled, the context's buffer
+};
+
+/**
+ * block_sink_write - Collect data and compress every block once it is full
+ * @param self Block sink
+ * @param data Data to compress
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the inner sink has failed
+ */
+static int block_sink_write(Sink *self, const char *data,
+                            const size_t data_len)
+{
+    BlockSink *sink = (BlockSink *)self;
+    size_t left = data_len;
+    while (left > 0 && sink->writer.status == 0) {
+        size_t room = sink->writer.block_size - sink->len;
+        size_t len = left < room ? left : room;
+        memcpy(sink->pending + sink->len, data, len);
+        sink->len += len;
+        data += len;
+        left -= len;
+        if (sink->len == sink->writer.block_size) {
+            write_block(&sink->writer, sink->pending, sink->len, &sink->stats);
+            sink->len = 0;
+        }
+    }
+    return sink->writer.status;
+}
+
+/**
+ * block_sink_close - Compress the last block, finish the file and free the
+ * sink, closing the inner one
+ * @param self Block sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int block_sink_close(Sink *self)
+{
+    BlockSink *sink = (BlockSink *)self;
+    if (sink->len > 0)
+        write_block(&sink->writer, sink->pending, sink->len, &sink->stats);
+    int status = finish_writer(&sink->writer);
+    if (sink->inner->close(sink->inner) != 0)
+        status = -1;
+    free_codec_context(sink->writer.context);
+    free(sink);
+    return status;
+}
+
+Sink *new_block_sink(Sink *inner, size_t block_size)
+{
+    BlockSink *sink = must_calloc(1, sizeof(BlockSink));
+    sink->base.write = &block_sink_write;
+    sink->base.close = &block_sink_close;
+    sink->inner = inner;
+    // the sink may be written from another thread than the one creating it
+    CodecContext *context = new_codec_context();
+    sink->pending =
+        reserve(&context->buffer, &context->buffer_room, block_size);
+    start_writer(&sink->writer, context, inner, block_size);
+    return &sink->base;
+}
+
+enum DECODE_PART { PART_HEADER, PART_LENGTHS, PART_BLOCK, PART_TAIL };
+
+typedef struct DecodeSink DecodeSink;
+struct DecodeSink {
+    Sink base;
+    Sink *inner;
+    enum DECODE_PART part; // what the bytes being collected are
+    size_t want;           // bytes that part needs
+    size_t len;            // bytes of it collected
+    unsigned char *pending;
+    unsigned char *buffer; // original bytes of a block
+    size_t block_size;
+    unsigned char flags;
+    uint64_t raw_len;  // original bytes decoded so far
+    size_t count;      // blocks decoded so far
+    uint32_t checksum; // CRC-32C of the original bytes so far
+    uint64_t tail_len;
+    unsigned char footer[BLOCK_FOOTER_LEN + 4]; // last bytes of the tail
+    int status;
+};
+
+/**
+ * decode_part - Act on a part of the file once it is collected
+ * @param sink Decode sink
+ * @return 0 on success, -1 if the file is malformed or the inner sink failed
+ */
+static int decode_part(DecodeSink *sink)
+{
+    const unsigned char *p = sink->pending;
+    switch (sink->part) {
+    case PART_HEADER:
+        sink->block_size = get_u32(p + 8);
+        sink->flags = p[5];
+        if (memcmp(p, BLOCK_MAGIC, 4) != 0 || p[4] != BLOCK_VERSION ||
+            (p[5] & ~BLOCK_FLAGS) != 0 || sink->block_size == 0 ||
+            sink->block_size > MAX_BLOCK_SIZE)
+            return -1;
+        sink->pending = must_calloc(block_room(sink->block_size), 1);
+        sink->buffer = must_calloc(sink->block_size, 1);
+        free((void *)p);
+        sink->part = PART_LENGTHS;
+        sink->want = 8;
+        return 0;
+    case PART_LENGTHS: {
+        size_t len = get_u32(p);
+        size_t payload_len = get_u32(p + 4);
+        if (len == 0 && payload_len == 0) {
+            sink->part = PART_TAIL; // the index and the footer
+            return 0;
+        }
+        size_t prefix = prefix_len(sink->flags);
+        if (len == 0 || len > sink->block_size ||
+            payload_len > block_room(sink->block_size) - prefix)
+            return -1;
+        // the lengths stay in front of the rest of the block
+        sink->part = PART_BLOCK;
+        sink->want = prefix + payload_len;
+        sink->len = 8;
+        return 0;
+    }
+    case PART_BLOCK: {
+        // a block is checked against the CRC in its header before it is
+        // passed on; older files only have the CRC of the whole file, in
+        // the footer
+        uint32_t checksum = 0;
+        if (decode_payload(p, sink->flags, sink->buffer, &checksum) != 0)
+            return -1;
+        size_t len = get_u32(p);
+        sink->checksum = crc32c_combine(sink->checksum, checksum, len);
+        sink->raw_len += len;
+        sink->count++;
+        sink->part = PART_LENGTHS;
+        sink->want = 8;
+        return sink->inner->write(sink->inner, (const char *)sink->buffer,
+                                  len);
+    }
+    default:
+        return -1;
+    }
+}
+
+/**
+ * decode_sink_write - Collect the parts of the file and decode every block
+ * once it is whole
+ * @param self Decode sink
+ * @param data Compressed data
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the file was found malformed or the inner
+ * sink has failed
+ */
+static int decode_sink_write(Sink *self, const char *data,
+                             const size_t data_len)
+{
+    DecodeSink *sink = (DecodeSink *)self;
+    size_t left = data_len;
+    while (left > 0 && sink->status == 0) {
+        if (sink->part == PART_TAIL) {
+            // only the footer is needed, the index describes the blocks
+            // that were just decoded
+            size_t footer_bytes = footer_len(sink->flags);
+            size_t keep = left < footer_bytes ? left : footer_bytes;
+            memmove(sink->footer, sink->footer + keep, footer_bytes - keep);
+            memcpy(sink->footer + footer_bytes - keep, data + left - keep,
+                   keep);
+            sink->tail_len += left;
+            break;
+        }
+        size_t len = sink->want - sink->len < left ? sink->want - sink->len
+                                                   : left;
+        memcpy(sink->pending + sink->len, data, len);
+        sink->len += len;
+        data += len;
+        left -= len;
+        if (sink->len == sink->want) {
+            sink->len = 0;
+            if (decode_part(sink) != 0)
+                sink->status = -1;
+        }
+    }
+    return sink->status;
+}
+
+/**
+ * decode_sink_close - Check the footer and free the sink, closing the inner
+ * one
+ * @param self Decode sink
+ * @return 0 on success, -1 if the file was malformed, cut short or any write
+ * failed
+ */
+static int decode_sink_close(Sink *self)
+{
+    DecodeSink *sink = (DecodeSink *)self;
+    int status = sink->status;
+    const unsigned char *footer = sink->footer;
+    bool checksums = sink->flags & BLOCK_FLAG_CHECKSUMS;
+    size_t footer_bytes = footer_len(sink->flags);
+    if (sink->part != PART_TAIL ||
+        sink->tail_len !=
+            entry_len(sink->flags) * (uint64_t)sink->count + footer_bytes ||
+        memcmp(footer + footer_bytes - 4, BLOCK_FOOTER_MAGIC, 4) != 0 ||
+        get_u64(footer) != sink->raw_len ||
+        get_u32(footer + 16) != sink->count ||
+        (checksums && get_u32(footer + 20) != sink->checksum))
+        status = -1;
+    if (sink->inner->close(sink->inner) != 0)
+        status = -1;
+    free(sink->pending);
+    free(sink->buffer);
+    free(sink);
+    return status;
+}
+
+Sink *new_block_decode_sink(Sink *inner)
+{
+    DecodeSink *sink = must_calloc(1, sizeof(DecodeSink));
+    sink->base.write = &decode_sink_write;
+    sink->base.close = &decode_sink_close;
+    sink->inner = inner;
+    sink->part = PART_HEADER;
+    sink->want = BLOCK_HEADER_LEN;
+    sink->pending = must_calloc(BLOCK_HEADER_LEN, 1);
+    return &sink->base;
+}
+
+int block_read_index(const char *data, size_t data_len, BlockIndex *index)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    if (!is_block_file(data, data_len) || p[4] != BLOCK_VERSION ||
+        (p[5] & ~BLOCK_FLAGS) != 0)
+        return -1;
+    size_t entry_bytes = entry_len(p[5]);
+    size_t footer_bytes = footer_len(p[5]);
+    if (data_len < BLOCK_HEADER_LEN + 8 + footer_bytes)
+        return -1;
+    const unsigned char *footer = p + data_len - footer_bytes;
+    if (memcmp(footer + footer_bytes - 4, BLOCK_FOOTER_MAGIC, 4) != 0)
+        return -1;
+
+    uint64_t raw_len = get_u64(footer);
+    uint64_t index_offset = get_u64(footer + 8);
+    size_t block_size = get_u32(p + 8);
+    size_t count = get_u32(footer + 16);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE ||
+        raw_len / block_size + (raw_len % block_size != 0) != count)
+        return -1;
+    // the index sits between the end marker and the footer
+    if (index_offset < BLOCK_HEADER_LEN + 8 ||
+        index_offset > data_len - footer_bytes ||
+        data_len - footer_bytes - index_offset !=
+            entry_bytes * (uint64_t)count)
+        return -1;
+    const unsigned char *end = p + index_offset - 8;
+    if (get_u64(end) != 0)
+        return -1;
+
+    index->raw_len = (size_t)raw_len;
+    index->block_size = block_size;
+    index->count = count;
+    index->end = (size_t)index_offset - 8;
+    index->offsets = p + index_offset;
+    index->entry_len = entry_bytes;
+    index->checksums = p[5] & BLOCK_FLAG_CHECKSUMS;
+    index->flags = p[5];
+    index->checksum = index->checksums ? get_u32(footer + 20) : 0;
+    return 0;
+}
+
+int block_decompress(CodecContext *context, Sink *out, const char *data,
+                     size_t data_len, CancelToken *cancel, CodecStats *stats)
+{
+    double started = monotonic_seconds();
+    BlockIndex index;
+    if (block_read_index(data, data_len, &index) != 0)
+        return -1;
+    double lap = monotonic_seconds();
+    stats->stage[STAGE_HEADER] = lap - started;
+
+    int status = 0;
+    unsigned char *buffer =
+        reserve(&context->buffer, &context->buffer_room, index.block_size);
+    for (size_t i = 0; i < index.count && status == 0; i++) {
+        size_t len = 0;
+        uint32_t checksum = 0;
+        if (cancel->is_cancelled(cancel) ||
+            decode_block(data, &index, i, buffer, &len, &checksum) != 0) {
+            status = -1;
+            break;
+        }
+        stats->output_len += len;
+        stats->checksum = crc32c_combine(stats->checksum, checksum, len);
+        status = out->write(out, (const char *)buffer, len);
+    }
+    if (status == 0 && index.checksums && stats->checksum != index.checksum)
+        status = -1;
+    stats->stage[STAGE_DECODE] = monotonic_seconds() - lap;
+    return status;
+}
+
+int block_decompress_range(CodecContext *context, Sink *out,
+                           const char *data, const BlockIndex *index,
+                           size_t first, size_t len)
+{
+    if (first > index->raw_len || len > index->raw_len - first)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    int status = 0;
+    size_t last = first + len - 1;
+    unsigned char *buffer =
+        reserve(&context->buffer, &context->buffer_room, index->block_size);
+    for (size_t i = first / index->block_size;
+         i <= last / index->block_size && status == 0; i++) {
+        size_t block_len = 0;
+        uint32_t checksum = 0;
+        if (decode_block(data, index, i, buffer, &block_len, &checksum) !=
+            0) {
+            status = -1;
+            break;
+        }
+        // only the part of the block inside the range is sent
+        size_t start = i * index->block_size;
+        size_t from = first > start ? first - start : 0;
+        size_t to = last - start < block_len ? last - start + 1 : block_len;
+        status = out->write(out, (const char *)buffer + from, to - from);
+    }
+    return status;
+}
+
+/**
+ * Verification - the blocks of the files block_verify checks, handed out to
+ * its threads one at a time
+ */
+typedef struct Verification {
+    BlockCheck *files;
+    BlockIndex *indexes;
+    size_t *firsts;    // number of the first block of each file, then total
+    uint32_t *crcs;    // CRC-32C of every block
+    size_t total;      // blocks of all the files
+    size_t block_size; // the largest of the files
+    size_t next;       // next block to hand out
+    CancelToken *cancel;
+} Verification;
+
+/**
+ * verify_blocks - Decode blocks until none is left, keeping their CRCs
+ * @param arg The verification
+ * @return NULL
+ */
+static void *verify_blocks(void *arg)
+{
+    Verification *run = arg;
+    unsigned char *buffer = must_calloc(run->block_size, 1);
+    size_t file = 0;
+    for (;;) {
+        size_t block = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (block >= run->total || run->cancel->is_cancelled(run->cancel))
+            break;
+        // a thread gets blocks in increasing order, so its file only moves
+        // forward
+        while (block >= run->firsts[file + 1])
+            file++;
+        BlockCheck *check = &run->files[file];
+        size_t len = 0;
+        if (__atomic_load_n(&check->status, __ATOMIC_RELAXED) != 0)
+            continue;
+        if (decode_block(check->data, &run->indexes[file],
+                         block - run->firsts[file], buffer, &len,
+                         &run->crcs[block]) != 0)
+            __atomic_store_n(&check->status, -1, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    return NULL;
+}
+
+int block_verify(BlockCheck *files, size_t count, int threads,
+                 CancelToken *cancel)
+{
+    Verification run = {0};
+    run.files = files;
+    run.cancel = cancel;
+    run.indexes = must_calloc(count ? count : 1, sizeof(BlockIndex));
+    run.firsts = must_calloc(count + 1, sizeof(size_t));
+    run.block_size = 1;
+    for (size_t i = 0; i < count; i++) {
+        BlockIndex *index = &run.indexes[i];
+        files[i].status = block_read_index(files[i].data, files[i].data_len,
+                                           index);
+        files[i].raw_len = files[i].status == 0 ? index->raw_len : 0;
+        files[i].checksum = 0;
+        run.firsts[i] = run.total;
+        if (files[i].status != 0)
+            continue;
+        run.total += index->count;
+        if (index->block_size > run.block_size)
+            run.block_size = index->block_size;
+    }
+    run.firsts[count] = run.total;
+    run.crcs = must_calloc(run.total ? run.total : 1, sizeof(uint32_t));
+
+    // the caller decodes along with the threads it starts
+    int helpers = threads > 1 ? threads - 1 : 0;
+    pthread_t *ids = must_calloc((size_t)helpers + 1, sizeof(pthread_t));
+    for (int i = 0; i < helpers; i++) {
+        if (pthread_create(&ids[i], NULL, &verify_blocks, &run) != 0) {
+            perror("Error creating verify thread");
+            exit(1);
+        }
+    }
+    verify_blocks(&run);
+    for (int i = 0; i < helpers; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+
+    // the CRCs of the blocks add up to the CRC of each original
+    int status = cancel->is_cancelled(cancel) ? -1 : 0;
+    for (size_t i = 0; i < count; i++) {
+        const BlockIndex *index = &run.indexes[i];
+        for (size_t b = run.firsts[i];
+             files[i].status == 0 && b < run.firsts[i + 1]; b++) {
+            size_t block = b - run.firsts[i];
+            size_t len = block + 1 < index->count
+                             ? index->block_size
+                             : index->raw_len - block * index->block_size;
+            files[i].checksum =
+                crc32c_combine(files[i].checksum, run.crcs[b], len);
+        }
+        if (files[i].status == 0 && index->checksums &&
+            files[i].checksum != index->checksum)
+            files[i].status = -1;
+        if (files[i].status != 0)
+            status = -1;
+    }
+    free(run.crcs);
+    free(run.firsts);
+    free(run.indexes);
+    return status;
+}
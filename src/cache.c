@@ -0,0 +1,272 @@
+#include "../include/cache.h"
+#include "../include/utils.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#define INITIAL_BUCKETS 256
+
+/**
+ * bucket_of - Find the bucket of a key
+ * @param self The result cache
+ * @param hash Hash of the input
+ * @param mode Operation run on the input
+ * @return Index of the bucket
+ */
+static size_t bucket_of(const ResultCache *self, uint64_t hash,
+                        enum MODE mode)
+{
+    return (size_t)(hash ^ (uint64_t)mode) & (self->bucket_count - 1);
+}
+
+/**
+ * matches - Check whether an entry holds the result of an input
+ * The hash only narrows the search, the input itself is compared.
+ * @param entry The entry
+ * @param hash Hash of the input
+ * @param input The input
+ * @param input_len Length of the input
+ * @param mode Operation run on the input
+ * @return Whether the entry is the input's result
+ */
+static bool matches(const CacheEntry *entry, uint64_t hash, const char *input,
+                    size_t input_len, enum MODE mode)
+{
+    return entry->hash == hash && entry->input_len == input_len &&
+           entry->mode == mode &&
+           memcmp(entry->input, input, input_len) == 0;
+}
+
+/**
+ * unlink_lru - Take an entry out of the LRU list
+ * @param self The result cache
+ * @param entry The entry
+ */
+static void unlink_lru(ResultCache *self, CacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        self->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        self->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+/**
+ * push_lru - Make an entry the most recently used one
+ * @param self The result cache
+ * @param entry The entry
+ */
+static void push_lru(ResultCache *self, CacheEntry *entry)
+{
+    entry->next = self->head;
+    entry->prev = NULL;
+    if (self->head)
+        self->head->prev = entry;
+    self->head = entry;
+    if (self->tail == NULL)
+        self->tail = entry;
+}
+
+/**
+ * drop_ref - Drop a reference, freeing the entry with the last one
+ * @param entry The entry
+ */
+static void drop_ref(CacheEntry *entry)
+{
+    if (--entry->refs == 0) {
+        free(entry->input);
+        free(entry->data);
+        free(entry);
+    }
+}
+
+/**
+ * evict - Remove the least recently used entry
+ * @param self The result cache
+ */
+static void evict(ResultCache *self)
+{
+    CacheEntry *victim = self->tail;
+    CacheEntry **link = &self->buckets[bucket_of(self, victim->hash,
+                                                  victim->mode)];
+    while (*link != victim)
+        link = &(*link)->chain;
+    *link = victim->chain;
+
+    unlink_lru(self, victim);
+    self->size -= victim->len + victim->input_len;
+    self->count--;
+    self->evictions++;
+    drop_ref(victim);
+}
+
+/**
+ * grow - Double the number of buckets once they get crowded
+ * @param self The result cache
+ */
+static void grow(ResultCache *self)
+{
+    CacheEntry **old = self->buckets;
+    size_t old_count = self->bucket_count;
+    self->bucket_count *= 2;
+    self->buckets = must_calloc(self->bucket_count, sizeof(CacheEntry *));
+    for (size_t i = 0; i < old_count; i++) {
+        while (old[i] != NULL) {
+            CacheEntry *entry = old[i];
+            old[i] = entry->chain;
+            size_t bucket = bucket_of(self, entry->hash, entry->mode);
+            entry->chain = self->buckets[bucket];
+            self->buckets[bucket] = entry;
+        }
+    }
+    free(old);
+}
+
+/**
+ * hash - Hash an input with the cache's secret seed
+ * @param self The result cache
+ * @param data The input
+ * @param data_len The length of the input
+ * @return The hash of the input
+ */
+static uint64_t hash(ResultCache *self, const char *data, size_t data_len)
+{
+    return hash_bytes(data, data_len, self->seed);
+}
+
+/**
+ * get - Look up a result, counting a hit or a miss
+ * @param self The result cache
+ * @param hash Hash of the input
+ * @param input The input
+ * @param input_len Length of the input
+ * @param mode Operation run on the input
+ * @return The entry, to be released after use, NULL on a miss
+ */
+static const CacheEntry *get(ResultCache *self, uint64_t hash,
+                             const char *input, size_t input_len,
+                             enum MODE mode)
+{
+    if (self->capacity == 0)
+        return NULL;
+
+    pthread_mutex_lock(&self->lock);
+    CacheEntry *entry = self->buckets[bucket_of(self, hash, mode)];
+    while (entry != NULL && !matches(entry, hash, input, input_len, mode))
+        entry = entry->chain;
+
+    if (entry != NULL) {
+        entry->refs++;
+        unlink_lru(self, entry);
+        push_lru(self, entry);
+        self->hits++;
+    } else {
+        self->misses++;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return entry;
+}
+
+/**
+ * release - Give back an entry returned by get()
+ * @param self The result cache
+ * @param entry The entry
+ */
+static void release(ResultCache *self, const CacheEntry *entry)
+{
+    pthread_mutex_lock(&self->lock);
+    drop_ref((CacheEntry *)entry);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * put - Store a result, evicting the least recently used ones to make room
+ * Entries bigger than a quarter of the cache, result and input together, are
+ * not kept, so one huge job can't flush everything else.
+ * @param self The result cache
+ * @param hash Hash of the input
+ * @param input The input, copied into the entry
+ * @param input_len Length of the input
+ * @param mode Operation run on the input
+ * @param data The result, owned by the cache from now on
+ * @param len The length of the result
+ */
+static void put(ResultCache *self, uint64_t hash, const char *input,
+                size_t input_len, enum MODE mode, char *data, size_t len)
+{
+    if (len > self->capacity / 4 || input_len > self->capacity / 4 - len) {
+        free(data);
+        return;
+    }
+
+    CacheEntry *entry = must_calloc(1, sizeof(CacheEntry));
+    entry->hash = hash;
+    entry->input = must_calloc(input_len + 1, 1);
+    memcpy(entry->input, input, input_len);
+    entry->input_len = input_len;
+    entry->mode = mode;
+    entry->data = data;
+    entry->len = len;
+    entry->refs = 1;
+
+    pthread_mutex_lock(&self->lock);
+    size_t bucket = bucket_of(self, hash, mode);
+    for (CacheEntry *cur = self->buckets[bucket]; cur; cur = cur->chain) {
+        if (matches(cur, hash, input, input_len, mode)) {
+            // another request stored the same result in the meantime
+            pthread_mutex_unlock(&self->lock);
+            drop_ref(entry);
+            return;
+        }
+    }
+
+    while (self->size + len + input_len > self->capacity)
+        evict(self);
+    if (self->count >= self->bucket_count)
+        grow(self);
+    bucket = bucket_of(self, hash, mode);
+    entry->chain = self->buckets[bucket];
+    self->buckets[bucket] = entry;
+    push_lru(self, entry);
+    self->size += len + input_len;
+    self->count++;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * stats - Render the counters as JSON
+ * @param self The result cache
+ * @param buffer Where to render
+ * @param buffer_len Size of the buffer
+ */
+static void stats(ResultCache *self, char *buffer, size_t buffer_len)
+{
+    pthread_mutex_lock(&self->lock);
+    snprintf(buffer, buffer_len,
+             "{\"hits\": %lu, \"misses\": %lu, \"evictions\": %lu, "
+             "\"entries\": %zu, \"bytes\": %zu, \"capacity\": %zu}",
+             self->hits, self->misses, self->evictions, self->count,
+             self->size, self->capacity);
+    pthread_mutex_unlock(&self->lock);
+}
+
+void init_result_cache(ResultCache **self, size_t capacity)
+{
+    *self = (ResultCache *)must_calloc(1, sizeof(ResultCache));
+    (*self)->capacity = capacity;
+    (*self)->bucket_count = INITIAL_BUCKETS;
+    (*self)->buckets = must_calloc(INITIAL_BUCKETS, sizeof(CacheEntry *));
+    // a per-process seed keeps crafted inputs from colliding on purpose
+    (*self)->seed = hash_bytes(self, sizeof(*self), (uint64_t)time(NULL)) ^
+                    (uint64_t)clock();
+    pthread_mutex_init(&(*self)->lock, NULL);
+    (*self)->hash = &hash;
+    (*self)->get = &get;
+    (*self)->release = &release;
+    (*self)->put = &put;
+    (*self)->stats = &stats;
+}
@@ -0,0 +1,43 @@
+#include "../include/cancel.h"
+#include "../include/utils.h"
+#include <poll.h>
+
+/**
+ * is_cancelled - Check whether the run should stop
+ * Only a connection that is gone cancels the run: POLLHUP, POLLERR or
+ * POLLNVAL. A peer that merely shut down its sending side after a complete
+ * request still reads the result; if it doesn't, the send fails and the run
+ * stops through its sink.
+ * @param self The cancel token
+ * @return true once cancelled
+ */
+static bool is_cancelled(CancelToken *self)
+{
+    if (__atomic_load_n(&self->cancelled, __ATOMIC_RELAXED))
+        return true;
+    if (self->fd < 0)
+        return false;
+
+    // POLLHUP, POLLERR and POLLNVAL are reported whatever the events
+    struct pollfd pfd = {.fd = self->fd, .events = 0};
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+        __atomic_store_n(&self->cancelled, 1, __ATOMIC_RELAXED);
+    return __atomic_load_n(&self->cancelled, __ATOMIC_RELAXED);
+}
+
+/**
+ * cancel - Ask the run to stop
+ * @param self The cancel token
+ */
+static void cancel(CancelToken *self)
+{
+    __atomic_store_n(&self->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+void init_cancel_token(CancelToken **self, int fd)
+{
+    *self = (CancelToken *)must_calloc(1, sizeof(CancelToken));
+    (*self)->fd = fd;
+    (*self)->is_cancelled = &is_cancelled;
+    (*self)->cancel = &cancel;
+}
@@ -0,0 +1,111 @@
+#include "../include/code.h"
+#include <string.h>
+
+void build_code_lengths(const uint64_t freq[SYMBOLS],
+                        unsigned char lengths[SYMBOLS])
+{
+    uint64_t weight[2 * SYMBOLS];
+    int parent[2 * SYMBOLS];
+    int depth[2 * SYMBOLS];
+    int leaves[SYMBOLS];
+    int n = 0;
+
+    memset(lengths, 0, SYMBOLS);
+    // insertion sort by frequency, ties broken by byte value
+    for (int symbol = 0; symbol < SYMBOLS; symbol++) {
+        if (freq[symbol] == 0)
+            continue;
+        int i = n++;
+        while (i > 0 && freq[leaves[i - 1]] > freq[symbol]) {
+            leaves[i] = leaves[i - 1];
+            i--;
+        }
+        leaves[i] = symbol;
+    }
+    if (n == 0)
+        return;
+    if (n == 1) {
+        lengths[leaves[0]] = 1;
+        return;
+    }
+
+    for (int i = 0; i < n; i++)
+        weight[i] = freq[leaves[i]];
+    int next_leaf = 0, next_node = n;
+    for (int node = n; node < 2 * n - 1; node++) {
+        int pick[2];
+        for (int k = 0; k < 2; k++) {
+            if (next_leaf < n &&
+                (next_node >= node || weight[next_leaf] <= weight[next_node]))
+                pick[k] = next_leaf++;
+            else
+                pick[k] = next_node++;
+        }
+        weight[node] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = node;
+    }
+    // parents come after their children, so one backwards pass sets depths
+    depth[2 * n - 2] = 0;
+    for (int node = 2 * n - 3; node >= 0; node--)
+        depth[node] = depth[parent[node]] + 1;
+
+    uint32_t kraft = 0;
+    for (int i = 0; i < n; i++) {
+        if (depth[i] > MAX_CODE_LEN)
+            depth[i] = MAX_CODE_LEN;
+        kraft += 1u << (MAX_CODE_LEN - depth[i]);
+    }
+    while (kraft > 1u << MAX_CODE_LEN) {
+        for (int i = 0; i < n; i++) {
+            if (depth[i] < MAX_CODE_LEN) {
+                depth[i]++;
+                kraft -= 1u << (MAX_CODE_LEN - depth[i]);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+        lengths[leaves[i]] = (unsigned char)depth[i];
+}
+
+int assign_codes(HuffmanCode *code)
+{
+    memset(code->count, 0, sizeof(code->count));
+    for (int symbol = 0; symbol < SYMBOLS; symbol++) {
+        if (code->lengths[symbol] > MAX_CODE_LEN)
+            return -1;
+        code->count[code->lengths[symbol]]++;
+    }
+    code->count[0] = 0;
+
+    uint32_t value = 0, kraft = 0, used = 0;
+    for (int len = 1; len <= MAX_CODE_LEN; len++) {
+        value = (value + code->count[len - 1]) << 1;
+        code->first[len] = (uint16_t)value;
+        code->start[len] = (uint16_t)used;
+        used += code->count[len];
+        kraft += (uint32_t)code->count[len] << (MAX_CODE_LEN - len);
+    }
+    if (used == 0 || kraft > 1u << MAX_CODE_LEN)
+        return -1;
+
+    uint16_t next[MAX_CODE_LEN + 1];
+    uint16_t slot[MAX_CODE_LEN + 1];
+    memcpy(next, code->first, sizeof(next));
+    memcpy(slot, code->start, sizeof(slot));
+    memset(code->lookup, 0, sizeof(code->lookup));
+    for (int symbol = 0; symbol < SYMBOLS; symbol++) {
+        int len = code->lengths[symbol];
+        if (len == 0)
+            continue;
+        code->codes[symbol] = next[len]++;
+        code->sorted[slot[len]++] = (unsigned char)symbol;
+        if (len <= LOOKUP_BITS) {
+            int shift = LOOKUP_BITS - len;
+            size_t base = (size_t)code->codes[symbol] << shift;
+            for (size_t i = 0; i < (size_t)1 << shift; i++)
+                code->lookup[base + i] = (uint16_t)(symbol << 4 | len);
+        }
+    }
+    return 0;
+}
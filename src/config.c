@@ -1,8 +1,15 @@
+#include "../include/adaptive.h"
 #include "../include/config.h"
+#include "../include/kernels.h"
+#include "../include/shm.h"
 #include "../include/utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define DEFAULT_PORT 8000
+#define DEFAULT_CACHE_MB 64
 
 /**
  * check_arg - print message and exit if the condition is false.
@@ -31,10 +38,73 @@ static void print_help(void)
     printf("Options:\n");
     printf("  -c, --compress        Compress the input file\n");
     printf("  -d, --decompress      Decompress the input file\n");
-    printf("  -i, --input <file>    The input file\n");
-    printf("  -o, --output <file>   The output file\n");
+    printf("  -i, --input <file>... The input file, - for stdin; several "
+           "files, globs or\n"
+           "                        directories are all coded into the "
+           "output directory\n");
+    printf("  -o, --output <file>   The output file, - for stdout, or "
+           "directory\n");
+    printf("  -a, --archive         Compress the inputs into one archive\n");
+    printf("      --member <name>   Extract one member of an archive\n");
+    printf("  -l, --list            List the members of an archive\n");
+    printf("  -t, --test            Check that the inputs decode, and their "
+           "checksums, without\n"
+           "                        writing anything\n");
+    printf("      --adaptive        Compress in one pass, each read going "
+           "out at once\n");
+    printf("      --rebuild-interval <KiB> Most input between two codes of "
+           "--adaptive (default: %d)\n",
+           DEFAULT_REBUILD_INTERVAL >> 10);
     printf("  -h, --help            Print this message\n");
     printf("  -s, --server          Run in server mode\n");
+    printf("      --watch-templates Reload templates when they change\n");
+    printf("  -p, --port <port>     Port to listen on (default: %d)\n",
+           DEFAULT_PORT);
+    printf("  -b, --backlog <n>     Length of the accept queue\n");
+    printf("  -w, --workers <n>     Number of worker threads (default: one "
+           "per core)\n");
+    printf("  -j, --jobs <n>        Number of background job threads, or "
+           "files coded at once\n"
+           "                        by the CLI (default: one per core, at "
+           "least 2)\n");
+    printf("      --reuseport       One SO_REUSEPORT listener per worker, "
+           "pinned to a core\n");
+    printf("      --io-uring        Queue accepts, reads and polls on "
+           "io_uring, falling back to\n                        epoll\n");
+    printf("      --max-jobs <n>    Codec runs at once (default: one per "
+           "core)\n");
+    printf("      --memory-budget <MiB> Memory requests may hold at once "
+           "(default: half of RAM)\n");
+    printf("      --header-timeout <s> Time to send the headers (default: "
+           "10)\n");
+    printf("      --body-timeout <s> Time to send the body on top of "
+           "--min-rate (default: 60)\n");
+    printf("      --idle-timeout <s> Time allowed between reads (default: "
+           "15)\n");
+    printf("      --write-timeout <s> Time a response may stall (default: "
+           "30)\n");
+    printf("      --min-rate <B/s>  Rate bodies and responses must average, 0 "
+           "disables (default: 500)\n");
+    printf("      --cache-size <MiB> Memory for cached results, 0 disables "
+           "(default: %d)\n",
+           DEFAULT_CACHE_MB);
+    printf("      --store-compressed Keep decompressed uploads compressed on "
+           "disk\n");
+    printf("      --unix <path>     Also listen on a Unix domain socket\n");
+    printf("      --shm <name>      Serve requests through a shared memory "
+           "segment; without -s,\n"
+           "                        send the job to the server owning it\n");
+    printf("      --shm-slots <n>   Requests in flight through the segment "
+           "(default: %d)\n",
+           DEFAULT_SHM_SLOTS);
+    printf("      --shm-slot-size <MiB> Largest input or output through the "
+           "segment (default: %d)\n",
+           DEFAULT_SHM_SLOT_SIZE >> 20);
+    printf("      --kernels <name>  Codec loops to run: " KERNEL_NAMES
+           " (default: auto,\n"
+           "                        the best this CPU runs)\n");
+    printf("      --log-level <level> debug, info, warn, error or off "
+           "(default: info)\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -49,15 +119,70 @@ static Config *init_config(void)
     Config *config = (Config *)must_calloc(1, sizeof(Config));
     config->input_file = NULL;
     config->output_file = NULL;
+    config->archive = false;
+    config->member = NULL;
+    config->list = false;
+    config->test = false;
+    config->adaptive = false;
+    config->rebuild_interval = DEFAULT_REBUILD_INTERVAL;
     config->using_server = false;
+    config->watch_templates = false;
+    config->port = DEFAULT_PORT;
+    config->backlog = SOMAXCONN;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config->workers = cpus > 0 ? (int)cpus : 1;
+    // a second thread keeps small jobs moving while a large one runs
+    config->job_workers = config->workers > 1 ? config->workers : 2;
+    config->reuseport = false;
+    config->io_uring = false;
+    config->store_compressed = false;
+    config->unix_path = NULL;
+    config->shm_name = NULL;
+    config->shm_slots = DEFAULT_SHM_SLOTS;
+    config->shm_slot_size = DEFAULT_SHM_SLOT_SIZE;
+    config->cache_size = (size_t)DEFAULT_CACHE_MB << 20;
+    config->max_jobs = config->workers;
+    config->header_timeout = 10;
+    config->body_timeout = 60;
+    config->idle_timeout = 15;
+    config->write_timeout = 30;
+    config->min_rate = 500;
+    config->kernels = NULL;
+    config->log_level = LOG_LEVEL_INFO;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    config->memory_budget = pages > 0 && page_size > 0
+                                ? (size_t)pages * (size_t)page_size / 2
+                                : (size_t)1 << 30;
     return config;
 }
 
+/**
+ * parse_count - parse an integer argument between min and 65535.
+ * --------------------------------------------------------------
+ * @arg: The argument to parse.
+ * @message: The error message to print if it isn't valid.
+ * @min: The smallest valid value.
+ *
+ * Return: The parsed value.
+ */
+static int parse_count(const char *arg, const char *message, long min)
+{
+    check_arg(arg, message);
+    char *end = NULL;
+    long value = strtol(arg, &end, 10);
+    check_arg(*arg != '\0' && *end == '\0' && value >= min &&
+                  value <= 65535,
+              message);
+    return (int)value;
+}
+
 inline static void chk_config(Config *config)
 {
     if (!config->using_server) {
-        check_arg(config->input_file, "No input file");
-        check_arg(config->output_file, "No output file");
+        check_arg(config->input_count > 0, "No input file");
+        check_arg(config->output_file || config->list || config->test,
+                  "No output file");
     }
 }
 
@@ -72,6 +197,8 @@ inline static void chk_config(Config *config)
 Config *new_config(const int argc, const char *argv[])
 {
     Config *config = init_config();
+    config->input_files =
+        (const char **)must_calloc((size_t)argc + 1, sizeof(char *));
     for (int i = 0; i < argc; i++) {
         if (!argv[i]) {
             break;
@@ -89,6 +216,41 @@ Config *new_config(const int argc, const char *argv[])
             strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0;
         bool is_output =
             strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0;
+        bool is_archive =
+            strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--archive") == 0;
+        bool is_member = strcmp(argv[i], "--member") == 0;
+        bool is_list =
+            strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0;
+        bool is_test =
+            strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--test") == 0;
+        bool is_adaptive = strcmp(argv[i], "--adaptive") == 0;
+        bool is_rebuild_interval = strcmp(argv[i], "--rebuild-interval") == 0;
+        bool is_watch = strcmp(argv[i], "--watch-templates") == 0;
+        bool is_port =
+            strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0;
+        bool is_backlog =
+            strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--backlog") == 0;
+        bool is_workers =
+            strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0;
+        bool is_jobs =
+            strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0;
+        bool is_reuseport = strcmp(argv[i], "--reuseport") == 0;
+        bool is_io_uring = strcmp(argv[i], "--io-uring") == 0;
+        bool is_cache_size = strcmp(argv[i], "--cache-size") == 0;
+        bool is_max_jobs = strcmp(argv[i], "--max-jobs") == 0;
+        bool is_budget = strcmp(argv[i], "--memory-budget") == 0;
+        bool is_header_timeout = strcmp(argv[i], "--header-timeout") == 0;
+        bool is_body_timeout = strcmp(argv[i], "--body-timeout") == 0;
+        bool is_idle_timeout = strcmp(argv[i], "--idle-timeout") == 0;
+        bool is_write_timeout = strcmp(argv[i], "--write-timeout") == 0;
+        bool is_min_rate = strcmp(argv[i], "--min-rate") == 0;
+        bool is_store_compressed = strcmp(argv[i], "--store-compressed") == 0;
+        bool is_kernels = strcmp(argv[i], "--kernels") == 0;
+        bool is_log_level = strcmp(argv[i], "--log-level") == 0;
+        bool is_unix = strcmp(argv[i], "--unix") == 0;
+        bool is_shm = strcmp(argv[i], "--shm") == 0;
+        bool is_shm_slots = strcmp(argv[i], "--shm-slots") == 0;
+        bool is_shm_slot_size = strcmp(argv[i], "--shm-slot-size") == 0;
 
         if (is_mode) {
             bool is_compress = strcmp(argv[i], "-c") == 0 ||
@@ -96,15 +258,103 @@ Config *new_config(const int argc, const char *argv[])
             config->mode = is_compress ? COMPRESS : DECOMPRESS;
         } else if (is_input) {
             check_arg(argv[i + 1], "-i/--input requires a file name");
-            config->input_file = argv[++i];
+            // a shell expands a glob into several names, all taken here
+            do {
+                config->input_files[config->input_count++] = argv[++i];
+            } while (argv[i + 1] && argv[i + 1][0] != '-');
+            config->input_file = config->input_files[0];
         } else if (is_output) {
             check_arg(argv[i + 1], "-o/--output requires a file name");
             config->output_file = argv[++i];
+        } else if (is_archive) {
+            config->archive = true;
+        } else if (is_member) {
+            check_arg(argv[i + 1], "--member requires a name");
+            config->member = argv[++i];
+        } else if (is_list) {
+            config->list = true;
+        } else if (is_test) {
+            config->test = true;
+        } else if (is_adaptive) {
+            config->adaptive = true;
+        } else if (is_rebuild_interval) {
+            int kilobytes = parse_count(
+                argv[++i], "--rebuild-interval requires a size", 1);
+            config->rebuild_interval = (size_t)kilobytes << 10;
+            check_arg(config->rebuild_interval <= MAX_REBUILD_INTERVAL,
+                      "--rebuild-interval is at most 16384");
         } else if (is_help) {
             free_config(&config);
             print_help();
         } else if (is_server) {
             config->using_server = true;
+        } else if (is_watch) {
+            config->watch_templates = true;
+        } else if (is_port) {
+            config->port =
+                parse_count(argv[++i], "-p/--port requires a port", 1);
+        } else if (is_backlog) {
+            config->backlog =
+                parse_count(argv[++i], "-b/--backlog requires a count", 1);
+        } else if (is_workers) {
+            config->workers =
+                parse_count(argv[++i], "-w/--workers requires a count", 1);
+        } else if (is_jobs) {
+            config->job_workers =
+                parse_count(argv[++i], "-j/--jobs requires a count", 1);
+        } else if (is_reuseport) {
+            config->reuseport = true;
+        } else if (is_io_uring) {
+            config->io_uring = true;
+        } else if (is_cache_size) {
+            int megabytes =
+                parse_count(argv[++i], "--cache-size requires a size", 0);
+            config->cache_size = (size_t)megabytes << 20;
+        } else if (is_max_jobs) {
+            config->max_jobs =
+                parse_count(argv[++i], "--max-jobs requires a count", 1);
+        } else if (is_budget) {
+            int megabytes =
+                parse_count(argv[++i], "--memory-budget requires a size", 1);
+            config->memory_budget = (size_t)megabytes << 20;
+        } else if (is_header_timeout) {
+            config->header_timeout = parse_count(
+                argv[++i], "--header-timeout requires seconds", 1);
+        } else if (is_body_timeout) {
+            config->body_timeout =
+                parse_count(argv[++i], "--body-timeout requires seconds", 1);
+        } else if (is_idle_timeout) {
+            config->idle_timeout =
+                parse_count(argv[++i], "--idle-timeout requires seconds", 1);
+        } else if (is_write_timeout) {
+            config->write_timeout = parse_count(
+                argv[++i], "--write-timeout requires seconds", 1);
+        } else if (is_min_rate) {
+            config->min_rate =
+                parse_count(argv[++i], "--min-rate requires a rate", 0);
+        } else if (is_store_compressed) {
+            config->store_compressed = true;
+        } else if (is_kernels) {
+            check_arg(argv[i + 1], "--kernels requires " KERNEL_NAMES);
+            config->kernels = argv[++i];
+        } else if (is_log_level) {
+            const char *level = argv[++i];
+            check_arg(level && parse_log_level(level, &config->log_level) == 0,
+                      "--log-level requires debug, info, warn, error or off");
+        } else if (is_unix) {
+            check_arg(argv[i + 1], "--unix requires a socket path");
+            config->unix_path = argv[++i];
+        } else if (is_shm) {
+            check_arg(argv[i + 1] && argv[i + 1][0] == '/',
+                      "--shm requires a name starting with /");
+            config->shm_name = argv[++i];
+        } else if (is_shm_slots) {
+            config->shm_slots =
+                parse_count(argv[++i], "--shm-slots requires a count", 1);
+        } else if (is_shm_slot_size) {
+            int megabytes =
+                parse_count(argv[++i], "--shm-slot-size requires a size", 1);
+            config->shm_slot_size = (size_t)megabytes << 20;
         } else {
             fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
             free_config(&config);
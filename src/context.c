@@ -0,0 +1,76 @@
+#include "../include/context.h"
+#include "../include/utils.h"
+#include <pthread.h>
+#include <stdio.h>
+
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+static pthread_key_t context_key;
+static __thread CodecContext *local_context;
+
+/**
+ * release_context - Free a thread's context as the thread exits
+ * @param context The context
+ */
+static void release_context(void *context)
+{
+    free_codec_context(context);
+}
+
+/**
+ * create_key - Create the key whose destructor frees the contexts
+ */
+static void create_key(void)
+{
+    if (pthread_key_create(&context_key, &release_context) != 0) {
+        fprintf(stderr, "Error: can't create the codec context key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+CodecContext *new_codec_context(void)
+{
+    CodecContext *context = must_calloc(1, sizeof(CodecContext));
+    context->tree = new_huffman_tree();
+    return context;
+}
+
+void free_codec_context(CodecContext *context)
+{
+    if (context == NULL)
+        return;
+    context->tree->destroy(&context->tree);
+    free(context->tree);
+    free(context->block);
+    free(context->index);
+    free(context->buffer);
+    free(context);
+}
+
+CodecContext *codec_context(void)
+{
+    if (local_context != NULL)
+        return local_context;
+
+    pthread_once(&context_once, &create_key);
+    local_context = new_codec_context();
+    pthread_setspecific(context_key, local_context);
+    return local_context;
+}
+
+unsigned char *reserve(unsigned char **buffer, size_t *room, size_t len)
+{
+    if (len <= *room)
+        return *buffer;
+
+    // grow at least twofold, so a workspace filled bit by bit is moved
+    // only a few times
+    size_t grown = *room * 2 > len ? *room * 2 : len;
+    unsigned char *moved = realloc(*buffer, grown);
+    if (moved == NULL) {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    *buffer = moved;
+    *room = grown;
+    return moved;
+}
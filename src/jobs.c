@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "../include/jobs.h"
+#include "../include/utils.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#define SMALL_JOB_BYTES (1 << 20)
+#define LARGE_JOB_MAX_WAIT_MS 500
+#define JOB_TTL_MS (5 * 60 * 1000)
+
+/**
+ * now_ms - Read the monotonic clock
+ * @return Milliseconds since an arbitrary point
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * drop_ref - Drop a reference, freeing the job with the last one
+ * @param self The job pool
+ * @param job The job
+ */
+static void drop_ref(JobPool *self, Job *job)
+{
+    if (--job->refs == 0) {
+        self->admission->release(self->admission, job->reserved);
+        free(job->input);
+        free(job->result);
+        free(job);
+    }
+}
+
+/**
+ * lookup - Find a job by id, with the lock held
+ * @param self The job pool
+ * @param id The id of the job
+ * @return The job, NULL if unknown
+ */
+static Job *lookup(JobPool *self, uint64_t id)
+{
+    Job *job = self->table[id % JOB_BUCKETS];
+    while (job != NULL && job->id != id)
+        job = job->chain;
+    return job;
+}
+
+/**
+ * expire - Forget finished jobs nobody fetched in time, with the lock held
+ * @param self The job pool
+ * @param now The current time
+ */
+static void expire(JobPool *self, long long now)
+{
+    while (self->done_head != NULL &&
+           now - self->done_head->finished_at >= JOB_TTL_MS) {
+        Job *job = self->done_head;
+        self->done_head = job->next;
+        if (self->done_head == NULL)
+            self->done_tail = NULL;
+
+        Job **link = &self->table[job->id % JOB_BUCKETS];
+        while (*link != job)
+            link = &(*link)->chain;
+        *link = job->chain;
+        drop_ref(self, job);
+    }
+}
+
+/**
+ * push - Append a job to a list
+ * @param head Head of the list
+ * @param tail Tail of the list
+ * @param job The job
+ */
+static void push(Job **head, Job **tail, Job *job)
+{
+    job->next = NULL;
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+/**
+ * pop - Take the first job off a list
+ * @param head Head of the list
+ * @param tail Tail of the list
+ * @return The job
+ */
+static Job *pop(Job **head, Job **tail)
+{
+    Job *job = *head;
+    *head = job->next;
+    if (*head == NULL)
+        *tail = NULL;
+    job->next = NULL;
+    return job;
+}
+
+/**
+ * next_job - Pick the job to run next, with the lock held
+ * @param self The job pool
+ * @param is_large Set if the picked job is a large one
+ * @return The job, NULL if nothing may run now
+ */
+static Job *next_job(JobPool *self, bool *is_large)
+{
+    bool large_ok =
+        self->large_head != NULL && self->running_large < self->max_large;
+    bool large_starved =
+        large_ok &&
+        now_ms() - self->large_head->queued_at >= LARGE_JOB_MAX_WAIT_MS;
+
+    *is_large = false;
+    if (self->small_head != NULL && !large_starved) {
+        self->queued_small--;
+        return pop(&self->small_head, &self->small_tail);
+    }
+    if (large_ok) {
+        *is_large = true;
+        self->running_large++;
+        self->queued_large--;
+        return pop(&self->large_head, &self->large_tail);
+    }
+    return NULL;
+}
+
+/**
+ * work - Thread body: run jobs as they come
+ * @param arg The job pool
+ * @return Never returns
+ */
+static void *work(void *arg)
+{
+    JobPool *self = (JobPool *)arg;
+    bool is_large;
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        Job *job = next_job(self, &is_large);
+        if (job == NULL) {
+            pthread_cond_wait(&self->ready, &self->lock);
+            continue;
+        }
+
+        job->state = JOB_RUNNING;
+        self->running++;
+        pthread_mutex_unlock(&self->lock);
+        self->admission->begin_job(self->admission);
+        int status = self->run(job);
+        self->admission->end_job(self->admission);
+        pthread_mutex_lock(&self->lock);
+
+        job->state = status == 0 ? JOB_DONE : JOB_FAILED;
+        self->running--;
+        job->finished_at = now_ms();
+        if (is_large) {
+            self->running_large--;
+            // a large job may be waiting for the lane we just freed
+            pthread_cond_broadcast(&self->ready);
+        }
+        push(&self->done_head, &self->done_tail, job);
+    }
+    return NULL;
+}
+
+/**
+ * answer - Thread body: run request jobs as they come
+ * @param arg The job pool
+ * @return Never returns
+ */
+static void *answer(void *arg)
+{
+    JobPool *self = (JobPool *)arg;
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        if (self->request_head == NULL) {
+            pthread_cond_wait(&self->request_ready, &self->lock);
+            continue;
+        }
+        Job *job = pop(&self->request_head, &self->request_tail);
+        pthread_mutex_unlock(&self->lock);
+        job->run(job);
+        free(job);
+        pthread_mutex_lock(&self->lock);
+    }
+    return NULL;
+}
+
+/**
+ * submit - Queue a job, owned by the pool from now on
+ * @param self The job pool
+ * @param job The job
+ * @return The id of the job
+ */
+static uint64_t submit(JobPool *self, Job *job)
+{
+    pthread_mutex_lock(&self->lock);
+    long long now = now_ms();
+    expire(self, now);
+
+    // ids are not sequential so clients can't fetch each other's results
+    do {
+        self->next_seq++;
+        job->id = hash_bytes(&self->next_seq, sizeof(self->next_seq),
+                             self->seed);
+    } while (job->id == 0 || lookup(self, job->id) != NULL);
+
+    job->state = JOB_QUEUED;
+    job->queued_at = now;
+    job->refs = 1;
+    job->chain = self->table[job->id % JOB_BUCKETS];
+    self->table[job->id % JOB_BUCKETS] = job;
+    if (job->input_len <= self->small_limit) {
+        push(&self->small_head, &self->small_tail, job);
+        self->queued_small++;
+    } else {
+        push(&self->large_head, &self->large_tail, job);
+        self->queued_large++;
+    }
+
+    uint64_t id = job->id;
+    pthread_cond_signal(&self->ready);
+    pthread_mutex_unlock(&self->lock);
+    return id;
+}
+
+/**
+ * submit_request - Queue the rest of a request that is being answered
+ * @param self The job pool
+ * @param job The job, owned by the pool from now on
+ */
+static void submit_request(JobPool *self, Job *job)
+{
+    pthread_mutex_lock(&self->lock);
+    push(&self->request_head, &self->request_tail, job);
+    pthread_cond_signal(&self->request_ready);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * find - Look up a job
+ * @param self The job pool
+ * @param id The id of the job
+ * @param state Where to store the current state of the job
+ * @return The job, to be released after use, NULL if unknown or expired
+ */
+static Job *find(JobPool *self, uint64_t id, enum JOB_STATE *state)
+{
+    pthread_mutex_lock(&self->lock);
+    expire(self, now_ms());
+    Job *job = lookup(self, id);
+    if (job != NULL) {
+        job->refs++;
+        *state = job->state;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return job;
+}
+
+/**
+ * release - Give back a job returned by find()
+ * @param self The job pool
+ * @param job The job
+ */
+static void release(JobPool *self, Job *job)
+{
+    pthread_mutex_lock(&self->lock);
+    drop_ref(self, job);
+    pthread_mutex_unlock(&self->lock);
+}
+
+void init_job_pool(JobPool **self, int workers, int request_workers,
+                   int (*run)(Job *job), Admission *admission)
+{
+    *self = (JobPool *)must_calloc(1, sizeof(JobPool));
+    (*self)->workers = workers;
+    (*self)->small_limit = SMALL_JOB_BYTES;
+    (*self)->max_large = workers > 1 ? workers - 1 : 1;
+    (*self)->seed = hash_bytes(self, sizeof(*self), (uint64_t)time(NULL)) ^
+                    (uint64_t)clock();
+    (*self)->run = run;
+    (*self)->admission = admission;
+    (*self)->submit = &submit;
+    (*self)->submit_request = &submit_request;
+    (*self)->find = &find;
+    (*self)->release = &release;
+    pthread_mutex_init(&(*self)->lock, NULL);
+    pthread_cond_init(&(*self)->ready, NULL);
+    pthread_cond_init(&(*self)->request_ready, NULL);
+
+    (*self)->threads = must_calloc((size_t)workers, sizeof(pthread_t));
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&(*self)->threads[i], NULL, &work, *self) != 0) {
+            perror("Error creating job thread");
+            exit(1);
+        }
+    }
+
+    (*self)->request_workers = request_workers;
+    (*self)->request_threads =
+        must_calloc((size_t)request_workers, sizeof(pthread_t));
+    for (int i = 0; i < request_workers; i++) {
+        if (pthread_create(&(*self)->request_threads[i], NULL, &answer,
+                           *self) != 0) {
+            perror("Error creating job thread");
+            exit(1);
+        }
+    }
+}
@@ -0,0 +1,433 @@
+#include "../include/kernels.h"
+#include "../include/utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#endif
+
+enum VARIANT { VARIANT_SCALAR, VARIANT_SSE42, VARIANT_BMI2, VARIANT_COUNT };
+
+#ifdef HAVE_X86_KERNELS
+// the crc32 instruction is written as assembly so the shared loops below
+// stay free of target-specific builtins, and compile for every target
+
+/**
+ * crc32c_word_hw - Fold eight bytes into a CRC-32C register with the crc32
+ * instruction of SSE4.2
+ * @param crc The register: ~0 to start, the CRC is its complement
+ * @param word The eight bytes, as read by load_le64
+ * @return The register after the bytes
+ */
+static inline uint32_t crc32c_word_hw(uint32_t crc, uint64_t word)
+{
+    uint64_t wide = crc;
+    __asm__("crc32q %1, %0" : "+r"(wide) : "rm"(word));
+    return (uint32_t)wide;
+}
+
+/**
+ * crc32c_byte_hw - Fold one byte into a CRC-32C register with the crc32
+ * instruction of SSE4.2
+ * @param crc The register: ~0 to start, the CRC is its complement
+ * @param byte The byte
+ * @return The register after the byte
+ */
+static inline uint32_t crc32c_byte_hw(uint32_t crc, unsigned char byte)
+{
+    __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(byte));
+    return crc;
+}
+#else
+// only the scalar kernels exist here, which never take these paths
+static inline uint32_t crc32c_word_hw(uint32_t crc, uint64_t word)
+{
+    return crc32c_word(crc32c_tables(), crc, word);
+}
+
+static inline uint32_t crc32c_byte_hw(uint32_t crc, unsigned char byte)
+{
+    return crc32c_byte(crc32c_tables(), crc, byte);
+}
+#endif
+
+/**
+ * load_be64 - Read eight bytes as a big-endian integer
+ * @param p The bytes, not necessarily aligned
+ * @return The integer
+ */
+static inline uint64_t load_be64(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/**
+ * store_be32 - Write an integer as four big-endian bytes
+ * @param p Where the bytes go, not necessarily aligned
+ * @param value The integer
+ */
+static inline void store_be32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(value >> (24 - 8 * i));
+}
+
+/**
+ * count_bytes - Shared loop of the count kernels
+ * The bytes are counted and checksummed from the same loads, eight at a
+ * time.
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param freq Where the occurrences of every byte are added
+ * @param hw Whether to use the crc32 instruction
+ * @return The CRC-32C of the bytes
+ */
+__attribute__((always_inline)) static inline uint32_t
+count_bytes(const unsigned char *data, size_t len, uint64_t freq[SYMBOLS],
+            bool hw)
+{
+    const uint32_t(*tables)[256] = hw ? NULL : crc32c_tables();
+    uint32_t crc = ~0u;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word = load_le64(data + i);
+        crc = hw ? crc32c_word_hw(crc, word) : crc32c_word(tables, crc, word);
+        for (int byte = 0; byte < 8; byte++)
+            freq[word >> (8 * byte) & 0xff]++;
+    }
+    for (; i < len; i++) {
+        crc = hw ? crc32c_byte_hw(crc, data[i])
+                 : crc32c_byte(tables, crc, data[i]);
+        freq[data[i]]++;
+    }
+    return ~crc;
+}
+
+/**
+ * pack_codes - Shared loop of the pack kernels
+ * @param code The code
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param out Room for len * MAX_CODE_LEN / 8 + 8 bytes
+ * @return The number of bytes written
+ */
+__attribute__((always_inline)) static inline size_t
+pack_codes(const HuffmanCode *code, const unsigned char *data, size_t len,
+           unsigned char *out)
+{
+    // the accumulator never holds more than 31 + MAX_CODE_LEN pending bits,
+    // and gives them up four bytes at a time
+    unsigned char *p = out;
+    uint64_t pending = 0;
+    int pending_bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        pending = pending << code->lengths[data[i]] | code->codes[data[i]];
+        pending_bits += code->lengths[data[i]];
+        if (pending_bits >= 32) {
+            pending_bits -= 32;
+            store_be32(p, (uint32_t)(pending >> pending_bits));
+            p += 4;
+        }
+    }
+    for (; pending_bits >= 8; pending_bits -= 8)
+        *p++ = (unsigned char)(pending >> (pending_bits - 8));
+    if (pending_bits > 0)
+        *p++ = (unsigned char)(pending << (8 - pending_bits));
+    return (size_t)(p - out);
+}
+
+/**
+ * unpack_codes - Shared loop of the unpack kernels
+ * @param code The code
+ * @param in The packed codes
+ * @param in_len The length of the packed codes
+ * @param out Room for len bytes
+ * @param len The number of bytes to decode
+ * @param checksum Where the CRC-32C of the bytes goes
+ * @param hw Whether to use the crc32 instruction
+ * @return 0 on success, -1 if a code is invalid or the input runs out
+ */
+__attribute__((always_inline)) static inline int
+unpack_codes(const HuffmanCode *code, const unsigned char *in, size_t in_len,
+             unsigned char *out, size_t len, uint32_t *checksum, bool hw)
+{
+    // bits are kept left-aligned in bits, available counts the valid ones;
+    // every eight bytes decoded are checksummed while still in L1
+    const uint32_t(*tables)[256] = hw ? NULL : crc32c_tables();
+    const unsigned char *in_end = in + in_len;
+    uint64_t bits = 0;
+    int available = 0;
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; i++) {
+        if (available < MAX_CODE_LEN) {
+            if (in_end - in >= 8) {
+                // whole bytes are taken, the bits below them are the next
+                // ones of the input, so loading them again changes nothing
+                bits |= load_be64(in) >> available;
+                in += (63 - available) >> 3;
+                available |= 56;
+            } else {
+                while (available <= 56 && in < in_end) {
+                    bits |= (uint64_t)*in++ << (56 - available);
+                    available += 8;
+                }
+            }
+        }
+
+        int code_len = 0;
+        int symbol = decode_symbol(code, bits, &code_len);
+        if (symbol < 0 || code_len > available)
+            return -1;
+        out[i] = (unsigned char)symbol;
+        bits <<= code_len;
+        available -= code_len;
+        if ((i & 7) == 7) {
+            uint64_t word = load_le64(out + i - 7);
+            crc = hw ? crc32c_word_hw(crc, word)
+                     : crc32c_word(tables, crc, word);
+        }
+    }
+    for (size_t i = len & ~(size_t)7; i < len; i++)
+        crc = hw ? crc32c_byte_hw(crc, out[i])
+                 : crc32c_byte(tables, crc, out[i]);
+    *checksum = ~crc;
+    return 0;
+}
+
+/**
+ * crc_bytes - Shared loop of the checksum kernels
+ * @param crc The CRC of the data before this one, 0 to start
+ * @param data The data
+ * @param data_len The length of the data
+ * @param hw Whether to use the crc32 instruction
+ * @return The CRC of everything so far
+ */
+__attribute__((always_inline)) static inline uint32_t
+crc_bytes(uint32_t crc, const void *data, size_t data_len, bool hw)
+{
+    const uint32_t(*tables)[256] = hw ? NULL : crc32c_tables();
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for (; data_len >= 8; data_len -= 8, bytes += 8) {
+        uint64_t word = load_le64(bytes);
+        crc = hw ? crc32c_word_hw(crc, word) : crc32c_word(tables, crc, word);
+    }
+    for (; data_len > 0; data_len--, bytes++)
+        crc = hw ? crc32c_byte_hw(crc, *bytes)
+                 : crc32c_byte(tables, crc, *bytes);
+    return ~crc;
+}
+
+/**
+ * count_scalar - Count and checksum bytes in portable C
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param freq Where the occurrences of every byte are added
+ * @return The CRC-32C of the bytes
+ */
+static uint32_t count_scalar(const unsigned char *data, size_t len,
+                             uint64_t freq[SYMBOLS])
+{
+    return count_bytes(data, len, freq, false);
+}
+
+/**
+ * pack_scalar - Pack codes in portable C
+ * @param code The code
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param out Room for len * MAX_CODE_LEN / 8 + 8 bytes
+ * @return The number of bytes written
+ */
+static size_t pack_scalar(const HuffmanCode *code, const unsigned char *data,
+                          size_t len, unsigned char *out)
+{
+    return pack_codes(code, data, len, out);
+}
+
+/**
+ * unpack_scalar - Decode and checksum bytes in portable C
+ * @param code The code
+ * @param in The packed codes
+ * @param in_len The length of the packed codes
+ * @param out Room for len bytes
+ * @param len The number of bytes to decode
+ * @param checksum Where the CRC-32C of the bytes goes
+ * @return 0 on success, -1 if a code is invalid or the input runs out
+ */
+static int unpack_scalar(const HuffmanCode *code, const unsigned char *in,
+                         size_t in_len, unsigned char *out, size_t len,
+                         uint32_t *checksum)
+{
+    return unpack_codes(code, in, in_len, out, len, checksum, false);
+}
+
+/**
+ * crc32c_scalar - CRC-32C with the slicing-by-8 tables
+ * @param crc The CRC of the data before this one, 0 to start
+ * @param data The data
+ * @param data_len The length of the data
+ * @return The CRC of everything so far
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const void *data, size_t data_len)
+{
+    return crc_bytes(crc, data, data_len, false);
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * count_sse42 - Count bytes, checksumming them with the crc32 instruction
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param freq Where the occurrences of every byte are added
+ * @return The CRC-32C of the bytes
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+count_sse42(const unsigned char *data, size_t len, uint64_t freq[SYMBOLS])
+{
+    return count_bytes(data, len, freq, true);
+}
+
+/**
+ * unpack_sse42 - Decode bytes, checksumming them with the crc32
+ * instruction
+ * @param code The code
+ * @param in The packed codes
+ * @param in_len The length of the packed codes
+ * @param out Room for len bytes
+ * @param len The number of bytes to decode
+ * @param checksum Where the CRC-32C of the bytes goes
+ * @return 0 on success, -1 if a code is invalid or the input runs out
+ */
+__attribute__((target("sse4.2"))) static int
+unpack_sse42(const HuffmanCode *code, const unsigned char *in, size_t in_len,
+             unsigned char *out, size_t len, uint32_t *checksum)
+{
+    return unpack_codes(code, in, in_len, out, len, checksum, true);
+}
+
+/**
+ * crc32c_sse42 - CRC-32C with the crc32 instruction
+ * @param crc The CRC of the data before this one, 0 to start
+ * @param data The data
+ * @param data_len The length of the data
+ * @return The CRC of everything so far
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const void *data, size_t data_len)
+{
+    return crc_bytes(crc, data, data_len, true);
+}
+
+/**
+ * pack_bmi2 - Pack codes with BMI2 shifts
+ * @param code The code
+ * @param data The bytes
+ * @param len The number of bytes
+ * @param out Room for len * MAX_CODE_LEN / 8 + 8 bytes
+ * @return The number of bytes written
+ */
+__attribute__((target("bmi2,sse4.2"))) static size_t
+pack_bmi2(const HuffmanCode *code, const unsigned char *data, size_t len,
+          unsigned char *out)
+{
+    return pack_codes(code, data, len, out);
+}
+
+/**
+ * unpack_bmi2 - Decode bytes with BMI2 shifts and checksum them
+ * @param code The code
+ * @param in The packed codes
+ * @param in_len The length of the packed codes
+ * @param out Room for len bytes
+ * @param len The number of bytes to decode
+ * @param checksum Where the CRC-32C of the bytes goes
+ * @return 0 on success, -1 if a code is invalid or the input runs out
+ */
+__attribute__((target("bmi2,sse4.2"))) static int
+unpack_bmi2(const HuffmanCode *code, const unsigned char *in, size_t in_len,
+            unsigned char *out, size_t len, uint32_t *checksum)
+{
+    return unpack_codes(code, in, in_len, out, len, checksum, true);
+}
+#endif
+
+static const Kernels variants[VARIANT_COUNT] = {
+    [VARIANT_SCALAR] = {"scalar", &count_scalar, &pack_scalar, &unpack_scalar,
+                        &crc32c_scalar},
+#ifdef HAVE_X86_KERNELS
+    [VARIANT_SSE42] = {"sse4.2", &count_sse42, &pack_scalar, &unpack_sse42,
+                       &crc32c_sse42},
+    [VARIANT_BMI2] = {"bmi2", &count_sse42, &pack_bmi2, &unpack_bmi2,
+                      &crc32c_sse42},
+#endif
+};
+
+static const Kernels *selected;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+/**
+ * cpu_runs - Check whether this CPU has the instructions of a variant
+ * @param variant The variant
+ * @return true if its kernels can run here
+ */
+static bool cpu_runs(enum VARIANT variant)
+{
+    if (variant == VARIANT_SCALAR)
+        return true;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (variant == VARIANT_SSE42)
+        return __builtin_cpu_supports("sse4.2");
+    if (variant == VARIANT_BMI2)
+        return __builtin_cpu_supports("sse4.2") &&
+               __builtin_cpu_supports("bmi2");
+#endif
+    return false;
+}
+
+/**
+ * best_variant - The most capable variant this CPU runs
+ * @return The variant
+ */
+static enum VARIANT best_variant(void)
+{
+    int variant = VARIANT_COUNT - 1;
+    while (variant > VARIANT_SCALAR && !cpu_runs((enum VARIANT)variant))
+        variant--;
+    return (enum VARIANT)variant;
+}
+
+/**
+ * detect_kernels - Pick the best kernels on first use
+ */
+static void detect_kernels(void)
+{
+    __atomic_store_n(&selected, &variants[best_variant()], __ATOMIC_RELEASE);
+}
+
+const Kernels *kernels(void)
+{
+    pthread_once(&detect_once, &detect_kernels);
+    return __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+}
+
+int select_kernels(const char *name)
+{
+    pthread_once(&detect_once, &detect_kernels);
+    int variant = strcmp(name, "auto") == 0 ? (int)best_variant() : -1;
+    for (int i = 0; i < VARIANT_COUNT && variant < 0; i++) {
+        if (variants[i].name != NULL && strcmp(name, variants[i].name) == 0)
+            variant = i;
+    }
+    if (variant < 0 || !cpu_runs((enum VARIANT)variant))
+        return -1;
+    __atomic_store_n(&selected, &variants[variant], __ATOMIC_RELEASE);
+    return 0;
+}
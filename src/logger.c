@@ -1,35 +1,266 @@
+#define _GNU_SOURCE
 #include "../include/logger.h"
 #include "../include/utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-static void info_logger(const char *msg, const char *filename, const int line)
+#define LOG_RING_SLOTS 512
+#define LOG_RECORD_TEXT 240
+#define LOG_STAMP_SIZE 48
+#define LOG_IDLE_MIN_NS 1000000L
+#define LOG_IDLE_MAX_NS 50000000L
+
+typedef struct LogRecord LogRecord;
+struct LogRecord {
+    struct timespec at;
+    enum LOG_LEVEL level;
+    const char *file;
+    int line;
+    size_t msg_len;
+    char text[LOG_RECORD_TEXT];
+};
+
+// single producer (the owning thread), single consumer (whoever holds
+// drain_lock); both indices only grow and are masked on use
+struct LogRing {
+    size_t head;
+    size_t tail;
+    LogRing *next;
+    LogRecord slots[LOG_RING_SLOTS];
+};
+
+static const char *const level_names[] = {"debug", "info", "warn", "error",
+                                          "off"};
+static Logger *shared_logger;
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread LogRing *local_ring;
+
+/**
+ * local - Get the calling thread's ring, registering it on first use
+ * Rings are never freed, the threads that log live as long as the process.
+ * @param self Logger object
+ * @return The ring
+ */
+static LogRing *local(Logger *self)
+{
+    if (local_ring != NULL)
+        return local_ring;
+
+    LogRing *ring = must_calloc(1, sizeof(LogRing));
+    ring->next = __atomic_load_n(&self->rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&self->rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    local_ring = ring;
+    return ring;
+}
+
+/**
+ * log_write - Queue a record on the calling thread's ring
+ * Formatting the timestamp and writing the line are left to the background
+ * writer. A full ring drops the record rather than block the caller.
+ * @param self Logger object
+ * @param level Severity of the record
+ * @param file Source file of the call site
+ * @param line Source line of the call site
+ * @param msg Message
+ * @param fields printf-style key=value fields, or NULL
+ */
+void log_write(Logger *self, enum LOG_LEVEL level, const char *file, int line,
+               const char *msg, const char *fields, ...)
+{
+    LogRing *ring = local(self);
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        LOG_RING_SLOTS) {
+        __atomic_add_fetch(&self->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->slots[tail % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME, &record->at);
+    record->level = level;
+    record->file = file;
+    record->line = line;
+    record->msg_len = strnlen(msg, LOG_RECORD_TEXT - 2);
+    memcpy(record->text, msg, record->msg_len);
+    record->text[record->msg_len] = '\0';
+    char *rest = record->text + record->msg_len + 1;
+    size_t rest_size = LOG_RECORD_TEXT - record->msg_len - 1;
+    *rest = '\0';
+    if (fields != NULL) {
+        va_list args;
+        va_start(args, fields);
+        vsnprintf(rest, rest_size, fields, args);
+        va_end(args);
+    }
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * format_time - Format a timestamp, redoing the calendar math once a second
+ * Only called with drain_lock held.
+ * @param at The timestamp
+ * @param out Buffer of LOG_STAMP_SIZE bytes
+ */
+static void format_time(const struct timespec *at, char *out)
+{
+    static time_t cached_second = -1;
+    static char cached[24];
+    if (at->tv_sec != cached_second) {
+        struct tm tm;
+        gmtime_r(&at->tv_sec, &tm);
+        strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%S", &tm);
+        cached_second = at->tv_sec;
+    }
+    snprintf(out, LOG_STAMP_SIZE, "%s.%03dZ", cached,
+             (int)(at->tv_nsec / 1000000L));
+}
+
+/**
+ * drain - Write out every queued record
+ * Debug and info records go to stdout, unless stderr_only is set, warnings
+ * and errors to stderr.
+ * @param self Logger object
+ * @return Number of records written
+ */
+static size_t drain(Logger *self)
 {
-    time_t now;
-    time(&now);
-    fprintf(stdout, "%s [INFO] %s:%d %s\n", ctime(&now), filename, line, msg);
+    size_t written = 0;
+    char stamp[LOG_STAMP_SIZE];
+    pthread_mutex_lock(&drain_lock);
+    int stderr_only = __atomic_load_n(&self->stderr_only, __ATOMIC_RELAXED);
+    for (LogRing *ring = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const LogRecord *record = &ring->slots[head % LOG_RING_SLOTS];
+            const char *fields = record->text + record->msg_len + 1;
+            format_time(&record->at, stamp);
+            fprintf(record->level >= LOG_LEVEL_WARN || stderr_only
+                        ? stderr
+                        : stdout,
+                    "ts=%s level=%s src=%s:%d msg=\"%s\"%s%s\n", stamp,
+                    level_names[record->level], record->file, record->line,
+                    record->text, *fields ? " " : "", fields);
+            written++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_exchange_n(&self->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        format_time(&now, stamp);
+        fprintf(stderr,
+                "ts=%s level=warn src=%s:%d msg=\"Log records dropped\" "
+                "count=%llu\n",
+                stamp, __FILE__, __LINE__, (unsigned long long)dropped);
+    }
+    if (written > 0 || dropped > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return written;
 }
 
-static void warn_logger(const char *msg, const char *filename, const int line)
+/**
+ * flush - Write out every queued record before returning
+ * @param self Logger object
+ */
+static void flush(Logger *self)
 {
-    time_t now;
-    time(&now);
-    fprintf(stderr, "%s [WARN] %s:%d %s\n", ctime(&now), filename, line, msg);
+    drain(self);
+}
+
+/**
+ * flush_at_exit - Keep the records queued before exit() from being lost
+ */
+static void flush_at_exit(void)
+{
+    flush(shared_logger);
+}
+
+/**
+ * writer - Background thread draining the rings
+ * It backs off while there is nothing to write, so an idle process costs at
+ * most a wakeup every LOG_IDLE_MAX_NS.
+ * @param arg Logger object
+ * @return NULL
+ */
+static void *writer(void *arg)
+{
+    Logger *self = arg;
+    long idle_ns = LOG_IDLE_MIN_NS;
+    for (;;) {
+        if (drain(self) > 0) {
+            idle_ns = LOG_IDLE_MIN_NS;
+            continue;
+        }
+        struct timespec pause = {0, idle_ns};
+        nanosleep(&pause, NULL);
+        if (idle_ns < LOG_IDLE_MAX_NS)
+            idle_ns *= 2;
+    }
+    return NULL;
+}
+
+/**
+ * create_logger - Create the process-wide logger and its writer thread
+ */
+static void create_logger(void)
+{
+    Logger *self = must_calloc(1, sizeof(Logger));
+    self->level = LOG_LEVEL_INFO;
+    self->rings = NULL;
+    self->dropped = 0;
+    self->stderr_only = 0;
+    self->flush = &flush;
+    shared_logger = self;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &writer, self) != 0) {
+        perror("Error creating log writer");
+        exit(1);
+    }
+    pthread_detach(thread);
+    atexit(&flush_at_exit);
+    LOG_DEBUG(self, "Logger initialized");
 }
 
-static void error_logger(const char *msg, const char *filename, const int line)
+/**
+ * parse_log_level - Look up a level by name
+ * @param name One of debug, info, warn, error or off
+ * @param level Where the level goes
+ * @return 0 on success, -1 if the name is unknown
+ */
+int parse_log_level(const char *name, enum LOG_LEVEL *level)
 {
-    time_t now;
-    time(&now);
-    fprintf(stderr, "%s [ERROR] %s:%d %s\n", ctime(&now), filename, line, msg);
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (enum LOG_LEVEL)i;
+            return 0;
+        }
+    }
+    return -1;
 }
 
+/**
+ * init_logger - Get the process-wide logger
+ * Every caller shares one set of rings and one writer thread.
+ * @param self Where the logger goes
+ */
 void init_logger(Logger **self)
 {
-    *self = (Logger *)must_calloc(1, sizeof(Logger));
-    (*self)->info_log = &info_logger;
-    (*self)->warn_log = &warn_logger;
-    (*self)->error_log = &error_logger;
-    (*self)->info_log("Logger initialized", __FILE__, __LINE__);
+    pthread_once(&logger_once, &create_logger);
+    *self = shared_logger;
 }
@@ -1,56 +1,788 @@
+#include "../include/adaptive.h"
+#include "../include/archive.h"
+#include "../include/batch.h"
+#include "../include/block.h"
+#include "../include/cancel.h"
 #include "../include/config.h"
+#include "../include/context.h"
+#include "../include/kernels.h"
+#include "../include/metrics.h"
 #include "../include/node.h"
 #include "../include/server.h"
+#include "../include/shm.h"
+#include "../include/sink.h"
+#include "../include/stream.h"
 #include "../include/tree.h"
 #include "../include/utils.h"
-#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define SERVER_PORT 8000
-#define BUFFER_SIZE 8192
 #define MAX_CLIENT_MSG_SIZE 4096
 #define MAX_HEADER_LINE_SIZE 1024
+#define DECODE_SLICE (64 * 1024)
+#define RETRY_AFTER "Retry-After: 1\r\n"
+// a result kept compressed by --store-compressed is stored under its name
+// plus this suffix
+#define STORED_SUFFIX ".stored"
+// names stdin as the input, or stdout as the output, of the cli
+#define STDIO_NAME "-"
 
-void compress(HuffmanTree *tree, const char *const output_file, char *raw_data,
-              size_t raw_len)
+/**
+ * compress - Compress data into the block format
+ * @param out Where the compressed data goes
+ * @param raw_data The data
+ * @param raw_len The length of the data
+ * @param cancel Checked between blocks to abort the run
+ * @param stats Where the stage timings and output length go
+ * @return 0 on success, -1 if cancelled or the sink failed
+ */
+int compress(Sink *out, const char *raw_data, size_t raw_len,
+             CancelToken *cancel, CodecStats *stats)
+{
+    Logger *logger;
+    init_logger(&logger);
+    LOG_DEBUGF(logger, "Start compressing", "bytes=%zu", raw_len);
+    int status = block_compress(codec_context(), out, raw_data, raw_len,
+                                DEFAULT_BLOCK_SIZE, cancel, stats);
+    LOG_INFOF(logger, status == 0 ? "Done compressing" : "Compression aborted",
+              "bytes_in=%zu bytes_out=%zu", raw_len, stats->output_len);
+    return status;
+}
+
+/**
+ * decompress_legacy - Decompress a file written before the block format
+ * @param context Whose tree is rebuilt from the header and whose buffer
+ * holds a slice
+ * @param out Where the original data goes
+ * @param raw_data The compressed file
+ * @param raw_len The length of the file
+ * @param cancel Checked between slices to abort the run
+ * @param stats Where the stage timings and output length go
+ * @return 0 on success, -1 if the header is malformed, undecodable data is
+ * left over, the run was cancelled or the sink failed
+ */
+static int decompress_legacy(CodecContext *context, Sink *out, char *raw_data,
+                             const size_t raw_len, CancelToken *cancel,
+                             CodecStats *stats)
+{
+    double started = monotonic_seconds();
+    HuffmanTree *tree = context->tree;
+    const char *encoded_data = tree->read_header(tree, raw_data, raw_len);
+    if (encoded_data == NULL)
+        return -1;
+    size_t encoded_len = raw_len - (size_t)(encoded_data - raw_data);
+    double lap = monotonic_seconds();
+    stats->stage[STAGE_HEADER] = lap - started;
+
+    // decode slice by slice so the output is streamed while it is produced
+    char *decoded_data = (char *)reserve(&context->buffer,
+                                         &context->buffer_room, DECODE_SLICE);
+    int status = 0;
+    for (size_t i = 0; i < encoded_len && status == 0;) {
+        if (cancel->is_cancelled(cancel)) {
+            status = -1;
+            break;
+        }
+        size_t consumed = 0;
+        size_t decoded_len =
+            tree->decode_slice(tree, encoded_data + i, encoded_len - i,
+                               decoded_data, DECODE_SLICE, &consumed);
+        if (consumed == 0) {
+            // a code cut short, or bytes that aren't codes at all
+            status = -1;
+            break;
+        }
+        i += consumed;
+        stats->output_len += decoded_len;
+        status = out->write(out, decoded_data, decoded_len);
+    }
+    stats->stage[STAGE_DECODE] = monotonic_seconds() - lap;
+    return status;
+}
+
+/**
+ * decompress - Decompress a block-format or adaptive file, or one in the
+ * legacy format
+ * @param out Where the original data goes
+ * @param raw_data The compressed file
+ * @param raw_len The length of the file
+ * @param cancel Checked between blocks to abort the run
+ * @param stats Where the stage timings and output length go
+ * @return 0 on success, -1 if malformed, cancelled or the sink failed
+ */
+int decompress(Sink *out, char *raw_data, const size_t raw_len,
+               CancelToken *cancel, CodecStats *stats)
+{
+    Logger *logger;
+    init_logger(&logger);
+    LOG_DEBUGF(logger, "Start decompressing", "bytes=%zu", raw_len);
+    CodecContext *context = codec_context();
+    int status;
+    if (is_block_file(raw_data, raw_len)) {
+        status =
+            block_decompress(context, out, raw_data, raw_len, cancel, stats);
+    } else if (is_adaptive_file(raw_data, raw_len)) {
+        status = adaptive_decompress(context, out, raw_data, raw_len, cancel,
+                                     stats);
+    } else {
+        status =
+            decompress_legacy(context, out, raw_data, raw_len, cancel, stats);
+    }
+    LOG_INFOF(logger,
+              status == 0 ? "Done decompressing" : "Decompression aborted",
+              "bytes_in=%zu bytes_out=%zu", raw_len, stats->output_len);
+    return status;
+}
+
+/**
+ * shm_client_mode - run a cli job on a server through its shared segment
+ * The input is read straight into a slot of the segment and the output is
+ * written from the same slot.
+ * @config: The config object
+ */
+static void shm_client_mode(Config *config)
+{
+    Logger *logger;
+    init_logger(&logger);
+    ShmClient *client = open_shm_client(config->shm_name);
+    if (client == NULL) {
+        perror("Error opening shared memory segment");
+        exit(1);
+    }
+    int fd = open(config->input_file, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror("Error opening input file");
+        exit(1);
+    }
+
+    size_t capacity = 0;
+    char *data = client->acquire(client, &capacity);
+    size_t input_len = (size_t)file_stat.st_size;
+    if (input_len > capacity) {
+        LOG_ERRORF(logger, "Input too large for the segment",
+                   "bytes=%zu slot_size=%zu", input_len, capacity);
+        client->release(client, data);
+        exit(1);
+    }
+    for (size_t done = 0; done < input_len;) {
+        ssize_t got = read(fd, data + done, input_len - done);
+        if (got <= 0) {
+            perror("Error reading input file");
+            client->release(client, data);
+            exit(1);
+        }
+        done += (size_t)got;
+    }
+    close(fd);
+
+    size_t output_len = 0;
+    enum SHM_STATE state =
+        client->call(client, data, config->mode, input_len, &output_len);
+    if (state == SHM_DONE) {
+        Sink *out = new_file_sink(config->output_file);
+        if (out == NULL) {
+            perror("Error opening output file");
+            exit(1);
+        }
+        int status = out->write(out, data, output_len);
+        if (out->close(out) != 0 || status != 0)
+            state = SHM_FAILED;
+    }
+    if (state == SHM_DONE) {
+        LOG_INFOF(logger, "Done through shared memory",
+                  "bytes_in=%zu bytes_out=%zu", input_len, output_len);
+    } else if (state == SHM_TOO_LARGE) {
+        LOG_ERRORF(logger, "Output too large for the segment",
+                   "bytes=%zu slot_size=%zu", output_len, capacity);
+    } else {
+        LOG_ERROR(logger, "Failed to write output");
+    }
+    client->release(client, data);
+    client->close(client);
+    if (state != SHM_DONE)
+        exit(1);
+}
+
+typedef struct StreamDecoder StreamDecoder;
+/**
+ * StreamDecoder - decompresses a file arriving through a pipe
+ * Block-format files are decoded a block at a time as they come, adaptive
+ * files a frame at a time. A file in the legacy format can only be decoded
+ * whole, so it is collected first.
+ */
+struct StreamDecoder {
+    Sink base;
+    Sink *out;
+    Sink *inner; // chosen once the magic has arrived
+    bool legacy;
+    char magic[4];
+    size_t magic_len;
+    char *legacy_data;
+    size_t legacy_len;
+};
+
+/**
+ * choose_decoder - Pick the decoder matching the magic of the file
+ * @param decoder Stream decoder
+ * @return 0 on success, -1 if the decoder failed
+ */
+static int choose_decoder(StreamDecoder *decoder)
+{
+    bool whole = decoder->magic_len == sizeof(decoder->magic);
+    if (whole && memcmp(decoder->magic, BLOCK_MAGIC, 4) == 0) {
+        decoder->inner = new_block_decode_sink(decoder->out);
+    } else if (whole && memcmp(decoder->magic, ADAPTIVE_MAGIC, 4) == 0) {
+        decoder->inner = new_adaptive_decode_sink(decoder->out);
+    } else {
+        decoder->legacy = true;
+        decoder->inner =
+            new_buffer_sink(&decoder->legacy_data, &decoder->legacy_len);
+    }
+    return decoder->inner->write(decoder->inner, decoder->magic,
+                                 decoder->magic_len);
+}
+
+/**
+ * stream_decoder_write - Hand compressed data to the decoder
+ * @param self Stream decoder
+ * @param data Compressed data
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the decoder has failed
+ */
+static int stream_decoder_write(Sink *self, const char *data,
+                                const size_t data_len)
+{
+    StreamDecoder *decoder = (StreamDecoder *)self;
+    size_t skip = 0;
+    if (decoder->inner == NULL) {
+        size_t room = sizeof(decoder->magic) - decoder->magic_len;
+        skip = data_len < room ? data_len : room;
+        memcpy(decoder->magic + decoder->magic_len, data, skip);
+        decoder->magic_len += skip;
+        if (decoder->magic_len < sizeof(decoder->magic))
+            return 0;
+        if (choose_decoder(decoder) != 0)
+            return -1;
+    }
+    return decoder->inner->write(decoder->inner, data + skip,
+                                 data_len - skip);
+}
+
+/**
+ * stream_decoder_close - Finish decoding and free the decoder, closing the
+ * sink of the output
+ * @param self Stream decoder
+ * @return 0 on success, -1 if the file was malformed or any write failed
+ */
+static int stream_decoder_close(Sink *self)
+{
+    StreamDecoder *decoder = (StreamDecoder *)self;
+    int status = 0;
+    if (decoder->inner == NULL)
+        status = choose_decoder(decoder);
+    if (decoder->inner->close(decoder->inner) != 0)
+        status = -1;
+    if (decoder->legacy) {
+        CancelToken *cancel;
+        init_cancel_token(&cancel, -1);
+        CodecStats stats = {0};
+        if (status == 0)
+            status = decompress(decoder->out, decoder->legacy_data,
+                                decoder->legacy_len, cancel, &stats);
+        if (decoder->out->close(decoder->out) != 0)
+            status = -1;
+        free(cancel);
+        free(decoder->legacy_data);
+    }
+    free(decoder);
+    return status;
+}
+
+/**
+ * new_stream_decoder - create a sink decompressing what is written to it
+ * @param out Where the original data goes, closed along with the decoder
+ * @return A new sink
+ */
+static Sink *new_stream_decoder(Sink *out)
+{
+    StreamDecoder *decoder = must_calloc(1, sizeof(StreamDecoder));
+    decoder->base.write = &stream_decoder_write;
+    decoder->base.close = &stream_decoder_close;
+    decoder->out = out;
+    return &decoder->base;
+}
+
+/**
+ * open_output - Open the output of the cli, written by a thread of its own
+ * @param path The output file, or STDIO_NAME for stdout
+ * @return A new sink
+ */
+static Sink *open_output(const char *path)
+{
+    Sink *out;
+    if (strcmp(path, STDIO_NAME) == 0) {
+        Logger *logger;
+        init_logger(&logger);
+        __atomic_store_n(&logger->stderr_only, 1, __ATOMIC_RELAXED);
+        out = new_fd_sink(STDOUT_FILENO);
+    } else {
+        out = new_file_sink(path);
+    }
+    if (out == NULL) {
+        perror("Error opening output file");
+        exit(1);
+    }
+    return new_async_sink(out);
+}
+
+/**
+ * stream_mode - run a cli job reading stdin or writing stdout, or compressing
+ * with --adaptive
+ * Reading, coding and writing each run on their own thread, with a few
+ * chunks in flight between them, so memory stays bounded however long the
+ * stream is. With --adaptive every read is compressed and written out at
+ * once rather than when a block fills up.
+ * @config: The config object
+ */
+static void stream_mode(Config *config)
+{
+    Logger *logger;
+    init_logger(&logger);
+    bool from_stdin = strcmp(config->input_file, STDIO_NAME) == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(config->input_file, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening input file");
+        exit(1);
+    }
+    Sink *out = open_output(config->output_file);
+    Sink *codec;
+    if (config->mode == DECOMPRESS)
+        codec = new_stream_decoder(out);
+    else if (config->adaptive)
+        codec = new_adaptive_sink(out, config->rebuild_interval);
+    else
+        codec = new_block_sink(out, DEFAULT_BLOCK_SIZE);
+    size_t bytes_in = 0;
+    errno = 0;
+    int status = pump_fd(fd, codec, &bytes_in);
+    if (status != 0 && errno != 0)
+        perror("Error streaming");
+    if (codec->close(codec) != 0)
+        status = -1;
+    if (!from_stdin)
+        close(fd);
+    if (status != 0) {
+        LOG_ERRORF(logger, "Failed to stream output", "bytes_in=%zu",
+                   bytes_in);
+        // stdout has had the blocks before the failure, a file is removed
+        if (strcmp(config->output_file, STDIO_NAME) != 0)
+            unlink(config->output_file);
+        exit(1);
+    }
+    LOG_INFOF(logger, "Done streaming", "bytes_in=%zu", bytes_in);
+}
+
+/**
+ * map_input - Map a file for reading
+ * @param path The file
+ * @param len Where to store the length of the file
+ * @return The mapping, NULL for an empty file; exits if it can't be read
+ */
+static char *map_input(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror("Error opening input file");
+        exit(1);
+    }
+    *len = (size_t)file_stat.st_size;
+    char *data = *len > 0 ? mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping input file");
+        exit(1);
+    }
+    return data;
+}
+
+/**
+ * by_member_name - Order batch files by the name they get in an archive
+ * @param a A file
+ * @param b Another file
+ * @return Like strcmp
+ */
+static int by_member_name(const void *a, const void *b)
 {
-    // read file and generate frequency array
-    tree->logger->info_log("Start compressing", __FILE__, __LINE__);
-    Node **tree_node_arr = must_calloc(raw_len, sizeof(Node *));
+    return strcmp(((const BatchFile *)a)->name, ((const BatchFile *)b)->name);
+}
+
+/**
+ * pack_archive - compress the inputs into one archive
+ * Inputs are collected like those of a batch, and named in the archive like
+ * the outputs of a batch are named in their directory.
+ * @config: The config object
+ */
+static void pack_archive(Config *config)
+{
+    Logger *logger;
+    init_logger(&logger);
+    Batch *batch;
+    init_batch(&batch, COMPRESS, NULL, 1);
+    int status = 0;
+    for (int i = 0; i < config->input_count; i++) {
+        if (batch->add(batch, config->input_files[i]) != 0)
+            status = -1;
+    }
+    qsort(batch->files, batch->count, sizeof(BatchFile), &by_member_name);
+    for (size_t i = 1; i < batch->count; i++) {
+        if (strcmp(batch->files[i - 1].name, batch->files[i].name) == 0) {
+            LOG_ERRORF(logger, "Two inputs would share a member name",
+                       "inputs=%s,%s name=%s", batch->files[i - 1].input,
+                       batch->files[i].input, batch->files[i].name);
+            status = -1;
+        }
+    }
+    if (status != 0)
+        exit(1);
+
+    Sink *out = open_output(config->output_file);
+    ArchiveWriter *writer = new_archive_writer(out);
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    size_t bytes_in = 0, bytes_out = 0;
+    for (size_t i = 0; i < batch->count && status == 0; i++) {
+        size_t len = 0;
+        char *data = map_input(batch->files[i].input, &len);
+        status = writer->add(writer, batch->files[i].name, data, len, cancel);
+        if (data != NULL)
+            munmap(data, len);
+        bytes_in += len;
+    }
+    bytes_out = (size_t)writer->offset;
+    if (writer->finish(writer) != 0)
+        status = -1;
+    free(cancel);
+    if (status != 0) {
+        LOG_ERROR(logger, "Failed to write archive");
+        exit(1);
+    }
+    LOG_INFOF(logger, "Done packing", "members=%zu bytes_in=%zu bytes_out=%zu",
+              batch->count, bytes_in, bytes_out);
+    batch->destroy(batch);
+}
+
+/**
+ * extract_member - decompress a member of an archive into a file
+ * @param archive The archive
+ * @param member The member
+ * @param path The file, STDIO_NAME for stdout
+ * @return 0 on success, -1 on failure
+ */
+static int extract_member(const Archive *archive, const ArchiveMember *member,
+                          const char *path)
+{
+    bool to_stdout = strcmp(path, STDIO_NAME) == 0;
+    if (!to_stdout && make_parent_dirs(path) != 0)
+        return -1;
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    Sink *out = open_output(path);
+    int status = archive_extract(archive, member, out, cancel);
+    if (out->close(out) != 0)
+        status = -1;
+    if (status != 0 && !to_stdout)
+        unlink(path);
+    free(cancel);
+    return status;
+}
+
+/**
+ * unpack_archive - list, or extract one or all members of an archive
+ * Every member is checked against its checksum as it is extracted.
+ * @config: The config object
+ */
+static void unpack_archive(Config *config)
+{
+    Logger *logger;
+    init_logger(&logger);
+    size_t len = 0;
+    char *data = map_input(config->input_file, &len);
+    Archive archive;
+    if (data == NULL || archive_open(&archive, data, len) != 0) {
+        LOG_ERRORF(logger, "Not a valid archive", "path=%s",
+                   config->input_file);
+        exit(1);
+    }
+
+    size_t failed = 0;
+    if (config->list) {
+        for (size_t i = 0; i < archive.count; i++) {
+            const ArchiveMember *member = &archive.members[i];
+            printf("%12zu %12zu  %.*s\n", member->raw_len, member->length,
+                   (int)member->name_len, member->name);
+        }
+    } else if (config->member != NULL) {
+        const ArchiveMember *member = archive_find(&archive, config->member);
+        if (member == NULL) {
+            LOG_ERRORF(logger, "No such member", "name=%s", config->member);
+            failed++;
+        } else if (extract_member(&archive, member, config->output_file)) {
+            LOG_ERRORF(logger, "Failed to extract member", "name=%s",
+                       config->member);
+            failed++;
+        }
+    } else {
+        for (size_t i = 0; i < archive.count; i++) {
+            const ArchiveMember *member = &archive.members[i];
+            size_t path_len =
+                strlen(config->output_file) + member->name_len + 2;
+            char *path = must_calloc(path_len, 1);
+            snprintf(path, path_len, "%s/%.*s", config->output_file,
+                     (int)member->name_len, member->name);
+            if (extract_member(&archive, member, path) != 0) {
+                LOG_ERRORF(logger, "Failed to extract member", "path=%s",
+                           path);
+                failed++;
+            }
+            free(path);
+        }
+        LOG_INFOF(logger, "Done extracting", "members=%zu failed=%zu",
+                  archive.count, failed);
+    }
+    archive_close(&archive);
+    munmap(data, len);
+    if (failed > 0)
+        exit(1);
+}
+
+/**
+ * is_archive_file - check whether a file is an archive
+ * @param path The file
+ * @return true if it starts with the archive magic
+ */
+static bool is_archive_file(const char *path)
+{
+    char head[ARCHIVE_HEADER_LEN];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    ssize_t got = read(fd, head, sizeof(head));
+    close(fd);
+    return got > 0 && is_archive(head, (size_t)got);
+}
+
+/**
+ * discard_write - Drop decoded data that is only checked
+ * @param self The sink
+ * @param data The data
+ * @param data_len The length of the data
+ * @return 0
+ */
+static int discard_write(Sink *self, const char *data, const size_t data_len)
+{
+    (void)self;
+    (void)data;
+    (void)data_len;
+    return 0;
+}
+
+/**
+ * VerifyReport - what checking a compressed file found
+ */
+typedef struct VerifyReport {
+    const char *format; // "block", "adaptive" or "archive", NULL otherwise
+    size_t bytes_out;   // original bytes decoded
+    size_t members;     // members of an archive
+    size_t corrupt;     // members of an archive that failed
+    double seconds;
+} VerifyReport;
 
-    // build tree and calculate code table
-    tree->gen_freq_arr(tree, tree_node_arr, raw_data, raw_len);
-    tree->build_tree(tree, tree_node_arr, raw_len);
+/**
+ * verify_data - Decode a compressed file without keeping the output, and
+ * check it against its lengths and checksums
+ * Legacy files carry neither, and can't be told from any other file, so
+ * only block-format files, adaptive files and archives are checked.
+ * @param path Name of the file, for the report of corrupt members
+ * @param data The file
+ * @param len The length of the file
+ * @param threads Number of blocks decoded at once
+ * @param cancel Checked between blocks to abort the run
+ * @param report Where the findings go
+ * @return 0 if the file checked out, -1 otherwise
+ */
+static int verify_data(const char *path, const char *data, size_t len,
+                       int threads, CancelToken *cancel, VerifyReport *report)
+{
+    Logger *logger;
+    init_logger(&logger);
+    memset(report, 0, sizeof(*report));
+    double started = monotonic_seconds();
+    int status = -1;
+    if (is_archive(data, len)) {
+        report->format = "archive";
+        Archive archive;
+        if (archive_open(&archive, data, len) != 0)
+            return -1;
+        bool *corrupt = must_calloc(archive.count + 1, sizeof(bool));
+        status = archive_verify(&archive, threads, cancel, corrupt);
+        report->members = archive.count;
+        for (size_t i = 0; i < archive.count; i++) {
+            const ArchiveMember *member = &archive.members[i];
+            if (corrupt[i]) {
+                LOG_WARNF(logger, "Corrupt member", "path=%s name=%.*s", path,
+                          (int)member->name_len, member->name);
+                report->corrupt++;
+            } else {
+                report->bytes_out += member->raw_len;
+            }
+        }
+        free(corrupt);
+        archive_close(&archive);
+    } else if (is_block_file(data, len)) {
+        report->format = "block";
+        BlockCheck check = {.data = data, .data_len = len};
+        status = block_verify(&check, 1, threads, cancel);
+        report->bytes_out = check.raw_len;
+    } else if (is_adaptive_file(data, len)) {
+        // every frame needs the code left by the ones before it, so an
+        // adaptive file is decoded in order on this thread
+        report->format = "adaptive";
+        Sink discard = {.write = &discard_write, .close = NULL};
+        CodecStats stats = {0};
+        status = adaptive_decompress(codec_context(), &discard, data, len,
+                                     cancel, &stats);
+        report->bytes_out = stats.output_len;
+    }
+    report->seconds = monotonic_seconds() - started;
+    return status;
+}
 
-    const char **code_table = tree->cal_code_table(tree, tree_node_arr);
-    char *encoded_data = tree->encode(tree, raw_data, code_table, raw_len);
-    tree->logger->info_log("Done compressing", __FILE__, __LINE__);
+/**
+ * mib_per_second - Rate of a run in MiB/s
+ * @param bytes Bytes handled
+ * @param seconds Time taken
+ * @return The rate, 0 if no time was measured
+ */
+static double mib_per_second(size_t bytes, double seconds)
+{
+    return seconds > 0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0;
+}
 
-    // write encoded header and encoded file to output file
-    size_t encoded_len = strlen(encoded_data);
-    write_header(output_file, code_table, encoded_len, raw_len, tree->size);
-    write_data(output_file, "ab", encoded_data, encoded_len);
+/**
+ * test_mode - check compressed files without writing anything
+ * Inputs are collected like those of a batch; every block of a file is
+ * decoded into scratch buffers by a pool of threads.
+ * @config: The config object
+ */
+static void test_mode(Config *config)
+{
+    Logger *logger;
+    init_logger(&logger);
+    Batch *batch;
+    init_batch(&batch, DECOMPRESS, NULL, 1);
+    size_t failed = 0;
+    for (int i = 0; i < config->input_count; i++) {
+        if (batch->add(batch, config->input_files[i]) != 0)
+            failed++;
+    }
 
-    // print header
-    tree->logger->info_log("Done", __FILE__, __LINE__);
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    size_t bytes_in = 0, bytes_out = 0;
+    double started = monotonic_seconds();
+    for (size_t i = 0; i < batch->count; i++) {
+        const char *path = batch->files[i].input;
+        size_t len = 0;
+        char *data = map_input(path, &len);
+        VerifyReport report;
+        int status = verify_data(path, data, len, config->job_workers,
+                                 cancel, &report);
+        if (data != NULL)
+            munmap(data, len);
+        if (report.format == NULL) {
+            LOG_ERRORF(logger, "Not a block-format or adaptive file or archive",
+                       "path=%s", path);
+            failed++;
+        } else if (status != 0) {
+            LOG_ERRORF(logger, "Failed verification",
+                       "path=%s format=%s members=%zu corrupt=%zu", path,
+                       report.format, report.members, report.corrupt);
+            failed++;
+        } else {
+            LOG_INFOF(logger, "Verified",
+                      "path=%s format=%s bytes_in=%zu bytes_out=%zu "
+                      "seconds=%.3f mib_per_s=%.1f",
+                      path, report.format, len, report.bytes_out,
+                      report.seconds,
+                      mib_per_second(report.bytes_out, report.seconds));
+        }
+        bytes_in += len;
+        bytes_out += report.bytes_out;
+    }
+    double seconds = monotonic_seconds() - started;
+    LOG_INFOF(logger, "Done testing",
+              "files=%zu failed=%zu bytes_in=%zu bytes_out=%zu "
+              "seconds=%.3f mib_per_s=%.1f",
+              batch->count, failed, bytes_in, bytes_out, seconds,
+              mib_per_second(bytes_out, seconds));
+    free(cancel);
+    batch->destroy(batch);
+    if (failed > 0)
+        exit(1);
+}
 
-    // clean up
-    free(encoded_data);
-    for (size_t i = 0; i < tree->size; i++)
-        free((void *)code_table[i]);
+/**
+ * run_batch_file - Run the codec on a file of a batch
+ * @param mode Whether to compress or decompress
+ * @param input The content of the file
+ * @param input_len The length of the content
+ * @param out Where the output goes
+ * @param cancel The cancel token of the batch thread
+ * @param stats Where the stage timings and output length go
+ * @return 0 on success, -1 on failure
+ */
+static int run_batch_file(enum MODE mode, char *input, size_t input_len,
+                          Sink *out, CancelToken *cancel, CodecStats *stats)
+{
+    return mode == COMPRESS
+               ? compress(out, input, input_len, cancel, stats)
+               : decompress(out, input, input_len, cancel, stats);
 }
 
-void decompress(HuffmanTree *tree, const char *const output_file,
-                char *raw_data, const size_t raw_len)
+/**
+ * batch_mode - code several files in one run, on a pool of threads
+ * @config: The config object
+ */
+static void batch_mode(Config *config)
 {
-    tree->logger->info_log("Start decompressing", __FILE__, __LINE__);
-    size_t decoded_len = 0;
-    char *decoded_data = tree->decode(tree, raw_data, &decoded_len, raw_len);
-    write_data(output_file, "wb", decoded_data, decoded_len);
-    tree->logger->info_log("Done decompressing", __FILE__, __LINE__);
+    if (config->shm_name != NULL) {
+        fprintf(stderr, "Error: --shm takes a single input file\n");
+        exit(1);
+    }
+    Batch *batch;
+    init_batch(&batch, config->mode, config->output_file,
+               config->job_workers);
+    batch->run = &run_batch_file;
+    int status = 0;
+    for (int i = 0; i < config->input_count; i++) {
+        if (batch->add(batch, config->input_files[i]) != 0)
+            status = -1;
+    }
+    if (status == 0)
+        status = batch->start(batch);
+    batch->destroy(batch);
+    if (status != 0)
+        exit(1);
 }
 
 /**
@@ -59,170 +791,901 @@ void decompress(HuffmanTree *tree, const char *const output_file,
  */
 static void cli_mode(Config *config)
 {
-    HuffmanTree *tree = new_huffman_tree();
+    if (config->test) {
+        if (config->shm_name != NULL ||
+            strcmp(config->input_file, STDIO_NAME) == 0) {
+            fprintf(stderr, "Error: --test needs named files\n");
+            exit(1);
+        }
+        test_mode(config);
+        return;
+    }
+    if (config->adaptive) {
+        if (config->mode != COMPRESS || config->archive || config->list ||
+            config->member != NULL || config->shm_name != NULL ||
+            config->input_count > 1 || is_batch_input(config->input_file)) {
+            fprintf(stderr, "Error: --adaptive compresses one file or "
+                            "stream\n");
+            exit(1);
+        }
+        stream_mode(config);
+        return;
+    }
+    bool reads_archive = config->list || config->member != NULL ||
+                         (config->mode == DECOMPRESS &&
+                          config->input_count == 1 &&
+                          is_archive_file(config->input_file));
+    if (config->archive || reads_archive) {
+        if (config->shm_name != NULL) {
+            fprintf(stderr, "Error: --shm can't be used with archives\n");
+            exit(1);
+        }
+        if (reads_archive)
+            unpack_archive(config);
+        else
+            pack_archive(config);
+        return;
+    }
+    if (config->input_count > 1 || is_batch_input(config->input_file)) {
+        batch_mode(config);
+        return;
+    }
+    if (strcmp(config->input_file, STDIO_NAME) == 0 ||
+        strcmp(config->output_file, STDIO_NAME) == 0) {
+        if (config->shm_name != NULL) {
+            fprintf(stderr, "Error: --shm needs named files\n");
+            exit(1);
+        }
+        stream_mode(config);
+        return;
+    }
+    if (config->shm_name != NULL) {
+        shm_client_mode(config);
+        return;
+    }
+    Logger *logger;
+    init_logger(&logger);
     size_t raw_data_len = 0;
     char *raw_data = read_file(config->input_file, &raw_data_len);
-    tree->logger->info_log("Starting CLI mode", __FILE__, __LINE__);
-    (config->mode == COMPRESS)
-        ? compress(tree, config->output_file, raw_data, raw_data_len)
-        : decompress(tree, config->output_file, raw_data, raw_data_len);
-    tree->destroy(&tree);
-    free(tree);
+    Sink *out = new_file_sink(config->output_file);
+    if (out == NULL) {
+        perror("Error opening output file");
+        exit(1);
+    }
+    LOG_INFO(logger, "Starting CLI mode");
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    CodecStats stats = {0};
+    errno = 0;
+    int status =
+        (config->mode == COMPRESS)
+            ? compress(out, raw_data, raw_data_len, cancel, &stats)
+            : decompress(out, raw_data, raw_data_len, cancel, &stats);
+    if (out->close(out) != 0)
+        status = -1;
+    free(cancel);
+    free(raw_data);
+    if (status != 0) {
+        // only I/O errors set errno, the codec fails on malformed input or
+        // a checksum that doesn't match
+        LOG_ERRORF(logger, "Failed to code file",
+                   "input=%s output=%s error=\"%s\"", config->input_file,
+                   config->output_file,
+                   errno ? strerror(errno)
+                         : "malformed input or checksum mismatch");
+        unlink(config->output_file);
+        exit(1);
+    }
+}
+
+/**
+ * produce_result - Write the result of a codec run to a sink and close it
+ * Identical payloads get identical results, so results are looked up in and
+ * added to the server's result cache.
+ * @param server Server object
+ * @param mode Whether to compress or decompress
+ * @param content The input
+ * @param len The length of the input
+ * @param out Where the result goes
+ * @param cancel Checked between blocks to abort the run
+ * @return 0 on success, -1 if the result couldn't be delivered
+ */
+static int produce_result(Server *server, enum MODE mode, char *content,
+                          size_t len, Sink *out, CancelToken *cancel)
+{
+    ResultCache *results = server->results;
+    uint64_t hash = results->hash(results, content, len);
+    const CacheEntry *hit = results->get(results, hash, content, len, mode);
+    char *copy = NULL;
+    size_t copy_len = 0;
+    int status;
+    if (hit != NULL) {
+        LOG_INFOF(server->logger, "Serving cached result", "bytes=%zu",
+                  hit->len);
+        status = out->write(out, hit->data, hit->len);
+        results->release(results, hit);
+    } else {
+        out = new_capture_sink(out, results->capacity / 4, &copy, &copy_len);
+        CodecStats stats = {0};
+        double started = monotonic_seconds();
+        status = (mode == COMPRESS)
+                     ? compress(out, content, len, cancel, &stats)
+                     : decompress(out, content, len, cancel, &stats);
+        if (status == 0)
+            server->metrics->observe_codec(server->metrics, mode, len,
+                                           monotonic_seconds() - started,
+                                           &stats);
+    }
+
+    if (status != 0)
+        sink_abort(out);
+    else if (out->close(out) != 0)
+        status = -1;
+    // an aborted run leaves a partial copy that must not be served later
+    if (copy != NULL && status == 0)
+        results->put(results, hash, content, len, mode, copy, copy_len);
+    else
+        free(copy);
+    return status;
+}
+
+/**
+ * run_job - Run an upload in the background, keeping the result in memory
+ * @param job The job
+ * @return 0 on success, -1 on failure
+ */
+static int run_job(Job *job)
+{
+    Sink *out = new_buffer_sink(&job->result, &job->result_len);
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    int status = produce_result((Server *)job->ctx, job->mode, job->input,
+                                job->input_len, out, cancel);
+    free(cancel);
+    return status;
+}
+
+/**
+ * run_shm_request - Answer a request placed in the shared segment
+ * The input and output live in the segment, so only a codec slot is taken.
+ * @param ctx Server object
+ * @param mode Whether to compress or decompress
+ * @param input The input, inside the segment
+ * @param input_len The length of the input
+ * @param out Where the output goes
+ * @return 0 on success, -1 on failure
+ */
+static int run_shm_request(void *ctx, enum MODE mode, char *input,
+                           size_t input_len, Sink *out)
+{
+    Server *server = ctx;
+    CancelToken *cancel;
+    init_cancel_token(&cancel, -1);
+    server->admission->begin_job(server->admission);
+    int status = produce_result(server, mode, input, input_len, out, cancel);
+    server->admission->end_job(server->admission);
+    free(cancel);
+    return status;
+}
+
+/**
+ * job_footprint - Estimate the memory a background job holds
+ * The input is copied and the whole result is kept. Compressed output is
+ * barely larger than the input, but one-bit codes let a decompressed result
+ * grow to eight times the input.
+ * @param mode Whether to compress or decompress
+ * @param len The length of the input
+ * @return The estimate in bytes, SIZE_MAX if it doesn't fit in a size_t
+ */
+static size_t job_footprint(enum MODE mode, size_t len)
+{
+    size_t factor = mode == COMPRESS ? 2 : 9;
+    return len > (SIZE_MAX - 1024) / factor ? SIZE_MAX : len * factor + 1024;
+}
+
+/**
+ * submit_job - Queue an upload and answer with the id of its job
+ * @param server Server object
+ * @param req Request to handle
+ * @param mode Whether to compress or decompress
+ * @param name File name offered with the result
+ * @param content The input
+ * @param len The length of the input
+ */
+static void submit_job(Server *server, Request *req, enum MODE mode,
+                       const char *name, const char *content, size_t len)
+{
+    Admission *admission = server->admission;
+    size_t footprint = job_footprint(mode, len);
+    if (!admission->reserve(admission, footprint)) {
+        server->send_response(req->client_socket, "503 Service Unavailable",
+                              RETRY_AFTER, "", 0);
+        return;
+    }
+
+    // the request buffer is gone once we return, the job keeps a copy
+    Job *job = must_calloc(1, sizeof(Job));
+    job->reserved = footprint;
+    job->mode = mode;
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->input = must_calloc(len + 1, 1);
+    memcpy(job->input, content, len);
+    job->input_len = len;
+    job->ctx = server;
+    uint64_t id = server->jobs->submit(server->jobs, job);
+
+    char headers[64];
+    char body[64];
+    snprintf(headers, sizeof(headers), "Location: /jobs/%016llx\r\n",
+             (unsigned long long)id);
+    int body_len = snprintf(body, sizeof(body),
+                            "{\"id\": \"%016llx\", \"status\": \"queued\"}",
+                            (unsigned long long)id);
+    server->send_response(req->client_socket, "202 Accepted", headers, body,
+                          (size_t)body_len);
+}
+
+/**
+ * check_out_file - Make sure an out_file names a file inside downloads/
+ * Anything empty, with a slash or with ".." in it is answered with a 400.
+ * @param server Server object
+ * @param req Request to handle
+ * @param name The out_file parameter
+ * @return Whether the name can be joined to downloads/
+ */
+static bool check_out_file(Server *server, Request *req, const char *name)
+{
+    if (name[0] != '\0' && strchr(name, '/') == NULL &&
+        strstr(name, "..") == NULL)
+        return true;
+    LOG_WARNF(server->logger, "Rejected file name", "out_file=\"%s\"", name);
+    server->send_response(req->client_socket, "400 Bad Request", "", "", 0);
+    return false;
+}
+
+/**
+ * UploadTask - what a synchronous upload hands to the job pool
+ */
+typedef struct UploadTask {
+    enum MODE mode;
+    bool respond_inline;
+    char output_file[MAX_PARAM_LEN];
+    char *content; // the uploaded file, inside the request
+    size_t len;
+} UploadTask;
+
+/**
+ * finish_upload - Run the codec for a synchronous upload and answer it
+ * Runs on the job pool with the codec slot taken by handle_upload.
+ * @param server Server object
+ * @param req Request to handle
+ * @param arg The upload task, freed here
+ */
+static void finish_upload(Server *server, Request *req, void *arg)
+{
+    UploadTask *task = arg;
+    int client_socket = req->client_socket;
+    enum MODE mode = task->mode;
+    bool respond_inline = task->respond_inline;
+    Admission *admission = server->admission;
+
+    // with --store-compressed a decompressed result is compressed again on its
+    // way to disk, and decompressed whenever it is downloaded
+    bool store_compressed =
+        server->store_compressed && mode == DECOMPRESS && !respond_inline;
+    Sink *out;
+    char path[MAX_PARAM_LEN + 20] = "downloads/";
+    strcat(path, task->output_file);
+    if (store_compressed)
+        strcat(path, STORED_SUFFIX);
+    if (respond_inline)
+        out = server->open_chunked_response(client_socket, task->output_file);
+    else
+        out = new_file_sink(path);
+    if (out != NULL && store_compressed)
+        out = new_block_sink(out, DEFAULT_BLOCK_SIZE);
+    if (out == NULL) {
+        LOG_ERRORF(server->logger, "Failed to open output", "path=\"%s\"",
+                   path);
+        server->send_response(client_socket, "500 Internal Server Error", "",
+                              "", 0);
+        admission->end_job(admission);
+        free(task);
+        return;
+    }
+
+    // a client hanging up, or a failed send, aborts the run
+    CancelToken *cancel;
+    init_cancel_token(&cancel, client_socket);
+    errno = 0;
+    int status =
+        produce_result(server, mode, task->content, task->len, out, cancel);
+    int error = errno;
+    bool cancelled = cancel->is_cancelled(cancel);
+    admission->end_job(admission);
+    free(cancel);
+    free(task);
+    if (status != 0) {
+        LOG_WARNF(server->logger, "Failed to deliver result", "error=\"%s\"",
+                  cancelled ? "client gone"
+                  : error   ? strerror(error)
+                            : "malformed input or checksum mismatch");
+        if (respond_inline)
+            return;
+        unlink(path);
+        // only I/O errors set errno, as in cli_mode; nobody is left to
+        // answer once the client is gone
+        if (!cancelled)
+            server->send_response(client_socket,
+                                  error ? "500 Internal Server Error"
+                                        : "422 Unprocessable Entity",
+                                  "", "", 0);
+    } else if (!respond_inline) {
+        // an older plain copy would be served instead of the stored one
+        if (store_compressed) {
+            path[strlen(path) - strlen(STORED_SUFFIX)] = '\0';
+            unlink(path);
+        }
+        server->send_ok_response(client_socket, "Done");
+    }
 }
 
 /**
  * handle_upload - Handle file upload (Compress or Decompress)
+ * The result goes to downloads/<out_file>, straight back to the client as a
+ * chunked response when the request carries inline=1, or to a background job
+ * polled at /jobs/<id> when it carries async=1. A synchronous upload takes
+ * its codec slot here and is finished by finish_upload() on the job pool.
  * @param server Server object
- * @param client_socket Client socket
+ * @param req Request to handle
  */
-static void handle_upload(Server *server, const char *const chunk,
-                          size_t chunk_len)
+static void handle_upload(Server *server, Request *req)
 {
-    char output_file[100];
-    char service_type[100];
-    HuffmanTree *tree = new_huffman_tree();
-    server->logger->info_log("Handling upload request", __FILE__, __LINE__);
-    server->logger->info_log("Parsing url params", __FILE__, __LINE__);
+    const char *const chunk = req->raw;
+    int client_socket = req->client_socket;
+    char output_file[MAX_PARAM_LEN];
+    char service_type[MAX_PARAM_LEN];
+    char flag[MAX_PARAM_LEN];
+    LOG_DEBUG(server->logger, "Handling upload request");
     server->parse_url_params(server, chunk, output_file, service_type);
+    if (!check_out_file(server, req, output_file))
+        return;
+    bool respond_inline =
+        server->get_url_param(chunk, "inline", flag, sizeof(flag)) &&
+        strcmp(flag, "1") == 0;
+    bool run_async =
+        server->get_url_param(chunk, "async", flag, sizeof(flag)) &&
+        strcmp(flag, "1") == 0;
+    enum MODE mode =
+        strcmp(service_type, "compress") == 0 ? COMPRESS : DECOMPRESS;
 
     // get file content and length
     long len = 0;
     char *content =
-        (char *)server->get_file_content(server, chunk, chunk_len, &len);
+        (char *)server->get_file_content(server, chunk, req->raw_len, &len);
+    if (content == NULL) {
+        LOG_WARN(server->logger, "Malformed upload");
+        server->send_response(client_socket, "400 Bad Request", "", "", 0);
+        return;
+    }
+    if (run_async) {
+        submit_job(server, req, mode, output_file, content, (size_t)len);
+        return;
+    }
 
-    // compress or decompress the file
-    char path[100] = "downloads/";
-    strcat(path, output_file);
-    (strcmp(service_type, "compress") == 0)
-        ? compress(tree, path, content, (size_t)len)
-        : decompress(tree, path, content, (size_t)len);
+    Admission *admission = server->admission;
+    if (!admission->try_begin_job(admission)) {
+        LOG_WARN(server->logger, "All codec slots busy");
+        server->send_response(client_socket, "503 Service Unavailable",
+                              RETRY_AFTER, "", 0);
+        return;
+    }
 
-    tree->destroy(&tree);
+    UploadTask *task = must_calloc(1, sizeof(UploadTask));
+    task->mode = mode;
+    task->respond_inline = respond_inline;
+    snprintf(task->output_file, sizeof(task->output_file), "%s",
+             output_file);
+    task->content = content;
+    task->len = (size_t)len;
+    server->defer(server, req, &finish_upload, task);
 }
 
 /**
- * handle_download - Handle file download (Compress or Decompress)
+ * release_job - Give back a job whose result went out
+ * @param ctx The job, found by handle_job()
+ */
+static void release_job(void *ctx)
+{
+    Job *job = ctx;
+    Server *server = job->ctx;
+    server->jobs->release(server->jobs, job);
+}
+
+/**
+ * handle_job - Report the state of a background job, or its result
+ * @param server Server object
+ * @param req Request to handle
+ */
+static void handle_job(Server *server, Request *req)
+{
+    const char *id_text = req->target + strlen(req->route->path);
+    char *end = NULL;
+    uint64_t id = (uint64_t)strtoull(id_text, &end, 16);
+    enum JOB_STATE state = JOB_QUEUED;
+    Job *job = NULL;
+    if (end != id_text && (*end == '\0' || *end == '?'))
+        job = server->jobs->find(server->jobs, id, &state);
+    if (job == NULL) {
+        server->send_not_found_response(req->client_socket);
+        return;
+    }
+
+    if (state == JOB_DONE) {
+        // the result is queued as it is, the job is held until it went out
+        char header[MAX_JOB_NAME + 320];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.1 200 OK\r\n"
+                 "Access-Control-Expose-Headers: Content-Disposition\r\n"
+                 "Content-Type: application/octet-stream\r\n"
+                 "Content-Disposition: attachment; filename=\"%s\"\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n"
+                 "\r\n",
+                 job->name, job->result_len);
+        if (server->send_all(req->client_socket, header, strlen(header)) != 0)
+            server->jobs->release(server->jobs, job);
+        else
+            server->send_held(req->client_socket, job->result,
+                              job->result_len, &release_job, job);
+        return;
+    }
+
+    static const char *const names[] = {"queued", "running", "done",
+                                        "failed"};
+    char body[64];
+    int body_len = snprintf(body, sizeof(body),
+                            "{\"id\": \"%016llx\", \"status\": \"%s\"}",
+                            (unsigned long long)id, names[state]);
+    server->send_response(req->client_socket,
+                          state == JOB_FAILED ? "500 Internal Server Error"
+                                              : "202 Accepted",
+                          "", body, (size_t)body_len);
+    server->jobs->release(server->jobs, job);
+}
+
+/**
+ * handle_cache_stats - Report the result cache counters
+ * @param server Server object
+ * @param req Request to handle
+ */
+static void handle_cache_stats(Server *server, Request *req)
+{
+    char stats[256];
+    server->results->stats(server->results, stats, sizeof(stats));
+    server->send_ok_response(req->client_socket, stats);
+}
+
+/**
+ * format_download_headers - Render the headers describing a download
+ * @param headers Where the header lines go
+ * @param headers_len Room in headers
+ * @param filename File name suggested to the client
+ * @param partial Whether only a range of the content is sent
+ * @param first Offset of the first byte sent
+ * @param last Offset of the last byte sent
+ * @param total Length of the whole content
+ */
+static void format_download_headers(char *headers, size_t headers_len,
+                                    const char *filename, bool partial,
+                                    size_t first, size_t last, size_t total)
+{
+    int len = snprintf(headers, headers_len,
+                       "Access-Control-Expose-Headers: Content-Disposition\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Disposition: attachment; filename=\"%s\"\r\n"
+                       "Accept-Ranges: bytes\r\n",
+                       filename);
+    if (partial && len > 0 && (size_t)len < headers_len)
+        snprintf(headers + len, headers_len - (size_t)len,
+                 "Content-Range: bytes %zu-%zu/%zu\r\n", first, last, total);
+}
+
+/**
+ * send_range_not_satisfiable - Turn down a range past the end of the content
  * @param server Server object
- * @param url URL
  * @param client_socket Client socket
+ * @param total Length of the whole content
  */
-static void handle_download(Server *server, const char *const url,
-                            int client_socket)
+static void send_range_not_satisfiable(Server *server, int client_socket,
+                                       size_t total)
 {
-    server->logger->info_log("Handling download request", __FILE__, __LINE__);
-    char output_file[100];
-    sscanf(url, "/download?out_file=%s", output_file);
-    char download_path[100] = "downloads/";
-    strcat(download_path, output_file);
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Content-Range: bytes */%zu\r\n",
+             total);
+    server->send_response(client_socket, "416 Range Not Satisfiable", headers,
+                          "", 0);
+}
+
+/**
+ * DecodeTask - what a download of decompressed content hands to the job pool
+ */
+typedef struct DecodeTask {
+    char path[MAX_PARAM_LEN + 20];
+    char headers[MAX_PARAM_LEN + 512];
+    bool partial; // a Range header asked for part of the file
+    char *data;   // the compressed file, mapped
+    size_t size;
+    BlockIndex index;
+    size_t first, len;
+} DecodeTask;
 
-    server->logger->info_log("Opening file", __FILE__, __LINE__);
-    server->logger->info_log(download_path, __FILE__, __LINE__);
-    FILE *file = fopen(download_path, "rb");
-    if (file == NULL) {
-        server->logger->error_log("File not found", __FILE__, __LINE__);
+/**
+ * finish_decompressed - Decode the requested blocks and send them
+ * Runs on the job pool with the codec slot taken by send_decompressed.
+ * @param server Server object
+ * @param req Request to handle
+ * @param arg The decode task, freed here
+ */
+static void finish_decompressed(Server *server, Request *req, void *arg)
+{
+    DecodeTask *task = arg;
+    Sink *out = server->open_response(
+        req->client_socket, task->partial ? "206 Partial Content" : "200 OK",
+        task->headers, task->len);
+    int status = block_decompress_range(codec_context(), out, task->data,
+                                        &task->index, task->first, task->len);
+    if (status != 0)
+        sink_abort(out);
+    else if (out->close(out) != 0)
+        status = -1;
+    if (status != 0)
+        LOG_WARNF(server->logger, "Failed to send decompressed content",
+                  "path=\"%s\"", task->path);
+    server->admission->end_job(server->admission);
+    munmap(task->data, task->size);
+    free(task);
+}
+
+/**
+ * send_decompressed - Serve the decompressed content of a block-format file
+ * With a Range header only the blocks overlapping the range are decoded, so
+ * a slice of a large file costs about as much as the slice itself. The
+ * decoding is left to finish_decompressed() on the job pool.
+ * @param server Server object
+ * @param req Request to handle
+ * @param path The compressed file
+ * @param name File name suggested to the client
+ */
+static void send_decompressed(Server *server, Request *req, const char *path,
+                              const char *name)
+{
+    int client_socket = req->client_socket;
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        LOG_WARNF(server->logger, "File not found", "path=\"%s\"", path);
         server->send_not_found_response(client_socket);
+        if (fd >= 0)
+            close(fd);
         return;
     }
 
-    // get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
-
-    // Send HTTP Headers
-    server->logger->info_log("Sending HTTP Headers", __FILE__, __LINE__);
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer),
-             "HTTP/1.1 200 OK\r\n"
-             "Access-Control-Expose-Headers: Content-Disposition\r\n"
-             "Content-Type: application/octet-stream\r\n"
-             "Content-Disposition: attachment; filename=\"%s\"\r\n"
-             "Content-Length: %ld\r\n"
-             "\r\n",
-             output_file, file_size);
-    send(client_socket, buffer, strlen(buffer), 0);
+    // the file is mapped so that only the pages of the blocks used are read
+    size_t size = (size_t)file_stat.st_size;
+    char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+    close(fd);
+    BlockIndex index;
+    if (data == MAP_FAILED || block_read_index(data, size, &index) != 0) {
+        server->send_response(client_socket, "415 Unsupported Media Type", "",
+                              "", 0);
+        if (data != MAP_FAILED)
+            munmap(data, size);
+        return;
+    }
 
-    // Send the file content
-    server->logger->info_log("Sending file content", __FILE__, __LINE__);
-    while (!feof(file)) {
-        size_t read = fread(buffer, 1, sizeof(buffer), file);
-        send(client_socket, buffer, read, 0);
+    size_t first = 0, last = index.raw_len - 1;
+    int range = server->get_range(req->raw, index.raw_len, &first, &last);
+    Admission *admission = server->admission;
+    if (range < 0) {
+        send_range_not_satisfiable(server, client_socket, index.raw_len);
+    } else if (!admission->try_begin_job(admission)) {
+        server->send_response(client_socket, "503 Service Unavailable",
+                              RETRY_AFTER, "", 0);
+    } else {
+        DecodeTask *task = must_calloc(1, sizeof(DecodeTask));
+        snprintf(task->path, sizeof(task->path), "%s", path);
+        format_download_headers(task->headers, sizeof(task->headers), name,
+                                range > 0, first, last, index.raw_len);
+        task->partial = range > 0;
+        task->data = data;
+        task->size = size;
+        task->index = index;
+        task->first = first;
+        task->len = index.raw_len == 0 ? 0 : last - first + 1;
+        server->defer(server, req, &finish_decompressed, task);
+        return;
     }
+    munmap(data, size);
+}
 
-    fclose(file);
+/**
+ * handle_extract - Serve the decompressed content of a compressed file
+ * @param server Server object
+ * @param req Request to handle
+ */
+static void handle_extract(Server *server, Request *req)
+{
+    char stored_file[MAX_PARAM_LEN] = "";
+    server->get_url_param(req->target, "out_file", stored_file,
+                          sizeof(stored_file));
+    if (!check_out_file(server, req, stored_file))
+        return;
+    char path[MAX_PARAM_LEN + 10] = "downloads/";
+    strcat(path, stored_file);
+
+    // offer the name the file had before it was compressed
+    size_t name_len = strlen(stored_file);
+    if (name_len > 4 && strcmp(stored_file + name_len - 4, ".huf") == 0)
+        stored_file[name_len - 4] = '\0';
+    send_decompressed(server, req, path, stored_file);
 }
 
 /**
- * handle_client_request - Handle client request
+ * VerifyTask - what a check of a stored file hands to the job pool
+ */
+typedef struct VerifyTask {
+    char path[MAX_PARAM_LEN + 20];
+    char *data; // the file, mapped
+    size_t size;
+    int threads; // codec slots taken, one per thread decoding blocks
+} VerifyTask;
+
+/**
+ * finish_verify - Check a stored file and report what was found
+ * Runs on the job pool with the codec slots taken by handle_verify.
  * @param server Server object
- * @param client_socket Client socket
+ * @param req Request to handle
+ * @param arg The verify task, freed here
  */
-static void handle_client_request(Server *server, int client_socket)
+static void finish_verify(Server *server, Request *req, void *arg)
 {
-    /*server->logger->info_log("Handling client request", __FILE__, __LINE__);*/
-    size_t req_len = 0;
-    char *chunk = (char *)must_calloc(INT_MAX, sizeof(char));
-    server->get_client_request(client_socket, &chunk, &req_len);
+    VerifyTask *task = arg;
+    Admission *admission = server->admission;
+    const char *path = task->path;
+    size_t size = task->size;
+    int threads = task->threads;
+    CancelToken *cancel;
+    init_cancel_token(&cancel, req->client_socket);
+    VerifyReport report;
+    int status = verify_data(path, task->data, size, threads, cancel, &report);
+    for (int i = 0; i < threads; i++)
+        admission->end_job(admission);
+    free(cancel);
+    munmap(task->data, size);
 
-    // parsing client socket header to get HTTP method, route
-    char method[100];
-    char route[100];
-    sscanf(chunk, "%s %s HTTP/1.1", method, route);
+    char body[512];
+    int body_len = snprintf(
+        body, sizeof(body),
+        "{\"ok\": %s, \"format\": \"%s\", \"bytes_in\": %zu, "
+        "\"bytes_out\": %zu, \"members\": %zu, \"corrupt\": %zu, "
+        "\"threads\": %d, \"seconds\": %.3f, \"mib_per_s\": %.1f}",
+        status == 0 ? "true" : "false", report.format, size,
+        report.bytes_out, report.members, report.corrupt, threads,
+        report.seconds, mib_per_second(report.bytes_out, report.seconds));
+    if (status != 0)
+        LOG_WARNF(server->logger, "Failed verification", "path=\"%s\"", path);
+    server->send_response(req->client_socket,
+                          status == 0 ? "200 OK" : "422 Unprocessable Entity",
+                          "", body, (size_t)body_len);
+    free(task);
+}
 
-    // render static file
-    if (strcmp(method, "GET") == 0) {
-        if (strncmp(route, "/download", 9) == 0) {
-            handle_download(server, route, client_socket);
-        } else {
-            char *response_data = server->handle_get_requests(server, route);
-            server->send_ok_response(client_socket, response_data);
-            free(response_data);
-        }
-    } else if (strcmp(method, "POST") == 0) {
-        if (strncmp(route, "/upload", 7) == 0) {
-            handle_upload(server, chunk, req_len);
-        } else {
-            server->send_not_found_response(client_socket);
+/**
+ * handle_verify - Check a stored compressed file without sending it
+ * The blocks are decoded by as many threads as there are free codec slots,
+ * up to half of them, so a long check leaves room for the uploads and
+ * downloads that arrive while it runs. The check itself is left to
+ * finish_verify() on the job pool.
+ * @param server Server object
+ * @param req Request to handle
+ */
+static void handle_verify(Server *server, Request *req)
+{
+    int client_socket = req->client_socket;
+    char stored_file[MAX_PARAM_LEN] = "";
+    server->get_url_param(req->target, "out_file", stored_file,
+                          sizeof(stored_file));
+    if (!check_out_file(server, req, stored_file))
+        return;
+    char path[MAX_PARAM_LEN + 20];
+    snprintf(path, sizeof(path), "downloads/%s", stored_file);
+    if (access(path, F_OK) != 0)
+        strcat(path, STORED_SUFFIX);
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        LOG_WARNF(server->logger, "File not found", "path=\"%s\"", path);
+        server->send_not_found_response(client_socket);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    size_t size = (size_t)file_stat.st_size;
+    char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED ||
+        (!is_block_file(data, size) && !is_adaptive_file(data, size) &&
+         !is_archive(data, size))) {
+        server->send_response(client_socket, "415 Unsupported Media Type", "",
+                              "", 0);
+        if (data != MAP_FAILED)
+            munmap(data, size);
+        return;
+    }
+
+    Admission *admission = server->admission;
+    if (!admission->try_begin_job(admission)) {
+        server->send_response(client_socket, "503 Service Unavailable",
+                              RETRY_AFTER, "", 0);
+        munmap(data, size);
+        return;
+    }
+    VerifyTask *task = must_calloc(1, sizeof(VerifyTask));
+    snprintf(task->path, sizeof(task->path), "%s", path);
+    task->data = data;
+    task->size = size;
+    task->threads = 1;
+    while (task->threads < admission->max_jobs / 2 &&
+           admission->try_begin_job(admission))
+        task->threads++;
+    server->defer(server, req, &finish_verify, task);
+}
+
+/**
+ * handle_download - Handle file download (Compress or Decompress)
+ * @param server Server object
+ * @param req Request to handle
+ */
+static void handle_download(Server *server, Request *req)
+{
+    LOG_DEBUG(server->logger, "Handling download request");
+    int client_socket = req->client_socket;
+    char output_file[MAX_PARAM_LEN] = "";
+    server->get_url_param(req->target, "out_file", output_file,
+                          sizeof(output_file));
+    if (!check_out_file(server, req, output_file))
+        return;
+    char download_path[MAX_PARAM_LEN + 10] = "downloads/";
+    strcat(download_path, output_file);
+
+    LOG_DEBUGF(server->logger, "Opening file", "path=\"%s\"", download_path);
+    int fd = open(download_path, O_RDONLY);
+    if (fd < 0) {
+        // kept compressed by --store-compressed, decompressed on the way out
+        char stored_path[MAX_PARAM_LEN + 20];
+        snprintf(stored_path, sizeof(stored_path), "%s%s", download_path,
+                 STORED_SUFFIX);
+        if (access(stored_path, F_OK) == 0) {
+            send_decompressed(server, req, stored_path, output_file);
+            return;
         }
-        server->send_ok_response(client_socket, "Done");
-    } else {
+    }
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        LOG_WARNF(server->logger, "File not found", "path=\"%s\"",
+                  download_path);
         server->send_not_found_response(client_socket);
+        if (fd >= 0)
+            close(fd);
+        return;
     }
-    free(chunk);
+
+    // a Range header asks for part of the file
+    size_t size = (size_t)file_stat.st_size;
+    size_t first = 0, last = size - 1;
+    int range = server->get_range(req->raw, size, &first, &last);
+    if (range < 0) {
+        send_range_not_satisfiable(server, client_socket, size);
+        close(fd);
+        return;
+    }
+    size_t len = size == 0 ? 0 : last - first + 1;
+
+    // Send HTTP Headers
+    LOG_DEBUG(server->logger, "Sending HTTP Headers");
+    char headers[MAX_PARAM_LEN + 512];
+    format_download_headers(headers, sizeof(headers), output_file, range > 0,
+                            first, last, size);
+    char buffer[MAX_PARAM_LEN + 640];
+    snprintf(buffer, sizeof(buffer),
+             "HTTP/1.1 %s\r\n"
+             "%s"
+             "Content-Length: %zu\r\n"
+             "\r\n",
+             range > 0 ? "206 Partial Content" : "200 OK", headers, len);
+
+    // Send the file content straight from the page cache
+    LOG_DEBUGF(server->logger, "Sending file content", "offset=%zu bytes=%zu",
+               first, len);
+    if (server->send_all(client_socket, buffer, strlen(buffer)) != 0 ||
+        server->send_file(client_socket, fd, (off_t)first, len) != 0) {
+        LOG_WARN(server->logger, "Client went away during download");
+    }
+
+    close(fd);
+}
+
+/**
+ * config_api_routes - Register the compression endpoints
+ * @param server Server object
+ */
+static void config_api_routes(Server *server)
+{
+    server->router->add_route(server->router, HTTP_POST, "/upload",
+                              &handle_upload, NULL, false);
+    server->router->add_route(server->router, HTTP_GET, "/download",
+                              &handle_download, NULL, false);
+    server->router->add_route(server->router, HTTP_GET, "/extract",
+                              &handle_extract, NULL, false);
+    server->router->add_route(server->router, HTTP_GET, "/verify",
+                              &handle_verify, NULL, false);
+    server->router->add_route(server->router, HTTP_GET, "/jobs/", &handle_job,
+                              NULL, true);
+    server->router->add_route(server->router, HTTP_GET, "/cache",
+                              &handle_cache_stats, NULL, false);
 }
 
 /**
  * server_mode - run in server mode
  * @config: The config object
  */
-static void server_mode(Config *config __attribute__((unused)))
+static void server_mode(Config *config)
 {
     // setup server
     Server *server;
-    init_server(&server, 8000);
-    server->logger->info_log("Starting server mode", __FILE__, __LINE__);
+    init_server(&server, config->port, config->backlog, config->reuseport,
+                config->unix_path);
+    server->assets->watch = config->watch_templates;
+    server->io_uring = config->io_uring;
+    server->store_compressed = config->store_compressed;
+    server->results->capacity = config->cache_size;
+    server->admission->budget = config->memory_budget;
+    server->admission->max_jobs = config->max_jobs;
+    server->timeouts = (Timeouts){.header = config->header_timeout,
+                                  .body = config->body_timeout,
+                                  .idle = config->idle_timeout,
+                                  .write = config->write_timeout,
+                                  .min_rate = config->min_rate};
+    init_job_pool(&server->jobs, config->job_workers, config->max_jobs,
+                  &run_job, server->admission);
+    if (config->shm_name != NULL) {
+        ShmService *shm;
+        if (init_shm_service(&shm, config->shm_name,
+                             (size_t)config->shm_slots,
+                             config->shm_slot_size, config->max_jobs) != 0) {
+            LOG_ERRORF(server->logger, "Failed to create shared memory",
+                       "name=\"%s\"", config->shm_name);
+            exit(1);
+        }
+        shm->ctx = server;
+        shm->run = &run_shm_request;
+        shm->start(shm);
+        LOG_INFOF(server->logger, "Serving shared memory",
+                  "name=\"%s\" slots=%d slot_size=%zu", config->shm_name,
+                  config->shm_slots, config->shm_slot_size);
+    }
+    LOG_INFO(server->logger, "Starting server mode");
+    // a client hanging up mid-transfer must not kill the handler
+    signal(SIGPIPE, SIG_IGN);
     server->config_router(server);
+    config_api_routes(server);
 
     // list routes
-    server->router->list_routes(server->router->root);
-    while (1) {
-        int client_socket = accept(server->socket, NULL, NULL);
-        if (client_socket == -1) {
-            continue;
-        }
-
-        // fork a child process to handle client request
-        pid_t pid = fork();
-        if (pid == 0) {
-            // child process
-            close(server->socket);
-            handle_client_request(server, client_socket);
-            close(client_socket);
-            exit(0);
-        } else {
-            close(client_socket);
-        }
-    }
+    server->router->list_routes(server->router);
+    server->serve(server, config->workers);
 }
 
 /**
@@ -236,6 +1699,16 @@ int main(const int argc, const char **argv)
 {
     typedef void (*mode_func)(Config *);
     autofree_config Config *config = new_config(argc, argv + 1);
+    Logger *logger;
+    init_logger(&logger);
+    logger->level = config->log_level;
+    if (config->kernels != NULL && select_kernels(config->kernels) != 0) {
+        fprintf(stderr,
+                "Error: --kernels takes %s, and this CPU runs only some\n",
+                KERNEL_NAMES);
+        exit(1);
+    }
+    LOG_DEBUGF(logger, "Selected kernels", "name=%s", kernels()->name);
     mode_func mode_funcs[] = {cli_mode, server_mode};
     mode_funcs[config->using_server](config);
     return 0;
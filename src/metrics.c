@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include "../include/metrics.h"
+#include "../include/utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const int statuses[STATUS_SLOTS - 1] = {200, 202, 206, 304, 400, 404,
+                                               405, 408, 413, 416, 500, 503};
+static const char *const mode_names[2] = {"compress", "decompress"};
+static const char *const stage_names[STAGE_COUNT] = {
+    "frequency", "tree", "code_table", "encode", "header", "decode"};
+
+// upper bounds of the buckets, the last bucket is +Inf
+static const double seconds_bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                        0.025,  0.05,  0.1,    0.25,  0.5,
+                                        1,      2.5,   5,      10};
+static const double ratio_bounds[] = {0.125, 0.25, 0.5, 0.75, 1,
+                                      1.5,   2,    4,   8};
+static const double throughput_bounds[] = {1e5, 1e6,   1e7, 2.5e7, 5e7,
+                                           1e8, 2.5e8, 5e8, 1e9};
+#define BOUNDS(b) (b), sizeof(b) / sizeof((b)[0])
+
+static __thread MetricsShard *local_shard;
+
+/**
+ * bump - Add to a value only the calling thread writes
+ * @param value The value
+ * @param delta The amount to add
+ */
+static inline void bump(uint64_t *value, uint64_t delta)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * shard - Find the shard of the calling thread, creating it on first use
+ * @param self The metrics
+ * @return The shard
+ */
+static MetricsShard *shard(Metrics *self)
+{
+    if (local_shard == NULL) {
+        local_shard = must_calloc(1, sizeof(MetricsShard));
+        pthread_mutex_lock(&self->lock);
+        local_shard->next = self->shards;
+        self->shards = local_shard;
+        pthread_mutex_unlock(&self->lock);
+    }
+    return local_shard;
+}
+
+/**
+ * observe - Record an observation in a histogram
+ * @param histogram The histogram, in the calling thread's shard
+ * @param bounds Upper bounds of the buckets
+ * @param bound_count Number of bounds
+ * @param value The observation
+ */
+static void observe(Histogram *histogram, const double *bounds,
+                    size_t bound_count, double value)
+{
+    size_t slot = 0;
+    while (slot < bound_count && value > bounds[slot])
+        slot++;
+    bump(&histogram->buckets[slot], 1);
+    bump(&histogram->count, 1);
+    double sum;
+    __atomic_load(&histogram->sum, &sum, __ATOMIC_RELAXED);
+    sum += value;
+    __atomic_store(&histogram->sum, &sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * count - Add to a counter
+ * @param self The metrics
+ * @param counter The counter
+ * @param value The amount to add
+ */
+static void count(Metrics *self, enum COUNTER counter, uint64_t value)
+{
+    bump(&shard(self)->counters[counter], value);
+}
+
+/**
+ * observe_request - Record a handled request
+ * @param self The metrics
+ * @param route The route that handled it, NULL if none matched
+ * @param status The status code sent, 0 if none
+ * @param seconds Time spent handling it
+ */
+static void observe_request(Metrics *self, const Route *route, int status,
+                            double seconds)
+{
+    size_t slot = 0;
+    while (slot < STATUS_SLOTS - 1 && statuses[slot] != status)
+        slot++;
+    int id = route != NULL ? route->id : MAX_ROUTES;
+    observe(&shard(self)->requests[id][slot], BOUNDS(seconds_bounds),
+            seconds);
+}
+
+/**
+ * observe_codec - Record a codec run
+ * @param self The metrics
+ * @param mode Whether it compressed or decompressed
+ * @param in_len Length of the input
+ * @param seconds Time spent in total
+ * @param stats Output length and time spent in each stage
+ */
+static void observe_codec(Metrics *self, enum MODE mode, size_t in_len,
+                          double seconds, const CodecStats *stats)
+{
+    MetricsShard *local = shard(self);
+    observe(&local->codec_seconds[mode], BOUNDS(seconds_bounds), seconds);
+    if (in_len > 0)
+        observe(&local->codec_ratio[mode], BOUNDS(ratio_bounds),
+                (double)stats->output_len / (double)in_len);
+    if (seconds > 0)
+        observe(&local->codec_throughput[mode], BOUNDS(throughput_bounds),
+                (double)in_len / seconds);
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        // a run only goes through the stages of its own direction
+        if (stats->stage[stage] > 0)
+            observe(&local->stages[stage], BOUNDS(seconds_bounds),
+                    stats->stage[stage]);
+    }
+}
+
+/**
+ * merge_histogram - Add a histogram read from another thread into a total
+ * @param total The total
+ * @param part The histogram to add
+ */
+static void merge_histogram(Histogram *total, const Histogram *part)
+{
+    for (int i = 0; i < HISTOGRAM_SLOTS; i++)
+        total->buckets[i] +=
+            __atomic_load_n(&part->buckets[i], __ATOMIC_RELAXED);
+    total->count += __atomic_load_n(&part->count, __ATOMIC_RELAXED);
+    double sum;
+    __atomic_load(&part->sum, &sum, __ATOMIC_RELAXED);
+    total->sum += sum;
+}
+
+/**
+ * write_help - Write the HELP and TYPE lines of a metric
+ * @param out Where to write
+ * @param name Name of the metric
+ * @param type Type of the metric
+ * @param help Description of the metric
+ */
+static void write_help(Sink *out, const char *name, const char *type,
+                         const char *help)
+{
+    char line[256];
+    int len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+                       name, help, name, type);
+    out->write(out, line, (size_t)len);
+}
+
+/**
+ * write_histogram - Write the series of one histogram
+ * @param out Where to write
+ * @param name Name of the metric
+ * @param labels Labels of the series, without braces
+ * @param histogram The histogram
+ * @param bounds Upper bounds of the buckets
+ * @param bound_count Number of bounds
+ */
+static void write_histogram(Sink *out, const char *name, const char *labels,
+                            const Histogram *histogram, const double *bounds,
+                            size_t bound_count)
+{
+    char line[512];
+    int len;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= bound_count; i++) {
+        cumulative += histogram->buckets[i];
+        if (i < bound_count)
+            len = snprintf(line, sizeof(line),
+                           "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                           bounds[i], (unsigned long long)cumulative);
+        else
+            len = snprintf(line, sizeof(line),
+                           "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+                           (unsigned long long)cumulative);
+        out->write(out, line, (size_t)len);
+    }
+    len = snprintf(line, sizeof(line), "%s_sum{%s} %.9g\n%s_count{%s} %llu\n",
+                   name, labels, histogram->sum, name, labels,
+                   (unsigned long long)histogram->count);
+    out->write(out, line, (size_t)len);
+}
+
+/**
+ * render - Write every metric in the Prometheus text format
+ * @param self The metrics
+ * @param router Router whose routes label the request metrics
+ * @param out Where to write
+ */
+static void render(Metrics *self, const Router *router, Sink *out)
+{
+    // add up the shards; they keep changing while we read, which only means
+    // the scrape is a few observations behind
+    MetricsShard *total = must_calloc(1, sizeof(MetricsShard));
+    pthread_mutex_lock(&self->lock);
+    MetricsShard *shards = self->shards;
+    pthread_mutex_unlock(&self->lock);
+    for (MetricsShard *part = shards; part != NULL; part = part->next) {
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            total->counters[i] +=
+                __atomic_load_n(&part->counters[i], __ATOMIC_RELAXED);
+        for (int r = 0; r <= MAX_ROUTES; r++)
+            for (int s = 0; s < STATUS_SLOTS; s++)
+                merge_histogram(&total->requests[r][s], &part->requests[r][s]);
+        for (int m = 0; m < 2; m++) {
+            merge_histogram(&total->codec_seconds[m], &part->codec_seconds[m]);
+            merge_histogram(&total->codec_ratio[m], &part->codec_ratio[m]);
+            merge_histogram(&total->codec_throughput[m],
+                            &part->codec_throughput[m]);
+        }
+        for (int i = 0; i < STAGE_COUNT; i++)
+            merge_histogram(&total->stages[i], &part->stages[i]);
+    }
+
+    uint64_t *counters = total->counters;
+    write_metric(out, "huffman_connections_total", "counter",
+                 "Connections accepted.",
+                 (double)counters[COUNTER_CONNECTIONS_OPENED]);
+    write_metric(out, "huffman_connections_active", "gauge",
+                 "Connections currently open.",
+                 (double)(counters[COUNTER_CONNECTIONS_OPENED] -
+                          counters[COUNTER_CONNECTIONS_CLOSED]));
+    write_metric(out, "huffman_received_bytes_total", "counter",
+                 "Bytes read from clients.",
+                 (double)counters[COUNTER_BYTES_RECEIVED]);
+    write_metric(out, "huffman_sent_bytes_total", "counter",
+                 "Bytes of responses sent to clients.",
+                 (double)counters[COUNTER_BYTES_SENT]);
+    write_metric(out, "huffman_timeouts_total", "counter",
+                 "Connections closed for being too slow.",
+                 (double)counters[COUNTER_TIMEOUTS]);
+    write_metric(out, "huffman_rejected_requests_total", "counter",
+                 "Requests turned away by admission control.",
+                 (double)counters[COUNTER_REJECTED]);
+
+    char labels[256];
+    const char *name = "huffman_http_request_duration_seconds";
+    write_help(out, name, "histogram", "Time to handle a request.");
+    for (int r = 0; r <= MAX_ROUTES; r++) {
+        for (int s = 0; s < STATUS_SLOTS; s++) {
+            const Histogram *histogram = &total->requests[r][s];
+            if (histogram->count == 0)
+                continue;
+            char status[8] = "other";
+            if (s < STATUS_SLOTS - 1)
+                snprintf(status, sizeof(status), "%d", statuses[s]);
+            if (r < router->route_count)
+                snprintf(labels, sizeof(labels),
+                         "route=\"%s\",method=\"%s\",status=\"%s\"",
+                         router->routes[r]->path,
+                         method_name(router->routes[r]->method), status);
+            else
+                snprintf(labels, sizeof(labels),
+                         "route=\"unmatched\",method=\"any\",status=\"%s\"",
+                         status);
+            write_histogram(out, name, labels, histogram,
+                            BOUNDS(seconds_bounds));
+        }
+    }
+
+    name = "huffman_codec_duration_seconds";
+    write_help(out, name, "histogram", "Time to run the codec.");
+    for (int m = 0; m < 2; m++) {
+        snprintf(labels, sizeof(labels), "mode=\"%s\"", mode_names[m]);
+        write_histogram(out, name, labels, &total->codec_seconds[m],
+                        BOUNDS(seconds_bounds));
+    }
+    name = "huffman_codec_ratio";
+    write_help(out, name, "histogram", "Output length over input length.");
+    for (int m = 0; m < 2; m++) {
+        snprintf(labels, sizeof(labels), "mode=\"%s\"", mode_names[m]);
+        write_histogram(out, name, labels, &total->codec_ratio[m],
+                        BOUNDS(ratio_bounds));
+    }
+    name = "huffman_codec_throughput_bytes_per_second";
+    write_help(out, name, "histogram", "Input bytes processed per second.");
+    for (int m = 0; m < 2; m++) {
+        snprintf(labels, sizeof(labels), "mode=\"%s\"", mode_names[m]);
+        write_histogram(out, name, labels, &total->codec_throughput[m],
+                        BOUNDS(throughput_bounds));
+    }
+    name = "huffman_codec_stage_duration_seconds";
+    write_help(out, name, "histogram", "Time spent in each codec stage.");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+        write_histogram(out, name, labels, &total->stages[i],
+                        BOUNDS(seconds_bounds));
+    }
+    free(total);
+}
+
+void write_metric(Sink *out, const char *name, const char *type,
+                  const char *help, double value)
+{
+    char line[128];
+    write_help(out, name, type, help);
+    int len = snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+    out->write(out, line, (size_t)len);
+}
+
+double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void init_metrics(Metrics **self)
+{
+    *self = (Metrics *)must_calloc(1, sizeof(Metrics));
+    pthread_mutex_init(&(*self)->lock, NULL);
+    (*self)->count = &count;
+    (*self)->observe_request = &observe_request;
+    (*self)->observe_codec = &observe_codec;
+    (*self)->render = &render;
+}
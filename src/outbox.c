@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+#include "../include/outbox.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <linux/sockios.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#define SENDFILE_CHUNK (1 << 20)
+#define FALLBACK_CHUNK 8192
+#define IOV_BATCH 16
+
+/**
+ * Segment - a piece of the response waiting for the socket
+ * Memory is either copied right after the segment or held by the caller
+ * until release() is called; a file region is sent with sendfile().
+ */
+struct Segment {
+    Segment *next;
+    const char *data; // next byte of a memory segment
+    size_t len;       // bytes left
+    int fd;           // file of a file segment, -1 for memory
+    off_t offset;     // next byte of a file segment
+    bool copied;      // data points into copy, counted in buffered
+    void (*release)(void *ctx); // for held memory, NULL otherwise
+    void *ctx;
+    char copy[];
+};
+
+/**
+ * now_ms - Read the monotonic clock
+ * @return Milliseconds since an arbitrary point
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * note_sent - Account for bytes that went out, with the lock held
+ * @param self The outbox
+ * @param sent Number of bytes
+ */
+static void note_sent(Outbox *self, size_t sent)
+{
+    if (self->started_ms == 0)
+        self->started_ms = now_ms();
+    self->sent += sent;
+}
+
+/**
+ * free_segment - Give back what a segment holds and free it
+ * @param self The outbox
+ * @param seg The segment, already unlinked
+ */
+static void free_segment(Outbox *self, Segment *seg)
+{
+    if (seg->copied)
+        self->buffered -= seg->len;
+    if (seg->release != NULL)
+        seg->release(seg->ctx);
+    if (seg->fd >= 0)
+        close(seg->fd);
+    free(seg);
+}
+
+/**
+ * drop_segments - Forget everything queued, with the lock held
+ * @param self The outbox
+ */
+static void drop_segments(Outbox *self)
+{
+    while (self->head != NULL) {
+        Segment *seg = self->head;
+        self->head = seg->next;
+        free_segment(self, seg);
+    }
+    self->tail = NULL;
+}
+
+/**
+ * fail_locked - Give up on the response, with the lock held
+ * @param self The outbox
+ */
+static void fail_locked(Outbox *self)
+{
+    if (!self->failed) {
+        self->failed = true;
+        shutdown(self->fd, SHUT_RDWR);
+    }
+    drop_segments(self);
+    pthread_cond_broadcast(&self->room);
+}
+
+/**
+ * send_error - Sort out a failed write
+ * @param self The outbox
+ * @return 0 to retry, 1 if the socket is full, -1 once the outbox has failed
+ */
+static int send_error(Outbox *self)
+{
+    if (errno == EINTR)
+        return 0;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+    fail_locked(self);
+    return -1;
+}
+
+/**
+ * send_now - Write as much of a buffer as the socket takes right away
+ * @param self The outbox
+ * @param data The data
+ * @param data_len The length of the data
+ * @return Bytes written, data_len unless the socket filled up or failed
+ */
+static size_t send_now(Outbox *self, const char *data, size_t data_len)
+{
+    size_t done = 0;
+    while (done < data_len) {
+        ssize_t sent = send(self->fd, data + done, data_len - done,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (send_error(self) == 0)
+                continue;
+            break;
+        }
+        note_sent(self, (size_t)sent);
+        done += (size_t)sent;
+    }
+    return done;
+}
+
+/**
+ * consume - Drop what went out from the front of the queue
+ * @param self The outbox
+ * @param sent Bytes written from the memory segments at the front
+ */
+static void consume(Outbox *self, size_t sent)
+{
+    while (sent > 0) {
+        Segment *seg = self->head;
+        size_t len = sent < seg->len ? sent : seg->len;
+        seg->data += len;
+        seg->len -= len;
+        if (seg->copied)
+            self->buffered -= len;
+        sent -= len;
+        if (seg->len == 0) {
+            self->head = seg->next;
+            if (self->head == NULL)
+                self->tail = NULL;
+            free_segment(self, seg);
+        }
+    }
+}
+
+/**
+ * send_memory - Write the memory segments at the front of the queue
+ * @param self The outbox
+ * @return 0 on progress, 1 if the socket is full, -1 once failed
+ */
+static int send_memory(Outbox *self)
+{
+    struct iovec iov[IOV_BATCH];
+    int count = 0;
+    for (Segment *seg = self->head; seg != NULL && seg->fd < 0 &&
+                                    count < IOV_BATCH;
+         seg = seg->next) {
+        iov[count].iov_base = (void *)seg->data;
+        iov[count].iov_len = seg->len;
+        count++;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+    ssize_t sent = sendmsg(self->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+        return send_error(self);
+    note_sent(self, (size_t)sent);
+    consume(self, (size_t)sent);
+    return 0;
+}
+
+/**
+ * send_region - Write the file segment at the front of the queue
+ * Copies through user space when the kernel refuses sendfile() for this fd
+ * pair.
+ * @param self The outbox
+ * @return 0 on progress, 1 if the socket is full, -1 once failed
+ */
+static int send_region(Outbox *self)
+{
+    Segment *seg = self->head;
+    size_t count = seg->len > SENDFILE_CHUNK ? SENDFILE_CHUNK : seg->len;
+    ssize_t sent = sendfile(self->fd, seg->fd, &seg->offset, count);
+    if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        char buffer[FALLBACK_CHUNK];
+        count = count < sizeof(buffer) ? count : sizeof(buffer);
+        ssize_t nread = pread(seg->fd, buffer, count, seg->offset);
+        if (nread < 0 && errno == EINTR)
+            return 0;
+        if (nread <= 0) {
+            fail_locked(self);
+            return -1;
+        }
+        // whatever the socket doesn't take is read again next time
+        sent = send(self->fd, buffer, (size_t)nread,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0)
+            seg->offset += sent;
+    }
+    if (sent < 0)
+        return send_error(self);
+    if (sent == 0) {
+        // the file shrank
+        fail_locked(self);
+        return -1;
+    }
+    note_sent(self, (size_t)sent);
+    seg->len -= (size_t)sent;
+    if (seg->len == 0) {
+        self->head = seg->next;
+        if (self->head == NULL)
+            self->tail = NULL;
+        free_segment(self, seg);
+    }
+    return 0;
+}
+
+/**
+ * drain - Write the queue as far as the socket takes it, with the lock held
+ * @param self The outbox
+ * @return 0 once the queue is empty, 1 if the socket is full, -1 once failed
+ */
+static int drain(Outbox *self)
+{
+    while (self->head != NULL) {
+        int status = self->head->fd >= 0 ? send_region(self)
+                                         : send_memory(self);
+        if (status != 0)
+            return status;
+    }
+    return self->failed ? -1 : 0;
+}
+
+/**
+ * note_status - Take the status code from the status line of the response
+ * @param self The outbox
+ * @param data The first bytes appended
+ * @param data_len The length of the data
+ */
+static void note_status(Outbox *self, const char *data, size_t data_len)
+{
+    if (self->status == 0 && self->sent == 0 && self->head == NULL &&
+        data_len > 12 && strncmp(data, "HTTP/1.1 ", 9) == 0)
+        self->status = atoi(data + 9);
+}
+
+/**
+ * block - Note that the socket is full, with the lock held
+ * The first time hands the outbox over to the event loop; a producer off
+ * the loop wakes it.
+ * @param self The outbox
+ */
+static void block(Outbox *self)
+{
+    if (self->blocked)
+        return;
+    self->blocked = true;
+    if (self->off_loop)
+        self->wake(self);
+}
+
+/**
+ * enqueue - Add a segment to the end of the queue, with the lock held
+ * @param self The outbox
+ * @param seg The segment
+ */
+static void enqueue(Outbox *self, Segment *seg)
+{
+    seg->next = NULL;
+    if (self->tail)
+        self->tail->next = seg;
+    else
+        self->head = seg;
+    self->tail = seg;
+}
+
+/**
+ * append - Send data, or queue a copy of what the socket doesn't take
+ * A producer off the event loop first waits for room.
+ * @param self The outbox
+ * @param data The data
+ * @param data_len The length of the data
+ * @return 0 on success, -1 once the outbox has failed
+ */
+static int append(Outbox *self, const char *data, size_t data_len)
+{
+    pthread_mutex_lock(&self->lock);
+    while (self->off_loop && self->buffered >= OUTBOX_LIMIT && !self->failed)
+        pthread_cond_wait(&self->room, &self->lock);
+    note_status(self, data, data_len);
+    size_t done = 0;
+    if (self->head == NULL && !self->failed)
+        done = send_now(self, data, data_len);
+    if (done < data_len && !self->failed) {
+        size_t len = data_len - done;
+        Segment *seg = must_calloc(1, sizeof(Segment) + len);
+        memcpy(seg->copy, data + done, len);
+        seg->data = seg->copy;
+        seg->len = len;
+        seg->fd = -1;
+        seg->copied = true;
+        self->buffered += len;
+        enqueue(self, seg);
+        block(self);
+    }
+    int failed = self->failed;
+    pthread_mutex_unlock(&self->lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * append_held - Send a buffer, queuing it without a copy
+ * @param self The outbox
+ * @param data The data
+ * @param data_len The length of the data
+ * @param release Called once the data went out or the outbox failed
+ * @param ctx Handed to release
+ * @return 0 on success, -1 once the outbox has failed
+ */
+static int append_held(Outbox *self, const char *data, size_t data_len,
+                       void (*release)(void *ctx), void *ctx)
+{
+    pthread_mutex_lock(&self->lock);
+    note_status(self, data, data_len);
+    size_t done = 0;
+    if (self->head == NULL && !self->failed)
+        done = send_now(self, data, data_len);
+    if (done < data_len && !self->failed) {
+        Segment *seg = must_calloc(1, sizeof(Segment));
+        seg->data = data + done;
+        seg->len = data_len - done;
+        seg->fd = -1;
+        seg->release = release;
+        seg->ctx = ctx;
+        enqueue(self, seg);
+        block(self);
+    } else {
+        release(ctx);
+    }
+    int failed = self->failed;
+    pthread_mutex_unlock(&self->lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * append_file - Send a file region straight from the page cache
+ * @param self The outbox
+ * @param fd The file, duplicated if the region has to be queued
+ * @param offset Offset of the first byte to send
+ * @param len Number of bytes to send
+ * @return 0 on success, -1 once the outbox has failed
+ */
+static int append_file(Outbox *self, int fd, off_t offset, size_t len)
+{
+    if (len == 0)
+        return self->failed ? -1 : 0;
+    int copy = dup(fd);
+    pthread_mutex_lock(&self->lock);
+    if (copy < 0)
+        fail_locked(self);
+    if (!self->failed) {
+        Segment *seg = must_calloc(1, sizeof(Segment));
+        seg->fd = copy;
+        seg->offset = offset;
+        seg->len = len;
+        copy = -1;
+        // the first write is tried right away, as for memory
+        enqueue(self, seg);
+        if (self->head != seg || drain(self) == 1)
+            block(self);
+    }
+    int failed = self->failed;
+    pthread_mutex_unlock(&self->lock);
+    if (copy >= 0)
+        close(copy);
+    return failed ? -1 : 0;
+}
+
+/**
+ * state - What the event loop waits for, with the lock held
+ * @param self The outbox
+ * @return The state
+ */
+static enum OUTBOX_STATE state(Outbox *self)
+{
+    if (self->head != NULL && !self->failed)
+        return OUTBOX_BLOCKED;
+    return self->finished ? OUTBOX_DONE : OUTBOX_WAITING;
+}
+
+/**
+ * flush - Write what is queued, as far as the socket takes it
+ * @param self The outbox
+ * @return Whether the event loop must wait for the socket, for the producer
+ * or for nothing
+ */
+static enum OUTBOX_STATE flush(Outbox *self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->blocked = false;
+    if (drain(self) == 1)
+        self->blocked = true;
+    if (self->buffered < OUTBOX_LIMIT)
+        pthread_cond_broadcast(&self->room);
+    enum OUTBOX_STATE result = state(self);
+    pthread_mutex_unlock(&self->lock);
+    return result;
+}
+
+/**
+ * finish - Mark the response as complete
+ * @param self The outbox
+ */
+static void finish(Outbox *self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->finished = true;
+    // woken with the lock held, so the loop can't free the outbox first
+    if (self->off_loop)
+        self->wake(self);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * fail - Give up on the response
+ * @param self The outbox
+ */
+static void fail(Outbox *self)
+{
+    pthread_mutex_lock(&self->lock);
+    fail_locked(self);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * deadline - Work out when the client of a blocked outbox is too slow
+ * @param self The outbox
+ * @param now_ms The current time
+ * @param timeout_ms How long a write may stall
+ * @param min_rate Bytes per second the response must be read at, 0 for none
+ * @return The deadline in milliseconds
+ */
+static long long deadline(Outbox *self, long long now_ms, long long timeout_ms,
+                          int min_rate)
+{
+    pthread_mutex_lock(&self->lock);
+    size_t taken = self->sent;
+    int queued = 0;
+    if (ioctl(self->fd, SIOCOUTQ, &queued) == 0 && queued > 0)
+        taken = (size_t)queued < taken ? taken - (size_t)queued : 0;
+    if (self->progress_ms == 0 || taken > self->taken) {
+        self->taken = taken;
+        self->progress_ms = now_ms;
+    }
+    long long result = self->progress_ms + timeout_ms;
+    if (min_rate > 0 && self->started_ms != 0) {
+        long long earned = self->started_ms + timeout_ms +
+                           (long long)(taken * 1000 / (size_t)min_rate);
+        result = earned < result ? earned : result;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return result;
+}
+
+void init_outbox(Outbox **self, int fd)
+{
+    *self = (Outbox *)must_calloc(1, sizeof(Outbox));
+    (*self)->fd = fd;
+    pthread_mutex_init(&(*self)->lock, NULL);
+    pthread_cond_init(&(*self)->room, NULL);
+    (*self)->append = &append;
+    (*self)->append_held = &append_held;
+    (*self)->append_file = &append_file;
+    (*self)->flush = &flush;
+    (*self)->finish = &finish;
+    (*self)->fail = &fail;
+    (*self)->deadline = &deadline;
+}
+
+void free_outbox(Outbox *self)
+{
+    drop_segments(self);
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->room);
+    free(self);
+}
@@ -1,82 +1,223 @@
 #include "../include/route.h"
+#include "../include/utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static const char *method_names[HTTP_METHOD_COUNT] = {"GET", "POST"};
+
 /**
- * init_route - Initialize a new route
- * @param endpoint uri
- * @param template the template file to render for the endpoint
- * @return Route object
+ * init_node - Initialize a new trie node
+ * @param label path bytes owned by the node
+ * @param label_len number of path bytes
+ * @return RouteNode object
  */
-static Route *init_route(char *key, char *value)
+static RouteNode *init_node(const char *label, size_t label_len)
 {
-    Route *new_route = (Route *)malloc(sizeof(Route));
+    RouteNode *node = must_calloc(1, sizeof(RouteNode));
+    node->label = must_calloc(label_len + 1, sizeof(char));
+    memcpy(node->label, label, label_len);
+    node->label_len = label_len;
+    return node;
+}
 
-    new_route->key = key;
-    new_route->value = value;
-    new_route->left = new_route->right = NULL;
-    return new_route;
+/**
+ * common_prefix - Length of the common prefix of two strings
+ * @param a first string
+ * @param b second string
+ * @param len maximum length to compare
+ * @return number of equal leading bytes
+ */
+static size_t common_prefix(const char *a, const char *b, size_t len)
+{
+    size_t i = 0;
+    while (i < len && a[i] == b[i])
+        i++;
+    return i;
 }
 
 /**
- * list_routes - List all the routes in the router
- * @param root Root node of the router
+ * split_node - Split a node so that it keeps only the first len label bytes
+ * @param node node to split
+ * @param len number of label bytes the node keeps
  */
-static void list_routes(Route *root)
+static void split_node(RouteNode *node, size_t len)
 {
+    RouteNode *tail = init_node(node->label + len, node->label_len - len);
+    tail->children = node->children;
+    memcpy(tail->exact, node->exact, sizeof(node->exact));
+    memcpy(tail->prefix, node->prefix, sizeof(node->prefix));
+
+    node->children = tail;
+    node->label[len] = '\0';
+    node->label_len = len;
+    memset(node->exact, 0, sizeof(node->exact));
+    memset(node->prefix, 0, sizeof(node->prefix));
+}
 
-    if (root != NULL) {
-        list_routes(root->left);
-        printf("%s -> %s \n", root->key, root->value);
-        list_routes(root->right);
+/**
+ * list_node - List the routes below a trie node
+ * @param node trie node
+ */
+static void list_node(const RouteNode *node)
+{
+    for (; node != NULL; node = node->next) {
+        for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+            const Route *routes[] = {node->exact[m], node->prefix[m]};
+            for (size_t i = 0; i < 2; i++) {
+                if (routes[i] == NULL)
+                    continue;
+                printf("%s %s%s -> %s \n", method_names[m], routes[i]->path,
+                       routes[i]->is_prefix ? "*" : "",
+                       routes[i]->value ? routes[i]->value : "handler");
+            }
+        }
+        list_node(node->children);
     }
 }
 
+/**
+ * list_routes - List all the routes in the router
+ * @param self Router object
+ */
+static void list_routes(Router *self)
+{
+    list_node(self->root);
+}
+
 /**
  * add_route - Add a new route to the router
- * @param root Root node of the router
- * @param endpoint uri
- * @param template the template file to render for the endpoint
- * @return Route object
+ * @param self Router object
+ * @param method HTTP method
+ * @param path uri
+ * @param handler function handling the request
+ * @param value handler argument, e.g. the template to render
+ * @param is_prefix also match every path starting with this one
  */
-static void add_route(Route **root, char *key, char *value)
+static void add_route(Router *self, enum METHOD method, const char *path,
+                      RouteHandler handler, const char *value, bool is_prefix)
 {
-    if (*root == NULL) {
-        *root = init_route(key, value);
-        return;
+    RouteNode *node = self->root;
+    const char *rest = path;
+
+    while (*rest != '\0') {
+        RouteNode *child = node->children;
+        while (child != NULL && child->label[0] != *rest)
+            child = child->next;
+
+        size_t rest_len = strlen(rest);
+        if (child == NULL) {
+            child = init_node(rest, rest_len);
+            child->next = node->children;
+            node->children = child;
+        }
+
+        size_t shared = common_prefix(child->label, rest, child->label_len);
+        if (shared < child->label_len)
+            split_node(child, shared);
+        node = child;
+        rest += shared;
     }
 
-    if (strcmp(key, (*root)->key) == 0) {
+    Route **slot = is_prefix ? &node->prefix[method] : &node->exact[method];
+    if (self->route_count == MAX_ROUTES) {
+        printf("============ WARNING ============\n");
+        printf("Too Many Routes, \"%s %s\" Ignored\n", method_names[method],
+               path);
+        return;
+    }
+    if (*slot != NULL) {
         printf("============ WARNING ============\n");
-        printf("A Route For \"%s\" Already Exists\n", key);
-    } else if (strcmp(key, (*root)->key) > 0) {
-        add_route(&(*root)->right, key, value);
-    } else {
-        add_route(&(*root)->left, key, value);
+        printf("A Route For \"%s %s\" Already Exists\n", method_names[method],
+               path);
+        return;
+    }
+    Route *route = must_calloc(1, sizeof(Route));
+    route->method = method;
+    route->path = path;
+    route->handler = handler;
+    route->value = value;
+    route->is_prefix = is_prefix;
+    route->id = self->route_count;
+    self->routes[self->route_count++] = route;
+    *slot = route;
+}
+
+/**
+ * has_routes - Check whether any method is routed at a node
+ * @param routes the exact or prefix routes of the node
+ * @return true if a route exists for any method
+ */
+static bool has_routes(Route *const routes[HTTP_METHOD_COUNT])
+{
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (routes[m] != NULL)
+            return true;
     }
+    return false;
 }
 
 /**
- * search_route - Search for a route in the router
- * @param root Root node of the router
- * @param endpoint uri
+ * match_route - Search for a route in the router
+ * Walks the trie once over the path; the longest matching prefix route is
+ * used when no exact route exists.
+ * @param self Router object
+ * @param method HTTP method of the request
+ * @param target request target, the query string is ignored
+ * @param path_known set when the path exists for another method
  * @return Route object
  */
-static Route *search_route(Route *root, const char *key)
+static const Route *match_route(Router *self, enum METHOD method,
+                                const char *target, bool *path_known)
 {
-    if (root == NULL) {
+    const Route *best = NULL;
+    const RouteNode *node = self->root;
+    size_t len = strcspn(target, "?#");
+    size_t pos = 0;
+    *path_known = false;
+    if (method >= HTTP_METHOD_COUNT)
         return NULL;
+
+    while (node != NULL) {
+        if (node->prefix[method] != NULL)
+            best = node->prefix[method];
+        else if (has_routes(node->prefix))
+            *path_known = true;
+
+        if (pos == len) {
+            if (node->exact[method] != NULL)
+                return node->exact[method];
+            *path_known = *path_known || has_routes(node->exact);
+            break;
+        }
+
+        const RouteNode *child = node->children;
+        while (child != NULL && child->label[0] != target[pos])
+            child = child->next;
+        if (child == NULL || child->label_len > len - pos ||
+            memcmp(child->label, target + pos, child->label_len) != 0)
+            break;
+        pos += child->label_len;
+        node = child;
     }
 
-    if (strcmp(key, root->key) == 0) {
-        return root;
-    } else if (strcmp(key, root->key) > 0) {
-        return search_route(root->right, key);
-    } else if (strcmp(key, root->key) < 0) {
-        return search_route(root->left, key);
+    if (best != NULL)
+        *path_known = false;
+    return best;
+}
+
+enum METHOD parse_method(const char *name)
+{
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++) {
+        if (strcmp(name, method_names[m]) == 0)
+            return (enum METHOD)m;
     }
-    return NULL;
+    return HTTP_METHOD_COUNT;
+}
+
+const char *method_name(enum METHOD method)
+{
+    return method < HTTP_METHOD_COUNT ? method_names[method] : "OTHER";
 }
 
 /**
@@ -89,8 +230,9 @@ void init_router(Router **self)
         printf("Failed to allocate memory for router\n");
         exit(1);
     }
-    (*self)->root = NULL;
+    (*self)->root = init_node("", 0);
+    (*self)->route_count = 0;
     (*self)->add_route = &add_route;
-    (*self)->search_route = &search_route;
+    (*self)->match_route = &match_route;
     (*self)->list_routes = &list_routes;
 }
@@ -1,38 +1,263 @@
+#define _GNU_SOURCE
 #include "../include/server.h"
+#include "../include/utils.h"
+#include "../include/worker.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
-#define TEMPLATE_SIZE 8192
-#define BUFFER_SIZE 8192
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_PREFIX_LEN 10 // hex length of CHUNK_SIZE plus \r\n
+
+static int send_all(int client_socket, const char *data, size_t data_len);
+static int send_iov(int client_socket, struct iovec *iov, int iov_len);
+static int send_response(int client_socket, const char *status,
+                         const char *headers, const char *body,
+                         size_t body_len);
+static void send_not_found_response(int client_socket);
+static void send_method_not_allowed(int client_socket);
+static void handle_get_requests(Server *self, Request *req);
+static void handle_metrics(Server *self, Request *req);
+
+// the response the calling thread is producing, NULL outside a handler
+static __thread Outbox *response_outbox;
 
 /**
  * config_router - Configure all the endpoints for the server
+ * Templates are read once here and served from memory afterwards.
  * @param self Server object
  */
 static void config_router(Server *self)
 {
-    self->router->add_route(&self->router->root, "/", "index.html");
+    self->router->add_route(self->router, HTTP_GET, "/", &handle_get_requests,
+                            "templates/index.html", false);
+    self->assets->load(self->assets, "templates/index.html", 200);
+    self->assets->load(self->assets, "templates/404.html", 404);
+    self->router->add_route(self->router, HTTP_GET, "/metrics",
+                            &handle_metrics, NULL, false);
+}
+
+/**
+ * get_request_header - Look up a header in an HTTP request
+ * @param request Raw HTTP request
+ * @param name Header name (case-insensitive)
+ * @param value Where to store the value
+ * @param value_len Size of the value buffer
+ * @return true if the header is present
+ */
+static bool get_request_header(const char *request, const char *name,
+                               char *value, size_t value_len)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(request, "\r\n");
+
+    // walk the header lines until the blank line closing them
+    while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *start = line + name_len + 1;
+            start += strspn(start, " \t");
+            size_t len = strcspn(start, "\r\n");
+            while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t'))
+                len--;
+            len = len < value_len ? len : value_len - 1;
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+/**
+ * get_range - Read the byte range asked for by the Range header
+ * Only a single range is honoured, anything else gets the whole body as the
+ * header allows.
+ * @param request Raw HTTP request
+ * @param total Length of the whole body
+ * @param first Where the offset of the first byte goes
+ * @param last Where the offset of the last byte goes
+ * @return 1 for a range to serve, 0 for the whole body, -1 if the range lies
+ * past the end
+ */
+static int get_range(const char *request, size_t total, size_t *first,
+                     size_t *last)
+{
+    char value[128];
+    if (!get_request_header(request, "Range", value, sizeof(value)) ||
+        strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL)
+        return 0;
+
+    const char *spec = value + 6;
+    char *end = NULL;
+    if (*spec == '-') {
+        // a suffix: the last n bytes
+        if (!isdigit((unsigned char)spec[1]))
+            return 0;
+        unsigned long long n = strtoull(spec + 1, &end, 10);
+        if (*end != '\0')
+            return 0;
+        if (n == 0 || total == 0)
+            return -1;
+        *first = n >= total ? 0 : total - (size_t)n;
+        *last = total - 1;
+        return 1;
+    }
+
+    if (!isdigit((unsigned char)*spec))
+        return 0;
+    unsigned long long from = strtoull(spec, &end, 10);
+    if (*end != '-')
+        return 0;
+    unsigned long long to = ULLONG_MAX;
+    if (end[1] != '\0') {
+        spec = end + 1;
+        if (!isdigit((unsigned char)*spec))
+            return 0;
+        to = strtoull(spec, &end, 10);
+        if (*end != '\0' || to < from)
+            return 0;
+    }
+    if (from >= total)
+        return -1;
+    *first = (size_t)from;
+    *last = to >= total ? total - 1 : (size_t)to;
+    return 1;
 }
 
 /**
- * handle_get_request - Handle GET request
+ * handle_get_request - Serve the template of a static route
+ * Requests without a route get the 404 page. The asset is held until it is
+ * sent, so a reload while sending doesn't free it.
  * @param server Server object
- * @param route Route to handle
+ * @param req Request to handle
  */
-static char *handle_get_requests(Server *self, const char *route)
+static void handle_get_requests(Server *self, Request *req)
 {
-    self->logger->info_log("Handling GET request", __FILE__, __LINE__);
-    struct Route *destination =
-        self->router->search_route(self->router->root, route);
-    char template[100] = "templates/";
-    !destination ? strcat(template, "404.html")
-                 : strcat(template, destination->value);
-    return (char *)self->render_static_route(self, template);
+    LOG_DEBUG(self->logger, "Handling GET request");
+    self->assets->refresh(self->assets);
+    const char *template =
+        req->route != NULL ? req->route->value : "templates/404.html";
+    const Asset *asset = self->assets->find(self->assets, template);
+    if (asset == NULL) {
+        send_not_found_response(req->client_socket);
+        return;
+    }
+
+    // answer revalidations without resending the body
+    char if_none_match[128], if_modified_since[64];
+    bool has_etag = get_request_header(req->raw, "If-None-Match",
+                                       if_none_match, sizeof(if_none_match));
+    bool has_date = get_request_header(req->raw, "If-Modified-Since",
+                                       if_modified_since,
+                                       sizeof(if_modified_since));
+    if (self->assets->is_fresh(asset, has_etag ? if_none_match : NULL,
+                               has_date ? if_modified_since : NULL)) {
+        send_all(req->client_socket, asset->not_modified,
+                 asset->not_modified_len);
+    } else {
+        struct iovec iov[2] = {{asset->header, asset->header_len},
+                               {asset->body, asset->body_len}};
+        send_iov(req->client_socket, iov, 2);
+    }
+    self->assets->release(self->assets, asset);
+}
+
+/**
+ * handle_metrics - Report the metrics in the Prometheus text format
+ * Gauges are read from their owners here; everything else comes from the
+ * per-thread shards.
+ * @param self Server object
+ * @param req Request to handle
+ */
+static void handle_metrics(Server *self, Request *req)
+{
+    char *body = NULL;
+    size_t body_len = 0;
+    Sink *out = new_buffer_sink(&body, &body_len);
+    self->metrics->render(self->metrics, self->router, out);
+
+    if (self->jobs != NULL) {
+        JobPool *jobs = self->jobs;
+        pthread_mutex_lock(&jobs->lock);
+        int queued_small = jobs->queued_small;
+        int queued_large = jobs->queued_large;
+        int running = jobs->running;
+        pthread_mutex_unlock(&jobs->lock);
+        write_metric(out, "huffman_jobs_queued_small", "gauge",
+                     "Small async jobs waiting to run.", queued_small);
+        write_metric(out, "huffman_jobs_queued_large", "gauge",
+                     "Large async jobs waiting to run.", queued_large);
+        write_metric(out, "huffman_jobs_running", "gauge",
+                     "Async jobs running.", running);
+    }
+
+    Admission *admission = self->admission;
+    pthread_mutex_lock(&admission->lock);
+    size_t used = admission->used;
+    int busy = admission->running;
+    unsigned long rejected = admission->rejected;
+    pthread_mutex_unlock(&admission->lock);
+    write_metric(out, "huffman_memory_reserved_bytes", "gauge",
+                 "Memory reserved by requests and jobs.", (double)used);
+    write_metric(out, "huffman_memory_budget_bytes", "gauge",
+                 "Memory requests and jobs may reserve.",
+                 (double)admission->budget);
+    write_metric(out, "huffman_codec_slots_busy", "gauge",
+                 "Codec runs in progress.", busy);
+    write_metric(out, "huffman_admission_denied_total", "counter",
+                 "Reservations and slots refused.", (double)rejected);
+
+    ResultCache *results = self->results;
+    pthread_mutex_lock(&results->lock);
+    unsigned long hits = results->hits, misses = results->misses;
+    size_t cached = results->size;
+    pthread_mutex_unlock(&results->lock);
+    write_metric(out, "huffman_result_cache_hits_total", "counter",
+                 "Uploads answered from the result cache.", (double)hits);
+    write_metric(out, "huffman_result_cache_misses_total", "counter",
+                 "Uploads that ran the codec.", (double)misses);
+    write_metric(out, "huffman_result_cache_bytes", "gauge",
+                 "Bytes of results cached.", (double)cached);
+
+    out->close(out);
+    send_response(req->client_socket, "200 OK",
+                  "Content-Type: text/plain; version=0.0.4\r\n", body,
+                  body_len);
+    free(body);
+}
+
+/**
+ * dispatch - Route a request to its handler
+ * @param self Server object
+ * @param req Request to handle
+ */
+static void dispatch(Server *self, Request *req)
+{
+    bool path_known = false;
+    req->route = self->router->match_route(self->router, req->method,
+                                           req->target, &path_known);
+    if (req->route != NULL) {
+        req->route->handler(self, req);
+    } else if (path_known) {
+        send_method_not_allowed(req->client_socket);
+    } else if (req->method == HTTP_GET) {
+        handle_get_requests(self, req);
+    } else {
+        send_not_found_response(req->client_socket);
+    }
 }
 
 /**
@@ -40,139 +265,391 @@ static char *handle_get_requests(Server *self, const char *route)
  * @param self Server object
  * @param chunk http request to parse
  * @param content_len length of the returned content
- * @return File content
+ * @return File content, NULL if the body is not a multipart upload
  */
 static const char *get_file_content(Server *self, const char *const chunk,
                                     const size_t chunk_len, long *content_len)
 {
     // get boundary
-    self->logger->info_log("Getting file content", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Getting file content");
+    const char *chunk_end = chunk + chunk_len;
     char boundary_header[] = "Content-Type: multipart/form-data; boundary=";
-    char *boundary = strstr(chunk, boundary_header) + strlen(boundary_header);
-    char *end_boundary = strstr(boundary, "\r\n");
+    const char *boundary = strstr(chunk, boundary_header);
+    if (boundary == NULL)
+        return NULL;
+    boundary += strlen(boundary_header);
+    const char *end_boundary = strstr(boundary, "\r\n");
+    if (end_boundary == NULL)
+        return NULL;
     size_t boundary_len = (size_t)(end_boundary - boundary);
-    char b[boundary_len];
+    char b[boundary_len + 1];
     strncpy(b, boundary, boundary_len);
+    b[boundary_len] = '\0';
 
-    // get file content
-    char *start = strstr(chunk, b) + boundary_len + 2;
-    start = strstr(start, b) + boundary_len + 2;
-    start = strstr(start, "\r\n\r\n") + 4;
-    char *end = strstr(start, b);
+    // get file content, which may hold NUL bytes, after the first delimiter
+    // and the part headers
+    const char *start = memmem(end_boundary, (size_t)(chunk_end - end_boundary),
+                               b, boundary_len);
+    if (start == NULL)
+        return NULL;
+    start += boundary_len;
+    start = memmem(start, (size_t)(chunk_end - start), "\r\n\r\n", 4);
+    if (start == NULL)
+        return NULL;
+    start += 4;
+    const char *end = memmem(start, (size_t)(chunk_end - start), b,
+                             boundary_len);
 
     // if there is no end boundary calculate the length by subtracting start of
     // form with the beginning of the chunk
-    *content_len = (end == NULL) ? (long)chunk_len - (start - chunk)
+    *content_len = (end == NULL) ? (long)(chunk_end - start)
                                  : end - start - 4; // 2 extra -- and  \r\n
+    if (*content_len < 0)
+        return NULL;
     return start;
 }
 
-/** get_content_length - Get http request content length
- * @param client_req Client request
- * @param total_size Total size of the request (where to store the result)
+/**
+ * get_url_param - Look up a query parameter in the request line
+ * @param url URL (or raw request) to search
+ * @param key Name of the parameter
+ * @param value Where to store the value
+ * @param value_len Size of the value buffer
+ * @return true if the parameter is present
  */
-static void get_content_length(const char *client_req, ssize_t *total_size)
+static bool get_url_param(const char *url, const char *key, char *value,
+                          size_t value_len)
 {
-    int cur_line = 0;
-    char *content_len = malloc(1000);
-    for (int i = 0; i < 9; i++) {
-        sscanf(client_req + cur_line, "%s", content_len);
-        cur_line += strlen(content_len) + 2; // skip \n
-        if (strcmp(content_len, "Content-Length:") == 0) {
-            sscanf(client_req + cur_line - 2, "%s", content_len);
-            *total_size = atoi(content_len);
-            free(content_len);
-            break;
+    const char *line_end = url + strcspn(url, "\r\n");
+    const char *param = strchr(url, '?');
+    if (param == NULL || param > line_end)
+        return false;
+
+    size_t key_len = strlen(key);
+    for (param++; param < line_end; param++) {
+        size_t param_len = strcspn(param, "& \r\n");
+        if (param_len > key_len && param[key_len] == '=' &&
+            strncmp(param, key, key_len) == 0) {
+            size_t len = param_len - key_len - 1;
+            len = len < value_len ? len : value_len - 1;
+            memcpy(value, param + key_len + 1, len);
+            value[len] = '\0';
+            return true;
         }
+        param += param_len;
+        if (*param != '&')
+            break;
     }
+    return false;
+}
+
+/**
+ * parse_url_params - Parse URL parameters
+ * @param self Server object
+ * @param url URL to parse
+ * @return Parsed URL parameters
+ */
+
+static void parse_url_params(Server *self,
+                             const char *url, char *out_file,
+                             char *service_type)
+{
+    LOG_DEBUG(self->logger, "Parsing URL parameters");
+    if (!get_url_param(url, "out_file", out_file, MAX_PARAM_LEN))
+        out_file[0] = '\0';
+    if (!get_url_param(url, "service_type", service_type, MAX_PARAM_LEN))
+        service_type[0] = '\0';
 }
 
 /**
- * get_client_request
+ * current_outbox - Find the outbox of the response being produced
  * @param client_socket Client socket
- * @return Client request
- */
-static void get_client_request(int client_socket, char **client_req,
-                               size_t *req_len)
-{
-    ssize_t total_size = BUFFER_SIZE;
-    ssize_t size_recv = 0;
-    size_t ext_len = 1;
-    while (1) {
-        size_recv = recv(client_socket, *client_req + *req_len, BUFFER_SIZE,
-                         MSG_DONTWAIT);
-
-        // go ahead and respond to client if it is a GET request
-        if (*req_len == 0) {
-            char method[100];
-            sscanf(*client_req, "%s", method);
-            if (strcmp(method, "GET") == 0) {
-                break;
-            }
-        }
+ * @return The outbox, NULL outside a handler
+ */
+static Outbox *current_outbox(int client_socket)
+{
+    if (response_outbox == NULL || response_outbox->fd != client_socket)
+        return NULL;
+    return response_outbox;
+}
 
-        if (size_recv < 0) {
+/**
+ * send_now - Write what a socket without an outbox takes right away
+ * Only used for the short answers the worker gives before a handler runs.
+ * @param client_socket Client socket
+ * @param data Data to send
+ * @param data_len Length of the data
+ * @return 0 if everything went out, -1 otherwise
+ */
+static int send_now(int client_socket, const char *data, size_t data_len)
+{
+    while (data_len > 0) {
+        ssize_t sent = send(client_socket, data, data_len,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR)
             continue;
-        }
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        data_len -= (size_t)sent;
+    }
+    return 0;
+}
 
-        *req_len += (size_t)size_recv;
-        if (*req_len >= (BUFFER_SIZE * ext_len - 1)) {
-            ext_len += 2;
-            char *new_buffer = realloc(*client_req, BUFFER_SIZE * ext_len);
-            *client_req = new_buffer;
-        }
+/**
+ * send_all - Send a whole buffer
+ * It goes to the outbox of the response, which writes what the socket takes
+ * and leaves the rest to the event loop.
+ * @param client_socket Client socket
+ * @param data Data to send
+ * @param data_len Length of the data
+ * @return 0 on success, -1 if the peer went away
+ */
+static int send_all(int client_socket, const char *data, size_t data_len)
+{
+    Outbox *out = current_outbox(client_socket);
+    if (out == NULL)
+        return send_now(client_socket, data, data_len);
+    return out->append(out, data, data_len);
+}
 
-        get_content_length(*client_req, &total_size);
-        if (*req_len >= (size_t)total_size) {
-            break;
-        }
+/**
+ * send_iov - Send several buffers in one go
+ * @param client_socket Client socket
+ * @param iov Buffers to send
+ * @param iov_len Number of buffers
+ * @return 0 on success, -1 if the peer went away
+ */
+static int send_iov(int client_socket, struct iovec *iov, int iov_len)
+{
+    for (int i = 0; i < iov_len; i++) {
+        if (send_all(client_socket, iov[i].iov_base, iov[i].iov_len) != 0)
+            return -1;
     }
+    return 0;
 }
 
 /**
- * parse_url_params - Parse URL parameters
- * @param self Server object
- * @param url URL to parse
- * @return Parsed URL parameters
+ * send_held - Send a buffer that stays valid until release() is called
+ * Large results are queued without a copy this way.
+ * @param client_socket Client socket
+ * @param data Data to send
+ * @param data_len Length of the data
+ * @param release Called once the data is no longer needed
+ * @param ctx Handed to release
+ * @return 0 on success, -1 if the peer went away
  */
+static int send_held(int client_socket, const char *data, size_t data_len,
+                     void (*release)(void *ctx), void *ctx)
+{
+    Outbox *out = current_outbox(client_socket);
+    if (out != NULL)
+        return out->append_held(out, data, data_len, release, ctx);
+    int status = send_now(client_socket, data, data_len);
+    release(ctx);
+    return status;
+}
 
-static void parse_url_params(Server *self __attribute__((unused)),
-                             const char *url, char *out_file,
-                             char *service_type)
+/**
+ * send_file - Send a file region straight from the page cache
+ * @param client_socket Client socket
+ * @param fd File to send, which the caller may close right away
+ * @param offset Offset of the first byte to send
+ * @param len Number of bytes to send
+ * @return 0 on success, -1 if the peer went away or the file shrank
+ */
+static int send_file(int client_socket, int fd, off_t offset, size_t len)
 {
-    /*self->logger->info_log("Parsing URL parameters", __FILE__, __LINE__);*/
-    char *start = strchr(url, '?');
-    sscanf(start + 1, "out_file=%[^&]&service_type=%s", out_file, service_type);
+    Outbox *out = current_outbox(client_socket);
+    if (out == NULL)
+        return -1;
+    return out->append_file(out, fd, offset, len);
 }
 
+typedef struct ResponseSink ResponseSink;
+struct ResponseSink {
+    Sink base;
+    int client_socket;
+    bool chunked;
+    int failed;
+    size_t len;
+    char buffer[CHUNK_PREFIX_LEN + CHUNK_SIZE + 2];
+};
+
 /**
- * render_static_route - Render a static route
- * @param self Server object
- * @param endpoint Endpoint to render
- * @return Rendered template data
+ * flush_chunk - Send the buffered data, as one HTTP chunk if chunked
+ * @param sink Response sink
+ * @return 0 on success, -1 once the client has gone away
  */
-static const char *render_static_route(Server *self, const char *endpoint)
+static int flush_chunk(ResponseSink *sink)
 {
-    self->logger->info_log("Rendering...", __FILE__, __LINE__);
-    FILE *file;
-    char *buffer;
+    if (sink->failed || sink->len == 0)
+        return sink->failed ? -1 : 0;
 
-    file = fopen(endpoint, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        self->logger->error_log("Error opening file", __FILE__, __LINE__);
+    char *start = sink->buffer + CHUNK_PREFIX_LEN;
+    size_t len = sink->len;
+    if (sink->chunked) {
+        // the size line is written right before the data so that the whole
+        // chunk leaves in a single send
+        char size_line[CHUNK_PREFIX_LEN + 1];
+        int size_len =
+            snprintf(size_line, sizeof(size_line), "%zx\r\n", sink->len);
+        start -= size_len;
+        memcpy(start, size_line, (size_t)size_len);
+        memcpy(sink->buffer + CHUNK_PREFIX_LEN + sink->len, "\r\n", 2);
+        len += (size_t)size_len + 2;
     }
+    if (send_all(sink->client_socket, start, len) != 0)
+        sink->failed = 1;
+    sink->len = 0;
+    return sink->failed ? -1 : 0;
+}
 
-    // get filename
-    fseek(file, 0, SEEK_END);
-    size_t filelen = (size_t)ftell(file);
-    rewind(file);
+/**
+ * response_write - Buffer data and send it whenever a chunk is full
+ * @param self Response sink
+ * @param data Data to send
+ * @param data_len Length of the data
+ * @return 0 on success, -1 once the client has gone away
+ */
+static int response_write(Sink *self, const char *data, const size_t data_len)
+{
+    ResponseSink *sink = (ResponseSink *)self;
+    size_t left = data_len;
+    while (left > 0 && !sink->failed) {
+        size_t room = CHUNK_SIZE - sink->len;
+        size_t len = left < room ? left : room;
+        memcpy(sink->buffer + CHUNK_PREFIX_LEN + sink->len, data, len);
+        sink->len += len;
+        data += len;
+        left -= len;
+        if (sink->len == CHUNK_SIZE)
+            flush_chunk(sink);
+    }
+    return sink->failed ? -1 : 0;
+}
 
-    // store data
-    buffer = (char *)malloc((filelen + 1) * sizeof(char));
-    fread(buffer, filelen, 1, file);
-    fclose(file);
-    return buffer;
+/**
+ * response_close - Send what is left, and the last chunk, and free the sink
+ * @param self Response sink
+ * @return 0 on success, -1 if the client went away
+ */
+static int response_close(Sink *self)
+{
+    ResponseSink *sink = (ResponseSink *)self;
+    if (flush_chunk(sink) == 0 && sink->chunked &&
+        send_all(sink->client_socket, "0\r\n\r\n", 5) != 0)
+        sink->failed = 1;
+    int failed = sink->failed;
+    free(sink);
+    return failed ? -1 : 0;
+}
+
+/**
+ * response_abort - Drop what is left and shut the connection down
+ * The last chunk is never sent, and a body shorter than its Content-Length
+ * is cut off, so the client sees the response is incomplete.
+ * @param self Response sink
+ */
+static void response_abort(Sink *self)
+{
+    ResponseSink *sink = (ResponseSink *)self;
+    Outbox *out = current_outbox(sink->client_socket);
+    if (out != NULL)
+        out->fail(out);
+    else
+        shutdown(sink->client_socket, SHUT_RDWR);
+    free(sink);
+}
+
+/**
+ * new_response_sink - Create a sink streaming a response body
+ * @param client_socket Client socket
+ * @param header The status line and headers, already complete
+ * @param chunked Whether the body goes out with chunked transfer encoding
+ * @return The sink, failed already if the header couldn't be sent
+ */
+static Sink *new_response_sink(int client_socket, const char *header,
+                               bool chunked)
+{
+    ResponseSink *sink = must_calloc(1, sizeof(ResponseSink));
+    sink->base.write = &response_write;
+    sink->base.close = &response_close;
+    sink->base.abort = &response_abort;
+    sink->client_socket = client_socket;
+    sink->chunked = chunked;
+    sink->failed = send_all(client_socket, header, strlen(header)) != 0;
+    return &sink->base;
+}
+
+/**
+ * open_chunked_response - Start a chunked download response
+ * @param client_socket Client socket
+ * @param filename File name suggested to the client
+ * @return Sink streaming the response body to the client
+ */
+static Sink *open_chunked_response(int client_socket, const char *filename)
+{
+    char header[512];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 200 OK\r\n"
+             "Access-Control-Expose-Headers: Content-Disposition\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Disposition: attachment; filename=\"%s\"\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "\r\n",
+             filename);
+    return new_response_sink(client_socket, header, true);
+}
+
+/**
+ * open_response - Start a response whose body is streamed afterwards
+ * @param client_socket Client socket
+ * @param status Status line, e.g. "206 Partial Content"
+ * @param headers Extra header lines, each ending with CRLF
+ * @param body_len Length of the body that will be written to the sink
+ * @return Sink streaming the response body to the client
+ */
+static Sink *open_response(int client_socket, const char *status,
+                           const char *headers, size_t body_len)
+{
+    char header[1024];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\n"
+             "%s"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             status, headers, body_len);
+    return new_response_sink(client_socket, header, false);
+}
+
+/**
+ * send_response - Send a complete response
+ * @param client_socket Client socket
+ * @param status Status line, e.g. "202 Accepted"
+ * @param headers Extra header lines, each ending with CRLF
+ * @param body Body of the response
+ * @param body_len Length of the body
+ * @return 0 on success, -1 if the client went away
+ */
+static int send_response(int client_socket, const char *status,
+                         const char *headers, const char *body,
+                         size_t body_len)
+{
+    char http_header[512];
+    int header_len = snprintf(http_header, sizeof(http_header),
+                              "HTTP/1.1 %s\r\n"
+                              "%s"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n"
+                              "\r\n",
+                              status, headers, body_len);
+    if (header_len < 0 || (size_t)header_len >= sizeof(http_header))
+        return -1;
+    struct iovec iov[2] = {{http_header, (size_t)header_len},
+                           {(void *)body, body_len}};
+    return send_iov(client_socket, iov, body_len > 0 ? 2 : 1);
 }
 
 /**
@@ -181,32 +658,238 @@ static const char *render_static_route(Server *self, const char *endpoint)
  */
 static void send_not_found_response(int client_socket)
 {
-    char http_header[TEMPLATE_SIZE] = "HTTP/1.1 404 Not Found\r\n\r\n";
-    send(client_socket, http_header, sizeof(http_header), 0);
-    close(client_socket);
+    send_response(client_socket, "404 Not Found", "", "", 0);
+}
+
+/**
+ * send_method_not_allowed - Send a 405 Method Not Allowed response
+ * @param client_socket Client socket
+ */
+static void send_method_not_allowed(int client_socket)
+{
+    send_response(client_socket, "405 Method Not Allowed", "", "", 0);
 }
 
 /**
  * send_ok_response - Send a 200 OK response
  * @param client_socket Client socket
- * @param content_type Content type of the response
- * @param content_length Content length of the response
+ * @param response_data Body of the response
  */
 static void send_ok_response(int client_socket, const char *response_data)
 {
-    char http_header[TEMPLATE_SIZE] = "HTTP/1.1 200 OK\r\n\r\n";
-    strcat(http_header, response_data);
-    strcat(http_header, "\r\n\r\n");
-    send(client_socket, http_header, sizeof(http_header), 0);
-    close(client_socket);
+    send_response(client_socket, "200 OK", "", response_data,
+                  strlen(response_data));
+}
+
+/**
+ * observe_response - Record a response once its connection is done with it
+ * @param self Server object
+ * @param req The request it answered
+ * @param out Its outbox
+ */
+static void observe_response(Server *self, const Request *req,
+                             const Outbox *out)
+{
+    self->metrics->observe_request(self->metrics, req->route, out->status,
+                                   monotonic_seconds() - req->started);
+    self->metrics->count(self->metrics, COUNTER_BYTES_SENT, out->sent);
+}
+
+/**
+ * handle_request - Parse a complete request and dispatch it
+ * Unless the handler deferred it, the response is finished once the handler
+ * returns, though its outbox may still hold bytes for the event loop.
+ * @param self Server object
+ * @param req The request, with its socket, raw request and outbox filled in
+ */
+static void handle_request(Server *self, Request *req)
+{
+    // parsing client socket header to get HTTP method, route
+    char method[16] = "";
+    char target[MAX_TARGET_LEN] = "";
+    sscanf(req->raw, "%15s %2047s HTTP/1.1", method, target);
+
+    req->method = parse_method(method);
+    req->target = target;
+    req->route = NULL;
+    req->started = monotonic_seconds();
+    response_outbox = req->outbox;
+    dispatch(self, req);
+    response_outbox = NULL;
+    if (!req->outbox->off_loop)
+        req->outbox->finish(req->outbox);
+}
+
+typedef struct Deferred Deferred;
+struct Deferred {
+    Server *server;
+    Request req;
+    char target[MAX_TARGET_LEN];
+    RequestTask task;
+    void *arg;
+};
+
+/**
+ * run_deferred - Finish a deferred request on a request thread of the pool
+ * @param job Request job carrying the deferred request
+ */
+static void run_deferred(Job *job)
+{
+    Deferred *deferred = job->ctx;
+    Request *req = &deferred->req;
+    response_outbox = req->outbox;
+    deferred->task(deferred->server, req, deferred->arg);
+    response_outbox = NULL;
+    req->outbox->finish(req->outbox);
+    free(deferred);
+}
+
+/**
+ * defer - Finish a request on the job pool rather than the event loop
+ * Handlers that run the codec take their codec slots and hand the rest of
+ * the work over, so the worker goes on serving its other connections.
+ * Without a job pool the task runs right away.
+ * @param self Server object
+ * @param req Request being handled, returned from by the handler afterwards
+ * @param task The rest of the work, which sends the response and gives the
+ * codec slots back
+ * @param arg Handed to the task
+ */
+static void defer(Server *self, Request *req, RequestTask task, void *arg)
+{
+    if (self->jobs == NULL) {
+        task(self, req, arg);
+        return;
+    }
+    Deferred *deferred = must_calloc(1, sizeof(Deferred));
+    deferred->server = self;
+    deferred->req = *req;
+    snprintf(deferred->target, sizeof(deferred->target), "%s", req->target);
+    deferred->req.target = deferred->target;
+    deferred->task = task;
+    deferred->arg = arg;
+    req->outbox->off_loop = true;
+
+    Job *job = must_calloc(1, sizeof(Job));
+    job->ctx = deferred;
+    job->run = &run_deferred;
+    self->jobs->submit_request(self->jobs, job);
+}
+
+/**
+ * open_listener - Create a listening socket on the server port
+ * With SO_REUSEPORT every call returns a new socket on the same port and the
+ * kernel spreads incoming connections across them.
+ * @param self Server object
+ * @return Listening socket
+ */
+static int open_listener(Server *self)
+{
+    int one = 1;
+    int server_socket =
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (self->reuseport &&
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) != 0) {
+        LOG_ERROR(self->logger, "Failed to set SO_REUSEPORT");
+        exit(1);
+    }
+
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons((uint16_t)self->port);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    // bind port
+    if (bind(server_socket, (struct sockaddr *)&server_address,
+             sizeof(server_address)) != 0) {
+        LOG_ERROR(self->logger, "Failed to bind socket");
+        exit(1);
+    } else {
+        LOG_DEBUG(self->logger, "Socket bound");
+    }
+
+    if (listen(server_socket, self->backlog) != 0) {
+        LOG_ERROR(self->logger, "Failed to listen");
+        exit(1);
+    }
+    return server_socket;
+}
+
+/**
+ * open_unix_listener - Create a listening socket on the Unix socket path
+ * A socket file left behind by an earlier run is replaced.
+ * @param self Server object
+ * @return Listening socket
+ */
+static int open_unix_listener(Server *self)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(self->unix_path) >= sizeof(address.sun_path)) {
+        LOG_ERROR(self->logger, "Unix socket path too long");
+        exit(1);
+    }
+    strcpy(address.sun_path, self->unix_path);
+
+    int server_socket =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(self->unix_path);
+    if (server_socket < 0 ||
+        bind(server_socket, (struct sockaddr *)&address, sizeof(address)) !=
+            0) {
+        LOG_ERRORF(self->logger, "Failed to bind socket", "path=\"%s\"",
+                   self->unix_path);
+        exit(1);
+    }
+    if (listen(server_socket, self->backlog) != 0) {
+        LOG_ERROR(self->logger, "Failed to listen");
+        exit(1);
+    }
+    return server_socket;
+}
+
+/**
+ * serve - Run the worker event loops until they exit
+ * Workers share the main listener, or each get their own SO_REUSEPORT
+ * listener and a core of their own.
+ * @param self Server object
+ * @param workers Number of worker threads
+ */
+static void serve(Server *self, int workers)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Worker **pool = must_calloc((size_t)workers, sizeof(Worker *));
+    for (int i = 0; i < workers; i++) {
+        int listener = (self->reuseport && i > 0) ? open_listener(self)
+                                                  : self->socket;
+        int cpu = (self->reuseport && cpus > 0) ? (int)(i % cpus) : -1;
+        init_worker(&pool[i], self, i, listener, cpu);
+        pool[i]->start(pool[i]);
+    }
+
+    LOG_INFOF(self->logger, "Started workers",
+              "workers=%d reuseport=%s backend=%s", workers,
+              self->reuseport ? "true" : "false",
+              self->io_uring ? "io_uring" : "epoll");
+    for (int i = 0; i < workers; i++)
+        pool[i]->join(pool[i]);
+    free(pool);
 }
 
 /**
  * init_server - Initialize server
  * @param self Server object
  * @param port Port to listen on
+ * @param backlog Length of the accept queue
+ * @param reuseport Give every worker its own SO_REUSEPORT listener
+ * @param unix_path Unix domain socket to listen on as well, or NULL
  */
-void init_server(Server **self, int port)
+void init_server(Server **self, int port, int backlog, bool reuseport,
+                 const char *unix_path)
 {
     if ((*self = (Server *)malloc(sizeof(Server))) == NULL) {
         perror("Error allocating memory");
@@ -214,35 +897,51 @@ void init_server(Server **self, int port)
     }
 
     (*self)->port = port;
+    (*self)->backlog = backlog;
+    (*self)->reuseport = reuseport;
+    (*self)->io_uring = false;
+    (*self)->unix_path = unix_path;
+    (*self)->store_compressed = false;
     init_logger(&(*self)->logger);
     init_router(&(*self)->router);
+    init_asset_cache(&(*self)->assets, false);
+    init_result_cache(&(*self)->results, 0);
+    (*self)->jobs = NULL;
+    init_metrics(&(*self)->metrics);
+    init_admission(&(*self)->admission, SIZE_MAX, INT_MAX);
+    (*self)->timeouts = (Timeouts){.header = 10,
+                                   .body = 60,
+                                   .idle = 15,
+                                   .write = 30,
+                                   .min_rate = 500};
     (*self)->config_router = &config_router;
-    (*self)->render_static_route = &render_static_route;
     (*self)->send_ok_response = &send_ok_response;
     (*self)->send_not_found_response = &send_not_found_response;
+    (*self)->send_method_not_allowed = &send_method_not_allowed;
+    (*self)->handle_request = &handle_request;
+    (*self)->observe_response = &observe_response;
+    (*self)->defer = &defer;
+    (*self)->dispatch = &dispatch;
+    (*self)->serve = &serve;
     (*self)->handle_get_requests = &handle_get_requests;
     (*self)->get_file_content = &get_file_content;
     (*self)->parse_url_params = &parse_url_params;
-    (*self)->get_client_request = &get_client_request;
-
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+    (*self)->send_all = &send_all;
+    (*self)->send_held = &send_held;
+    (*self)->send_response = &send_response;
+    (*self)->send_file = &send_file;
+    (*self)->get_url_param = &get_url_param;
+    (*self)->get_request_header = &get_request_header;
+    (*self)->open_chunked_response = &open_chunked_response;
+    (*self)->open_response = &open_response;
+    (*self)->get_range = &get_range;
 
-    // bind port
-    if (bind(server_socket, (struct sockaddr *)&server_address,
-             sizeof(server_address)) != 0) {
-        (*self)->logger->error_log("Failed to bind socket", __FILE__, __LINE__);
-        exit(1);
-    } else {
-        (*self)->logger->info_log("Socket bound", __FILE__, __LINE__);
+    (*self)->socket = open_listener(*self);
+    LOG_INFOF((*self)->logger, "Server listening", "port=%d", port);
+    (*self)->unix_socket = -1;
+    if (unix_path != NULL) {
+        (*self)->unix_socket = open_unix_listener(*self);
+        LOG_INFOF((*self)->logger, "Server listening", "path=\"%s\"",
+                  unix_path);
     }
-
-    char msg[100];
-    snprintf(msg, 100, "Server listening on port %d", port);
-    listen(server_socket, 5);
-    (*self)->socket = server_socket;
-    (*self)->logger->info_log(msg, __FILE__, __LINE__);
 }
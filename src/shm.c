@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "../include/shm.h"
+#include "../include/utils.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// slots start on their own cache line, as does the state of every slot
+#define SHM_ALIGN 64
+// polls of a futex word before going to sleep on it, which keeps a busy
+// caller from paying for a wakeup
+#define SHM_SPINS 4000
+// how often a waiting client checks that the service is still alive
+#define SHM_PROBE_SECONDS 1
+
+struct ShmHeader {
+    char magic[8];
+    uint64_t slot_size; // bytes of data in a slot
+    uint64_t stride;    // bytes from one slot to the next
+    int32_t pid;        // process of the service
+    uint32_t slots;
+    uint32_t doorbell; // bumped for every submitted request
+    uint32_t sleepers; // service threads asleep on the doorbell
+    uint32_t next;     // ticket spreading clients over the slots
+    uint32_t released; // bumped for every slot given back
+    uint32_t waiters;  // clients asleep waiting for a free slot
+};
+
+struct ShmSlot {
+    uint32_t state; // an enum SHM_STATE
+    uint32_t mode;  // an enum MODE
+    uint64_t len;   // input length, then output length
+    char data[];
+};
+
+typedef struct SlotSink SlotSink;
+struct SlotSink {
+    Sink base;
+    char *buf; // workspace of the service thread
+    size_t cap;
+    size_t len; // keeps counting past cap, to report what was needed
+};
+
+/**
+ * futex_wait - Sleep while a shared word holds a value
+ * @param addr The word, inside the segment
+ * @param value The value to sleep on
+ * @param timeout Longest sleep, NULL for none
+ * @return 0 once woken, -1 with errno set otherwise
+ */
+static int futex_wait(uint32_t *addr, uint32_t value,
+                      const struct timespec *timeout)
+{
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT, value, timeout, NULL,
+                        0);
+}
+
+/**
+ * futex_wake - Wake processes sleeping on a shared word
+ * @param addr The word, inside the segment
+ * @param count How many to wake at most
+ */
+static void futex_wake(uint32_t *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/**
+ * slot_at - Find a slot of the segment
+ * @param header The segment
+ * @param i Index of the slot
+ * @return The slot
+ */
+static ShmSlot *slot_at(ShmHeader *header, size_t i)
+{
+    return (ShmSlot *)((char *)header + SHM_ALIGN + i * header->stride);
+}
+
+/**
+ * segment_size - Work out the size of a segment
+ * @param slots Number of slots
+ * @param slot_size Bytes of data in a slot
+ * @param stride Where to store the bytes from one slot to the next
+ * @return The size in bytes, 0 if it doesn't fit in a size_t
+ */
+static size_t segment_size(size_t slots, size_t slot_size, size_t *stride)
+{
+    size_t limit = SIZE_MAX - SHM_ALIGN - sizeof(ShmSlot) - SHM_ALIGN;
+    if (slots == 0 || slot_size > limit)
+        return 0;
+    *stride = (sizeof(ShmSlot) + slot_size + SHM_ALIGN - 1) &
+              ~(size_t)(SHM_ALIGN - 1);
+    if (slots > (SIZE_MAX - SHM_ALIGN) / *stride)
+        return 0;
+    return SHM_ALIGN + slots * *stride;
+}
+
+/**
+ * slot_write - Collect output in the workspace
+ * @param self The slot sink
+ * @param data The data to append
+ * @param data_len The length of the data
+ * @return 0, output that doesn't fit is only counted
+ */
+static int slot_write(Sink *self, const char *data, const size_t data_len)
+{
+    SlotSink *sink = (SlotSink *)self;
+    if (sink->len <= sink->cap && data_len <= sink->cap - sink->len)
+        memcpy(sink->buf + sink->len, data, data_len);
+    sink->len = data_len > SIZE_MAX - sink->len ? SIZE_MAX
+                                                : sink->len + data_len;
+    return 0;
+}
+
+/**
+ * slot_close - Nothing to release, the workspace outlives the request
+ * @param self The slot sink
+ * @return 0
+ */
+static int slot_close(Sink *self)
+{
+    (void)self;
+    return 0;
+}
+
+/**
+ * take - Claim a submitted request
+ * @param self The service
+ * @return The slot, NULL if nothing is waiting
+ */
+static ShmSlot *take(ShmService *self)
+{
+    for (size_t i = 0; i < self->header->slots; i++) {
+        ShmSlot *slot = slot_at(self->header, i);
+        uint32_t expected = SHM_SUBMITTED;
+        if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) == expected &&
+            __atomic_compare_exchange_n(&slot->state, &expected, SHM_RUNNING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return slot;
+    }
+    return NULL;
+}
+
+/**
+ * answer - Run the codec on a request and put the output in its slot
+ * The codec reads the input from the slot, so the output is collected in
+ * the workspace first and copied over the input once it is complete.
+ * @param self The service
+ * @param slot The slot, claimed by take()
+ * @param workspace Slot size bytes owned by the calling thread
+ */
+static void answer(ShmService *self, ShmSlot *slot, char *workspace)
+{
+    size_t cap = self->header->slot_size;
+    SlotSink sink = {.base = {.write = &slot_write, .close = &slot_close},
+                     .buf = workspace,
+                     .cap = cap,
+                     .len = 0};
+    enum SHM_STATE state = SHM_FAILED;
+    bool valid = (slot->mode == COMPRESS || slot->mode == DECOMPRESS) &&
+                 slot->len <= cap;
+    if (valid && self->run(self->ctx, (enum MODE)slot->mode, slot->data,
+                           (size_t)slot->len, &sink.base) == 0) {
+        state = sink.len <= cap ? SHM_DONE : SHM_TOO_LARGE;
+    }
+
+    if (state == SHM_DONE)
+        memcpy(slot->data, workspace, sink.len);
+    slot->len = state == SHM_FAILED ? 0 : sink.len;
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+    futex_wake(&slot->state, 1);
+}
+
+/**
+ * serve - Service thread answering requests until the process exits
+ * @param arg The service
+ * @return NULL
+ */
+static void *serve(void *arg)
+{
+    ShmService *self = arg;
+    ShmHeader *header = self->header;
+    char *workspace = must_calloc(header->slot_size, sizeof(char));
+    while (1) {
+        uint32_t rung = __atomic_load_n(&header->doorbell, __ATOMIC_SEQ_CST);
+        ShmSlot *slot = take(self);
+        if (slot != NULL) {
+            answer(self, slot, workspace);
+            continue;
+        }
+
+        int spins = 0;
+        while (spins < SHM_SPINS &&
+               __atomic_load_n(&header->doorbell, __ATOMIC_RELAXED) == rung)
+            spins++;
+        if (spins < SHM_SPINS)
+            continue;
+        // a client rings after submitting and wakes only if someone sleeps,
+        // so announce the sleep before checking the doorbell a last time
+        __atomic_add_fetch(&header->sleepers, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&header->doorbell, rung, NULL);
+        __atomic_sub_fetch(&header->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/**
+ * start - Start the service threads
+ * @param self The service
+ */
+static void start(ShmService *self)
+{
+    self->pool = must_calloc((size_t)self->threads, sizeof(pthread_t));
+    for (int i = 0; i < self->threads; i++) {
+        if (pthread_create(&self->pool[i], NULL, &serve, self) != 0) {
+            perror("Error starting shared memory service");
+            exit(1);
+        }
+        pthread_detach(self->pool[i]);
+    }
+}
+
+int init_shm_service(ShmService **self, const char *name, size_t slots,
+                     size_t slot_size, int threads)
+{
+    size_t stride = 0;
+    size_t size = segment_size(slots, slot_size, &stride);
+    if (size == 0 || slots > UINT32_MAX || strlen(name) >= 64)
+        return -1;
+
+    // a segment left by an earlier run may still be mapped by its clients,
+    // who keep the old one while new clients find this one
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0)
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    // the pages come zeroed, so every slot starts out SHM_FREE
+    ShmHeader *header = base;
+    header->slot_size = slot_size;
+    header->stride = stride;
+    header->slots = (uint32_t)slots;
+    header->pid = (int32_t)getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+
+    *self = (ShmService *)must_calloc(1, sizeof(ShmService));
+    snprintf((*self)->name, sizeof((*self)->name), "%s", name);
+    (*self)->header = header;
+    (*self)->size = size;
+    (*self)->threads = threads;
+    (*self)->start = &start;
+    return 0;
+}
+
+/**
+ * slot_of - Find the slot holding some data
+ * @param data The data of the slot
+ * @return The slot
+ */
+static ShmSlot *slot_of(char *data)
+{
+    return (ShmSlot *)(data - offsetof(ShmSlot, data));
+}
+
+/**
+ * acquire - Claim a free slot, waiting for one if they are all in use
+ * @param self The client
+ * @param capacity Where to store how many bytes the slot holds
+ * @return The data of the slot
+ */
+static char *acquire(ShmClient *self, size_t *capacity)
+{
+    ShmHeader *header = self->header;
+    *capacity = header->slot_size;
+    while (1) {
+        uint32_t released =
+            __atomic_load_n(&header->released, __ATOMIC_SEQ_CST);
+        for (size_t i = 0; i < header->slots; i++) {
+            uint32_t ticket =
+                __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+            ShmSlot *slot = slot_at(header, ticket % header->slots);
+            uint32_t expected = SHM_FREE;
+            if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                            SHM_CLAIMED, false,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return slot->data;
+        }
+        __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&header->released, released, NULL);
+        __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * call - Submit the input written to a claimed slot and wait for the output
+ * @param self The client
+ * @param data The data of the slot
+ * @param mode Whether to compress or decompress
+ * @param input_len The length of the input
+ * @param output_len Where to store the length of the output
+ * @return The state the request ended in
+ */
+static enum SHM_STATE call(ShmClient *self, char *data, enum MODE mode,
+                           size_t input_len, size_t *output_len)
+{
+    ShmHeader *header = self->header;
+    ShmSlot *slot = slot_of(data);
+    slot->mode = (uint32_t)mode;
+    slot->len = input_len;
+    __atomic_store_n(&slot->state, SHM_SUBMITTED, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->doorbell, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->sleepers, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&header->doorbell, 1);
+
+    // a service that died would leave the request waiting forever
+    const struct timespec probe = {SHM_PROBE_SECONDS, 0};
+    uint32_t state;
+    for (int spins = 0;
+         (state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) ==
+             SHM_SUBMITTED ||
+         state == SHM_RUNNING;
+         spins++) {
+        if (spins < SHM_SPINS)
+            continue;
+        if (futex_wait(&slot->state, state, &probe) != 0 &&
+            errno == ETIMEDOUT && kill(header->pid, 0) != 0 &&
+            errno == ESRCH) {
+            *output_len = 0;
+            return SHM_FAILED;
+        }
+    }
+    *output_len = (size_t)slot->len;
+    return (enum SHM_STATE)state;
+}
+
+/**
+ * release - Give back a slot once its output has been read
+ * @param self The client
+ * @param data The data of the slot
+ */
+static void release(ShmClient *self, char *data)
+{
+    ShmHeader *header = self->header;
+    __atomic_store_n(&slot_of(data)->state, SHM_FREE, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->released, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&header->released, INT_MAX);
+}
+
+/**
+ * close_client - Unmap the segment and free the client
+ * @param self The client
+ */
+static void close_client(ShmClient *self)
+{
+    munmap(self->header, self->size);
+    free(self);
+}
+
+ShmClient *open_shm_client(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= SHM_ALIGN)
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    // the service writes the magic last, and the geometry must match the
+    // size of the segment before any slot is touched
+    ShmHeader *header = base;
+    size_t stride = 0;
+    bool valid = memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) == 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = valid &&
+            segment_size(header->slots, header->slot_size, &stride) ==
+                (size_t)st.st_size &&
+            stride == header->stride;
+    if (!valid) {
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+
+    ShmClient *self = must_calloc(1, sizeof(ShmClient));
+    self->header = header;
+    self->size = (size_t)st.st_size;
+    self->acquire = &acquire;
+    self->call = &call;
+    self->release = &release;
+    self->close = &close_client;
+    return self;
+}
@@ -0,0 +1,269 @@
+#include "../include/sink.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void sink_abort(Sink *sink)
+{
+    if (sink->abort != NULL)
+        sink->abort(sink);
+    else
+        sink->close(sink);
+}
+
+typedef struct FileSink FileSink;
+struct FileSink {
+    Sink base;
+    FILE *file;
+    int failed;
+};
+
+/**
+ * file_write - Append data to the file
+ * @param self The file sink
+ * @param data The data to append
+ * @param data_len The length of the data
+ * @return 0 on success, -1 once a write has failed
+ */
+static int file_write(Sink *self, const char *data, const size_t data_len)
+{
+    FileSink *sink = (FileSink *)self;
+    if (!sink->failed && fwrite(data, 1, data_len, sink->file) != data_len)
+        sink->failed = 1;
+    return sink->failed ? -1 : 0;
+}
+
+/**
+ * file_close - Close the file and free the sink
+ * @param self The file sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int file_close(Sink *self)
+{
+    FileSink *sink = (FileSink *)self;
+    int failed = (fclose(sink->file) != 0) || sink->failed;
+    free(sink);
+    return failed ? -1 : 0;
+}
+
+Sink *new_file_sink(const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+        return NULL;
+
+    FileSink *sink = must_calloc(1, sizeof(FileSink));
+    sink->base.write = &file_write;
+    sink->base.close = &file_close;
+    sink->file = file;
+    return &sink->base;
+}
+
+typedef struct FdSink FdSink;
+struct FdSink {
+    Sink base;
+    int fd;
+    int failed;
+};
+
+/**
+ * fd_write - Write all of the data to the descriptor
+ * @param self The fd sink
+ * @param data The data to write
+ * @param data_len The length of the data
+ * @return 0 on success, -1 once a write has failed
+ */
+static int fd_write(Sink *self, const char *data, const size_t data_len)
+{
+    FdSink *sink = (FdSink *)self;
+    for (size_t done = 0; done < data_len && !sink->failed;) {
+        ssize_t sent = write(sink->fd, data + done, data_len - done);
+        if (sent < 0 && errno != EINTR)
+            sink->failed = 1;
+        else if (sent > 0)
+            done += (size_t)sent;
+    }
+    return sink->failed ? -1 : 0;
+}
+
+/**
+ * fd_close - Free the sink, leaving the descriptor open
+ * @param self The fd sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int fd_close(Sink *self)
+{
+    FdSink *sink = (FdSink *)self;
+    int failed = sink->failed;
+    free(sink);
+    return failed ? -1 : 0;
+}
+
+Sink *new_fd_sink(int fd)
+{
+    FdSink *sink = must_calloc(1, sizeof(FdSink));
+    sink->base.write = &fd_write;
+    sink->base.close = &fd_close;
+    sink->fd = fd;
+    return &sink->base;
+}
+
+/**
+ * append - Append data to a growing buffer
+ * @param buf The buffer
+ * @param len Bytes used in the buffer
+ * @param cap Size of the buffer
+ * @param data The data to append
+ * @param data_len The length of the data
+ */
+static void append(char **buf, size_t *len, size_t *cap, const char *data,
+                   size_t data_len)
+{
+    if (*len + data_len > *cap) {
+        while (*len + data_len > *cap)
+            *cap *= 2;
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+}
+
+typedef struct BufferSink BufferSink;
+struct BufferSink {
+    Sink base;
+    char *buf;
+    size_t len;
+    size_t cap;
+    char **data;
+    size_t *data_len;
+};
+
+/**
+ * buffer_write - Append data to the buffer
+ * @param self The buffer sink
+ * @param data The data to append
+ * @param data_len The length of the data
+ * @return Always 0
+ */
+static int buffer_write(Sink *self, const char *data, const size_t data_len)
+{
+    BufferSink *sink = (BufferSink *)self;
+    append(&sink->buf, &sink->len, &sink->cap, data, data_len);
+    return 0;
+}
+
+/**
+ * buffer_close - Hand over the buffer and free the sink
+ * @param self The buffer sink
+ * @return Always 0
+ */
+static int buffer_close(Sink *self)
+{
+    BufferSink *sink = (BufferSink *)self;
+    *sink->data = sink->buf;
+    *sink->data_len = sink->len;
+    free(sink);
+    return 0;
+}
+
+Sink *new_buffer_sink(char **data, size_t *data_len)
+{
+    BufferSink *sink = must_calloc(1, sizeof(BufferSink));
+    sink->base.write = &buffer_write;
+    sink->base.close = &buffer_close;
+    sink->cap = 4096;
+    sink->buf = must_calloc(1, sink->cap);
+    sink->data = data;
+    sink->data_len = data_len;
+    return &sink->base;
+}
+
+typedef struct CaptureSink CaptureSink;
+struct CaptureSink {
+    Sink base;
+    Sink *inner;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t limit;
+    int failed;
+    char **copy;
+    size_t *copy_len;
+};
+
+/**
+ * capture_write - Forward data and append it to the copy
+ * @param self The capture sink
+ * @param data The data to append
+ * @param data_len The length of the data
+ * @return 0 on success, -1 once the inner sink has failed
+ */
+static int capture_write(Sink *self, const char *data, const size_t data_len)
+{
+    CaptureSink *sink = (CaptureSink *)self;
+    if (sink->inner->write(sink->inner, data, data_len) != 0)
+        sink->failed = 1;
+
+    if (sink->buf != NULL && sink->len + data_len > sink->limit) {
+        free(sink->buf);
+        sink->buf = NULL;
+    }
+    if (sink->buf != NULL)
+        append(&sink->buf, &sink->len, &sink->cap, data, data_len);
+    return sink->failed ? -1 : 0;
+}
+
+/**
+ * capture_close - Close the inner sink and hand over the copy
+ * @param self The capture sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int capture_close(Sink *self)
+{
+    CaptureSink *sink = (CaptureSink *)self;
+    int failed = (sink->inner->close(sink->inner) != 0) || sink->failed;
+    if (failed) {
+        free(sink->buf);
+        sink->buf = NULL;
+    }
+    *sink->copy = sink->buf;
+    *sink->copy_len = sink->buf != NULL ? sink->len : 0;
+    free(sink);
+    return failed ? -1 : 0;
+}
+
+/**
+ * capture_abort - Abort the inner sink and drop the copy
+ * @param self The capture sink
+ */
+static void capture_abort(Sink *self)
+{
+    CaptureSink *sink = (CaptureSink *)self;
+    sink_abort(sink->inner);
+    free(sink->buf);
+    *sink->copy = NULL;
+    *sink->copy_len = 0;
+    free(sink);
+}
+
+Sink *new_capture_sink(Sink *inner, size_t limit, char **copy,
+                       size_t *copy_len)
+{
+    CaptureSink *sink = must_calloc(1, sizeof(CaptureSink));
+    sink->base.write = &capture_write;
+    sink->base.close = &capture_close;
+    sink->base.abort = &capture_abort;
+    sink->inner = inner;
+    sink->limit = limit;
+    sink->cap = 4096;
+    sink->buf = limit > 0 ? must_calloc(1, sink->cap) : NULL;
+    sink->copy = copy;
+    sink->copy_len = copy_len;
+    return &sink->base;
+}
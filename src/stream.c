@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include "../include/stream.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * ChunkQueue - a bounded queue of chunks between two threads
+ * Every slot owns a buffer of STREAM_CHUNK_SIZE bytes. The producer fills
+ * the slot after the last queued one and the consumer drains the first,
+ * both outside the lock, so the lock is only held to move the counters.
+ */
+typedef struct ChunkQueue {
+    char *buffers[STREAM_DEPTH];
+    size_t lens[STREAM_DEPTH];
+    int head;    // first queued slot
+    int count;   // queued slots
+    bool closed; // the producer is done
+    bool failed; // the consumer gave up
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ChunkQueue;
+
+/**
+ * queue_init - Set up an empty queue
+ * @param queue The queue
+ */
+static void queue_init(ChunkQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    for (int i = 0; i < STREAM_DEPTH; i++)
+        queue->buffers[i] = must_calloc(STREAM_CHUNK_SIZE, 1);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+/**
+ * queue_destroy - Free the buffers of a queue
+ * @param queue The queue
+ */
+static void queue_destroy(ChunkQueue *queue)
+{
+    for (int i = 0; i < STREAM_DEPTH; i++)
+        free(queue->buffers[i]);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
+
+/**
+ * queue_reserve - Wait for a free slot, for the producer to fill
+ * @param queue The queue
+ * @return The buffer of the slot, NULL once the consumer gave up
+ */
+static char *queue_reserve(ChunkQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == STREAM_DEPTH && !queue->failed)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    char *buffer =
+        queue->failed
+            ? NULL
+            : queue->buffers[(queue->head + queue->count) % STREAM_DEPTH];
+    pthread_mutex_unlock(&queue->lock);
+    return buffer;
+}
+
+/**
+ * queue_commit - Queue the slot the producer filled
+ * @param queue The queue
+ * @param len Bytes filled
+ */
+static void queue_commit(ChunkQueue *queue, size_t len)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->lens[(queue->head + queue->count) % STREAM_DEPTH] = len;
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * queue_idle - Check whether the consumer has drained every queued slot
+ * @param queue The queue
+ * @return true if nothing is queued
+ */
+static bool queue_idle(ChunkQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool idle = queue->count == 0;
+    pthread_mutex_unlock(&queue->lock);
+    return idle;
+}
+
+/**
+ * queue_peek - Wait for the first queued slot, for the consumer to drain
+ * @param queue The queue
+ * @param len Where to store the bytes in the slot
+ * @return The buffer of the slot, NULL once the producer is done
+ */
+static char *queue_peek(ChunkQueue *queue, size_t *len)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    char *buffer = NULL;
+    if (queue->count > 0) {
+        buffer = queue->buffers[queue->head];
+        *len = queue->lens[queue->head];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return buffer;
+}
+
+/**
+ * queue_release - Free the slot the consumer drained
+ * @param queue The queue
+ */
+static void queue_release(ChunkQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->head = (queue->head + 1) % STREAM_DEPTH;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * queue_end - Mark the producer done or the consumer failed
+ * @param queue The queue
+ * @param failed true if the consumer gave up
+ */
+static void queue_end(ChunkQueue *queue, bool failed)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (failed)
+        queue->failed = true;
+    else
+        queue->closed = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+typedef struct AsyncSink AsyncSink;
+struct AsyncSink {
+    Sink base;
+    Sink *inner;
+    ChunkQueue queue;
+    pthread_t writer;
+    char *chunk; // slot being filled, NULL if none or the writer failed
+    size_t len;
+};
+
+/**
+ * drain_queue - Writer thread of an async sink
+ * @param arg The async sink
+ * @return NULL
+ */
+static void *drain_queue(void *arg)
+{
+    AsyncSink *sink = arg;
+    size_t len = 0;
+    char *chunk;
+    while ((chunk = queue_peek(&sink->queue, &len)) != NULL) {
+        int status = sink->inner->write(sink->inner, chunk, len);
+        queue_release(&sink->queue);
+        if (status != 0) {
+            queue_end(&sink->queue, true);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * async_write - Copy data into chunks, queueing every full one, and the one
+ * being filled too if the writer has nothing else to do
+ * @param self The async sink
+ * @param data The data to append
+ * @param data_len The length of the data
+ * @return 0 on success, -1 once the writer has failed
+ */
+static int async_write(Sink *self, const char *data, const size_t data_len)
+{
+    AsyncSink *sink = (AsyncSink *)self;
+    size_t left = data_len;
+    while (left > 0) {
+        if (sink->chunk == NULL) {
+            sink->chunk = queue_reserve(&sink->queue);
+            sink->len = 0;
+            if (sink->chunk == NULL)
+                return -1;
+        }
+        size_t room = STREAM_CHUNK_SIZE - sink->len;
+        size_t len = left < room ? left : room;
+        memcpy(sink->chunk + sink->len, data, len);
+        sink->len += len;
+        data += len;
+        left -= len;
+        if (sink->len == STREAM_CHUNK_SIZE) {
+            queue_commit(&sink->queue, sink->len);
+            sink->chunk = NULL;
+        }
+    }
+    // a trickle of small writes goes out as it comes, while a busy writer
+    // still gets full chunks
+    if (sink->chunk != NULL && sink->len > 0 && queue_idle(&sink->queue)) {
+        queue_commit(&sink->queue, sink->len);
+        sink->chunk = NULL;
+    }
+    return 0;
+}
+
+/**
+ * async_close - Queue the last chunk, wait for the writer and free the sink,
+ * closing the inner one
+ * @param self The async sink
+ * @return 0 on success, -1 if any write failed
+ */
+static int async_close(Sink *self)
+{
+    AsyncSink *sink = (AsyncSink *)self;
+    if (sink->chunk != NULL && sink->len > 0)
+        queue_commit(&sink->queue, sink->len);
+    queue_end(&sink->queue, false);
+    pthread_join(sink->writer, NULL);
+    int failed = sink->queue.failed;
+    if (sink->inner->close(sink->inner) != 0)
+        failed = 1;
+    queue_destroy(&sink->queue);
+    free(sink);
+    return failed ? -1 : 0;
+}
+
+Sink *new_async_sink(Sink *inner)
+{
+    AsyncSink *sink = must_calloc(1, sizeof(AsyncSink));
+    sink->base.write = &async_write;
+    sink->base.close = &async_close;
+    sink->inner = inner;
+    queue_init(&sink->queue);
+    if (pthread_create(&sink->writer, NULL, &drain_queue, sink) != 0) {
+        perror("Error creating writer thread");
+        exit(1);
+    }
+    return &sink->base;
+}
+
+typedef struct Pump {
+    ChunkQueue queue;
+    int fd;
+    int error; // errno of a failed read, 0 if none
+} Pump;
+
+/**
+ * fill_queue - Reader thread of pump_fd
+ * Only the read itself can be cancelled, so a reader blocked on a quiet
+ * descriptor can be stopped without leaving the queue locked.
+ * @param arg The pump
+ * @return NULL
+ */
+static void *fill_queue(void *arg)
+{
+    Pump *pump = arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    char *chunk;
+    // a chunk holds what one read returned, so data trickling in through a
+    // pipe moves on at once instead of waiting for a full chunk
+    while ((chunk = queue_reserve(&pump->queue)) != NULL) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t got = read(pump->fd, chunk, STREAM_CHUNK_SIZE);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            pump->error = errno;
+        if (got <= 0)
+            break;
+        queue_commit(&pump->queue, (size_t)got);
+    }
+    queue_end(&pump->queue, false);
+    return NULL;
+}
+
+int pump_fd(int fd, Sink *out, size_t *total)
+{
+    Pump pump;
+    queue_init(&pump.queue);
+    pump.fd = fd;
+    pump.error = 0;
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, &fill_queue, &pump) != 0) {
+        perror("Error creating reader thread");
+        exit(1);
+    }
+
+    int status = 0;
+    size_t len = 0;
+    char *chunk;
+    *total = 0;
+    while ((chunk = queue_peek(&pump.queue, &len)) != NULL) {
+        status = out->write(out, chunk, len);
+        queue_release(&pump.queue);
+        *total += len;
+        if (status != 0) {
+            queue_end(&pump.queue, true);
+            pthread_cancel(reader);
+            break;
+        }
+    }
+    pthread_join(reader, NULL);
+    queue_destroy(&pump.queue);
+    if (pump.error != 0) {
+        errno = pump.error;
+        status = -1;
+    }
+    return status;
+}
@@ -1,5 +1,6 @@
 #include "../include/tree.h"
 #include "../include/utils.h"
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +15,12 @@
  */
 static void swap(void *a, void *b, size_t width)
 {
-    void *tmp = must_calloc(1, width);
-    memcpy(tmp, a, width);
-    memcpy(a, b, width);
-    memcpy(b, tmp, width);
-    free(tmp);
+    unsigned char *x = a, *y = b;
+    for (size_t i = 0; i < width; i++) {
+        unsigned char tmp = x[i];
+        x[i] = y[i];
+        y[i] = tmp;
+    }
 }
 
 /**
@@ -29,8 +31,7 @@ static void swap(void *a, void *b, size_t width)
 static void gen_freq_arr(HuffmanTree *self, Node *freq_node_arr[],
                          const char data[], const size_t data_len)
 {
-    self->logger->info_log("Reading file and generating frequency table",
-                           __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Reading file and generating frequency table");
     char cur_datum = data[0];
     init_node_arr(freq_node_arr, data_len);
 
@@ -101,7 +102,7 @@ Node *merge_node(Node *a, Node *b)
  */
 static void build_tree(HuffmanTree *self, Node *arr[], const size_t len)
 {
-    self->logger->info_log("Building tree", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Building tree");
     if (self->size <= 0)
         return;
 
@@ -117,7 +118,7 @@ static void build_tree(HuffmanTree *self, Node *arr[], const size_t len)
         }
         tmp[end++] = merge_node(tmp[i], tmp[i + 1]);
     }
-    self->logger->info_log("Tree built", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Tree built");
     free(tmp);
 }
 
@@ -159,7 +160,7 @@ static char *get_code(const HuffmanTree *self, Node *cur_node)
 static const char **cal_code_table(HuffmanTree *self, Node *data[])
 {
 
-    self->logger->info_log("Calculating code", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Calculating code");
     char **header = must_calloc(sizeof(char *), self->size);
     qsort(data, self->size, sizeof(Node *), compare_char);
 
@@ -173,55 +174,92 @@ static const char **cal_code_table(HuffmanTree *self, Node *data[])
 }
 
 /**
- * Get the Huffman code from raw data string
- * @param self The Huffman tree
- * @param header_str the raw data string
- * @return the header of the encoded file
+ * Read the next word of an encoded file, never past its end
+ * Words longer than ALLOC_SIZE - 1 are split, as %255s would.
+ * @param data The encoded file
+ * @param len The length of the file
+ * @param pos Where to start reading, moved past the word
+ * @param word Where to store the word, ALLOC_SIZE bytes
+ * @return the length of the word, 0 at the end of the file
  */
-static const char **get_header(HuffmanTree *self, const char *encoded_str)
+static size_t next_word(const char *data, size_t len, size_t *pos, char *word)
 {
-    self->logger->info_log("Extracting header", __FILE__, __LINE__);
-    char **header = must_calloc(ALLOC_SIZE, sizeof(char *));
-    int cur_idx = 0;
+    size_t i = *pos, n = 0;
+    while (i < len && isspace((unsigned char)data[i]))
+        i++;
+    while (i < len && !isspace((unsigned char)data[i]) && n < ALLOC_SIZE - 1)
+        word[n++] = data[i++];
+    word[n] = '\0';
+    *pos = i;
+    return n;
+}
 
+/**
+ * Get the header from raw encoded data string
+ * @param self The Huffman tree
+ * @param encoded_str The encoded file
+ * @param encoded_len The length of the file
+ * @param pos Set to where the length lines start
+ * @return the header of the encoded file, NULL if it has no length lines
+ */
+static const char **get_header(HuffmanTree *self, const char *encoded_str,
+                               size_t encoded_len, size_t *pos)
+{
+    LOG_DEBUG(self->logger, "Extracting header");
+    // one code per byte value, and one entry left NULL to end the header
+    char **header = must_calloc(ALLOC_SIZE + 1, sizeof(char *));
     char line[ALLOC_SIZE];
-    while (sscanf(encoded_str + cur_idx, "%s", line)) {
+    size_t cur = 0, start = 0;
+    bool ended = false;
+    self->size = 0;
+    while (self->size < ALLOC_SIZE) {
+        start = cur;
+        size_t len = next_word(encoded_str, encoded_len, &cur, line);
+        if (len == 0)
+            break;
         if (strncmp(line, "Uncompressed", 12) == 0) {
-            self->size--;
+            ended = true;
             break;
         }
-
-        size_t len = strlen(line);
         header[self->size] = must_calloc(len + 1, sizeof(char));
         strcpy(header[self->size++], line);
-        cur_idx += len + 1;
     }
-    self->size += 1;
-    self->logger->info_log("Header extracted", __FILE__, __LINE__);
+    if (!ended) {
+        for (size_t i = 0; i < self->size; i++)
+            free(header[i]);
+        free(header);
+        return NULL;
+    }
+    *pos = start;
+    LOG_DEBUG(self->logger, "Header extracted");
     return (const char **)header;
 }
 
 /**
  * Get the encoded data from raw encoded data string
+ * The data starts on the line after the "Compression Ratio" one.
  * @param self The Huffman tree
- * @param header_str the raw data string
- * @return the encoded data
+ * @param encoded_str The encoded file
+ * @param encoded_len The length of the file
+ * @param pos Where the length lines start
+ * @return the encoded data, NULL if the ratio line is missing
  */
-static const char *get_encoded_data(HuffmanTree *self, const char *encoded_str)
+static const char *get_encoded_data(HuffmanTree *self,
+                                    const char *encoded_str,
+                                    size_t encoded_len, size_t pos)
 {
-    self->logger->info_log("Extracting encoded data", __FILE__, __LINE__);
-    int cur_idx = 0;
+    LOG_DEBUG(self->logger, "Extracting encoded data");
     char line[ALLOC_SIZE];
-
-    while (sscanf(encoded_str + cur_idx, "%s", line) == 1) {
-        cur_idx += strlen(line) + 1;
-        if (strncmp(line, "Compression", 11) == 0) {
-            break;
-        }
+    while (next_word(encoded_str, encoded_len, &pos, line) > 0) {
+        if (strncmp(line, "Compression", 11) != 0)
+            continue;
+        const char *end = memchr(encoded_str + pos, '\n', encoded_len - pos);
+        if (end == NULL)
+            return NULL;
+        LOG_DEBUG(self->logger, "Encoded data extracted");
+        return end + 1;
     }
-
-    self->logger->info_log("Encoded data extracted", __FILE__, __LINE__);
-    return encoded_str + cur_idx + 16;
+    return NULL;
 }
 
 /**
@@ -293,7 +331,7 @@ static char *encode(HuffmanTree *self, const char *data,
  */
 static size_t build_tree_from_header(HuffmanTree *self, const char **header)
 {
-    self->logger->info_log("Building tree from header", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Building tree from header");
 
     size_t decoded_len = 0;
     Node *cur_node = self->root = create_node('\0');
@@ -301,7 +339,8 @@ static size_t build_tree_from_header(HuffmanTree *self, const char **header)
     for (size_t i = 0; i < self->size; i++) {
         unsigned int byte;
         char code[ALLOC_SIZE];
-        sscanf(header[i], "%x=%s", &byte, code);
+        if (sscanf(header[i], "%x=%255s", &byte, code) != 2)
+            continue;
 
         for (size_t j = 0; j < strlen(code); j++) {
             if (code[j] == '0') {
@@ -322,7 +361,40 @@ static size_t build_tree_from_header(HuffmanTree *self, const char **header)
         cur_node = self->root;
         decoded_len++;
     }
-    self->logger->info_log("Tree built from header", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Tree built from header");
+    return decoded_len;
+}
+
+/**
+ * Decode whole codes until the encoded data or the room for output runs out
+ * @param self The Huffman tree, built by read_header
+ * @param encoded_data The encoded data
+ * @param encoded_len The length of the encoded data
+ * @param out Where to store the decoded bytes
+ * @param out_len Room in out
+ * @param consumed Set to the length of encoded data used
+ *
+ * @return the number of decoded bytes
+ */
+static size_t decode_slice(HuffmanTree *self, const char *encoded_data,
+                           size_t encoded_len, char *out, size_t out_len,
+                           size_t *consumed)
+{
+    size_t i = 0, decoded_len = 0;
+    while (decoded_len < out_len && i < encoded_len) {
+        Node *cur_node = self->root;
+        size_t j = i;
+        while (cur_node->left != NULL && cur_node->right != NULL &&
+               j < encoded_len)
+            cur_node = encoded_data[j++] == '0' ? cur_node->left
+                                                : cur_node->right;
+        // stop at a code cut short, or one that doesn't advance at all
+        if ((cur_node->left != NULL && cur_node->right != NULL) || j == i)
+            break;
+        out[decoded_len++] = cur_node->data;
+        i = j;
+    }
+    *consumed = i;
     return decoded_len;
 }
 
@@ -333,41 +405,56 @@ static size_t build_tree_from_header(HuffmanTree *self, const char **header)
  *
  * @return the decoded data
  */
-static char *_decode(const HuffmanTree *self, const char *encoded_data,
+static char *_decode(HuffmanTree *self, const char *encoded_data,
                      size_t *decoded_len, size_t encoded_len)
 {
-    self->logger->info_log("Decoding", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Decoding");
     if (!self->root) {
-        self->logger->error_log("Tree is empty", __FILE__, __LINE__);
+        LOG_ERROR(self->logger, "Tree is empty");
         return NULL;
     }
 
-    // decode the data
-    Node *cur_node = self->root;
-    size_t i = 0, j = 1;
-    char *decoded_data = must_calloc(ALLOC_SIZE, sizeof(char));
-
+    // decode the data, doubling the buffer whenever it fills up
+    size_t cap = ALLOC_SIZE, i = 0;
+    char *decoded_data = must_calloc(cap, sizeof(char));
     while (i < encoded_len) {
-        while (cur_node->left != NULL && cur_node->right != NULL) {
-            cur_node =
-                encoded_data[i++] == '0' ? cur_node->left : cur_node->right;
-        }
-        if (*decoded_len >= ALLOC_SIZE * j) {
-            char *tmp = realloc(decoded_data, sizeof(char) * 256 * ++j);
+        if (*decoded_len == cap) {
+            cap *= 2;
+            char *tmp = realloc(decoded_data, sizeof(char) * cap);
             if (!tmp) {
                 free(decoded_data);
                 return NULL;
             }
             decoded_data = tmp;
         }
-        decoded_data[(*decoded_len)++] = cur_node->data;
-        cur_node = self->root;
+        size_t consumed = 0;
+        *decoded_len += decode_slice(self, encoded_data + i, encoded_len - i,
+                                     decoded_data + *decoded_len,
+                                     cap - *decoded_len, &consumed);
+        if (consumed == 0)
+            break;
+        i += consumed;
     }
 
-    self->logger->info_log("Decoded", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Decoded");
     return decoded_data;
 }
 
+/**
+ * Free the Huffman tree node
+ * @param self The Huffman tree node
+ */
+static void destroy_node(Node **self)
+{
+    if (!self || !*self)
+        return;
+
+    destroy_node(&(*self)->left);
+    destroy_node(&(*self)->right);
+    free(*self);
+    *self = NULL;
+}
+
 /**
  * destroy header - free the header
  * @param header The header of the encoded file
@@ -383,35 +470,50 @@ static void destroy_header(const char **header)
 }
 
 /**
- * Decode the given data
+ * Build the tree from the header of an encoded file
+ * The tree of an earlier file is freed first, so one tree serves any number
+ * of files. Nothing is read past encoded_len, so the file needn't end in a
+ * NUL.
  * @param self The Huffman tree
+ * @param encoded_str The encoded file
+ * @param encoded_len The length of the file
  *
- * @return the decoded data
+ * @return the encoded data following the header, NULL if the file lacks the
+ * length lines or any code
  */
-static char *decode(HuffmanTree *self, char *encoded_str, size_t *decoded_len,
-                    size_t encoded_len)
+static const char *read_header(HuffmanTree *self, const char *encoded_str,
+                               size_t encoded_len)
 {
-    const char **header = get_header(self, encoded_str);
-    const char *encoded_data = get_encoded_data(self, encoded_str);
-    encoded_len -= (size_t)(encoded_data - encoded_str);
-    build_tree_from_header(self, header);
+    destroy_node(&self->root);
+    size_t pos = 0;
+    const char **header = get_header(self, encoded_str, encoded_len, &pos);
+    if (header == NULL)
+        return NULL;
+    const char *encoded_data =
+        get_encoded_data(self, encoded_str, encoded_len, pos);
+    size_t codes = build_tree_from_header(self, header);
     destroy_header(header);
-    return _decode(self, encoded_data, decoded_len, encoded_len);
+    if (encoded_data == NULL || codes == 0) {
+        destroy_node(&self->root);
+        return NULL;
+    }
+    return encoded_data;
 }
 
 /**
- * Free the Huffman tree node
- * @param self The Huffman tree node
+ * Decode the given data
+ * @param self The Huffman tree
+ *
+ * @return the decoded data
  */
-static void destroy_node(Node **self)
+static char *decode(HuffmanTree *self, char *encoded_str, size_t *decoded_len,
+                    size_t encoded_len)
 {
-    if (!self || !*self)
-        return;
-
-    destroy_node(&(*self)->left);
-    destroy_node(&(*self)->right);
-    free(*self);
-    *self = NULL;
+    const char *encoded_data = read_header(self, encoded_str, encoded_len);
+    if (encoded_data == NULL)
+        return NULL;
+    encoded_len -= (size_t)(encoded_data - encoded_str);
+    return _decode(self, encoded_data, decoded_len, encoded_len);
 }
 
 /**
@@ -441,7 +543,9 @@ HuffmanTree *new_huffman_tree(void)
     self->destroy = &destroy;
     self->encode = &encode;
     self->decode = &decode;
+    self->read_header = &read_header;
+    self->decode_slice = &decode_slice;
     init_logger(&self->logger);
-    self->logger->info_log("Huffman tree initialized", __FILE__, __LINE__);
+    LOG_DEBUG(self->logger, "Huffman tree initialized");
     return self;
 }
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "../include/uring.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * submit - Hand the queued operations to the kernel
+ * @param self Ring object
+ * @param wait_nr Completions to wait for, 0 to return at once
+ * @return 0 on success, -1 on failure
+ */
+static int submit(Ring *self, unsigned wait_nr)
+{
+    unsigned tail = *self->sq_tail;
+    unsigned to_submit = self->sq_queued - tail;
+    __atomic_store_n(self->sq_tail, self->sq_queued, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, self->fd, to_submit, wait_nr, flags,
+                   NULL, 0) < 0) {
+        // a signal may interrupt the wait after the submission went through
+        if (errno != EINTR)
+            return -1;
+        to_submit = 0;
+    }
+    return 0;
+}
+
+/**
+ * get_sqe - Claim the next submission entry, submitting if the ring is full
+ * @param self Ring object
+ * @param opcode Operation of the entry
+ * @param fd File the operation works on
+ * @param user_data Tag of the completion
+ * @return The entry, zeroed apart from the arguments
+ */
+static struct io_uring_sqe *get_sqe(Ring *self, uint8_t opcode, int fd,
+                                    uint64_t user_data)
+{
+    while (self->sq_queued -
+               __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE) >=
+           self->entries)
+        submit(self, 0);
+
+    unsigned index = self->sq_queued & *self->sq_mask;
+    struct io_uring_sqe *sqe = &self->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    self->sq_array[index] = index;
+    self->sq_queued++;
+    return sqe;
+}
+
+/**
+ * accept_conn - Queue an accept on a listening socket
+ * @param self Ring object
+ * @param listener The listening socket
+ * @param user_data Tag of the completions
+ */
+static void accept_conn(Ring *self, int listener, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe =
+        get_sqe(self, IORING_OP_ACCEPT, listener, user_data);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (self->multishot_accept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * recv_conn - Queue a receive
+ * @param self Ring object
+ * @param fd The socket
+ * @param buf Where the data goes
+ * @param len Room in buf
+ * @param user_data Tag of the completion
+ */
+static void recv_conn(Ring *self, int fd, void *buf, size_t len,
+                      uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(self, IORING_OP_RECV, fd, user_data);
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+}
+
+/**
+ * read_fd - Queue a read
+ * @param self Ring object
+ * @param fd The descriptor
+ * @param buf Where the data goes
+ * @param len Room in buf
+ * @param user_data Tag of the completion
+ */
+static void read_fd(Ring *self, int fd, void *buf, size_t len,
+                    uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(self, IORING_OP_READ, fd, user_data);
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+}
+
+/**
+ * poll_fd - Queue a one-shot poll
+ * @param self Ring object
+ * @param fd The descriptor
+ * @param events Poll events to wait for, e.g. POLLOUT
+ * @param user_data Tag of the completion
+ */
+static void poll_fd(Ring *self, int fd, unsigned events, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(self, IORING_OP_POLL_ADD, fd, user_data);
+    sqe->poll32_events = events;
+}
+
+/**
+ * cancel - Queue the cancellation of an operation still in flight
+ * @param self Ring object
+ * @param target Tag of the operation to cancel
+ * @param user_data Tag of the completion
+ */
+static void cancel(Ring *self, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe =
+        get_sqe(self, IORING_OP_ASYNC_CANCEL, -1, user_data);
+    sqe->addr = target;
+}
+
+/**
+ * timer - Queue a timer
+ * @param self Ring object
+ * @param ms Milliseconds until it fires
+ * @param user_data Tag of the completion
+ */
+static void timer(Ring *self, long long ms, uint64_t user_data)
+{
+    self->timeout.tv_sec = ms / 1000;
+    self->timeout.tv_nsec = (ms % 1000) * 1000000;
+    struct io_uring_sqe *sqe = get_sqe(self, IORING_OP_TIMEOUT, -1, user_data);
+    sqe->addr = (uint64_t)(uintptr_t)&self->timeout;
+    sqe->len = 1;
+}
+
+/**
+ * next - Take the next completion off the ring
+ * @param self Ring object
+ * @param cqe Where the completion is copied
+ * @return true if there was one
+ */
+static bool next(Ring *self, struct io_uring_cqe *cqe)
+{
+    unsigned head = *self->cq_head;
+    if (head == __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    *cqe = self->cqes[head & *self->cq_mask];
+    __atomic_store_n(self->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int init_ring(Ring **self, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return -1;
+    // older kernels map the two rings separately, not worth supporting
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_len = sq_len > cq_len ? sq_len : cq_len;
+    size_t sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    char *rings = mmap(NULL, rings_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        if (rings != MAP_FAILED)
+            munmap(rings, rings_len);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_len);
+        close(fd);
+        return -1;
+    }
+
+    *self = (Ring *)must_calloc(1, sizeof(Ring));
+    (*self)->fd = fd;
+    (*self)->entries = params.sq_entries;
+    (*self)->sq_head = (unsigned *)(rings + params.sq_off.head);
+    (*self)->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    (*self)->sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    (*self)->sq_array = (unsigned *)(rings + params.sq_off.array);
+    (*self)->sq_queued = *(*self)->sq_tail;
+    (*self)->sqes = sqes;
+    (*self)->cq_head = (unsigned *)(rings + params.cq_off.head);
+    (*self)->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    (*self)->cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    (*self)->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    (*self)->rings = rings;
+    (*self)->rings_len = rings_len;
+    (*self)->multishot_accept = true;
+    (*self)->accept = &accept_conn;
+    (*self)->recv = &recv_conn;
+    (*self)->read = &read_fd;
+    (*self)->poll = &poll_fd;
+    (*self)->cancel = &cancel;
+    (*self)->timer = &timer;
+    (*self)->submit = &submit;
+    (*self)->next = &next;
+    return 0;
+}
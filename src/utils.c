@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
+#include "../include/kernels.h"
 #include "../include/utils.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 void *must_calloc(size_t count, size_t nmemb)
 {
@@ -13,6 +18,124 @@ void *must_calloc(size_t count, size_t nmemb)
     return ptr;
 }
 
+uint64_t hash_bytes(const void *data, size_t data_len, uint64_t seed)
+{
+    const uint64_t k1 = 0x9e3779b185ebca87ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+    const unsigned char *bytes = data;
+    uint64_t hash = seed ^ (data_len * k1);
+
+    // mix eight bytes at a time, then the tail
+    for (; data_len >= 8; bytes += 8, data_len -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        word *= k2;
+        word = (word << 31) | (word >> 33);
+        hash ^= word * k1;
+        hash = ((hash << 27) | (hash >> 37)) * k1 + k2;
+    }
+    for (; data_len > 0; bytes++, data_len--) {
+        hash ^= *bytes * k1;
+        hash = ((hash << 11) | (hash >> 53)) * k2;
+    }
+
+    hash ^= hash >> 33;
+    hash *= k2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// reflected Castagnoli polynomial, as used by iSCSI, ext4 and SSE4.2
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+// x^(2^n) modulo the polynomial, to move a CRC past 2^n zero bits, for as
+// many bits as a length in bytes can have
+static uint32_t crc32c_powers[3 + 64];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * multiply_mod - Multiply two polynomials modulo the CRC polynomial
+ * @param a A polynomial, reflected like the CRC
+ * @param b Another polynomial, reflected like the CRC
+ * @return The product
+ */
+static uint32_t multiply_mod(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit != 0 && a != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+            a ^= bit;
+        }
+        b = b >> 1 ^ (CRC32C_POLY & (0u - (b & 1)));
+    }
+    return product;
+}
+
+/**
+ * init_crc32c - Fill the slicing tables and the powers of x
+ * Table k holds the CRC of a byte followed by k zero bytes.
+ */
+static void init_crc32c(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc >> 1 ^ (CRC32C_POLY & (0u - (crc & 1)));
+        crc32c_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = crc >> 8 ^ crc32c_table[0][crc & 0xff];
+        }
+    }
+    uint32_t power = 1u << 30; // x
+    for (int n = 0; n < 3 + 64; n++) {
+        crc32c_powers[n] = power;
+        power = multiply_mod(power, power);
+    }
+}
+
+const uint32_t (*crc32c_tables(void))[256]
+{
+    pthread_once(&crc32c_once, &init_crc32c);
+    return (const uint32_t(*)[256])crc32c_table;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t data_len)
+{
+    return kernels()->crc32c(crc, data, data_len);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    // crc1 is moved past the 8 * len2 zero bits of the second piece, a power
+    // of two at a time, then the second piece is added
+    pthread_once(&crc32c_once, &init_crc32c);
+    uint32_t shift = 1u << 31; // 1
+    for (int n = 3; len2 != 0; len2 >>= 1, n++) {
+        if (len2 & 1)
+            shift = multiply_mod(crc32c_powers[n], shift);
+    }
+    return multiply_mod(shift, crc1) ^ crc2;
+}
+
+int make_parent_dirs(const char *path)
+{
+    char *copy = strdup(path);
+    int status = 0;
+    for (char *slash = strchr(copy + 1, '/'); slash && status == 0;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(copy, 0755) != 0 && errno != EEXIST)
+            status = -1;
+        *slash = '/';
+    }
+    free(copy);
+    return status;
+}
+
 char *read_file(const char *filename, size_t *filelen)
 {
     FILE *file;
@@ -41,27 +164,52 @@ void write_data(const char *filename, const char *mode, const char *data,
                 const size_t data_len)
 {
     FILE *fd = fopen(filename, mode);
-    for (size_t i = 0; i < data_len; i++)
-        fputc(data[i], fd);
+    fwrite(data, 1, data_len, fd);
     fclose(fd);
 }
 
+char *format_header(const char **header, const size_t encoded_len,
+                    const size_t raw_len, const size_t header_num,
+                    size_t *header_len)
+{
+    int table_len = 0;
+    for (size_t i = 0; i < header_num; i++)
+        table_len += (int)strlen(header[i]) + 1;
+
+    char org_line[64], enc_line[64], ratio_line[64];
+    int p_org_len = snprintf(org_line, sizeof(org_line),
+                             "Uncompressed Length: %zu\n", raw_len);
+    int p_enc_len = snprintf(enc_line, sizeof(enc_line),
+                             "Compressed Length: %zu\n", encoded_len);
+    int p_ratio_len =
+        snprintf(ratio_line, sizeof(ratio_line), "Compression Ratio: %f\n",
+                 (double)raw_len / (double)((int)encoded_len + table_len +
+                                            p_org_len + p_enc_len + 29));
+
+    *header_len = (size_t)(table_len + p_org_len + p_enc_len + p_ratio_len);
+    char *text = must_calloc(*header_len + 1, sizeof(char));
+    char *cur = text;
+    for (size_t i = 0; i < header_num; i++) {
+        size_t len = strlen(header[i]);
+        memcpy(cur, header[i], len);
+        cur[len] = '\n';
+        cur += len + 1;
+    }
+    memcpy(cur, org_line, (size_t)p_org_len);
+    memcpy(cur += p_org_len, enc_line, (size_t)p_enc_len);
+    memcpy(cur += p_enc_len, ratio_line, (size_t)p_ratio_len);
+    return text;
+}
+
 void write_header(const char *filename, const char **header,
                   const size_t encoded_len, const size_t raw_len,
                   const size_t header_num)
 {
-    int header_len = 0;
-    FILE *fd = fopen(filename, "wb");
-    for (size_t i = 0; i < header_num; i++) {
-        fprintf(fd, "%s\n", header[i]);
-        header_len += strlen(header[i]) + 1;
-    }
-    int p_org_len = fprintf(fd, "Uncompressed Length: %zu\n", raw_len);
-    int p_enc_len = fprintf(fd, "Compressed Length: %zu\n", encoded_len);
-    fprintf(fd, "Compression Ratio: %f\n",
-            (double)raw_len / (double)((int)encoded_len + header_len +
-                                       p_org_len + p_enc_len + 29));
-    fclose(fd);
+    size_t header_len = 0;
+    char *text =
+        format_header(header, encoded_len, raw_len, header_num, &header_len);
+    write_data(filename, "wb", text, header_len);
+    free(text);
 }
 
 void print_header(const char **header, size_t header_num)
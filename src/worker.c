@@ -0,0 +1,894 @@
+#define _GNU_SOURCE
+#include "../include/worker.h"
+#include "../include/uring.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#define MAX_EVENTS 64
+#define BUFFER_SIZE 8192
+// the request buffer grows by doubling, so it can be twice the request
+#define REQUEST_MEMORY_FACTOR 2
+#define RETRY_AFTER_SECONDS 1
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK_MS 100
+#define RING_ENTRIES 256
+
+// tags the Unix socket listener in the event loop, the TCP one is NULL
+static char unix_listener_tag;
+// tags the eventfd the job pool wakes the event loop with
+static char wake_tag;
+
+// tags of ring completions that aren't reads, which carry their connection
+enum RING_TAG {
+    TAG_ACCEPT = 1,
+    TAG_ACCEPT_UNIX,
+    TAG_TICK,
+    TAG_CANCEL,
+    TAG_WAKE
+};
+
+typedef struct Conn Conn;
+struct Conn {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t header_len; // 0 until the blank line closing the headers arrived
+    size_t content_len;
+    size_t reserved; // memory held in the admission budget
+    size_t draining; // bytes of a turned away body left to discard
+    long long accepted_at;
+    long long body_started_at;
+    long long last_read_at;
+    long long deadline;
+    bool reading;   // a read is queued on the ring
+    bool polling;   // a poll for room to write is queued on the ring
+    bool closed;    // closed with an operation queued, freed once it completes
+    bool scheduled; // on the timer wheel
+    bool woken;     // listed for the event loop, see wake_conn()
+    Worker *worker;
+    Request req;
+    Outbox *outbox;    // the response, NULL while the request is being read
+    Conn *prev, *next; // neighbours in the wheel slot
+    Conn *woken_next;  // next connection the producer listed
+};
+
+/**
+ * now_ms - Read the monotonic clock
+ * @return Milliseconds since an arbitrary point
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * unschedule - Take a connection off the timer wheel
+ * @param self Worker object
+ * @param conn Connection to take off
+ */
+static void unschedule(Worker *self, Conn *conn)
+{
+    if (!conn->scheduled)
+        return;
+    conn->scheduled = false;
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        self->wheel[(conn->deadline / WHEEL_TICK_MS) % WHEEL_SLOTS] =
+            conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/**
+ * deadline_of - Work out the deadline of a connection
+ * Headers must arrive within the header timeout. The body gets the body
+ * timeout plus a second for every min_rate bytes received, which enforces
+ * an average rate without cutting off large uploads. No read may be
+ * further apart than the idle timeout. A response waiting for the client to
+ * make room may stall for the write timeout, and the rate is enforced the
+ * same way, see the outbox's deadline().
+ * @param self Worker object
+ * @param conn Connection
+ * @return The deadline in milliseconds
+ */
+static long long deadline_of(Worker *self, Conn *conn)
+{
+    const Timeouts *timeouts = &self->server->timeouts;
+    if (conn->outbox != NULL)
+        return conn->outbox->deadline(conn->outbox, now_ms(),
+                                      timeouts->write * 1000LL,
+                                      timeouts->min_rate);
+
+    long long deadline;
+    if (conn->header_len == 0) {
+        deadline = conn->accepted_at + timeouts->header * 1000LL;
+    } else {
+        deadline = conn->body_started_at + timeouts->body * 1000LL;
+        if (timeouts->min_rate > 0) {
+            size_t received = conn->len - conn->header_len;
+            deadline += (long long)(received * 1000 /
+                                    (size_t)timeouts->min_rate);
+        }
+    }
+    long long idle_deadline = conn->last_read_at + timeouts->idle * 1000LL;
+    return deadline < idle_deadline ? deadline : idle_deadline;
+}
+
+/**
+ * schedule - Put a connection on the wheel at its deadline
+ * @param self Worker object
+ * @param conn Connection to schedule, not on the wheel
+ */
+static void schedule(Worker *self, Conn *conn)
+{
+    conn->deadline = deadline_of(self, conn);
+
+    // a deadline in the past still goes to the next slot the wheel visits
+    if (conn->deadline / WHEEL_TICK_MS <= self->tick)
+        conn->deadline = (self->tick + 1) * WHEEL_TICK_MS;
+    Conn **slot = &self->wheel[(conn->deadline / WHEEL_TICK_MS) % WHEEL_SLOTS];
+    conn->prev = NULL;
+    conn->next = *slot;
+    if (*slot)
+        (*slot)->prev = conn;
+    *slot = conn;
+    conn->scheduled = true;
+}
+
+/**
+ * new_conn - Track a freshly accepted connection
+ * @param self Worker object
+ * @param fd Client socket
+ * @return Connection object
+ */
+static Conn *new_conn(Worker *self, int fd)
+{
+    Conn *conn = must_calloc(1, sizeof(Conn));
+    conn->fd = fd;
+    conn->worker = self;
+    conn->accepted_at = conn->last_read_at = now_ms();
+    conn->cap = BUFFER_SIZE;
+    conn->buf = must_calloc(conn->cap, sizeof(char));
+    return conn;
+}
+
+/**
+ * close_conn - Close a connection and forget it
+ * @param self Worker object
+ * @param conn Connection to close
+ */
+static void close_conn(Worker *self, Conn *conn)
+{
+    Admission *admission = self->server->admission;
+    admission->release(admission, conn->reserved);
+    if (conn->outbox != NULL) {
+        self->server->observe_response(self->server, &conn->req,
+                                       conn->outbox);
+        free_outbox(conn->outbox);
+        conn->outbox = NULL;
+    }
+    unschedule(self, conn);
+    if (self->ring == NULL)
+        epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    // the kernel may still write to the buffer of a queued read
+    if (conn->reading || conn->polling) {
+        self->ring->cancel(self->ring, (uint64_t)(uintptr_t)conn, TAG_CANCEL);
+        conn->closed = true;
+    } else {
+        free(conn->buf);
+        free(conn);
+    }
+    self->conns--;
+    self->server->metrics->count(self->server->metrics,
+                                 COUNTER_CONNECTIONS_CLOSED, 1);
+}
+
+/**
+ * arm_write - Wait for a connection's socket to have room again
+ * @param self Worker object
+ * @param conn Connection whose outbox is blocked
+ */
+static void arm_write(Worker *self, Conn *conn)
+{
+    if (self->ring == NULL) {
+        struct epoll_event ev = {.events = EPOLLOUT | EPOLLONESHOT,
+                                 .data.ptr = conn};
+        epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    } else if (!conn->polling) {
+        self->ring->poll(self->ring, conn->fd, POLLOUT,
+                         (uint64_t)(uintptr_t)conn);
+        conn->polling = true;
+    }
+}
+
+/**
+ * respond - Write out what the outbox of a connection holds
+ * A full socket puts the connection on the wheel with its write deadline
+ * until it has room again. A response still produced on the job pool is
+ * waited for off the wheel, until its producer wakes the worker.
+ * @param self Worker object
+ * @param conn Connection being answered
+ */
+static void respond(Worker *self, Conn *conn)
+{
+    unschedule(self, conn);
+    enum OUTBOX_STATE state = conn->outbox->flush(conn->outbox);
+    if (state == OUTBOX_BLOCKED) {
+        schedule(self, conn);
+        arm_write(self, conn);
+        return;
+    }
+    if (state == OUTBOX_WAITING)
+        return;
+
+    // a producer that woke the worker as it finished still has it listed
+    pthread_mutex_lock(&self->lock);
+    bool woken = conn->woken;
+    pthread_mutex_unlock(&self->lock);
+    if (!woken)
+        close_conn(self, conn);
+}
+
+/**
+ * expire_conns - Close the connections whose deadline has passed
+ * Slots are only visited once their tick is over, so everything in them
+ * that belongs to this turn of the wheel is due. A client that stopped
+ * reading its response has it dropped instead; one that still reads is
+ * checked again at its next deadline.
+ * @param self Worker object
+ */
+static void expire_conns(Worker *self)
+{
+    static const char timeout_response[] = "HTTP/1.1 408 Request Timeout\r\n"
+                                           "Content-Length: 0\r\n"
+                                           "Connection: close\r\n"
+                                           "\r\n";
+    long long done_tick = now_ms() / WHEEL_TICK_MS - 1;
+    if (done_tick - self->tick > WHEEL_SLOTS)
+        self->tick = done_tick - WHEEL_SLOTS;
+
+    while (self->tick < done_tick) {
+        self->tick++;
+        Conn *conn = self->wheel[self->tick % WHEEL_SLOTS];
+        while (conn != NULL) {
+            Conn *next = conn->next;
+            if (conn->deadline / WHEEL_TICK_MS > self->tick) {
+                conn = next;
+                continue;
+            }
+            if (conn->outbox != NULL &&
+                deadline_of(self, conn) / WHEEL_TICK_MS > self->tick) {
+                // the client took more of the response since, so it isn't
+                // stalled even though the socket has no room yet
+                unschedule(self, conn);
+                schedule(self, conn);
+            } else if (conn->outbox != NULL) {
+                self->server->metrics->count(self->server->metrics,
+                                             COUNTER_TIMEOUTS, 1);
+                conn->outbox->fail(conn->outbox);
+                respond(self, conn);
+            } else {
+                self->server->metrics->count(self->server->metrics,
+                                             COUNTER_TIMEOUTS, 1);
+                // best effort, a client this slow may not even read it
+                if (conn->draining == 0)
+                    send(conn->fd, timeout_response,
+                         sizeof(timeout_response) - 1,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+                close_conn(self, conn);
+            }
+            conn = next;
+        }
+    }
+}
+
+/**
+ * next_timeout - How long the event loop may sleep before the wheel needs a
+ * turn
+ * @param self Worker object
+ * @return Milliseconds to the end of the current tick, -1 if idle
+ */
+static int next_timeout(Worker *self)
+{
+    if (self->conns == 0)
+        return -1;
+    return (int)(WHEEL_TICK_MS - now_ms() % WHEEL_TICK_MS);
+}
+
+/**
+ * is_complete - Check whether the whole request has been received
+ * @param self Worker object
+ * @param conn Connection being read
+ * @return true once headers and body are in the buffer
+ */
+static bool is_complete(Worker *self, Conn *conn)
+{
+    if (conn->header_len == 0) {
+        char *end = strstr(conn->buf, "\r\n\r\n");
+        if (end == NULL)
+            return false;
+        conn->header_len = (size_t)(end + 4 - conn->buf);
+
+        char content_len[32];
+        if (self->server->get_request_header(conn->buf, "Content-Length",
+                                             content_len, sizeof(content_len)))
+            conn->content_len = strtoul(content_len, NULL, 10);
+    }
+    return conn->len >= conn->header_len + conn->content_len;
+}
+
+/**
+ * admit - Reserve memory for a request whose headers just arrived
+ * Bodies that could never fit get 413, bodies that don't fit right now get
+ * 503 and are discarded as they arrive so the client sees the response.
+ * @param self Worker object
+ * @param conn Connection being read
+ * @return true if the body may be read, false if the request was turned away
+ */
+static bool admit(Worker *self, Conn *conn)
+{
+    if (conn->content_len == 0)
+        return true;
+
+    Admission *admission = self->server->admission;
+    const char *status = NULL;
+    char headers[32] = "";
+    size_t limit = admission->budget / REQUEST_MEMORY_FACTOR;
+    if (conn->content_len > limit ||
+        conn->header_len + conn->content_len > limit) {
+        status = "413 Payload Too Large";
+    } else {
+        size_t need =
+            (conn->header_len + conn->content_len) * REQUEST_MEMORY_FACTOR;
+        if (admission->reserve(admission, need)) {
+            conn->reserved = need;
+            return true;
+        }
+        status = "503 Service Unavailable";
+        snprintf(headers, sizeof(headers), "Retry-After: %d\r\n",
+                 RETRY_AFTER_SECONDS);
+    }
+
+    LOG_WARNF(self->server->logger, "Turning request away",
+              "status=%.3s bytes=%zu", status,
+              conn->header_len + conn->content_len);
+    self->server->metrics->count(self->server->metrics, COUNTER_REJECTED, 1);
+    self->server->send_response(conn->fd, status, headers, "", 0);
+    shutdown(conn->fd, SHUT_WR);
+    conn->draining = conn->header_len + conn->content_len - conn->len;
+    return false;
+}
+
+/**
+ * drain_conn - Discard the body of a request that was turned away
+ * @param conn Connection to read from
+ * @return 0 to wait for more, -1 once the body is gone or on error
+ */
+static int drain_conn(Conn *conn)
+{
+    while (conn->draining > 0) {
+        size_t want = conn->draining < conn->cap ? conn->draining : conn->cap;
+        ssize_t size_recv = recv(conn->fd, conn->buf, want, 0);
+        if (size_recv < 0 && errno == EINTR)
+            continue;
+        if (size_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (size_recv <= 0)
+            return -1;
+        conn->draining -= (size_t)size_recv;
+        conn->len += (size_t)size_recv;
+        conn->last_read_at = now_ms();
+    }
+    return -1;
+}
+
+/**
+ * make_room - Grow the buffer to hold a full read plus the terminating NUL
+ * @param conn Connection about to be read
+ * @return 0 on success, -1 if out of memory
+ */
+static int make_room(Conn *conn)
+{
+    if (conn->len + BUFFER_SIZE + 1 > conn->cap) {
+        conn->cap *= 2;
+        conn->buf = realloc(conn->buf, conn->cap);
+        if (conn->buf == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * consume - Account for bytes just read into the buffer
+ * @param self Worker object
+ * @param conn Connection that was read
+ * @param size Number of bytes read, after conn->len
+ * @return 1 when the request is complete, 0 to wait for more (or to drain a
+ * request that was turned away), -1 to close
+ */
+static int consume(Worker *self, Conn *conn, size_t size)
+{
+    conn->len += size;
+    conn->last_read_at = now_ms();
+    conn->buf[conn->len] = '\0';
+    bool had_headers = conn->header_len != 0;
+    bool complete = is_complete(self, conn);
+    if (!had_headers && conn->header_len != 0)
+        conn->body_started_at = conn->last_read_at;
+    if (!had_headers && conn->header_len != 0 && !admit(self, conn))
+        return conn->draining > 0 ? 0 : -1;
+    return complete ? 1 : 0;
+}
+
+/**
+ * read_conn - Read whatever the client sent so far
+ * @param self Worker object
+ * @param conn Connection to read from
+ * @return 1 when the request is complete, 0 to wait for more, -1 on error
+ */
+static int read_conn(Worker *self, Conn *conn)
+{
+    if (conn->draining > 0)
+        return drain_conn(conn);
+
+    while (1) {
+        if (make_room(conn) != 0)
+            return -1;
+        ssize_t size_recv =
+            recv(conn->fd, conn->buf + conn->len, BUFFER_SIZE, 0);
+        if (size_recv < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (size_recv == 0)
+            return is_complete(self, conn) ? 1 : -1;
+
+        int status = consume(self, conn, (size_t)size_recv);
+        if (status != 0)
+            return status;
+        if (conn->draining > 0)
+            return drain_conn(conn);
+    }
+}
+
+/**
+ * add_conn - Start tracking a freshly accepted connection
+ * @param self Worker object
+ * @param fd Client socket
+ * @return Connection object, on the wheel
+ */
+static Conn *add_conn(Worker *self, int fd)
+{
+    Conn *conn = new_conn(self, fd);
+    self->conns++;
+    self->server->metrics->count(self->server->metrics,
+                                 COUNTER_CONNECTIONS_OPENED, 1);
+    schedule(self, conn);
+    return conn;
+}
+
+/**
+ * wake_conn - List a connection for its worker, from a producer on the job
+ * pool whose outbox is blocked or finished
+ * Called with the outbox locked, so the worker can't close the connection
+ * before it is listed.
+ * @param out The outbox of the connection
+ */
+static void wake_conn(Outbox *out)
+{
+    Conn *conn = out->owner;
+    Worker *self = conn->worker;
+    pthread_mutex_lock(&self->lock);
+    bool listed = conn->woken;
+    if (!listed) {
+        conn->woken = true;
+        conn->woken_next = self->woken;
+        self->woken = conn;
+    }
+    pthread_mutex_unlock(&self->lock);
+    uint64_t one = 1;
+    if (!listed && write(self->wake_fd, &one, sizeof(one)) < 0)
+        LOG_WARN(self->server->logger, "Failed to wake worker");
+}
+
+/**
+ * respond_woken - Answer the connections the job pool listed
+ * @param self Worker object
+ */
+static void respond_woken(Worker *self)
+{
+    while (1) {
+        pthread_mutex_lock(&self->lock);
+        Conn *conn = self->woken;
+        if (conn != NULL) {
+            self->woken = conn->woken_next;
+            conn->woken_next = NULL;
+            conn->woken = false;
+        }
+        pthread_mutex_unlock(&self->lock);
+        if (conn == NULL)
+            return;
+        respond(self, conn);
+    }
+}
+
+/**
+ * settle - Act on the outcome of a read
+ * Once the request is complete the socket is only watched for room to write
+ * the response, which respond() takes over. A handler that leaves the
+ * response to the job pool keeps the connection open until its producer is
+ * done.
+ * @param self Worker object
+ * @param conn Connection that was read
+ * @param status 1 when the request is complete, 0 to wait for more, -1 to
+ * close
+ */
+static void settle(Worker *self, Conn *conn, int status)
+{
+    if (status == 0) {
+        unschedule(self, conn);
+        schedule(self, conn);
+        return;
+    }
+    if (status == 1) {
+        init_outbox(&conn->outbox, conn->fd);
+        conn->outbox->wake = &wake_conn;
+        conn->outbox->owner = conn;
+        conn->req = (Request){.client_socket = conn->fd,
+                              .raw = conn->buf,
+                              .raw_len = conn->len,
+                              .outbox = conn->outbox};
+        unschedule(self, conn);
+        if (self->ring == NULL) {
+            struct epoll_event ev = {.events = EPOLLONESHOT, .data.ptr = conn};
+            epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        self->server->handle_request(self->server, &conn->req);
+        respond(self, conn);
+        return;
+    }
+    close_conn(self, conn);
+}
+
+/**
+ * accept_conns - Accept every pending connection
+ * @param self Worker object
+ * @param listener Listening socket that became readable
+ */
+static void accept_conns(Worker *self, int listener)
+{
+    while (1) {
+        int fd = accept4(listener, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        Conn *conn = add_conn(self, fd);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP,
+                                 .data.ptr = conn};
+        if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            close_conn(self, conn);
+    }
+}
+
+/**
+ * run_epoll - Event loop serving connections as epoll reports them ready
+ * @param self Worker object
+ */
+static void run_epoll(Worker *self)
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(self->epoll_fd, events, MAX_EVENTS,
+                           next_timeout(self));
+        bool woken = false;
+        for (int i = 0; i < n; i++) {
+            Conn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_conns(self, self->listener);
+                continue;
+            }
+            if ((void *)conn == &unix_listener_tag) {
+                accept_conns(self, self->server->unix_socket);
+                continue;
+            }
+            if ((void *)conn == &wake_tag) {
+                uint64_t count;
+                woken = read(self->wake_fd, &count, sizeof(count)) > 0;
+                continue;
+            }
+            if (conn->outbox != NULL) {
+                respond(self, conn);
+                continue;
+            }
+
+            size_t received = conn->len;
+            int status = read_conn(self, conn);
+            self->server->metrics->count(self->server->metrics,
+                                         COUNTER_BYTES_RECEIVED,
+                                         conn->len - received);
+            settle(self, conn, status);
+        }
+        // after the batch, which may still hold events of listed connections
+        if (woken)
+            respond_woken(self);
+        expire_conns(self);
+    }
+}
+
+/**
+ * queue_read - Queue the next read of a connection on the ring
+ * A request that was turned away is read into the start of the buffer,
+ * where it is discarded.
+ * @param self Worker object
+ * @param conn Connection to read
+ */
+static void queue_read(Worker *self, Conn *conn)
+{
+    char *buf = conn->buf;
+    size_t len = conn->draining < conn->cap ? conn->draining : conn->cap;
+    if (conn->draining == 0) {
+        if (make_room(conn) != 0) {
+            close_conn(self, conn);
+            return;
+        }
+        buf = conn->buf + conn->len;
+        len = BUFFER_SIZE;
+    }
+    self->ring->recv(self->ring, conn->fd, buf, len, (uint64_t)(uintptr_t)conn);
+    conn->reading = true;
+}
+
+/**
+ * complete_read - Handle the completion of a read queued on the ring
+ * @param self Worker object
+ * @param conn Connection that was read
+ * @param res Bytes read, or a negative errno
+ */
+static void complete_read(Worker *self, Conn *conn, int res)
+{
+    conn->reading = false;
+    if (conn->closed) {
+        free(conn->buf);
+        free(conn);
+        return;
+    }
+    if (res == -EINTR || res == -EAGAIN) {
+        queue_read(self, conn);
+        return;
+    }
+
+    int status;
+    if (res < 0) {
+        status = -1;
+    } else if (res == 0) {
+        status = conn->draining == 0 && is_complete(self, conn) ? 1 : -1;
+    } else if (conn->draining > 0) {
+        conn->draining -= (size_t)res;
+        conn->len += (size_t)res;
+        conn->last_read_at = now_ms();
+        status = conn->draining > 0 ? 0 : -1;
+    } else {
+        status = consume(self, conn, (size_t)res);
+    }
+    if (res > 0)
+        self->server->metrics->count(self->server->metrics,
+                                     COUNTER_BYTES_RECEIVED, (size_t)res);
+    settle(self, conn, status);
+    if (status == 0)
+        queue_read(self, conn);
+}
+
+/**
+ * complete_poll - Handle a connection's socket having room again
+ * @param self Worker object
+ * @param conn Connection that was polled
+ */
+static void complete_poll(Worker *self, Conn *conn)
+{
+    conn->polling = false;
+    if (conn->closed) {
+        free(conn->buf);
+        free(conn);
+        return;
+    }
+    respond(self, conn);
+}
+
+/**
+ * complete_accept - Handle an accept completion from the ring
+ * @param self Worker object
+ * @param cqe The completion
+ * @param listener Listening socket the accept was queued on
+ */
+static void complete_accept(Worker *self, const struct io_uring_cqe *cqe,
+                            int listener)
+{
+    if (cqe->res >= 0)
+        queue_read(self, add_conn(self, cqe->res));
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+    // a multishot accept ended, or the kernel doesn't know about them
+    if (cqe->res == -EINVAL && self->ring->multishot_accept)
+        self->ring->multishot_accept = false;
+    self->ring->accept(self->ring, listener, cqe->user_data);
+}
+
+/**
+ * run_ring - Event loop queuing accepts, reads and polls on io_uring
+ * Every operation queued while handling a batch of completions goes to the
+ * kernel with the wait for the next batch, in a single system call.
+ * @param self Worker object
+ */
+static void run_ring(Worker *self)
+{
+    Ring *ring = self->ring;
+    int unix_socket = self->server->unix_socket;
+    bool ticking = false;
+    uint64_t wakes;
+    ring->accept(ring, self->listener, TAG_ACCEPT);
+    if (unix_socket >= 0)
+        ring->accept(ring, unix_socket, TAG_ACCEPT_UNIX);
+    ring->read(ring, self->wake_fd, &wakes, sizeof(wakes), TAG_WAKE);
+
+    struct io_uring_cqe cqe;
+    while (1) {
+        // the wheel only needs turning while there are connections
+        if (self->conns > 0 && !ticking) {
+            ring->timer(ring, next_timeout(self), TAG_TICK);
+            ticking = true;
+        }
+        if (ring->submit(ring, 1) != 0) {
+            perror("Error waiting for completions");
+            exit(1);
+        }
+
+        while (ring->next(ring, &cqe)) {
+            switch (cqe.user_data) {
+            case TAG_ACCEPT:
+                complete_accept(self, &cqe, self->listener);
+                break;
+            case TAG_ACCEPT_UNIX:
+                complete_accept(self, &cqe, unix_socket);
+                break;
+            case TAG_TICK:
+                ticking = false;
+                break;
+            case TAG_CANCEL:
+                break;
+            case TAG_WAKE:
+                respond_woken(self);
+                ring->read(ring, self->wake_fd, &wakes, sizeof(wakes),
+                           TAG_WAKE);
+                break;
+            default: {
+                Conn *conn = (Conn *)(uintptr_t)cqe.user_data;
+                if (conn->polling)
+                    complete_poll(self, conn);
+                else
+                    complete_read(self, conn, cqe.res);
+            }
+            }
+        }
+        expire_conns(self);
+    }
+}
+
+/**
+ * run - Event loop of the worker
+ * @param arg Worker object
+ * @return NULL
+ */
+static void *run(void *arg)
+{
+    Worker *self = arg;
+    if (self->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t)self->cpu, &cpus);
+        if (pthread_setaffinity_np(self->thread, sizeof(cpus), &cpus) != 0)
+            LOG_WARNF(self->server->logger, "Failed to pin worker",
+                      "worker=%d cpu=%d", self->id, self->cpu);
+    }
+
+    if (self->ring != NULL)
+        run_ring(self);
+    else
+        run_epoll(self);
+    return NULL;
+}
+
+/**
+ * start - Start the event loop on a new thread
+ * @param self Worker object
+ */
+static void start(Worker *self)
+{
+    if (pthread_create(&self->thread, NULL, &run, self) != 0) {
+        perror("Error starting worker");
+        exit(1);
+    }
+}
+
+/**
+ * join - Wait for the event loop to exit
+ * @param self Worker object
+ */
+static void join(Worker *self)
+{
+    pthread_join(self->thread, NULL);
+}
+
+void init_worker(Worker **self, Server *server, int id, int listener, int cpu)
+{
+    *self = (Worker *)must_calloc(1, sizeof(Worker));
+    (*self)->server = server;
+    (*self)->id = id;
+    (*self)->cpu = cpu;
+    (*self)->listener = listener;
+    (*self)->start = &start;
+    (*self)->join = &join;
+    (*self)->wheel = must_calloc(WHEEL_SLOTS, sizeof(Conn *));
+    (*self)->tick = now_ms() / WHEEL_TICK_MS;
+    (*self)->ring = NULL;
+    (*self)->epoll_fd = -1;
+    (*self)->woken = NULL;
+    pthread_mutex_init(&(*self)->lock, NULL);
+    (*self)->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if ((*self)->wake_fd < 0) {
+        perror("Error creating event loop");
+        exit(1);
+    }
+
+    // the first worker finds out whether io_uring is usable, for all of them
+    if (server->io_uring && init_ring(&(*self)->ring, RING_ENTRIES) != 0) {
+        LOG_WARN(server->logger, "io_uring unavailable, falling back to epoll");
+        server->io_uring = false;
+    }
+    if ((*self)->ring != NULL)
+        return;
+
+    // workers sharing a listener are woken one at a time
+    (*self)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (!server->reuseport)
+        ev.events |= EPOLLEXCLUSIVE;
+    if ((*self)->epoll_fd < 0 ||
+        epoll_ctl((*self)->epoll_fd, EPOLL_CTL_ADD, listener, &ev) != 0) {
+        perror("Error creating event loop");
+        exit(1);
+    }
+    struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = &wake_tag};
+    if (epoll_ctl((*self)->epoll_fd, EPOLL_CTL_ADD, (*self)->wake_fd,
+                  &wake_ev) != 0) {
+        perror("Error creating event loop");
+        exit(1);
+    }
+    // the Unix socket listener is always shared by every worker
+    struct epoll_event unix_ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                  .data.ptr = &unix_listener_tag};
+    if (server->unix_socket >= 0 &&
+        epoll_ctl((*self)->epoll_fd, EPOLL_CTL_ADD, server->unix_socket,
+                  &unix_ev) != 0) {
+        perror("Error creating event loop");
+        exit(1);
+    }
+}
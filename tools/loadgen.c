@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Load generator for the server mode. Every connection slot is a thread
+ * sending one request at a time (the server closes the connection after
+ * each response) and timing it from connect to the last byte. Latencies go
+ * to HDR-style histograms: 64 linear sub-buckets per power of two, so any
+ * recorded value is off by less than 1.6%, from a microsecond to hours.
+ */
+#define SUB_BUCKET_BITS 7
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HALF_BUCKETS (SUB_BUCKETS / 2)
+#define HIST_BUCKETS (64 * HALF_BUCKETS)
+#define MAX_STATUS 600
+#define READ_BUFFER_SIZE (64 * 1024)
+#define IO_TIMEOUT_SECONDS 30
+#define DOWNLOAD_NAME "loadgen.huf"
+#define BOUNDARY "loadgenboundary7f3a"
+
+enum KIND { KIND_GET, KIND_COMPRESS, KIND_DECOMPRESS, KIND_DOWNLOAD, KINDS };
+static const char *const kind_names[] = {"get", "compress", "decompress",
+                                         "download"};
+
+typedef struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct Options {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    int connections;
+    int duration;
+    size_t payload_size;
+    unsigned weights[KINDS];
+} Options;
+
+typedef struct Target {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family;
+} Target;
+
+typedef struct Request {
+    char *data;
+    size_t len;
+} Request;
+
+typedef struct Stats {
+    Histogram latency[KINDS];
+    uint64_t errors[KINDS];
+    uint64_t statuses[MAX_STATUS]; // 0 for requests that failed on the wire
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+} Stats;
+
+typedef struct Client {
+    pthread_t thread;
+    const Target *target;
+    const Request *requests;
+    const unsigned *weights;
+    unsigned weight_sum;
+    double deadline;
+    uint64_t seed;
+    Stats stats;
+} Client;
+
+/**
+ * now_seconds - Read the monotonic clock
+ * @return Seconds since an arbitrary point
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * bucket_of - Find the histogram bucket of a value
+ * @param value The value
+ * @return Index of its bucket
+ */
+static size_t bucket_of(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return (size_t)value;
+    int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS + 1;
+    return (size_t)(shift + 1) * HALF_BUCKETS +
+           (size_t)(value >> shift) - HALF_BUCKETS;
+}
+
+/**
+ * highest_in - Largest value that lands in a bucket
+ * @param bucket Index of the bucket
+ * @return The value
+ */
+static uint64_t highest_in(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    size_t shift = bucket / HALF_BUCKETS - 1;
+    uint64_t low = (uint64_t)(bucket % HALF_BUCKETS + HALF_BUCKETS) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * record - Add a value to a histogram
+ * @param hist The histogram
+ * @param value The value
+ */
+static void record(Histogram *hist, uint64_t value)
+{
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/**
+ * merge - Add the values of a histogram to another one
+ * @param into The histogram added to
+ * @param from The histogram to add
+ */
+static void merge(Histogram *into, const Histogram *from)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/**
+ * percentile - Find the value below which a share of the values fall
+ * @param hist The histogram
+ * @param share The share, e.g. 0.99
+ * @return The value, 0 for an empty histogram
+ */
+static uint64_t percentile(const Histogram *hist, double share)
+{
+    uint64_t rank = (uint64_t)(share * (double)hist->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank)
+            return highest_in(i) < hist->max ? highest_in(i) : hist->max;
+    }
+    return hist->max;
+}
+
+/**
+ * next_random - Step a xorshift generator
+ * @param state The state of the generator
+ * @return A pseudo-random number
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * make_payload - Generate text that compresses like prose
+ * @param len Length of the text
+ * @return The text, malloc'd
+ */
+static char *make_payload(size_t len)
+{
+    static const char *const words[] = {
+        "the ",   "server ", "huffman ", "tree ",  "of ",    "and ",
+        "codes ", "block ",  "a ",       "bytes ", "to ",    "in ",
+        "data ",  "is ",     "for ",     "with ",  "file\n", "each "};
+    char *text = malloc(len + 1);
+    if (text == NULL) {
+        perror("Error allocating payload");
+        exit(1);
+    }
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    while (i < len) {
+        const char *word =
+            words[next_random(&seed) % (sizeof(words) / sizeof(*words))];
+        while (*word && i < len)
+            text[i++] = *word++;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+/**
+ * make_get - Build a GET request
+ * @param path Path and query string
+ * @return The request
+ */
+static Request make_get(const char *path)
+{
+    Request req;
+    req.len = (size_t)asprintf(&req.data,
+                               "GET %s HTTP/1.1\r\n"
+                               "Host: loadgen\r\n"
+                               "\r\n",
+                               path);
+    return req;
+}
+
+/**
+ * make_upload - Build a multipart upload like a browser form sends
+ * @param query Query string of /upload
+ * @param body The file to upload
+ * @param body_len The length of the file
+ * @return The request
+ */
+static Request make_upload(const char *query, const char *body,
+                           size_t body_len)
+{
+    static const char part_head[] =
+        "--" BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"in_file\"; "
+        "filename=\"payload\"\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "\r\n";
+    static const char part_tail[] = "\r\n--" BOUNDARY "--\r\n";
+    size_t content_len = sizeof(part_head) - 1 + body_len +
+                         sizeof(part_tail) - 1;
+    char *head = NULL;
+    int head_len = asprintf(&head,
+                            "POST /upload?%s HTTP/1.1\r\n"
+                            "Host: loadgen\r\n"
+                            "Content-Type: multipart/form-data; "
+                            "boundary=" BOUNDARY "\r\n"
+                            "Content-Length: %zu\r\n"
+                            "\r\n",
+                            query, content_len);
+    Request req;
+    req.len = (size_t)head_len + content_len;
+    req.data = malloc(req.len);
+    if (head_len < 0 || req.data == NULL) {
+        perror("Error building request");
+        exit(1);
+    }
+    char *p = req.data;
+    memcpy(p, head, (size_t)head_len);
+    p += head_len;
+    memcpy(p, part_head, sizeof(part_head) - 1);
+    p += sizeof(part_head) - 1;
+    memcpy(p, body, body_len);
+    p += body_len;
+    memcpy(p, part_tail, sizeof(part_tail) - 1);
+    free(head);
+    return req;
+}
+
+/**
+ * exchange - Send a request on a new connection and read the response
+ * @param target Where the server is
+ * @param req The request
+ * @param response Where the response goes, NUL-terminated
+ * @param response_cap Bytes of the response to keep, the rest is read and
+ * discarded; response holds one more for the NUL
+ * @param response_len Where to store the length of the whole response
+ * @return The HTTP status, 0 if the exchange failed
+ */
+static int exchange(const Target *target, const Request *req, char *response,
+                    size_t response_cap, size_t *response_len)
+{
+    *response_len = 0;
+    int fd = socket(target->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+    struct timeval timeout = {IO_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (const struct sockaddr *)&target->addr,
+                target->addr_len) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    // the server may answer early, e.g. 503, and stop reading the body
+    for (size_t sent = 0; sent < req->len;) {
+        ssize_t n = send(fd, req->data + sent, req->len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += (size_t)n;
+    }
+
+    char discard[READ_BUFFER_SIZE];
+    while (1) {
+        bool keep = *response_len < response_cap;
+        char *into = keep ? response + *response_len : discard;
+        size_t room = keep ? response_cap - *response_len : sizeof(discard);
+        ssize_t n = recv(fd, into, room, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        *response_len += (size_t)n;
+    }
+    close(fd);
+    response[*response_len < response_cap ? *response_len : response_cap] =
+        '\0';
+
+    int status = 0;
+    if (*response_len >= 12 &&
+        sscanf(response, "HTTP/1.%*d %3d", &status) != 1)
+        status = 0;
+    return status >= 0 && status < MAX_STATUS ? status : 0;
+}
+
+/**
+ * pick_kind - Draw the kind of the next request from the mix
+ * @param client The client
+ * @return The kind
+ */
+static enum KIND pick_kind(Client *client)
+{
+    unsigned draw = (unsigned)(next_random(&client->seed) % client->weight_sum);
+    for (int kind = 0; kind < KINDS; kind++) {
+        if (draw < client->weights[kind])
+            return (enum KIND)kind;
+        draw -= client->weights[kind];
+    }
+    return KIND_GET;
+}
+
+/**
+ * run_client - Send requests back to back until the deadline
+ * @param arg The client
+ * @return NULL
+ */
+static void *run_client(void *arg)
+{
+    Client *client = arg;
+    char head[256];
+    while (now_seconds() < client->deadline) {
+        enum KIND kind = pick_kind(client);
+        const Request *req = &client->requests[kind];
+        size_t received = 0;
+        double started = now_seconds();
+        int status = exchange(client->target, req, head, sizeof(head) - 1,
+                              &received);
+        double elapsed = now_seconds() - started;
+
+        Stats *stats = &client->stats;
+        record(&stats->latency[kind], (uint64_t)(elapsed * 1e6));
+        stats->statuses[status]++;
+        if (status < 200 || status > 299)
+            stats->errors[kind]++;
+        stats->bytes_sent += req->len;
+        stats->bytes_received += received;
+    }
+    return NULL;
+}
+
+/**
+ * resolve - Work out where the server is
+ * @param options The options
+ * @param target Where the address goes
+ */
+static void resolve(const Options *options, Target *target)
+{
+    memset(target, 0, sizeof(*target));
+    if (options->unix_path != NULL) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&target->addr;
+        if (strlen(options->unix_path) >= sizeof(addr->sun_path)) {
+            fprintf(stderr, "Error: Unix socket path too long\n");
+            exit(1);
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, options->unix_path);
+        target->addr_len = sizeof(*addr);
+        target->family = AF_UNIX;
+        return;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *found = NULL;
+    int rc = getaddrinfo(options->host, options->port, &hints, &found);
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s: %s\n", options->host, gai_strerror(rc));
+        exit(1);
+    }
+    memcpy(&target->addr, found->ai_addr, found->ai_addrlen);
+    target->addr_len = found->ai_addrlen;
+    target->family = found->ai_family;
+    freeaddrinfo(found);
+}
+
+/**
+ * body_of - Find the body of a response read in full
+ * @param response The response
+ * @param response_len The length of the response
+ * @param body_len Where to store the length of the body
+ * @return The body, NULL if the response has no header end
+ */
+static char *body_of(char *response, size_t response_len, size_t *body_len)
+{
+    char *end = memmem(response, response_len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return NULL;
+    end += 4;
+    *body_len = response_len - (size_t)(end - response);
+    return end;
+}
+
+/**
+ * prepare - Build the requests of the mix
+ * Decompressions and downloads need a compressed file, so the payload is
+ * compressed once into downloads/ and fetched back before the run.
+ * @param options The options
+ * @param target Where the server is
+ * @param requests Where the requests go, one per kind
+ */
+static void prepare(const Options *options, const Target *target,
+                    Request *requests)
+{
+    char *payload = make_payload(options->payload_size);
+    requests[KIND_GET] = make_get("/");
+    requests[KIND_COMPRESS] =
+        make_upload("out_file=payload.huf&service_type=compress&inline=1",
+                    payload, options->payload_size);
+    requests[KIND_DOWNLOAD] = make_get("/download?out_file=" DOWNLOAD_NAME);
+    requests[KIND_DECOMPRESS] = (Request){NULL, 0};
+    if (options->weights[KIND_DECOMPRESS] == 0 &&
+        options->weights[KIND_DOWNLOAD] == 0) {
+        free(payload);
+        return;
+    }
+
+    size_t cap = options->payload_size * 2 + 4096;
+    char *response = malloc(cap + 1);
+    size_t response_len = 0;
+    Request store = make_upload("out_file=" DOWNLOAD_NAME
+                                "&service_type=compress",
+                                payload, options->payload_size);
+    int status = exchange(target, &store, response, cap, &response_len);
+    if (status == 200)
+        status = exchange(target, &requests[KIND_DOWNLOAD], response, cap,
+                          &response_len);
+    size_t compressed_len = 0;
+    char *compressed = body_of(response, response_len, &compressed_len);
+    if (status != 200 || compressed == NULL || response_len >= cap) {
+        fprintf(stderr, "Error: preparing %s failed with status %d\n",
+                DOWNLOAD_NAME, status);
+        exit(1);
+    }
+    requests[KIND_DECOMPRESS] =
+        make_upload("out_file=payload.txt&service_type=decompress&inline=1",
+                    compressed, compressed_len);
+    free(store.data);
+    free(response);
+    free(payload);
+}
+
+/**
+ * format_latency - Render a latency for the report
+ * @param micros The latency in microseconds
+ * @param out Where the text goes
+ * @param out_len Size of out
+ */
+static void format_latency(uint64_t micros, char *out, size_t out_len)
+{
+    if (micros < 10000)
+        snprintf(out, out_len, "%.2fms", (double)micros / 1000.0);
+    else if (micros < 10000000)
+        snprintf(out, out_len, "%.1fms", (double)micros / 1000.0);
+    else
+        snprintf(out, out_len, "%.2fs", (double)micros / 1e6);
+}
+
+/**
+ * report_row - Print the figures of one kind of request
+ * @param name Name of the row
+ * @param hist Latencies of the requests
+ * @param errors Requests that failed or got no 2xx
+ * @param elapsed Length of the run in seconds
+ */
+static void report_row(const char *name, const Histogram *hist,
+                       uint64_t errors, double elapsed)
+{
+    static const double shares[] = {0.5, 0.9, 0.99, 0.999};
+    char cells[5][16];
+    for (size_t i = 0; i < 4; i++)
+        format_latency(percentile(hist, shares[i]), cells[i],
+                       sizeof(cells[i]));
+    format_latency(hist->max, cells[4], sizeof(cells[4]));
+    printf("%-11s %9llu %7llu %10.1f %9s %9s %9s %9s %9s\n", name,
+           (unsigned long long)hist->total, (unsigned long long)errors,
+           (double)hist->total / elapsed, cells[0], cells[1], cells[2],
+           cells[3], cells[4]);
+}
+
+/**
+ * report - Print the results of the run
+ * @param clients The clients, with their stats
+ * @param count Number of clients
+ * @param elapsed Length of the run in seconds
+ */
+static void report(Client *clients, int count, double elapsed)
+{
+    static Stats total;
+    for (int i = 0; i < count; i++) {
+        const Stats *stats = &clients[i].stats;
+        for (int kind = 0; kind < KINDS; kind++) {
+            merge(&total.latency[kind], &stats->latency[kind]);
+            total.errors[kind] += stats->errors[kind];
+        }
+        for (int status = 0; status < MAX_STATUS; status++)
+            total.statuses[status] += stats->statuses[status];
+        total.bytes_sent += stats->bytes_sent;
+        total.bytes_received += stats->bytes_received;
+    }
+
+    printf("%-11s %9s %7s %10s %9s %9s %9s %9s %9s\n", "kind", "requests",
+           "errors", "req/s", "p50", "p90", "p99", "p99.9", "max");
+    static Histogram all;
+    uint64_t errors = 0;
+    for (int kind = 0; kind < KINDS; kind++) {
+        if (total.latency[kind].total == 0)
+            continue;
+        report_row(kind_names[kind], &total.latency[kind],
+                   total.errors[kind], elapsed);
+        merge(&all, &total.latency[kind]);
+        errors += total.errors[kind];
+    }
+    report_row("total", &all, errors, elapsed);
+
+    printf("\nsent %.1f MiB, received %.1f MiB (%.1f MiB/s)\n",
+           (double)total.bytes_sent / (1 << 20),
+           (double)total.bytes_received / (1 << 20),
+           (double)total.bytes_received / (1 << 20) / elapsed);
+    if (errors == 0)
+        return;
+    printf("errors:");
+    if (total.statuses[0] > 0)
+        printf(" connection %llu", (unsigned long long)total.statuses[0]);
+    for (int status = 1; status < MAX_STATUS; status++) {
+        if ((status < 200 || status > 299) && total.statuses[status] > 0)
+            printf(" %d x %llu", status,
+                   (unsigned long long)total.statuses[status]);
+    }
+    printf("\n");
+}
+
+/**
+ * print_help - Print the help message and exit
+ */
+static void print_help(void)
+{
+    printf("Usage: ./loadgen [OPTIONS]\n");
+    printf("Options:\n");
+    printf("  -H, --host <host>     Server to load (default: 127.0.0.1)\n");
+    printf("  -p, --port <port>     Port of the server (default: 8000)\n");
+    printf("  -u, --unix <path>     Connect through a Unix domain socket "
+           "instead\n");
+    printf("  -c, --connections <n> Requests in flight at once (default: "
+           "8)\n");
+    printf("  -d, --duration <s>    Length of the run (default: 10)\n");
+    printf("  -m, --mix <mix>       Weights of the request kinds, e.g. "
+           "get=2,compress=1\n");
+    printf("                        kinds: get, compress, decompress, "
+           "download (default: get=1)\n");
+    printf("  -s, --size <bytes>    Payload of uploads, K and M suffixes "
+           "allowed (default: 64K)\n");
+    printf("  -h, --help            Print this message\n");
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * parse_number - Parse a positive number, with a K or M suffix if allowed
+ * @param arg The argument
+ * @param message Error message if it isn't valid
+ * @param suffixes Whether K and M suffixes are allowed
+ * @return The number
+ */
+static size_t parse_number(const char *arg, const char *message,
+                           bool suffixes)
+{
+    char *end = NULL;
+    unsigned long long value = arg ? strtoull(arg, &end, 10) : 0;
+    if (suffixes && end != NULL && (*end == 'K' || *end == 'k')) {
+        value <<= 10;
+        end++;
+    } else if (suffixes && end != NULL && (*end == 'M' || *end == 'm')) {
+        value <<= 20;
+        end++;
+    }
+    if (arg == NULL || end == arg || *end != '\0' || value == 0) {
+        fprintf(stderr, "Error: %s\n", message);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)value;
+}
+
+/**
+ * parse_mix - Parse request weights such as get=2,compress=1
+ * @param arg The argument
+ * @param weights Where the weights go, one per kind
+ */
+static void parse_mix(const char *arg, unsigned *weights)
+{
+    static const char message[] =
+        "-m/--mix requires kind=weight pairs, e.g. get=2,compress=1";
+    if (arg == NULL) {
+        fprintf(stderr, "Error: %s\n", message);
+        exit(EXIT_FAILURE);
+    }
+    memset(weights, 0, KINDS * sizeof(*weights));
+    char *copy = strdup(arg);
+    char *save = NULL;
+    for (char *pair = strtok_r(copy, ",", &save); pair != NULL;
+         pair = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(pair, '=');
+        int kind = 0;
+        if (eq != NULL) {
+            *eq = '\0';
+            while (kind < KINDS && strcmp(pair, kind_names[kind]) != 0)
+                kind++;
+        }
+        if (eq == NULL || kind == KINDS) {
+            fprintf(stderr, "Error: %s\n", message);
+            exit(EXIT_FAILURE);
+        }
+        weights[kind] = (unsigned)parse_number(eq + 1, message, false);
+    }
+    free(copy);
+}
+
+/**
+ * parse_options - Read the command line
+ * @param argc Number of arguments
+ * @param argv The arguments
+ * @param options Where the options go
+ */
+static void parse_options(int argc, char **argv, Options *options)
+{
+    *options = (Options){.host = "127.0.0.1",
+                         .port = "8000",
+                         .unix_path = NULL,
+                         .connections = 8,
+                         .duration = 10,
+                         .payload_size = 64 * 1024,
+                         .weights = {1, 0, 0, 0}};
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = argv[i + 1];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_help();
+        } else if (strcmp(arg, "-H") == 0 || strcmp(arg, "--host") == 0) {
+            options->host = value;
+            i++;
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            parse_number(value, "-p/--port requires a port", false);
+            options->port = value;
+            i++;
+        } else if (strcmp(arg, "-u") == 0 || strcmp(arg, "--unix") == 0) {
+            options->unix_path = value;
+            i++;
+        } else if (strcmp(arg, "-c") == 0 ||
+                   strcmp(arg, "--connections") == 0) {
+            options->connections = (int)parse_number(
+                value, "-c/--connections requires a count", false);
+            i++;
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            options->duration = (int)parse_number(
+                value, "-d/--duration requires seconds", false);
+            i++;
+        } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mix") == 0) {
+            parse_mix(value, options->weights);
+            i++;
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--size") == 0) {
+            options->payload_size =
+                parse_number(value, "-s/--size requires a size", true);
+            i++;
+        } else {
+            fprintf(stderr, "Error: Unknown option: %s\n", arg);
+            exit(EXIT_FAILURE);
+        }
+        if (i >= argc) {
+            fprintf(stderr, "Error: %s requires a value\n", arg);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * main - Load a server and report throughput and latency
+ * @argc: The number of arguments
+ * @argv: The array of arguments
+ *
+ * Return: 0 on success, 1 otherwise
+ */
+int main(int argc, char **argv)
+{
+    Options options;
+    parse_options(argc, argv, &options);
+    unsigned weight_sum = 0;
+    for (int kind = 0; kind < KINDS; kind++)
+        weight_sum += options.weights[kind];
+    if (weight_sum == 0) {
+        fprintf(stderr, "Error: the mix has no requests\n");
+        return 1;
+    }
+
+    Target target;
+    resolve(&options, &target);
+    Request requests[KINDS];
+    prepare(&options, &target, requests);
+
+    if (options.unix_path != NULL)
+        printf("Loading %s for %ds with %d connections\n\n",
+               options.unix_path, options.duration, options.connections);
+    else
+        printf("Loading %s:%s for %ds with %d connections\n\n", options.host,
+               options.port, options.duration, options.connections);
+
+    Client *clients = calloc((size_t)options.connections, sizeof(Client));
+    if (clients == NULL) {
+        perror("Error allocating clients");
+        return 1;
+    }
+    double started = now_seconds();
+    for (int i = 0; i < options.connections; i++) {
+        clients[i].target = &target;
+        clients[i].requests = requests;
+        clients[i].weights = options.weights;
+        clients[i].weight_sum = weight_sum;
+        clients[i].deadline = started + options.duration;
+        clients[i].seed = 0x2545f4914f6cdd1dULL * ((uint64_t)i + 1);
+        if (pthread_create(&clients[i].thread, NULL, &run_client,
+                           &clients[i]) != 0) {
+            perror("Error starting client");
+            return 1;
+        }
+    }
+    for (int i = 0; i < options.connections; i++)
+        pthread_join(clients[i].thread, NULL);
+
+    report(clients, options.connections, now_seconds() - started);
+    for (int kind = 0; kind < KINDS; kind++)
+        free(requests[kind].data);
+    free(clients);
+    return 0;
+}